@@ -1,3 +1,5 @@
 extern void ComPort_Open(int PortNr, int Speed);
+extern void ComPort_OpenDevice(const char *DeviceName, int Speed);
 extern void ComPort_Close(void);
+extern int ComPort_SetSpeed(int Speed);
 extern void ComPort_Send(char *in);
@@ -1,27 +1,41 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
-#include <termios.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h> //termios2, any baud rate with BOTHER
 #include "../MePort.h"
+#include "ComPort.h"
+#include "ComTrace.h"
 
 
 #define DEVICE "/dev/ttyUSB"
-static int FDSerial;
+#define RX_BUF_SIZE 4096 //Bytes read at once, holds many frames
+static int FDSerial = -1;
+static int FDStop = -1;
+static pthread_t RecvThread;
 
-static void WriteDataToDebugFile(char *prefix, char *in);
 static void* recvData(void* arg);
-static int Baudrate(int Speed);
 
 
 void ComPort_Open(int PortNr, int Speed)
 {
-	struct termios Settings;
 	char DeviceName[30];
 	sprintf(DeviceName, "%s%d", DEVICE, PortNr);
+	ComPort_OpenDevice(DeviceName, Speed);
+}
+
+//Opens any tty by its path, e.g. the pty of the MeCom emulator
+void ComPort_OpenDevice(const char *DeviceName, int Speed)
+{
+	struct termios2 Settings;
 
 	FDSerial = open(DeviceName, O_RDWR | O_NOCTTY);
 
@@ -42,10 +56,13 @@ void ComPort_Open(int PortNr, int Speed)
 	printf("ComPort %s Opened!\n", DeviceName);
 
 	//Load Port Settings
-	tcgetattr(FDSerial, &Settings);
+	ioctl(FDSerial, TCGETS2, &Settings);
 
-	//Set Baudrate
-	cfsetspeed(&Settings, Baudrate(Speed));
+	//Set Baudrate, any value the UART can divide down to
+	Settings.c_cflag &= ~CBAUD;
+	Settings.c_cflag |= BOTHER;
+	Settings.c_ispeed = Speed;
+	Settings.c_ospeed = Speed;
 
 	//Set Read and Local
 	Settings.c_cflag |= (CLOCAL | CREAD);
@@ -56,9 +73,13 @@ void ComPort_Open(int PortNr, int Speed)
 	Settings.c_cflag &= ~CSIZE;
 	Settings.c_cflag |= CS8;
 
-	//Read Raw Data
-	Settings.c_lflag &= ~(ICANON | ISIG);
+	//Read Raw Data, no echo and no CR to NL translation
+	Settings.c_lflag &= ~(ICANON | ISIG | ECHO | ECHONL | IEXTEN);
 	Settings.c_iflag |= IGNPAR;
+	Settings.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL);
+	//A read returns as soon as there is one byte, with all bytes there are
+	Settings.c_cc[VMIN] = 1;
+	Settings.c_cc[VTIME] = 0;
 	//Disable Software Flow Control
 	Settings.c_iflag &= ~(IXON | IXOFF | IXANY);
 
@@ -66,82 +87,130 @@ void ComPort_Open(int PortNr, int Speed)
 	Settings.c_oflag &= ~OPOST;
 
 	//Clear Buffer
-	tcflush(FDSerial, TCIOFLUSH);
+	ioctl(FDSerial, TCFLSH, TCIOFLUSH);
 	//Write Settings to ComPort
-	tcsetattr(FDSerial, TCSANOW, &Settings);
+	if(ioctl(FDSerial, TCSETS2, &Settings) == -1)
+		printf("ComPort %s settings failed: ERRNO is %d\n", DeviceName, errno);
 
-	//Receive Task
-	pthread_t thread;
-	pthread_create(&thread, NULL, &recvData, NULL);
+	//Receive Task, FDStop wakes it up for ComPort_Close
+	FDStop = eventfd(0, EFD_CLOEXEC);
+	if(FDStop == -1 || pthread_create(&RecvThread, NULL, &recvData, NULL) != 0)
+	{
+		printf("ComPort %s receive task failed!\n", DeviceName);
+		if(FDStop != -1) close(FDStop);
+		FDStop = -1;
+		return;
+	}
 	printf("ComPort %s Ready!\n", DeviceName);
 }
 
 void ComPort_Close(void)
 {
-	close(FDSerial);
+	uint64_t One = 1;
+
+	if(FDStop != -1)
+	{
+		if(write(FDStop, &One, sizeof(One)) == sizeof(One)) pthread_join(RecvThread, NULL);
+		close(FDStop);
+		FDStop = -1;
+	}
+	if(FDSerial != -1) close(FDSerial);
+	FDSerial = -1;
+	ComTrace_Stop();
+}
+
+/*
+ * Changes the baud rate once everything queued has been sent. Returns the
+ * rate the driver has set, which may be rounded, or -1.
+ */
+int ComPort_SetSpeed(int Speed)
+{
+	struct termios2 Settings;
+
+	if(FDSerial == -1) return -1;
+	ioctl(FDSerial, TCSBRK, 1); //tcdrain
+	if(ioctl(FDSerial, TCGETS2, &Settings) == -1) return -1;
+	Settings.c_cflag &= ~CBAUD;
+	Settings.c_cflag |= BOTHER;
+	Settings.c_ispeed = Speed;
+	Settings.c_ospeed = Speed;
+	if(ioctl(FDSerial, TCSETS2, &Settings) == -1 || ioctl(FDSerial, TCGETS2, &Settings) == -1)
+	{
+		printf("ComPort %d baud not supported: ERRNO is %d\n", Speed, errno);
+		return -1;
+	}
+	//Drop what arrived at the old rate
+	ioctl(FDSerial, TCFLSH, TCIFLUSH);
+	return Settings.c_ospeed;
 }
 
 void ComPort_Send(char *in)
 {
-	WriteDataToDebugFile("OUT: ", in);
-
 	size_t size;
 	int len = strlen(in);
+	ComTrace_Record(COMTRACE_OUT, in, len);
 	size = write(FDSerial, in, len);
 	if(size != len) return; // Data Write Error
 }
 
-static void* recvData(void* arg)
+/*
+ * Hands every complete frame in Buffer, '!' up to the 0x0D, to the MeCom
+ * parser in one call. Bytes in front of a start indicator are noise and
+ * dropped. An unfinished frame is moved to the front of Buffer, its length
+ * is returned.
+ */
+static size_t DeliverFrames(char *Buffer, size_t Fill)
 {
-	char Buffer[100];
-	ssize_t bytes_read;
+	char *Pos = Buffer, *End = Buffer + Fill;
+	char *Start, *Stop;
 
-	while(true)
+	while((Start = memchr(Pos, '!', End - Pos)) != NULL)
 	{
-		bytes_read = read(FDSerial, Buffer, sizeof(Buffer)-1);
-		Buffer[bytes_read] = 0;
-		WriteDataToDebugFile("IN:  ", Buffer);
-		MePort_ReceiveByte((int8_t*)Buffer);
+		Stop = memchr(Start, 0x0D, End - Start);
+		if(Stop == NULL) break;
+		//Another start indicator restarts the frame, as in MeFrame_Receive
+		Start = memrchr(Start, '!', Stop - Start);
+		MePort_ReceiveFrame((int8_t*)Start, Stop - Start);
+		Pos = Stop + 1;
 	}
-	pthread_exit((void *)pthread_self());
+	if(Start == NULL) return 0;
+	memmove(Buffer, Start, End - Start);
+	return End - Start;
 }
 
-static void WriteDataToDebugFile(char *prefix, char *in)
+static void* recvData(void* arg)
 {
-	FILE *fd;
-	fd = fopen("./ComLog.txt", "a+");
-	if(fd >= 0)
-	{
-		int len = strcspn(in, "\r\n");
-		char format[20] = "";
-		sprintf(format, "%%s%%.%ds\n", len);
-		fprintf(fd, format, prefix, in);
-		fclose(fd);
-	}
-}
+	static char Buffer[RX_BUF_SIZE];
+	struct pollfd Fds[2] = {{FDSerial, POLLIN, 0}, {FDStop, POLLIN, 0}};
+	size_t Fill = 0;
+	ssize_t bytes_read;
 
-int Baudrate(int Speed)
-{
-	switch(Speed)
+	while(true)
 	{
-		case 1200: return B1200;
-		case 1800: return B1800;
-		case 2400: return B2400;
-		case 4800: return B4800;
-		case 9600: return B9600;
-		case 19200: return B19200;
-		case 38400: return B38400;
-		case 57600: return B57600;
-		case 115200: return B115200;
-		case 230400: return B230400;
-		//case 460800: return B460800;
-		//case 500000: return B500000;
-		//case 576000: return B576000;
-		//case 921600: return B921600;
-		//case 1000000: return B1000000;
-		default:
-			printf("Baudrate not supported\n");
-			return B0;
+		if(poll(Fds, 2, -1) < 0)
+		{
+			if(errno == EINTR) continue;
+			printf("ComPort poll failed: ERRNO is %d\n", errno);
+			break;
+		}
+		if(Fds[1].revents) break;
+		if(Fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+		{
+			printf("ComPort closed by the device\n");
+			break;
+		}
+
+		//A full buffer without a frame end is garbage
+		if(Fill == sizeof(Buffer)) Fill = 0;
+		bytes_read = read(FDSerial, Buffer + Fill, sizeof(Buffer) - Fill);
+		if(bytes_read <= 0)
+		{
+			if(bytes_read == 0 || errno == EINTR || errno == EAGAIN) continue;
+			printf("ComPort read failed: ERRNO is %d\n", errno);
+			break;
+		}
+		ComTrace_Record(COMTRACE_IN, Buffer + Fill, bytes_read);
+		Fill = DeliverFrames(Buffer, Fill + bytes_read);
 	}
-	return B0;
+	return NULL;
 }
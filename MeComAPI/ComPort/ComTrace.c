@@ -0,0 +1,214 @@
+/*
+ * Serial trace for ComPort_Linux.c
+ *
+ * ComTrace_Record only copies the chunk with its direction and a monotonic
+ * timestamp into an in-memory ring, it never touches the file. A writer
+ * thread at idle priority drains the ring every COMTRACE_FLUSH_MS (or as
+ * soon as it is half full) into COMTRACE_FILE and rotates the file once it
+ * grows beyond COMTRACE_MAX_FILE_SIZE. If the writer falls behind, records
+ * are dropped and counted instead of blocking the serial line. If the file
+ * can not be opened, that is reported once and retried at every flush, the
+ * records meanwhile are counted as dropped.
+ *
+ * Tracing is off until ComTrace_Enable(1), and costs one load per chunk
+ * while it is off. It may be switched on and off at any time.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include "ComTrace.h"
+
+struct ComTraceHeader
+{
+	uint64_t Time;		//ns, CLOCK_MONOTONIC
+	uint16_t Length;
+	char Dir;
+};
+
+static uint8_t Ring[COMTRACE_RING_SIZE];
+static size_t Head, Tail;	//Bytes ever written and read, under Lock
+static unsigned long Dropped;
+static int Enabled;
+static int Running;
+static int OpenFailed;	//Reported, writer only
+static pthread_t Writer;
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Cond = PTHREAD_COND_INITIALIZER;
+
+static void RingPut(const void *Data, size_t Length)
+{
+	size_t Offs = Head % COMTRACE_RING_SIZE;
+	size_t First = Length < COMTRACE_RING_SIZE - Offs ? Length : COMTRACE_RING_SIZE - Offs;
+
+	memcpy(Ring + Offs, Data, First);
+	memcpy(Ring, (const uint8_t *)Data + First, Length - First);
+	Head += Length;
+}
+
+static void RingGet(void *Data, size_t Length)
+{
+	size_t Offs = Tail % COMTRACE_RING_SIZE;
+	size_t First = Length < COMTRACE_RING_SIZE - Offs ? Length : COMTRACE_RING_SIZE - Offs;
+
+	memcpy(Data, Ring + Offs, First);
+	memcpy((uint8_t *)Data + First, Ring, Length - First);
+	Tail += Length;
+}
+
+void ComTrace_Record(char Dir, const char *Data, size_t Length)
+{
+	struct ComTraceHeader Hdr;
+	struct timespec Now;
+
+	if(!__atomic_load_n(&Enabled, __ATOMIC_RELAXED)) return;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	Hdr.Time = (uint64_t)Now.tv_sec * 1000000000 + Now.tv_nsec;
+	Hdr.Length = Length < COMTRACE_MAX_RECORD ? Length : COMTRACE_MAX_RECORD;
+	Hdr.Dir = Dir;
+
+	pthread_mutex_lock(&Lock);
+	if(COMTRACE_RING_SIZE - (Head - Tail) < sizeof(Hdr) + Hdr.Length)
+	{
+		Dropped++;
+	}
+	else
+	{
+		RingPut(&Hdr, sizeof(Hdr));
+		RingPut(Data, Hdr.Length);
+		if(Head - Tail > COMTRACE_RING_SIZE / 2) pthread_cond_signal(&Cond);
+	}
+	pthread_mutex_unlock(&Lock);
+}
+
+static void WriteRecord(FILE *fd, const struct ComTraceHeader *Hdr, const uint8_t *Data)
+{
+	int i;
+
+	fprintf(fd, "%llu.%06llu %s", (unsigned long long)(Hdr->Time / 1000000000),
+		(unsigned long long)(Hdr->Time % 1000000000 / 1000), Hdr->Dir == COMTRACE_OUT ? "OUT: " : "IN:  ");
+	for(i = 0; i < Hdr->Length; i++)
+	{
+		if(Data[i] >= 0x20 && Data[i] < 0x7f) fputc(Data[i], fd);
+		else if(Data[i] != '\r' && Data[i] != '\n' && Data[i] != 0) fprintf(fd, "\\x%02x", Data[i]);
+	}
+	fputc('\n', fd);
+}
+
+static FILE *OpenTrace(const char *Mode)
+{
+	FILE *fd = fopen(COMTRACE_FILE, Mode);
+
+	if(fd == NULL && !OpenFailed) printf("ComTrace: can not open %s, %s, retrying\n", COMTRACE_FILE, strerror(errno));
+	if(fd && OpenFailed) printf("ComTrace: %s open again\n", COMTRACE_FILE);
+	OpenFailed = fd == NULL;
+	return fd;
+}
+
+static FILE *Rotate(FILE *fd)
+{
+	fclose(fd);
+	if(rename(COMTRACE_FILE, COMTRACE_FILE ".1") != 0) printf("ComTrace: can not rename %s, %s\n", COMTRACE_FILE, strerror(errno));
+	return OpenTrace("w");
+}
+
+static void *WriterTask(void *arg)
+{
+	struct sched_param Param = {.sched_priority = 0};
+	struct ComTraceHeader Hdr;
+	uint8_t Data[COMTRACE_MAX_RECORD];
+	unsigned long Lost = 0;
+	struct timespec Timeout;
+	FILE *fd;
+	int Run = 1;
+
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &Param);
+	fd = OpenTrace("a");
+
+	pthread_mutex_lock(&Lock);
+	while(Run)
+	{
+		Run = Running;
+		if(Head == Tail && Run)
+		{
+			clock_gettime(CLOCK_REALTIME, &Timeout);
+			Timeout.tv_nsec += COMTRACE_FLUSH_MS * 1000000L;
+			Timeout.tv_sec += Timeout.tv_nsec / 1000000000L;
+			Timeout.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&Cond, &Lock, &Timeout);
+		}
+		if(fd == NULL && Head != Tail)
+		{
+			pthread_mutex_unlock(&Lock);
+			fd = OpenTrace("a");
+			pthread_mutex_lock(&Lock);
+		}
+
+		while(Head != Tail)
+		{
+			RingGet(&Hdr, sizeof(Hdr));
+			RingGet(Data, Hdr.Length);
+			pthread_mutex_unlock(&Lock);
+			if(fd) WriteRecord(fd, &Hdr, Data);
+			else Lost++;
+			pthread_mutex_lock(&Lock);
+		}
+		Lost += Dropped;
+		Dropped = 0;
+		pthread_mutex_unlock(&Lock);
+
+		if(fd)
+		{
+			if(Lost) fprintf(fd, "ComTrace: %lu records dropped\n", Lost);
+			Lost = 0;
+			fflush(fd);
+			if(ftell(fd) > COMTRACE_MAX_FILE_SIZE) fd = Rotate(fd);
+		}
+		pthread_mutex_lock(&Lock);
+	}
+	pthread_mutex_unlock(&Lock);
+
+	if(fd) fclose(fd);
+	return NULL;
+}
+
+/*
+ * starts the writer on first use, disabling keeps it for the next enable.
+ * returns whether tracing is on now.
+ */
+int ComTrace_Enable(int Enable)
+{
+	pthread_mutex_lock(&Lock);
+	if(Enable && !Running)
+	{
+		Running = 1;
+		if(pthread_create(&Writer, NULL, WriterTask, NULL) != 0)
+		{
+			printf("ComTrace: can not start the writer\n");
+			Running = 0;
+			Enable = 0;
+		}
+	}
+	__atomic_store_n(&Enabled, Enable, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&Lock);
+	return Enable;
+}
+
+/* writes out what is left and ends the writer */
+void ComTrace_Stop(void)
+{
+	int WasRunning;
+
+	pthread_mutex_lock(&Lock);
+	__atomic_store_n(&Enabled, 0, __ATOMIC_RELAXED);
+	WasRunning = Running;
+	Running = 0;
+	pthread_cond_signal(&Cond);
+	pthread_mutex_unlock(&Lock);
+	if(WasRunning) pthread_join(Writer, NULL);
+}
@@ -0,0 +1,19 @@
+#ifndef COMTRACE_H
+#define COMTRACE_H
+
+#include <stddef.h>
+
+#define COMTRACE_FILE "./ComLog.txt"
+#define COMTRACE_RING_SIZE (64 * 1024)          //Bytes of records waiting for the writer
+#define COMTRACE_MAX_RECORD 256                 //Bytes kept of a longer chunk
+#define COMTRACE_MAX_FILE_SIZE (4L * 1024 * 1024) //Then ComLog.txt becomes ComLog.txt.1
+#define COMTRACE_FLUSH_MS 200
+
+#define COMTRACE_OUT 'O'
+#define COMTRACE_IN 'I'
+
+extern int ComTrace_Enable(int Enable);
+extern void ComTrace_Record(char Dir, const char *Data, size_t Length);
+extern void ComTrace_Stop(void);
+
+#endif
@@ -24,11 +24,33 @@ typedef struct
     float Max;
 } MeParFloatFields;
 
+typedef struct
+{
+    uint16_t ParId;
+    uint8_t Inst;
+    MeParCmd Cmd;
+    union
+    {
+        MeParLongFields l;      //INT32 parameters
+        MeParFloatFields f;     //FLOAT32 parameters
+    } Fields;
+    uint8_t Succeeded;          //Set by MeCom_ParBatch
+} MeParBatchItem;
+
 extern uint8_t MeCom_ResetDevice(uint8_t Address);
 extern uint8_t MeCom_GetIdentString(uint8_t Address, int8_t *arr);
 extern uint8_t MeCom_ParValuel(uint8_t Address, uint16_t ParId, uint8_t Inst, MeParLongFields  *Fields, MeParCmd Cmd);
 extern uint8_t MeCom_ParValuef(uint8_t Address, uint16_t ParId, uint8_t Inst, MeParFloatFields *Fields, MeParCmd Cmd);
 
+//Pipelined access: Submit returns at once, Wait collects the answer
+extern int32_t MeCom_ParValuelSubmit(uint8_t Address, uint16_t ParId, uint8_t Inst, MeParLongFields  *Fields, MeParCmd Cmd);
+extern uint8_t MeCom_ParValuelWait(int32_t Handle, MeParLongFields  *Fields, MeParCmd Cmd);
+extern int32_t MeCom_ParValuefSubmit(uint8_t Address, uint16_t ParId, uint8_t Inst, MeParFloatFields *Fields, MeParCmd Cmd);
+extern uint8_t MeCom_ParValuefWait(int32_t Handle, MeParFloatFields *Fields, MeParCmd Cmd);
+
+//Several parameters of one device back to back, returns the number of Items that succeeded
+extern uint32_t MeCom_ParBatch(uint8_t Address, MeParBatchItem *Items, uint32_t Count);
+
 
 //**************************************************************************
 //**********Definition of all Common Parameter Numbers**********************
@@ -12,6 +12,13 @@
 
 #define MEPORT_SET_AND_QUERY_TIMEOUT 100 //ms
 
+//Requests which may wait for their answer at the same time
+//Every one of them holds a TX and a RX Buffer
+#define MEPORT_MAX_IN_FLIGHT 4 //Requests per device
+
+//Device addresses on the port with requests at the same time
+#define MEPORT_MAX_DEVICES 4 //Devices
+
 #define MEPORT_ERROR_CMD_NOT_AVAILABLE      1    
 #define MEPORT_ERROR_DEVICE_BUSY            2
 #define MEPORT_ERROR_GENERAL_COM            3 
@@ -33,8 +40,15 @@ typedef enum
 
 extern void MePort_SendByte(int8_t in, MePort_SB FirstLast);
 extern void MePort_ReceiveByte(int8_t *arr);
+extern void MePort_ReceiveFrame(int8_t *Frame, uint32_t Length);
 extern void MePort_SemaphorTake(uint32_t TimeoutMs);
 extern void MePort_SemaphorGive(void);
 extern void MePort_ErrorThrow(int32_t ErrorNr);
 
+extern void MePort_Lock(void);
+extern void MePort_Unlock(void);
+extern void MePort_WaitLocked(uint32_t TimeoutMs);
+extern void MePort_WakeAllLocked(void);
+extern uint32_t MePort_TimeMs(void);
+
 #endif
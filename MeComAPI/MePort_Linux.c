@@ -44,6 +44,8 @@
 /*==============================================================================*/
 static pthread_mutex_t Mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t Condition = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t RequestMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t RequestCondition = PTHREAD_COND_INITIALIZER;
 
 /*==============================================================================*/
 /** @brief      Interface Function: Send Byte
@@ -113,6 +115,17 @@ void MePort_ReceiveByte(int8_t *arr)
     }
 }
 /*==============================================================================*/
+/** @brief      Interface Function: Receive Frame
+ *
+ *  For receivers which deliver whole frames, this function passes the
+ *  frame starting with '!' and without the terminating 0x0D to
+ *  "MeFrame_ReceiveFrame" in one call.
+*/
+void MePort_ReceiveFrame(int8_t *Frame, uint32_t Length)
+{
+    MeFrame_ReceiveFrame(Frame, Length);
+}
+/*==============================================================================*/
 /** @brief      Interface Function: SemaphorTake
  *
  *  This function is being called by the Query and Set functions,
@@ -170,6 +183,62 @@ void MePort_SemaphorGive(void)
 	pthread_mutex_unlock(&Mutex);
 }
 
+/*==============================================================================*/
+/** @brief      Interface Functions: Lock, Unlock, WaitLocked, WakeAllLocked
+ *
+ *  These functions protect the table of outstanding requests, which is
+ *  shared by the threads sending requests and the receiving thread.
+ *
+ *  WaitLocked is called with the lock held. It releases the lock while it
+ *  waits for WakeAllLocked or the timeout, and holds it again on return.
+ *  Spurious returns are allowed, the callers check their state again.
+ *
+*/
+void MePort_Lock(void)
+{
+	pthread_mutex_lock(&RequestMutex);
+}
+
+void MePort_Unlock(void)
+{
+	pthread_mutex_unlock(&RequestMutex);
+}
+
+void MePort_WaitLocked(uint32_t TimeoutMs)
+{
+	struct timespec Timeout;
+
+	clock_gettime(CLOCK_REALTIME, &Timeout);
+	Timeout.tv_sec += TimeoutMs/1000;
+	Timeout.tv_nsec += (TimeoutMs%1000)*1000000;
+	if (Timeout.tv_nsec >= 1000000000L)
+	{
+		Timeout.tv_sec++;
+		Timeout.tv_nsec = Timeout.tv_nsec - 1000000000L ;
+	}
+	pthread_cond_timedwait(&RequestCondition, &RequestMutex, &Timeout);
+}
+
+void MePort_WakeAllLocked(void)
+{
+	pthread_cond_broadcast(&RequestCondition);
+}
+
+/*==============================================================================*/
+/** @brief      Interface Function: TimeMs
+ *
+ *  Returns a millisecond counter for the request timeouts.
+ *  Only differences of its values are used, it may wrap around.
+ *
+*/
+uint32_t MePort_TimeMs(void)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (uint32_t)(Now.tv_sec * 1000 + Now.tv_nsec / 1000000);
+}
+
 /*==============================================================================*/
 /** @brief      Interface Function: ErrorThrow
  *
@@ -39,6 +39,8 @@
 /*                          STATIC  VARIABLES                                   */
 /*==============================================================================*/
 static volatile uint8_t SemaphorHandler = 0;
+static SRWLOCK RequestLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE RequestCondition = CONDITION_VARIABLE_INIT;
 
 /*==============================================================================*/
 /** @brief      Interface Function: Send Byte
@@ -107,6 +109,17 @@ void MePort_ReceiveByte(int8_t *arr)
     }
 }
 /*==============================================================================*/
+/** @brief      Interface Function: Receive Frame
+ *
+ *  For receivers which deliver whole frames, this function passes the
+ *  frame starting with '!' and without the terminating 0x0D to
+ *  "MeFrame_ReceiveFrame" in one call.
+*/
+void MePort_ReceiveFrame(int8_t *Frame, uint32_t Length)
+{
+    MeFrame_ReceiveFrame(Frame, Length);
+}
+/*==============================================================================*/
 /** @brief      Interface Function: SemaphorTake
  *
  *  This function is being called by the Query and Set functions,
@@ -154,6 +167,47 @@ void MePort_SemaphorGive(void)
     SemaphorHandler = 1;
 }
 
+/*==============================================================================*/
+/** @brief      Interface Functions: Lock, Unlock, WaitLocked, WakeAllLocked
+ *
+ *  These functions protect the table of outstanding requests, which is
+ *  shared by the threads sending requests and the receiving thread.
+ *
+ *  WaitLocked is called with the lock held. It releases the lock while it
+ *  waits for WakeAllLocked or the timeout, and holds it again on return.
+ *
+*/
+void MePort_Lock(void)
+{
+    AcquireSRWLockExclusive(&RequestLock);
+}
+
+void MePort_Unlock(void)
+{
+    ReleaseSRWLockExclusive(&RequestLock);
+}
+
+void MePort_WaitLocked(uint32_t TimeoutMs)
+{
+    SleepConditionVariableSRW(&RequestCondition, &RequestLock, TimeoutMs, 0);
+}
+
+void MePort_WakeAllLocked(void)
+{
+    WakeAllConditionVariable(&RequestCondition);
+}
+
+/*==============================================================================*/
+/** @brief      Interface Function: TimeMs
+ *
+ *  Returns a millisecond counter for the request timeouts.
+ *
+*/
+uint32_t MePort_TimeMs(void)
+{
+    return GetTickCount();
+}
+
 /*==============================================================================*/
 /** @brief      Interface Function: ErrorThrow
  *
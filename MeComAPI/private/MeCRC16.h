@@ -4,5 +4,6 @@
 #include <stdint.h>
 
 extern uint16_t MeCRC16(uint16_t n, uint8_t m);
+extern uint16_t MeCRC16_Block(uint16_t n, const int8_t *Data, uint32_t Length);
 
 #endif
\ No newline at end of file
@@ -13,6 +13,7 @@
 /*                          IMPORT                                              */
 /*==============================================================================*/
 #include "../MeCom.h"
+#include "../MePort.h"
 #include "MeInt.h"
 #include "MeVarConv.h"
 
@@ -77,55 +78,76 @@ uint8_t MeCom_GetIdentString(uint8_t Address, int8_t *arr)
 */
 uint8_t MeCom_ParValuel(uint8_t Address, uint16_t ParId, uint8_t Inst, MeParLongFields  *Fields, MeParCmd Cmd)
 {
+    return MeCom_ParValuelWait(MeCom_ParValuelSubmit(Address, ParId, Inst, Fields, Cmd), Fields, Cmd);
+}
+/*==============================================================================*/
+/** @brief      Starts a Parameter Set, Get or Limit Get for INT32 parameters
+ *
+ *  Returns at once with a Handle, which must be passed to
+ *  MeCom_ParValuelWait together with the same Fields and Cmd.
+ *  Several Requests can be outstanding at the same time, their answers
+ *  are received in parallel. Returns -1 on error.
+ *
+*/
+int32_t MeCom_ParValuelSubmit(uint8_t Address, uint16_t ParId, uint8_t Inst, MeParLongFields *Fields, MeParCmd Cmd)
+{
+    int8_t TxData[20];
+
     if(Cmd == MeGet)
     {
-        int8_t TxData[20];
         TxData[0] = '?'; TxData[1] = 'V'; TxData[2] = 'R'; 
         MeVarConv_AddUsHex(&TxData[3], ParId);
         MeVarConv_AddUcHex(&TxData[7], Inst);
 
-        uint8_t Succeeded = MeInt_Query('#', Address, 9, TxData);
-        if(Succeeded == 0) 
-        {
-            Fields->Value = 0;
-            return Succeeded;
-        }
-
-        Fields->Value = MeVarConv_HexToSl(&MeInt_QueryRcvPayload[0]);
-
-        return Succeeded;
+        return MeInt_Submit('#', Address, 9, TxData, 1);
     }
     else if(Cmd == MeSet)
     {
-        int8_t TxData[20];
         TxData[0] = 'V'; TxData[1] = 'S';
         MeVarConv_AddUsHex(&TxData[2], ParId);
         MeVarConv_AddUcHex(&TxData[6], Inst);
         MeVarConv_AddSlHex(&TxData[8], Fields->Value);
 
-        return MeInt_Set('#', Address, 16, TxData);
+        return MeInt_Submit('#', Address, 16, TxData, 0);
     }
     else if(Cmd == MeGetLimits)
     {
-        int8_t TxData[20];
         TxData[0] = '?'; TxData[1] = 'V'; TxData[2] = 'L'; 
         MeVarConv_AddUsHex(&TxData[3], ParId);
         MeVarConv_AddUcHex(&TxData[7], Inst);
 
-        uint8_t Succeeded = MeInt_Query('#', Address, 9, TxData);
-        if(Succeeded == 0) 
+        return MeInt_Submit('#', Address, 9, TxData, 1);
+    }
+    return -1;
+}
+/*==============================================================================*/
+/** @brief      Completes a Request of MeCom_ParValuelSubmit
+ *
+ *  Waits for the answer and fills in the Fields.
+ *
+*/
+uint8_t MeCom_ParValuelWait(int32_t Handle, MeParLongFields *Fields, MeParCmd Cmd)
+{
+    int8_t RcvData[MEPORT_MAX_RX_BUF_SIZE];
+    uint8_t Succeeded = MeInt_Wait(Handle, RcvData);
+
+    //An answer which is no hex number counts as failed
+    if(Cmd == MeGet)
+    {
+        if(!Succeeded || !MeVarConv_HexToSlChecked(&RcvData[0], &Fields->Value))
         {
-            Fields->Min = 0;
-            Fields->Max = 0;
-            return Succeeded;
+            Fields->Value = 0; Succeeded = 0;
         }
-
-        Fields->Min = MeVarConv_HexToSl(&MeInt_QueryRcvPayload[2]);
-        Fields->Max = MeVarConv_HexToSl(&MeInt_QueryRcvPayload[10]);
-
-        return Succeeded;
     }
-    return 0;
+    else if(Cmd == MeGetLimits)
+    {
+        if(!Succeeded || !MeVarConv_HexToSlChecked(&RcvData[2], &Fields->Min) ||
+           !MeVarConv_HexToSlChecked(&RcvData[10], &Fields->Max))
+        {
+            Fields->Min = 0; Fields->Max = 0; Succeeded = 0;
+        }
+    }
+    return Succeeded;
 }
 /*==============================================================================*/
 /** @brief      Parameter Set, Get and Limit Get Function for FLOAT32 parameters
@@ -140,3 +162,49 @@ uint8_t MeCom_ParValuef(uint8_t Address, uint16_t ParId, uint8_t Inst, MeParFloa
 {
     return MeCom_ParValuel(Address, ParId, Inst, (MeParLongFields *)Fields, Cmd);
 }
+/*==============================================================================*/
+/** @brief      Parameter Submit and Wait for FLOAT32 parameters
+ *
+ *  These functions just call the INT32 Functions.
+ *
+*/
+int32_t MeCom_ParValuefSubmit(uint8_t Address, uint16_t ParId, uint8_t Inst, MeParFloatFields *Fields, MeParCmd Cmd)
+{
+    return MeCom_ParValuelSubmit(Address, ParId, Inst, (MeParLongFields *)Fields, Cmd);
+}
+
+uint8_t MeCom_ParValuefWait(int32_t Handle, MeParFloatFields *Fields, MeParCmd Cmd)
+{
+    return MeCom_ParValuelWait(Handle, (MeParLongFields *)Fields, Cmd);
+}
+/*==============================================================================*/
+/** @brief      Parameter Set, Get and Limit Get for a list of parameters
+ *
+ *  The Requests are sent back to back, up to MEPORT_MAX_IN_FLIGHT of them
+ *  are on the wire at once. The answers are collected in the order of the
+ *  Items, every Item gets its own Succeeded flag.
+ *  INT32 and FLOAT32 parameters can be mixed, see MeParBatchItem.
+ *  Returns the number of Items that succeeded.
+ *
+*/
+uint32_t MeCom_ParBatch(uint8_t Address, MeParBatchItem *Items, uint32_t Count)
+{
+    int32_t Handles[MEPORT_MAX_IN_FLIGHT];
+    uint32_t Sent = 0, Done = 0, Succeeded = 0;
+
+    while(Done < Count)
+    {
+        //Keep the window full
+        while(Sent < Count && Sent - Done < MEPORT_MAX_IN_FLIGHT)
+        {
+            Handles[Sent % MEPORT_MAX_IN_FLIGHT] = MeCom_ParValuelSubmit(Address, Items[Sent].ParId, Items[Sent].Inst, &Items[Sent].Fields.l, Items[Sent].Cmd);
+            Sent++;
+        }
+
+        //Oldest answer first
+        Items[Done].Succeeded = MeCom_ParValuelWait(Handles[Done % MEPORT_MAX_IN_FLIGHT], &Items[Done].Fields.l, Items[Done].Cmd);
+        Succeeded += Items[Done].Succeeded;
+        Done++;
+    }
+    return Succeeded;
+}
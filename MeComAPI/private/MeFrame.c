@@ -13,6 +13,7 @@
 #include "MeFrame.h"
 #include "../MePort.h"
 #include "MeCRC16.h"
+#include "MeInt.h"
 #include "MeVarConv.h"
 #include <string.h>
 
@@ -28,12 +29,10 @@
 /*==============================================================================*/
 /*                          EXTERN VARIABLES                                    */
 /*==============================================================================*/
-struct MeFrame_RcvFrameS MeFrame_RcvFrame;
 
 /*==============================================================================*/
 /*                          STATIC  VARIABLES                                   */
 /*==============================================================================*/
-static uint16_t LastCRC;
 
 /*==============================================================================*/
 /** @brief      Frame Send Function
@@ -41,41 +40,44 @@ static uint16_t LastCRC;
  *  This function packs the Payload Data into the Frame and calculates the CRC.
  *  The Data is directly passed to the Port Send Byte Function.
  *  The Port Send Function receives the start and End of the Frame information.
+ *  Returns the CRC of the Frame, which the device echoes in its ACK.
  *
 */
-void MeFrame_Send(int8_t Control, uint8_t Address, uint32_t Length, uint16_t SeqNr, int8_t *Payload)
+uint16_t MeFrame_Send(int8_t Control, uint8_t Address, uint32_t Length, uint16_t SeqNr, int8_t *Payload)
 {
-    uint16_t CRC = 0;
-    int8_t txc;
+    int8_t Header[7];
+    int8_t Trailer[4];
+    uint16_t CRC;
 
     //Control (Source) Byte
-    txc = Control;                              MePort_SendByte(txc, MePort_SB_IsFirstByte); CRC = MeCRC16(CRC, txc);
+    Header[0] = Control;
 
     //Device Address
-    txc = MeVarConv_UcToHEX(Address / 16);      MePort_SendByte(txc, MePort_SB_Normal); CRC = MeCRC16(CRC, txc);
-    txc = MeVarConv_UcToHEX(Address % 16);      MePort_SendByte(txc, MePort_SB_Normal); CRC = MeCRC16(CRC, txc);
+    Header[1] = MeVarConv_UcToHEX(Address / 16);
+    Header[2] = MeVarConv_UcToHEX(Address % 16);
 
     //Sequence Number
-    txc = MeVarConv_UcToHEX(SeqNr>>12);        MePort_SendByte(txc, MePort_SB_Normal); CRC = MeCRC16(CRC, txc);
-    txc = MeVarConv_UcToHEX((SeqNr/256)%16);    MePort_SendByte(txc, MePort_SB_Normal); CRC = MeCRC16(CRC, txc);
-    txc = MeVarConv_UcToHEX((SeqNr%256)/16);    MePort_SendByte(txc, MePort_SB_Normal); CRC = MeCRC16(CRC, txc);
-    txc = MeVarConv_UcToHEX((SeqNr%256)%16);    MePort_SendByte(txc, MePort_SB_Normal); CRC = MeCRC16(CRC, txc);
+    MeVarConv_AddUsHex(&Header[3], SeqNr);
+
+    //CRC of the Header, continued over the Payload
+    CRC = MeCRC16_Block(0, Header, sizeof(Header));
+    CRC = MeCRC16_Block(CRC, Payload, Length);
+
+    MePort_SendByte(Header[0], MePort_SB_IsFirstByte);
+    for(uint32_t i = 1; i < sizeof(Header); i++) MePort_SendByte(Header[i], MePort_SB_Normal);
 
     for(uint32_t i = 0; i < Length; i++)
     {
         MePort_SendByte(*Payload, MePort_SB_Normal);
-        CRC = MeCRC16(CRC, *Payload);
         Payload++;
     }
 
-    txc = MeVarConv_UcToHEX(CRC>>12);          MePort_SendByte(txc, MePort_SB_Normal); 
-    txc = MeVarConv_UcToHEX((CRC/256)%16);      MePort_SendByte(txc, MePort_SB_Normal); 
-    txc = MeVarConv_UcToHEX((CRC%256)/16);      MePort_SendByte(txc, MePort_SB_Normal); 
-    txc = MeVarConv_UcToHEX((CRC%256)%16);      MePort_SendByte(txc, MePort_SB_Normal); 
+    MeVarConv_AddUsHex(Trailer, CRC);
+    for(uint32_t i = 0; i < sizeof(Trailer); i++) MePort_SendByte(Trailer[i], MePort_SB_Normal);
 
     MePort_SendByte(0x0D, MePort_SB_IsLastByte);
 
-    LastCRC = CRC;
+    return CRC;
 }
 
 
@@ -85,9 +87,8 @@ void MeFrame_Send(int8_t Control, uint8_t Address, uint32_t Length, uint16_t Seq
  *  This Function is being called by the receiving function of the target system.
  *  It puts the received bytes back into the frame structure and
  *  checks the CRC. If a complete frame has been received,
- *  the corresponding received Flag is set and
- *  the MePort_SemaphorGive function is being called to unlock
- *  the upper level functions.
+ *  it is handed to MeInt_FrameReceived, which completes the request
+ *  with the same sequence number.
  *
 */
 void MeFrame_Receive(int8_t in)
@@ -106,38 +107,8 @@ void MeFrame_Receive(int8_t in)
     else if(in == 0x0D && (RcvCtr >=11))
     {
         //End of a Frame received
-        if(RcvCtr == 11)
-        {
-            //Ack Received
-
-            uint16_t RcvCRC = MeVarConv_HexToUs(&RcvBuf[7]);
-            if(RcvCRC == LastCRC && MeFrame_RcvFrame.AckReceived == 0)
-            {
-                MeFrame_RcvFrame.Address    = MeVarConv_HexToUc(&RcvBuf[1]);
-                MeFrame_RcvFrame.SeqNr      = MeVarConv_HexToUs(&RcvBuf[3]);
-                MeFrame_RcvFrame.AckReceived = 1;
-                MePort_SemaphorGive();
-            }
-            else RcvCtr = -1; //Error
-        }
-        else
-        {
-            //Data Received 
-
-            //Check CRC of received Frame
-            uint16_t RcvCRC, CalcCRC = 0;
-            for(int32_t i=0; i < (RcvCtr-4); i++) CalcCRC = MeCRC16(CalcCRC, RcvBuf[i]); //Calculate CRC of received Frame
-            RcvCRC = MeVarConv_HexToUs(&RcvBuf[RcvCtr-4]); //Get Frame CRC
-            if(RcvCRC == CalcCRC && MeFrame_RcvFrame.DataReceived == 0)
-            {
-                //CRC is correct and all data has been processed
-                MeFrame_RcvFrame.Address    = MeVarConv_HexToUc(&RcvBuf[1]);
-                MeFrame_RcvFrame.SeqNr      = MeVarConv_HexToUs(&RcvBuf[3]);
-                for(int32_t i = 7; i < (RcvCtr-4);  i++)	MeFrame_RcvFrame.Payload[i-7] = RcvBuf[i];
-                MeFrame_RcvFrame.DataReceived = 1;
-                MePort_SemaphorGive();
-            }
-        }
+        MeFrame_ReceiveFrame(RcvBuf, RcvCtr);
+        RcvCtr = -1;
     }
     else if(RcvCtr >= 0 && RcvCtr < (MEPORT_MAX_RX_BUF_SIZE+15))
     {
@@ -151,3 +122,41 @@ void MeFrame_Receive(int8_t in)
         RcvCtr = -1;
     }
 }
+/*==============================================================================*/
+/** @brief      Frame Receive Function for complete Frames
+ *
+ *  This Function is being called by receivers which find the frame
+ *  boundaries themselves. Frame points to the start indicator '!',
+ *  Length counts the bytes up to, but without the terminating 0x0D.
+ *  The CRC is checked and the frame is handed to MeInt_FrameReceived,
+ *  the same way as MeFrame_Receive does it byte by byte.
+ *
+*/
+void MeFrame_ReceiveFrame(int8_t *Frame, uint32_t Length)
+{
+    if(Length < 11 || Length > (MEPORT_MAX_RX_BUF_SIZE+15) || Frame[0] != '!') return;
+
+    if(Length == 11)
+    {
+        //Ack Received
+
+        //The ACK echoes the CRC of the acknowledged frame
+        uint16_t SeqNr, RcvCRC;
+        if(!MeVarConv_HexToUsChecked(&Frame[3], &SeqNr) || !MeVarConv_HexToUsChecked(&Frame[7], &RcvCRC)) return;
+        MeInt_FrameReceived(MeVarConv_HexToUc(&Frame[1]), SeqNr, 1, RcvCRC, 0, 0);
+    }
+    else
+    {
+        //Data Received 
+
+        //Check CRC of received Frame
+        uint16_t SeqNr, RcvCRC, CalcCRC;
+        CalcCRC = MeCRC16_Block(0, Frame, Length-4); //Calculate CRC of received Frame
+        if(!MeVarConv_HexToUsChecked(&Frame[Length-4], &RcvCRC)) return; //Get Frame CRC
+        if(RcvCRC == CalcCRC && MeVarConv_HexToUsChecked(&Frame[3], &SeqNr))
+        {
+            //CRC is correct
+            MeInt_FrameReceived(MeVarConv_HexToUc(&Frame[1]), SeqNr, 0, 0, &Frame[7], Length-11);
+        }
+    }
+}
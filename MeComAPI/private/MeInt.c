@@ -4,13 +4,24 @@
     @author     Meerstetter Engineering GmbH: Marc Luethi
 
     These Functions do send the given Data down to the Frame level and
-    call a wait timeout Function (MePort_SemaphorTake).
-    If the timeout has expired without receiving an answer, an error is generated.
-    if an answer is received by the lower level functions, the timeout
-    function is being unblocked immediately (SemaphoreGive) and the
-    received Frame is being checked.
+    wait for the answer of the device.
+    If the timeout has expired without receiving an answer, the request is
+    sent again, 3 times in total. Then an error is generated.
 
-    These functions to try 3 Times. Till a timeout is being generated.
+    All devices share one port, the bus (MeComBus). Every device address
+    has its own sequence numbers and may have up to MEPORT_MAX_IN_FLIGHT
+    requests outstanding, the answers are matched to the requests by
+    address and sequence number as they arrive (MeInt_FrameReceived).
+    MeInt_Submit starts a request and returns at once, MeInt_Wait collects
+    its result. MeInt_Query and MeInt_Set do both.
+
+    Only one device talks on the wire at a time, otherwise the answers of
+    two devices could collide on RS485. The device owning the wire sends
+    all its queued requests and keeps the wire until they are answered or
+    overdue, new requests of the owner join in as long as no other device
+    waits. Then the next device with queued requests gets the wire, round
+    robin. An overdue request goes back to the queue for its next trial, so
+    a slow or missing device costs the others one timeout per round.
 
 */
 
@@ -21,86 +32,387 @@
 #include "MeInt.h"
 #include "MeFrame.h"
 #include "MeVarConv.h"
+#include <string.h>
 
 /*==============================================================================*/
 /*                          DEFINITIONS/DECLARATIONS                            */
 /*==============================================================================*/
+#define MEINT_TRIALS 3
+#define MEINT_MAX_SLOTS (MEPORT_MAX_IN_FLIGHT * MEPORT_MAX_DEVICES)
+
+typedef enum
+{
+    MeInt_SlotFree,
+    MeInt_SlotQueued,   //Waiting for its device to own the wire
+    MeInt_SlotPending,  //Sent, waiting for the answer
+    MeInt_SlotDone,
+} MeInt_SlotState;
+
+struct MeInt_SlotS
+{
+    MeInt_SlotState State;
+    uint8_t IsQuery;
+    uint8_t Succeeded;
+    int32_t ErrorNr;
+    int32_t Device;
+    int8_t Control;
+    uint8_t Address;
+    uint16_t SeqNr;
+    uint16_t SentCRC;
+    int32_t Trials;
+    uint32_t Deadline;
+    uint32_t Length;
+    int8_t TxPayload[MEPORT_MAX_TX_BUF_SIZE];
+    int8_t RcvPayload[MEPORT_MAX_RX_BUF_SIZE];
+};
+
+struct MeInt_DeviceS
+{
+    uint8_t Used;
+    uint8_t Address;
+    uint16_t SequenceNr;
+    int32_t Slots;      //Slots held by requests to this device
+    int32_t Queued;
+    int32_t Pending;
+};
 
+typedef struct
+{
+    struct MeInt_SlotS Slots[MEINT_MAX_SLOTS];
+    struct MeInt_DeviceS Devices[MEPORT_MAX_DEVICES];
+    int32_t Owner;      //Device owning the wire, -1 if it is free
+    int32_t Turn;       //Device which got the wire last
+} MeComBus;
 
 /*==============================================================================*/
 /*                          STATIC FUNCTION PROTOTYPES                          */
 /*==============================================================================*/
+static int32_t MeInt_DeviceLocked(MeComBus *Bus, uint8_t Address);
+static void MeInt_SendLocked(MeComBus *Bus, struct MeInt_SlotS *Slot);
+static void MeInt_ScheduleLocked(MeComBus *Bus);
+static void MeInt_LeavePendingLocked(MeComBus *Bus, struct MeInt_SlotS *Slot, MeInt_SlotState State);
+static uint32_t MeInt_ExpireLocked(MeComBus *Bus);
 
 /*==============================================================================*/
 /*                          EXTERN VARIABLES                                    */
 /*==============================================================================*/
-int8_t *MeInt_QueryRcvPayload = MeFrame_RcvFrame.Payload;
+static int8_t QueryRcvPayload[MEPORT_MAX_RX_BUF_SIZE];
+int8_t *MeInt_QueryRcvPayload = QueryRcvPayload;
 /*==============================================================================*/
 /*                          STATIC  VARIABLES                                   */
 /*==============================================================================*/
-static uint16_t SequenceNr = 5545; //Initialized to random value
+static MeComBus Bus = {.Owner = -1, .Turn = MEPORT_MAX_DEVICES - 1}; //The bus on the port of MePort_*
 
 /*==============================================================================*/
-/** @brief      Connection Function for Query Commands
+/** @brief      Returns the Device Entry of an Address, -1 if the table is full
+ *
+ *  Entries of addresses without requests are taken over by new addresses.
  *
 */
-uint8_t MeInt_Query(int8_t Control, uint8_t Address, uint32_t Length, int8_t *Payload)
+static int32_t MeInt_DeviceLocked(MeComBus *Bus, uint8_t Address)
+{
+    int32_t i, Unused = -1;
+
+    for(i = 0; i < MEPORT_MAX_DEVICES; i++)
+    {
+        if(Bus->Devices[i].Used && Bus->Devices[i].Address == Address) return i;
+        if(Unused < 0 && Bus->Devices[i].Slots == 0 && i != Bus->Owner) Unused = i;
+    }
+    if(Unused >= 0)
+    {
+        Bus->Devices[Unused].Used = 1;
+        Bus->Devices[Unused].Address = Address;
+        Bus->Devices[Unused].SequenceNr = 5545 + Address * 256; //Initialized to random value
+    }
+    return Unused;
+}
+
+/*==============================================================================*/
+/** @brief      Sends the Frame of a queued Request and starts its Timeout
+ *
+ *  Must be called with the Port locked, which also keeps the Frames of
+ *  different Threads apart.
+ *
+*/
+static void MeInt_SendLocked(MeComBus *Bus, struct MeInt_SlotS *Slot)
+{
+    Bus->Devices[Slot->Device].Queued--;
+    Bus->Devices[Slot->Device].Pending++;
+    Slot->State = MeInt_SlotPending;
+    Slot->Trials--;
+    Slot->Deadline = MePort_TimeMs() + MEPORT_SET_AND_QUERY_TIMEOUT;
+    Slot->SentCRC = MeFrame_Send(Slot->Control, Slot->Address, Slot->Length, Slot->SeqNr, Slot->TxPayload);
+}
+
+/*==============================================================================*/
+/** @brief      Hands the Wire to the next Device and sends its Requests
+ *
+ *  Called after every change of a Request's State.
+ *
+*/
+static void MeInt_ScheduleLocked(MeComBus *Bus)
 {
-    SequenceNr++;
+    int32_t i, Dev;
 
-    int32_t Trials = 3;
-    while(Trials > 0)
+    if(Bus->Owner >= 0 && Bus->Devices[Bus->Owner].Pending > 0)
     {
-        Trials--;
-        MeFrame_RcvFrame.DataReceived = 0;
-        MeFrame_RcvFrame.AckReceived = 0;
-        MeFrame_Send(Control, Address, Length, SequenceNr, Payload);
-        MePort_SemaphorTake(MEPORT_SET_AND_QUERY_TIMEOUT);
-        if(MeFrame_RcvFrame.DataReceived == 1 && MeFrame_RcvFrame.Address == Address && MeFrame_RcvFrame.SeqNr == SequenceNr )
+        //The owner keeps the wire, it may send more while nobody else waits
+        for(i = 0; i < MEPORT_MAX_DEVICES; i++)
         {
-            //Correct Data Received -->Check for Error Code
-            if(MeFrame_RcvFrame.Payload[0] == '+')
-            {
-                //Server Error code Received
-                MePort_ErrorThrow(MeVarConv_HexToUc(&MeFrame_RcvFrame.Payload[1]));
-                return 0;
-            }
-            return 1;
+            if(i != Bus->Owner && Bus->Devices[i].Queued > 0) return;
         }
-    }  
-    MePort_ErrorThrow(MEPORT_ERROR_QUERY_TIMEOUT);
-    return 0;
+        Dev = Bus->Owner;
+    }
+    else
+    {
+        //Round robin, starting after the device which had the wire last
+        Bus->Owner = -1;
+        for(i = 1; i <= MEPORT_MAX_DEVICES; i++)
+        {
+            Dev = (Bus->Turn + i) % MEPORT_MAX_DEVICES;
+            if(Bus->Devices[Dev].Queued > 0) break;
+        }
+        if(i > MEPORT_MAX_DEVICES) return;
+        Bus->Owner = Bus->Turn = Dev;
+    }
+
+    for(i = 0; i < MEINT_MAX_SLOTS; i++)
+    {
+        if(Bus->Slots[i].State == MeInt_SlotQueued && Bus->Slots[i].Device == Dev) MeInt_SendLocked(Bus, &Bus->Slots[i]);
+    }
 }
 
 /*==============================================================================*/
-/** @brief      Connection Function for Set Commands
+/** @brief      Ends the Wait for an Answer, the Request is Done or Queued again
  *
 */
-uint8_t MeInt_Set(int8_t Control, uint8_t Address, uint32_t Length, int8_t *Payload)
+static void MeInt_LeavePendingLocked(MeComBus *Bus, struct MeInt_SlotS *Slot, MeInt_SlotState State)
+{
+    Bus->Devices[Slot->Device].Pending--;
+    if(State == MeInt_SlotQueued) Bus->Devices[Slot->Device].Queued++;
+    Slot->State = State;
+    MeInt_ScheduleLocked(Bus);
+}
+
+/*==============================================================================*/
+/** @brief      Handles all overdue Requests, whoever waits for them
+ *
+ *  An overdue Request goes back to the queue while it has trials left,
+ *  then it is Done with a timeout. Returns the time in ms until the next
+ *  Request gets overdue.
+ *
+*/
+static uint32_t MeInt_ExpireLocked(MeComBus *Bus)
 {
-    SequenceNr++;
+    struct MeInt_SlotS *Slot;
+    uint32_t Now = MePort_TimeMs(), Next = MEPORT_SET_AND_QUERY_TIMEOUT;
+    uint8_t Woken = 0;
+    int32_t i, Left;
 
-    int32_t Trials = 3;
-    while(Trials > 0)
+    for(i = 0; i < MEINT_MAX_SLOTS; i++)
     {
-        Trials--;
-        MeFrame_RcvFrame.DataReceived = 0;
-        MeFrame_RcvFrame.AckReceived = 0;
-        MeFrame_Send(Control, Address, Length, SequenceNr, Payload);
-        MePort_SemaphorTake(MEPORT_SET_AND_QUERY_TIMEOUT);
-        if(MeFrame_RcvFrame.DataReceived == 1 && MeFrame_RcvFrame.Address == Address && MeFrame_RcvFrame.SeqNr == SequenceNr &&
-            MeFrame_RcvFrame.Payload[0] == '+')
+        Slot = &Bus->Slots[i];
+        if(Slot->State != MeInt_SlotPending) continue;
+        Left = (int32_t)(Slot->Deadline - Now);
+        if(Left > 0)
         {
-            //Server Error code Received
-            MePort_ErrorThrow(MeVarConv_HexToUc(&MeFrame_RcvFrame.Payload[1]));
-            return 0;
+            if((uint32_t)Left < Next) Next = Left;
         }
-        else if(MeFrame_RcvFrame.AckReceived == 1 && MeFrame_RcvFrame.Address == Address && MeFrame_RcvFrame.SeqNr == SequenceNr )
+        else if(Slot->Trials > 0)
+        {
+            MeInt_LeavePendingLocked(Bus, Slot, MeInt_SlotQueued);
+        }
+        else
+        {
+            Slot->ErrorNr = Slot->IsQuery ? MEPORT_ERROR_QUERY_TIMEOUT : MEPORT_ERROR_SET_TIMEOUT;
+            MeInt_LeavePendingLocked(Bus, Slot, MeInt_SlotDone);
+            Woken = 1;
+        }
+    }
+    if(Woken) MePort_WakeAllLocked();
+    return Next;
+}
+
+/*==============================================================================*/
+/** @brief      Starts a Query (IsQuery = 1) or Set Request
+ *
+ *  Returns a Handle for MeInt_Wait, or -1 if no Request Slot became free
+ *  within the timeout.
+ *
+*/
+int32_t MeInt_Submit(int8_t Control, uint8_t Address, uint32_t Length, int8_t *Payload, uint8_t IsQuery)
+{
+    struct MeInt_SlotS *Slot;
+    uint32_t Start;
+    int32_t i, Dev;
+
+    if(Length > MEPORT_MAX_TX_BUF_SIZE) return -1;
+
+    MePort_Lock();
+    Start = MePort_TimeMs();
+    for(;;)
+    {
+        i = MEINT_MAX_SLOTS;
+        Dev = MeInt_DeviceLocked(&Bus, Address);
+        if(Dev >= 0 && Bus.Devices[Dev].Slots < MEPORT_MAX_IN_FLIGHT)
         {
-            //Correct ADC received
-            return 1;
+            for(i = 0; i < MEINT_MAX_SLOTS; i++) if(Bus.Slots[i].State == MeInt_SlotFree) break;
         }
-    }  
-    MePort_ErrorThrow(MEPORT_ERROR_SET_TIMEOUT);
-    return 0;
+        if(i < MEINT_MAX_SLOTS) break;
+        if(MePort_TimeMs() - Start >= MEINT_TRIALS * MEPORT_SET_AND_QUERY_TIMEOUT)
+        {
+            MePort_Unlock();
+            MePort_ErrorThrow(IsQuery ? MEPORT_ERROR_QUERY_TIMEOUT : MEPORT_ERROR_SET_TIMEOUT);
+            return -1;
+        }
+        MePort_WaitLocked(MeInt_ExpireLocked(&Bus));
+    }
+
+    Slot = &Bus.Slots[i];
+    Bus.Devices[Dev].Slots++;
+    Bus.Devices[Dev].Queued++;
+    Bus.Devices[Dev].SequenceNr++;
+    Slot->State = MeInt_SlotQueued;
+    Slot->IsQuery = IsQuery;
+    Slot->Succeeded = 0;
+    Slot->ErrorNr = 0;
+    Slot->Device = Dev;
+    Slot->Control = Control;
+    Slot->Address = Address;
+    Slot->SeqNr = Bus.Devices[Dev].SequenceNr;
+    Slot->Trials = MEINT_TRIALS;
+    Slot->Length = Length;
+    memcpy(Slot->TxPayload, Payload, Length);
+    MeInt_ScheduleLocked(&Bus);
+    MePort_Unlock();
+    return i;
+}
+
+/*==============================================================================*/
+/** @brief      Waits for the Result of a Request
+ *
+ *  Meanwhile handles overdue Requests (MeInt_ExpireLocked). The received Payload
+ *  of a Query is copied to RcvPayload (MEPORT_MAX_RX_BUF_SIZE Bytes) if it is
+ *  not NULL. Frees the Handle. Returns 1 on Success.
+ *
+*/
+uint8_t MeInt_Wait(int32_t Handle, int8_t *RcvPayload)
+{
+    struct MeInt_SlotS *Slot;
+    uint8_t Succeeded;
+    int32_t ErrorNr;
+    uint32_t Next;
+
+    if(Handle < 0 || Handle >= MEINT_MAX_SLOTS) return 0;
+    Slot = &Bus.Slots[Handle];
+
+    MePort_Lock();
+    while(Slot->State != MeInt_SlotDone)
+    {
+        Next = MeInt_ExpireLocked(&Bus);
+        if(Slot->State != MeInt_SlotDone) MePort_WaitLocked(Next);
+    }
+    Succeeded = Slot->Succeeded;
+    ErrorNr = Slot->ErrorNr;
+    if(Succeeded && RcvPayload) memcpy(RcvPayload, Slot->RcvPayload, MEPORT_MAX_RX_BUF_SIZE);
+    Bus.Devices[Slot->Device].Slots--;
+    Slot->State = MeInt_SlotFree;
+    MePort_WakeAllLocked(); //Someone may wait for a free Slot
+    MePort_Unlock();
+
+    if(!Succeeded) MePort_ErrorThrow(ErrorNr);
+    return Succeeded;
+}
+
+/*==============================================================================*/
+/** @brief      Hands a received Frame to the Request it answers
+ *
+ *  Called by MeFrame_Receive for every Frame with a correct CRC.
+ *  AckCRC is the CRC the device echoed in an ACK Frame (IsAck = 1),
+ *  Payload holds Length Bytes of a Data Frame.
+ *  A late answer to a Request that waits for its next trial is taken as well.
+ *  Frames that match no Request are dropped.
+ *
+*/
+void MeInt_FrameReceived(uint8_t Address, uint16_t SeqNr, uint8_t IsAck, uint16_t AckCRC, int8_t *Payload, int32_t Length)
+{
+    struct MeInt_SlotS *Slot = 0;
+    uint8_t Done = 0;
+    int32_t i;
+
+    MePort_Lock();
+    for(i = 0; i < MEINT_MAX_SLOTS; i++)
+    {
+        if((Bus.Slots[i].State == MeInt_SlotPending || Bus.Slots[i].State == MeInt_SlotQueued) &&
+           Bus.Slots[i].Address == Address && Bus.Slots[i].SeqNr == SeqNr)
+        {
+            Slot = &Bus.Slots[i];
+            break;
+        }
+    }
+
+    if(Slot == 0)
+    {
+        //Late Answer of a Request which was given up
+    }
+    else if(IsAck)
+    {
+        //Correct ACK received
+        if(!Slot->IsQuery && AckCRC == Slot->SentCRC)
+        {
+            Slot->Succeeded = 1;
+            Done = 1;
+        }
+    }
+    else if(Length > 0 && Payload[0] == '+')
+    {
+        //Server Error code Received
+        Slot->ErrorNr = MeVarConv_HexToUc(&Payload[1]);
+        Done = 1;
+    }
+    else if(Slot->IsQuery)
+    {
+        //Correct Data Received
+        if(Length > MEPORT_MAX_RX_BUF_SIZE) Length = MEPORT_MAX_RX_BUF_SIZE;
+        memcpy(Slot->RcvPayload, Payload, Length);
+        memset(Slot->RcvPayload + Length, 0, MEPORT_MAX_RX_BUF_SIZE - Length);
+        Slot->Succeeded = 1;
+        Done = 1;
+    }
+
+    if(Done)
+    {
+        if(Slot->State == MeInt_SlotPending)
+        {
+            MeInt_LeavePendingLocked(&Bus, Slot, MeInt_SlotDone);
+        }
+        else
+        {
+            Bus.Devices[Slot->Device].Queued--;
+            Slot->State = MeInt_SlotDone;
+        }
+        MePort_WakeAllLocked();
+    }
+    MePort_Unlock();
+}
+
+/*==============================================================================*/
+/** @brief      Connection Function for Query Commands
+ *
+ *  The answer is left in MeInt_QueryRcvPayload, which is shared by all
+ *  callers of this function.
+ *
+*/
+uint8_t MeInt_Query(int8_t Control, uint8_t Address, uint32_t Length, int8_t *Payload)
+{
+    return MeInt_Wait(MeInt_Submit(Control, Address, Length, Payload, 1), MeInt_QueryRcvPayload);
+}
+
+/*==============================================================================*/
+/** @brief      Connection Function for Set Commands
+ *
+*/
+uint8_t MeInt_Set(int8_t Control, uint8_t Address, uint32_t Length, int8_t *Payload)
+{
+    return MeInt_Wait(MeInt_Submit(Control, Address, Length, Payload, 0), 0);
 }
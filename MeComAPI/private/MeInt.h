@@ -8,5 +8,9 @@ extern int8_t *MeInt_QueryRcvPayload;
 extern uint8_t MeInt_Query(int8_t Control, uint8_t Address, uint32_t Length, int8_t *Payload);
 extern uint8_t MeInt_Set(int8_t Control, uint8_t Address, uint32_t Length, int8_t *Payload);
 
+extern int32_t MeInt_Submit(int8_t Control, uint8_t Address, uint32_t Length, int8_t *Payload, uint8_t IsQuery);
+extern uint8_t MeInt_Wait(int32_t Handle, int8_t *RcvPayload);
+extern void MeInt_FrameReceived(uint8_t Address, uint16_t SeqNr, uint8_t IsAck, uint16_t AckCRC, int8_t *Payload, int32_t Length);
+
 
 #endif
\ No newline at end of file
@@ -3,6 +3,12 @@
     @brief      Converts the variables for the communication
     @author     Meerstetter Engineering GmbH: Marc Luethi
 
+    Up to 8 hex digits are converted at once (HexDecode, HexEncode): the
+    digits are held in one 64 bit word, one per byte, and all bytes are
+    classified and converted together with word arithmetic. The Checked
+    functions report input that is not hex. The other functions keep
+    their old result for such input, every invalid digit counts as 0.
+
 */
 
 /*==============================================================================*/
@@ -14,11 +20,16 @@
 /*==============================================================================*/
 /*                          DEFINITIONS/DECLARATIONS                            */
 /*==============================================================================*/
+#define BYTES(b) (0x0101010101010101ULL * (b))   //b in every byte of a word
 
 /*==============================================================================*/
 /*                          STATIC FUNCTION PROTOTYPES                          */
 /*==============================================================================*/
 static uint8_t HEXtoNR(int8_t uc);
+static inline uint64_t HexLoad(const int8_t *arr, uint32_t Digits);
+static inline uint8_t HexDecode(uint64_t x, uint32_t *value);
+static inline uint32_t HexDecodeAny(const int8_t *arr, uint32_t Digits);
+static inline void HexEncode(int8_t *arr, uint32_t value, uint32_t Digits);
 
 /*==============================================================================*/
 /*                          EXTERN VARIABLES                                    */
@@ -54,30 +65,22 @@ int8_t   MeVarConv_HexToSc   (int8_t *arr)
 /*======================================================================*/
 uint16_t MeVarConv_HexToUs   (int8_t *arr)
 {
-	return (HEXtoNR(*(arr+0))*4096)+ (HEXtoNR(*(arr+1))*256)+ (HEXtoNR(*(arr+2))*16)+ (HEXtoNR(*(arr+3)));
+	return (uint16_t)HexDecodeAny(arr, 4);
 }
 /*======================================================================*/
 int16_t  MeVarConv_HexToSs   (int8_t *arr)
 {
-	return (((int16_t)HEXtoNR(arr[0])<<12)+ ((int16_t)HEXtoNR(arr[1])<<8)+ ((int16_t)HEXtoNR(arr[2])<<4)+ (int16_t)HEXtoNR(arr[3]));
+	return (int16_t)HexDecodeAny(arr, 4);
 }
 /*======================================================================*/
 uint32_t MeVarConv_HexToUl   (int8_t *arr)
 {
-	return 
-        (((uint32_t)HEXtoNR(arr[0])<<28)   + ((uint32_t)HEXtoNR(arr[1])<<24)+  
-        ((uint32_t)HEXtoNR(arr[2])<<20)    + ((uint32_t)HEXtoNR(arr[3])<<16)+
-		((uint32_t)HEXtoNR(arr[4])<<12)    + ((uint32_t)HEXtoNR(arr[5])<<8)+ 
-        ((uint32_t)HEXtoNR(arr[6])<<4)     +  (uint32_t)HEXtoNR(arr[7]));
+	return HexDecodeAny(arr, 8);
 }
 /*======================================================================*/
 int32_t  MeVarConv_HexToSl   (int8_t *arr)
 {
-	return 
-        (((int32_t)HEXtoNR(arr[0])<<28)    + ((int32_t)HEXtoNR(arr[1])<<24)+  
-        ((int32_t)HEXtoNR(arr[2])<<20)     + ((int32_t)HEXtoNR(arr[3])<<16)+
-		((int32_t)HEXtoNR(arr[4])<<12)     + ((int32_t)HEXtoNR(arr[5])<<8)+ 
-        ((int32_t)HEXtoNR(arr[6])<<4)      + (int32_t)HEXtoNR(arr[7]));
+	return (int32_t)HexDecodeAny(arr, 8);
 }
 /*======================================================================*/
 float    MeVarConv_HexToFloat(int8_t *arr)
@@ -89,6 +92,27 @@ float    MeVarConv_HexToFloat(int8_t *arr)
     return fpv;
 }
 /*======================================================================*/
+uint8_t  MeVarConv_HexToUsChecked(int8_t *arr, uint16_t *value)
+{
+    uint32_t ul;
+    if(!HexDecode(HexLoad(arr, 4), &ul)) return 0;
+    *value = (uint16_t)ul;
+    return 1;
+}
+/*======================================================================*/
+uint8_t  MeVarConv_HexToUlChecked(int8_t *arr, uint32_t *value)
+{
+    return HexDecode(HexLoad(arr, 8), value);
+}
+/*======================================================================*/
+uint8_t  MeVarConv_HexToSlChecked(int8_t *arr, int32_t *value)
+{
+    uint32_t ul;
+    if(!HexDecode(HexLoad(arr, 8), &ul)) return 0;
+    *value = (int32_t)ul;
+    return 1;
+}
+/*======================================================================*/
 void MeVarConv_AddDigitHex   (int8_t *arr, uint8_t  value)
 {
 	*arr = cHex[value]; arr++;
@@ -109,46 +133,23 @@ void MeVarConv_AddScHex      (int8_t *arr, int8_t   value)
 /*======================================================================*/
 void MeVarConv_AddUsHex      (int8_t *arr, uint16_t value)
 {
-	value = value & 0x0000FFFF;
-	*arr = cHex[value/4096]; arr++;
-	*arr = cHex[(value/256)%16]; arr++;
-	*arr = cHex[(value%256)/16]; arr++;
-	*arr = cHex[(value%256)%16]; arr++;
+	HexEncode(arr, value, 4);
 }
 /*======================================================================*/
 void MeVarConv_AddSsHex      (int8_t *arr, int16_t  value)
 {
-    uint16_t us = (uint16_t)value;
-	*arr = cHex[(us>>12)&0x00F]; arr++;
-	*arr = cHex[(us>>8)&0x00F]; arr++;
-	*arr = cHex[(us>>4)&0x00F]; arr++;
-	*arr = cHex[(us   )&0x00F]; arr++;
+	HexEncode(arr, (uint16_t)value, 4);
 }
 /*======================================================================*/
 void MeVarConv_AddUlHex      (int8_t *arr, uint32_t value)
 {
-	*arr = cHex[value>>28]; arr++;
-	*arr = cHex[(value>>24)&0x00F]; arr++;
-	*arr = cHex[(value>>20)&0x00F]; arr++;
-	*arr = cHex[(value>>16)&0x00F]; arr++;
-	*arr = cHex[(value>>12)&0x00F]; arr++;
-	*arr = cHex[(value>>8)&0x00F]; arr++;
-	*arr = cHex[(value>>4)&0x00F]; arr++;
-	*arr = cHex[(value   )&0x00F]; arr++;
+	HexEncode(arr, value, 8);
 }
 
 /*======================================================================*/
 void MeVarConv_AddSlHex      (int8_t *arr, int32_t  value)
 {
-    uint32_t ul = (uint32_t)value;
-	*arr = cHex[ul>>28]; arr++;
-	*arr = cHex[(ul>>24)&0x00F]; arr++;
-	*arr = cHex[(ul>>20)&0x00F]; arr++;
-	*arr = cHex[(ul>>16)&0x00F]; arr++;
-	*arr = cHex[(ul>>12)&0x00F]; arr++;
-	*arr = cHex[(ul>>8)&0x00F]; arr++;
-	*arr = cHex[(ul>>4)&0x00F]; arr++;
-	*arr = cHex[(ul   )&0x00F]; arr++;
+	HexEncode(arr, (uint32_t)value, 8);
 }
 /*======================================================================*/
 void MeVarConv_AddFloatHex   (int8_t *arr, float    value)
@@ -189,4 +190,90 @@ static uint8_t HEXtoNR(int8_t uc)
 		return (0);
 }
 
+/*======================================================================*/
+/*  Loads 8 or 4 hex digits, the first one into the lowest byte used, so
+ *  that the word holds 8 digits with leading '0's. Written byte by byte
+ *  for any byte order, compilers turn it into one load.
+ */
+static inline uint64_t HexLoad(const int8_t *arr, uint32_t Digits)
+{
+    const uint8_t *p = (const uint8_t *)arr;
+
+    if(Digits == 8)
+    {
+        return (uint64_t)p[0]         | ((uint64_t)p[1] << 8)  | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+               ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+    }
+    return (BYTES('0') >> 32) |
+           ((uint64_t)p[0] << 32) | ((uint64_t)p[1] << 40) | ((uint64_t)p[2] << 48) | ((uint64_t)p[3] << 56);
+}
+
+/*======================================================================*/
+/*  Converts the 8 digits of HexLoad, returns 0 if one of them is not
+ *  0-9, A-F or a-f.
+ */
+static inline uint8_t HexDecode(uint64_t x, uint32_t *value)
+{
+    uint64_t Lower = x | BYTES(0x20);
+    uint64_t Digit, Letter, n;
+
+    //For bytes below 0x80: the high bit of b + (0x80 - lo) is set for b >= lo,
+    //the high bit of b + (0x7F - hi) for b > hi
+    Digit  = (x + BYTES(0x80 - '0')) & ~(x + BYTES(0x7F - '9'));
+    Letter = (Lower + BYTES(0x80 - 'a')) & ~(Lower + BYTES(0x7F - 'f'));
+    if(((Digit | Letter) & ~x & BYTES(0x80)) != BYTES(0x80)) return 0;
+
+    //'0'-'9' -> 0-9, 'A'-'F' and 'a'-'f' -> 1-6 + 9
+    n = (x & BYTES(0x0F)) + ((x >> 6) & BYTES(0x01)) * 9;
+
+    //Join the nibbles: the first digit is the highest
+    n = ((n & 0x000F000F000F000FULL) << 4) | ((n >> 8) & 0x000F000F000F000FULL);
+    n = (n | (n >> 8)) & 0x0000FFFF0000FFFFULL;
+    n = (n | (n >> 16)) & 0x00000000FFFFFFFFULL;
+#if defined(__GNUC__)
+    *value = __builtin_bswap32((uint32_t)n);
+#else
+    *value = ((uint32_t)n >> 24) | (((uint32_t)n >> 8) & 0xFF00) |
+             (((uint32_t)n << 8) & 0xFF0000) | ((uint32_t)n << 24);
+#endif
+    return 1;
+}
+
+/*======================================================================*/
+/*  Converts 8 or 4 hex digits, invalid digits count as 0 like in HEXtoNR.
+ */
+static inline uint32_t HexDecodeAny(const int8_t *arr, uint32_t Digits)
+{
+    uint32_t value = 0;
+
+    if(HexDecode(HexLoad(arr, Digits), &value)) return value;
+    for(uint32_t i = 0; i < Digits; i++) value = (value << 4) | HEXtoNR(arr[i]);
+    return value;
+}
+
+/*======================================================================*/
+/*  Writes the lowest 8 or 4 nibbles of value as upper case hex.
+ */
+static inline void HexEncode(int8_t *arr, uint32_t value, uint32_t Digits)
+{
+    uint64_t n = value;
+
+    //One nibble per byte, the highest one in the lowest byte
+    n = ((n & 0xFFFF0000ULL) >> 16) | ((n & 0x0000FFFFULL) << 32);
+    n = ((n & 0x0000FF000000FF00ULL) >> 8) | ((n & 0x000000FF000000FFULL) << 16);
+    n = ((n & 0x00F000F000F000F0ULL) >> 4) | ((n & 0x000F000F000F000FULL) << 8);
+
+    //0-9 -> '0'-'9', 10-15 -> 'A'-'F'
+    n += BYTES('0') + (((n + BYTES(0x76)) >> 7) & BYTES(0x01)) * 7;
+
+    if(Digits == 8)
+    {
+        arr[0] = (int8_t)n;         arr[1] = (int8_t)(n >> 8);
+        arr[2] = (int8_t)(n >> 16); arr[3] = (int8_t)(n >> 24);
+        arr += 4;
+    }
+    arr[0] = (int8_t)(n >> 32); arr[1] = (int8_t)(n >> 40);
+    arr[2] = (int8_t)(n >> 48); arr[3] = (int8_t)(n >> 56);
+}
+
 /*==========================EOF=====================================================*/
@@ -14,6 +14,11 @@ extern uint32_t MeVarConv_HexToUl   (int8_t *arr);
 extern int32_t  MeVarConv_HexToSl   (int8_t *arr);
 extern float    MeVarConv_HexToFloat(int8_t *arr);
 
+//Return 0 and leave value alone if arr holds something else than hex digits
+extern uint8_t  MeVarConv_HexToUsChecked(int8_t *arr, uint16_t *value);
+extern uint8_t  MeVarConv_HexToUlChecked(int8_t *arr, uint32_t *value);
+extern uint8_t  MeVarConv_HexToSlChecked(int8_t *arr, int32_t *value);
+
 extern void MeVarConv_AddDigitHex   (int8_t *arr, uint8_t  value);
 extern void MeVarConv_AddUcHex      (int8_t *arr, uint8_t  value);
 extern void MeVarConv_AddScHex      (int8_t *arr, int8_t   value);
@@ -6,62 +6,62 @@
  * - TCP/IP comms
  * - Interface with MeCOM API for comunication with PID controller
  * - Startup flags to change quastion size (-a), enable PID contoller (-m), set cilent IP (-i) 
+ * - Pipelined acquisition with several frames in flight per channel (-d)
+ * - Zero-copy transmission straight from the dma window (-z)
+ * - Selectable trigger wait backend with wake latency statistics (-w)
+ * - Software fpga model for running without a Red Pitaya (-S)
+ * - Single port data server multiplexing both channels, telemetry and acks (-s)
+ * - Persistent framed sessions on the A/B/ACK ports (-p)
+ * - On-board Rb dip and etalon fringe finder (-f), optionally results only (-r)
+ * - On-board lock of the etalon to the Rb dips (-l), gains set with -k
+ * - Binary control commands with request id correlated replies (-s, -p)
+ * - TEC telemetry polled in the background (-t sets the period in ms)
+ * - Several TEC controllers sharing the serial line (-e addr:inst,...)
+ * - TEC serial link at any baud rate (-b), verified with a ping
+ * - Serial trace of the MeCom traffic to ComLog.txt (-T, or CMD_SET_TRACE)
+ * - Emulated TEC controllers on a pty for running without them (-M)
+ * - BME280 sampled in the background, read once per frame without i2c traffic
+ * - BME280 conversions timed to end just before each trigger, settings (-B)
+ * - I2C through i2c-dev combined transfers with retries, a BME280 model with -S
+ * - Sensor registry, telemetry filled from a lock-free table of the newest samples
+ * - Per frame send and peak finder timings on stderr (-v), send totals at exit
  * 
  * Copyright Chris Betters USYD 2017
  */
 
 #include <sys/time.h>
-#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <linux/errqueue.h>
 
 #include "temp_moniter.h"
 #include "configuration.h"
 #include "MeComAPI/MeCom.h"
+#include "MeComAPI/ComPort/ComTrace.h"
 #include "bme280.h"
+#include "scope.h"
+#include "queue.h"
+#include "data_server.h"
+#include "peak_finder.h"
+#include "lock.h"
+#include "control.h"
+#include "tec_poller.h"
+#include "tec_writer.h"
+#include "bme_poller.h"
+#include "sensors.h"
+#include "mecom_sim.h"
+#include "trigger_wait.h"
 
 /* data types */
-enum equalizer
+enum send_mode
 {
-  EQ_OFF,
-  EQ_LV,
-  EQ_HV
+  SEND_COPY = 0, /* copy from dma ram into queue->buf, send from there */
+  SEND_DIRECT, /* sendmsg straight from the dma window */
+  SEND_ZEROCOPY /* as SEND_DIRECT, with MSG_ZEROCOPY where the kernel can */
 };
-enum trigger
-{
-  TR_OFF = 0,
-  TR_MANUAL,
-  TR_CH_A_RISING,
-  TR_CH_A_FALLING,
-  TR_CH_B_RISING,
-  TR_CH_B_FALLING,
-  TR_EXT_RISING,
-  TR_EXT_FALLING,
-  TR_ASG_RISING,
-  TR_ASG_FALLING
-};
-enum decimation
-{
-  DE_OFF = 0,
-  DE_1 = 0x00001,
-  DE_8 = 0x00008,
-  DE_64 = 0x00040,
-  DE_1024 = 0x00400,
-  DE_8192 = 0x02000,
-  DE_65536 = 0x10000
-};
-
-struct queue
-{
-  pthread_mutex_t mutex;
-  pthread_t sender;
-  int started;
-  unsigned int read_end;
-  uint8_t *buf;
-  int sock_fd;
-};
-
 /* macros and prototypes */
 /* note: the circular buffer macros may evaluate each of their arguments once,
  * more
@@ -90,56 +90,119 @@ struct queue
     }                                                                    \
   } while (0)
 
-static void scope_reset(void);
-static void scope_set_filters(enum equalizer eq, int shaping,
-                              volatile uint32_t *base);
-static void scope_setup_input_parameters(enum decimation dec,
-                                         enum equalizer ch_a_eq,
-                                         enum equalizer ch_b_eq,
-                                         int ch_a_shaping, int ch_b_shaping);
-static void scope_setup_trigger_parameters(int thresh_a, int thresh_b,
-                                           int hyst_a, int hyst_b,
-                                           int deadtime);
-static void scope_setup_axi_recording(void);
-static void scope_activate_trigger(enum trigger trigger);
+static int queue_wait_released(struct queue *q, unsigned int max_in_flight);
+static void queue_publish(struct queue *q, uint8_t *frame, unsigned int pos,
+                          void *src, unsigned int offs, unsigned int size,
+                          unsigned int length, uint32_t flags);
 static void ADC_read_worker(struct queue *a, struct queue *b);
 static void *TCP_ADC_data_send_worker(void *data);
+static void *TCP_ack_worker(void *data);
+static int session_send(int sock_fd, int *psd, uint16_t type,
+                        uint32_t sequence, void *payload, uint32_t length);
+static int session_receive(int sock_fd, int *psd, uint32_t sequence,
+                           struct proto_header *hdr, uint8_t *payload);
+static int session_ack(int sock_fd, int *psd, uint32_t sequence,
+                       struct telemetry *tm, float *value);
+static int session_idle(int sock_fd, int *psd, uint32_t sequence);
+static int apply_settings(struct queue *a, struct queue *b,
+                          const struct acq_settings *next);
+static int send_iov(int psd, struct iovec *iov, int niov, int *zerocopy,
+                    uint32_t *zc_sends);
+static void apply_set_point(float value);
+static int max_acquisition_length(void);
+static void fill_telemetry(struct telemetry *tm,
+                           const struct sensor_sample *table,
+                           const struct sensor_ref *fields,
+                           struct sensor_ref env);
+static int parse_tec_devices(const char *arg);
+static void request_stop(void);
+static void send_stats_report(const char *name, const struct send_stats *st);
 unsigned long long getMillisecondsSinceEpoch(void);
 int flipFibreSwitchs(bool enableSpec);
 
 /* module global variables */
-static volatile void
-    *scope; /* access to fpga registers must not be optimized */
-static void *buf_a = MAP_FAILED;
-static void *buf_b = MAP_FAILED;
 static struct queue queue_a = {
-    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .ring = {.data_fd = -1, .done_fd = -1},
     .started = 0,
-    .read_end = 0,
+    .in_flight = 0,
     .buf = NULL,
     .sock_fd = -1,
 };
 static struct queue queue_b = {
-    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .ring = {.data_fd = -1, .done_fd = -1},
     .started = 0,
-    .read_end = 0,
+    .in_flight = 0,
     .buf = NULL,
     .sock_fd = -1,
 };
-
-static struct queue queue_tecpid = {
-    .mutex = PTHREAD_MUTEX_INITIALIZER,
+static struct queue queue_ack = {
+    .ring = {.data_fd = -1, .done_fd = -1},
     .started = 0,
-    .read_end = 0,
+    .in_flight = 0,
     .buf = NULL,
     .sock_fd = -1,
 };
+static int stop_requested; /* set by the ack worker on "END" */
+static struct trigger_wait trig_wait;
+static struct data_server data_srv = {
+    .sock_fd = -1,
+    .reply_fd = -1,
+    .a = &queue_a,
+    .b = &queue_b,
+    .tm = &queue_ack,
+    .ack = tec_writer_set_point,
+    .gains = lock_set_gains,
+    .end = request_stop,
+};
+static pthread_t data_srv_thread;
+static int data_srv_started;
+static struct peak_result *peak_results; /* one per frame slot */
+static struct acq_settings acq; /* in effect, changed by the reader only */
+/*
+ * sensor channels (sensors.c) the telemetry fields are filled from, 0 while
+ * a channel has no sample. env_timestamp is the time of the sample behind
+ * TELEMETRY_ENV_CHANNEL.
+ */
+static const struct
+{
+  const char *channel;
+  size_t offset;
+} telemetry_fields[] = {
+    {"tec0.object_temp", offsetof(struct telemetry, tec_temp)},
+    {"bme280.temp", offsetof(struct telemetry, t)},
+    {"bme280.pressure", offsetof(struct telemetry, p)},
+    {"bme280.humidity", offsetof(struct telemetry, h)},
+};
+#define TELEMETRY_FIELDS (sizeof(telemetry_fields) / sizeof(telemetry_fields[0]))
+#define TELEMETRY_ENV_CHANNEL "bme280.temp"
 
-int AckSock_fd;
+int AckSock_fd = -1;
 
 char CLIENT_IP_ADDR[] = "10.66.101.131";
 int ACQUISITION_LENGTH = 20000;
 int USE_BUILT_IN_PID;
+int PIPELINE_DEPTH = 1; /* frames in flight per channel, 1 = wait for send */
+int SEND_MODE = SEND_COPY; /* one of enum send_mode */
+int TRIGGER_WAIT = TW_BUSY_POLL; /* one of enum trigger_wait_mode */
+double SIM_SAMPLE_RATE = 0; /* samples/s of the fpga model, 0 = real fpga */
+int DATA_SERVER; /* serve everything on DATA_SERVER_PORT instead of A/B/ACK */
+int PERSISTENT_SESSIONS; /* keep A/B/ACK connections open, frames framed */
+int PEAK_FINDER; /* analyse each frame on board, send a struct peak_result */
+int RESULTS_ONLY; /* send the peak finder results instead of the samples */
+int LOCK_MODE; /* lock on board, LOCK_OUTPUT is the TEC operating point */
+int VERBOSE; /* per frame timings on stderr (-v) */
+int TEC_POLL_PERIOD = TEC_POLL_PERIOD_MS; /* ms between TEC telemetry polls */
+int TEC_BAUD = TEC_BAUD_RATE; /* serial rate of the TEC link */
+/* TEC controllers on the line, the lock and the telemetry use the first */
+struct tec_device TEC_DEVICES[TEC_MAX_DEVICES] = {{0, 1}};
+int TEC_DEVICE_COUNT = 1;
+/* -B t,p,h,filter, BME280 oversampling and IIR filter */
+bme280_settings BME_SETTINGS = {.osrs_t = BME_OVERSAMPLING, .osrs_p = BME_OVERSAMPLING,
+                                .osrs_h = BME_OVERSAMPLING, .filter = BME_FILTER};
+/* -M latency_us,jitter_us,error_permille, emulated TEC controllers */
+int MECOM_SIM;
+struct mecom_sim_config MECOM_SIM_CONFIG;
+float LOCK_OUTPUT;
 
 // int bmefd;
 // bme280_calib_data bmecal;
@@ -152,12 +215,13 @@ int USE_BUILT_IN_PID;
 int main(int argc, char **argv)
 {
   int rc;
-  int mem_fd;
-  void *smap = MAP_FAILED;
+  int scope_opened = 0;
+  int lock_started = 0;
+  float kp, ki, kd;
   struct sockaddr_in srv_addr;
   int c;
 
-  while ((c = getopt(argc, argv, "a:m:i:")) != -1)
+  while ((c = getopt(argc, argv, "a:m:i:d:z:w:S:spfrl:k:t:Tb:e:M:B:v")) != -1)
     switch (c)
     {
     case 'a':
@@ -169,6 +233,93 @@ int main(int argc, char **argv)
     case 'm':
       USE_BUILT_IN_PID = atoi(optarg);
       break;
+    case 'd':
+      PIPELINE_DEPTH = atoi(optarg);
+      if (PIPELINE_DEPTH < 1)
+        PIPELINE_DEPTH = 1;
+      if (PIPELINE_DEPTH > SPSC_RING_SLOTS)
+        PIPELINE_DEPTH = SPSC_RING_SLOTS;
+      break;
+    case 'z':
+      SEND_MODE = atoi(optarg);
+      if (SEND_MODE < SEND_COPY || SEND_MODE > SEND_ZEROCOPY)
+        SEND_MODE = SEND_COPY;
+      break;
+    case 'w':
+      TRIGGER_WAIT = atoi(optarg);
+      if (TRIGGER_WAIT < TW_BUSY_POLL || TRIGGER_WAIT > TW_UIO)
+        TRIGGER_WAIT = TW_BUSY_POLL;
+      break;
+    case 'S':
+      SIM_SAMPLE_RATE = atof(optarg);
+      break;
+    case 's':
+      DATA_SERVER = 1;
+      break;
+    case 'p':
+      PERSISTENT_SESSIONS = 1;
+      break;
+    case 'f':
+      PEAK_FINDER = 1;
+      break;
+    case 'r':
+      PEAK_FINDER = RESULTS_ONLY = 1;
+      break;
+    case 'l':
+      LOCK_MODE = 1;
+      LOCK_OUTPUT = atof(optarg);
+      break;
+    case 't':
+      TEC_POLL_PERIOD = atoi(optarg);
+      if (TEC_POLL_PERIOD < 1)
+        TEC_POLL_PERIOD = 1;
+      break;
+    case 'T':
+      ComTrace_Enable(1);
+      break;
+    case 'v':
+      VERBOSE = 1;
+      break;
+    case 'b':
+      TEC_BAUD = atoi(optarg);
+      if (TEC_BAUD <= 0)
+        TEC_BAUD = TEC_BAUD_RATE;
+      break;
+    case 'e':
+      if (parse_tec_devices(optarg))
+      {
+        fprintf(stderr, "Option -e takes up to %d addr:inst pairs.\n",
+                TEC_MAX_DEVICES);
+        return 1;
+      }
+      break;
+    case 'M':
+      MECOM_SIM = 1;
+      if (sscanf(optarg, "%u,%u,%u", &MECOM_SIM_CONFIG.latency_us,
+                 &MECOM_SIM_CONFIG.jitter_us,
+                 &MECOM_SIM_CONFIG.error_permille) < 1)
+      {
+        fprintf(stderr, "Option -M takes latency_us[,jitter_us[,error_permille]].\n");
+        return 1;
+      }
+      break;
+    case 'B':
+      if (sscanf(optarg, "%hhu,%hhu,%hhu,%hhu", &BME_SETTINGS.osrs_t,
+                 &BME_SETTINGS.osrs_p, &BME_SETTINGS.osrs_h,
+                 &BME_SETTINGS.filter) != 4)
+      {
+        fprintf(stderr, "Option -B takes t,p,h oversampling and filter.\n");
+        return 1;
+      }
+      break;
+    case 'k':
+      if (sscanf(optarg, "%f,%f,%f", &kp, &ki, &kd) != 3)
+      {
+        fprintf(stderr, "Option -k takes Kp,Ki,Kd.\n");
+        return 1;
+      }
+      lock_set_gains(kp, ki, kd);
+      break;
     case '?':
       if (optopt == 'c')
         fprintf(stderr, "Option -%c requires an argument.\n", optopt);
@@ -183,6 +334,63 @@ int main(int argc, char **argv)
       abort();
     }
   fprintf(stderr, "IP of Moniter %s\n", CLIENT_IP_ADDR);
+  if (LOCK_MODE)
+  {
+    /* the lock needs the peak finder, monitors watch on the data server */
+    PEAK_FINDER = 1;
+    DATA_SERVER = 1;
+    data_srv.autonomous = 1;
+    data_srv.ack = NULL;
+  }
+  if (RESULTS_ONLY && !DATA_SERVER && !PERSISTENT_SESSIONS)
+  {
+    fprintf(stderr, "Results only mode needs -s or -p.\n");
+    return 1;
+  }
+  if (PEAK_FINDER)
+  {
+    fprintf(stderr, "Peak finder: %s%s\n", peak_finder_impl(),
+            RESULTS_ONLY ? ", results only" : "");
+    if (!DATA_SERVER && !PERSISTENT_SESSIONS)
+      fprintf(stderr, "Peak results are only sent with -s or -p\n");
+    if (SEND_MODE != SEND_COPY)
+    {
+      /* the analysis wants each frame linear in memory */
+      fprintf(stderr, "Peak finder needs copy mode, ignoring -z %d\n",
+              SEND_MODE);
+      SEND_MODE = SEND_COPY;
+    }
+    /* a result and a telemetry block per frame on the ack ring */
+    if (PIPELINE_DEPTH > SPSC_RING_SLOTS / 2)
+      PIPELINE_DEPTH = SPSC_RING_SLOTS / 2;
+  }
+  if (SEND_MODE != SEND_COPY && PIPELINE_DEPTH > 1)
+  {
+    /* the armed scope keeps overwriting the whole dma ring until it triggers,
+     * so a frame sent from there must be gone before the next arm */
+    fprintf(stderr, "Zero-copy send needs pipeline depth 1, ignoring -d %d\n",
+            PIPELINE_DEPTH);
+    PIPELINE_DEPTH = 1;
+  }
+  if (DATA_SERVER && SEND_MODE == SEND_ZEROCOPY)
+  {
+    /* the data server does not reap MSG_ZEROCOPY completions */
+    fprintf(stderr, "Data server sends without MSG_ZEROCOPY, using direct send\n");
+    SEND_MODE = SEND_DIRECT;
+  }
+#ifndef MSG_ZEROCOPY
+  if (SEND_MODE == SEND_ZEROCOPY)
+  {
+    fprintf(stderr, "MSG_ZEROCOPY not available, using direct send\n");
+    SEND_MODE = SEND_DIRECT;
+  }
+#endif
+  if (ACQUISITION_LENGTH < 1 || ACQUISITION_LENGTH > max_acquisition_length())
+  {
+    fprintf(stderr, "Acquisition length %d out of range, 1 to %d with -d %d\n",
+            ACQUISITION_LENGTH, max_acquisition_length(), PIPELINE_DEPTH);
+    return EXIT_FAILURE;
+  }
   // if (rp_Init() != RP_OK) {
   //   fprintf(stderr, "Red Pitaya API init failed!\n");
   //   return EXIT_FAILURE;
@@ -190,55 +398,113 @@ int main(int argc, char **argv)
 
   if (ENABLE_MECOM)
   {
-    if (initMeCom(0, 1, USE_BUILT_IN_PID))
+    char *tec_port = NULL;
+    char sim_port[64];
+
+    if (MECOM_SIM)
+    {
+      MECOM_SIM_CONFIG.devices = TEC_DEVICES;
+      MECOM_SIM_CONFIG.count = TEC_DEVICE_COUNT;
+      if (mecom_sim_start(&MECOM_SIM_CONFIG, sim_port, sizeof(sim_port)))
+      {
+        rc = -1;
+        goto main_exit;
+      }
+      tec_port = sim_port;
+    }
+    if (initMeCom(tec_port, TEC_DEVICES, TEC_DEVICE_COUNT, USE_BUILT_IN_PID, TEC_BAUD))
     {
       fprintf(stderr, "MeCom Failed.");
+      rc = -1;
+      goto main_exit;
+    }
+    if (tec_poller_start(TEC_DEVICES, TEC_DEVICE_COUNT, TEC_POLL_PERIOD) != 0)
+    {
+      rc = -6;
       goto main_exit;
     }
   }
 
-  // if (ENABLE_BME280)
-  // {
-  //   if (setupBME280())
-  //   {
-  //     fprintf(stderr, "BME280 Failed.");
-  //     goto main_exit;
-  //   }
-  // }
+  /* without the sensor the frames carry zeros, as before */
+  i2c_sim_configure(SIM_I2C_ERROR_PERMILLE);
+  if (ENABLE_BME280 &&
+      bme_poller_start(BME_POLL_PERIOD_MS, &BME_SETTINGS,
+                       SIM_SAMPLE_RATE > 0 ? &i2c_sim_ops : &i2c_dev_ops) != 0)
+    fprintf(stderr, "BME280 Failed.\n");
 
-  /* acquire pointers to mapped bus regions of fpga and dma ram */
-  mem_fd = open("/dev/mem", O_RDWR);
-  if (mem_fd < 0)
+  /* acquire fpga registers and dma ram */
+  if (SIM_SAMPLE_RATE > 0)
   {
-    fprintf(stderr, "open /dev/mem failed, %s\n", strerror(errno));
-    rc = -1;
-    goto main_exit;
+    scope_sim_configure(SIM_SAMPLE_RATE, SIM_TRIGGER_PERIOD_US);
+    rc = scope_open(&scope_sim_ops);
   }
+  else
+    rc = scope_open(&scope_fpga_ops);
+  if (rc != 0)
+    goto main_exit;
+  scope_opened = 1;
+  trigger_wait_init(&trig_wait, TRIGGER_WAIT, TRIGGER_UIO_DEVICE);
 
-  smap = mmap(NULL, 0x00100000UL, PROT_WRITE | PROT_READ, MAP_SHARED, mem_fd,
-              0x40100000UL);
-  buf_a = mmap(NULL, RAM_A_SIZE, PROT_READ, MAP_SHARED, mem_fd, RAM_A_ADDRESS);
-  buf_b = mmap(NULL, RAM_B_SIZE, PROT_READ, MAP_SHARED, mem_fd, RAM_B_ADDRESS);
-  if (smap == MAP_FAILED || buf_a == MAP_FAILED || buf_b == MAP_FAILED)
+  /* allocate cacheable buffers, one frame per pipeline stage. not needed when
+   * sending straight from the dma window */
+  if (SEND_MODE == SEND_COPY)
+  {
+    queue_a.buf = malloc((size_t)ACQUISITION_LENGTH * 2 * PIPELINE_DEPTH);
+    queue_b.buf = malloc((size_t)ACQUISITION_LENGTH * 2 * PIPELINE_DEPTH);
+  }
+  queue_ack.buf = malloc(sizeof(struct telemetry) * PIPELINE_DEPTH);
+  if (PEAK_FINDER)
+    peak_results = malloc(sizeof(struct peak_result) * PIPELINE_DEPTH);
+  if ((SEND_MODE == SEND_COPY && (queue_a.buf == NULL || queue_b.buf == NULL)) ||
+      queue_ack.buf == NULL || (PEAK_FINDER && peak_results == NULL) ||
+      (PEAK_FINDER && peak_finder_init(max_acquisition_length()) != 0))
   {
-    fprintf(stderr, "mmap failed, %s - scope %p buf_a %p buf_b %p\n",
-            strerror(errno), smap, buf_a, buf_b);
-    rc = -2;
+    fprintf(stderr, "malloc failed, %s - buf a %p buf b %p buf ack %p\n",
+            strerror(errno), queue_a.buf, queue_b.buf, queue_ack.buf);
+    rc = -3;
     goto main_exit;
   }
-  scope = smap;
 
-  /* allocate cacheable buffers */
-  queue_a.buf = malloc(ACQUISITION_LENGTH * 2);
-  queue_b.buf = malloc(ACQUISITION_LENGTH * 2);
-  if (queue_a.buf == NULL || queue_b.buf == NULL)
+  /* setup reader to sender rings */
+  if (spsc_ring_init(&queue_a.ring) || spsc_ring_init(&queue_b.ring) ||
+      spsc_ring_init(&queue_ack.ring))
   {
-    fprintf(stderr, "malloc failed, %s - buf a %p buf b %p\n", strerror(errno),
-            queue_a.buf, queue_b.buf);
+    fprintf(stderr, "create ring failed, %s\n", strerror(errno));
     rc = -3;
     goto main_exit;
   }
 
+  acq.acquisition_length = ACQUISITION_LENGTH;
+  acq.decimation = DECIMATION;
+  acq.trigger = TRIGGER_MODE;
+  acq.trigger_threshold = TRIGGER_THRESHOLD;
+  control_init(&acq, max_acquisition_length(), LOCK_MODE, TEC_DEVICES,
+               TEC_DEVICE_COUNT);
+
+  /* the client's set points and TEC commands are applied off the network
+   * threads */
+  if (tec_writer_start(apply_set_point, control_execute) != 0)
+  {
+    rc = -6;
+    goto main_exit;
+  }
+
+  if (DATA_SERVER)
+  {
+    data_srv.frame_length = ACQUISITION_LENGTH * 2;
+    data_srv.command = control_submit;
+    data_srv.reply_fd = tec_writer_reply_fd();
+    data_srv.take_reply = tec_writer_take_reply;
+    data_srv.results_only = RESULTS_ONLY;
+    data_srv.verbose = VERBOSE;
+    if (data_server_open(&data_srv, DATA_SERVER_PORT) != 0)
+    {
+      rc = -5;
+      goto main_exit;
+    }
+    goto setup_scope;
+  }
+
   /* setup tcp sockets */
   queue_a.sock_fd = socket(PF_INET, SOCK_STREAM, 0);
   queue_b.sock_fd = socket(PF_INET, SOCK_STREAM, 0);
@@ -252,6 +518,7 @@ int main(int argc, char **argv)
     rc = -4;
     goto main_exit;
   }
+  queue_ack.sock_fd = AckSock_fd;
 
   int reuse = 1;
   if (setsockopt(queue_a.sock_fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0)
@@ -298,12 +565,42 @@ int main(int argc, char **argv)
     goto main_exit;
   }
 
+setup_scope:
   /* initialize scope */
   scope_reset();
-  scope_setup_input_parameters(DECIMATION, EQ_LV, EQ_HV, 1, 1);
-  scope_setup_trigger_parameters(TRIGGER_THRESHOLD, TRIGGER_THRESHOLD, 50, 50,
-                                 1250);
-  scope_setup_axi_recording();
+  scope_setup_input_parameters(acq.decimation, EQ_LV, EQ_HV, 1, 1);
+  scope_setup_trigger_parameters(acq.trigger_threshold, acq.trigger_threshold,
+                                 50, 50, 1250);
+  scope_setup_axi_recording(acq.acquisition_length);
+
+  if (LOCK_MODE)
+  {
+    if (USE_BUILT_IN_PID && ENABLE_MECOM)
+      rc = lock_start(LOCK_OUTPUT, LOCK_TEMP_MIN, LOCK_TEMP_MAX,
+                      apply_set_point);
+    else
+      rc = lock_start(LOCK_OUTPUT, LOCK_CURRENT_MIN, LOCK_CURRENT_MAX,
+                      apply_set_point);
+    if (rc != 0)
+    {
+      rc = -6;
+      goto main_exit;
+    }
+    lock_started = 1;
+  }
+
+  if (DATA_SERVER)
+  {
+    rc = pthread_create(&data_srv_thread, NULL, data_server_worker, &data_srv);
+    if (rc != 0)
+    {
+      fprintf(stderr, "start data server failed, %s\n", strerror(rc));
+      rc = -6;
+      goto main_exit;
+    }
+    data_srv_started = 1;
+    goto start_reader;
+  }
 
   /* start socket senders */
   rc = pthread_create(&queue_a.sender, NULL, TCP_ADC_data_send_worker, &queue_a);
@@ -324,6 +621,16 @@ int main(int argc, char **argv)
   }
   queue_b.started = 1;
 
+  rc = pthread_create(&queue_ack.sender, NULL, TCP_ack_worker, &queue_ack);
+  if (rc != 0)
+  {
+    fprintf(stderr, "start ack sender failed, %s\n", strerror(rc));
+    rc = -6;
+    goto main_exit;
+  }
+  queue_ack.started = 1;
+
+start_reader:
   /* start reader in main-thread */
   fprintf(stderr, "ADC_read_worker starting...\n");
   ADC_read_worker(&queue_a, &queue_b);
@@ -336,144 +643,141 @@ main_exit:
     pthread_cancel(queue_a.sender);
     pthread_join(queue_a.sender, NULL);
   }
-  if (queue_tecpid.started)
+  if (queue_b.started)
   {
     pthread_cancel(queue_b.sender);
     pthread_join(queue_b.sender, NULL);
   }
-  if (queue_tecpid.started)
+  if (queue_ack.started)
   {
-    pthread_cancel(queue_b.sender);
-    pthread_join(queue_b.sender, NULL);
+    pthread_cancel(queue_ack.sender);
+    pthread_join(queue_ack.sender, NULL);
+  }
+  if (data_srv_started)
+  {
+    pthread_cancel(data_srv_thread);
+    pthread_join(data_srv_thread, NULL);
+  }
+  if (data_srv_started)
+  {
+    /* the reader copies for the data server out of both channels */
+    data_srv.sent.copy_ms = queue_a.sent.copy_ms + queue_b.sent.copy_ms;
+    send_stats_report("Data server", &data_srv.sent);
+  }
+  else
+  {
+    send_stats_report("Sender a", &queue_a.sent);
+    send_stats_report("Sender b", &queue_b.sent);
+  }
+  if (lock_started)
+    lock_stop();
+  tec_writer_stop();
+  tec_poller_stop();
+  bme_poller_stop();
+  sensors_stop();
+  ComTrace_Stop();
+  mecom_sim_stop();
+  if (scope_opened)
+  {
+    trigger_wait_report(&trig_wait);
+    trigger_wait_close(&trig_wait);
+    scope_close();
   }
-  if (smap != MAP_FAILED)
-    munmap(smap, 0x00100000UL);
-  if (buf_a != MAP_FAILED)
-    munmap(buf_a, RAM_A_SIZE);
-  if (buf_b != MAP_FAILED)
-    munmap(buf_b, RAM_B_SIZE);
   if (queue_a.buf)
     free(queue_a.buf);
   if (queue_b.buf)
     free(queue_b.buf);
-  if (mem_fd >= 0)
-    close(mem_fd);
+  if (queue_ack.buf)
+    free(queue_ack.buf);
+  if (peak_results)
+    free(peak_results);
+  peak_finder_free();
+  spsc_ring_destroy(&queue_a.ring);
+  spsc_ring_destroy(&queue_b.ring);
+  spsc_ring_destroy(&queue_ack.ring);
   if (queue_a.sock_fd >= 0)
     close(queue_a.sock_fd);
   if (queue_b.sock_fd >= 0)
     close(queue_b.sock_fd);
   if (AckSock_fd >= 0)
     close(AckSock_fd);
+  data_server_close(&data_srv);
 
   return rc;
 }
 
-static void scope_reset(void)
-{
-  *(uint32_t *)(scope + 0x00000) = 2; /* reset scope */
-}
-
-static void scope_set_filters(enum equalizer eq, int shaping,
-                              volatile uint32_t *base)
+/*
+ * blocks until the sender of q has released all but max_in_flight of the
+ * frames that were handed to it.
+ */
+static int queue_wait_released(struct queue *q, unsigned int max_in_flight)
 {
-  /* equalization filter */
-  switch (eq)
-  {
-  case EQ_HV:
-    *(base + 0) = 0x4c5f; /* filter coeff aa */
-    *(base + 1) = 0x2f38b; /* filter coeff bb */
-    break;
-  case EQ_LV:
-    *(base + 0) = 0x7d93; /* filter coeff aa */
-    *(base + 1) = 0x437c7; /* filter coeff bb */
-    break;
-  case EQ_OFF:
-    *(base + 0) = 0x0; /* filter coeff aa */
-    *(base + 1) = 0x0; /* filter coeff bb */
-    break;
-  }
+  uint64_t released;
 
-  /* shaping filter */
-  if (shaping)
-  {
-    *(base + 2) = 0xd9999a; /* filter coeff kk */
-    *(base + 3) = 0x2666; /* filter coeff pp */
-  }
-  else
+  while (q->in_flight > max_in_flight)
   {
-    *(base + 2) = 0xffffff; /* filter coeff kk */
-    *(base + 3) = 0x0; /* filter coeff pp */
+    if (spsc_ring_wait_released(&q->ring, &released) != 0)
+      return -1;
+    q->in_flight -= released;
   }
+  return 0;
 }
 
-static void scope_setup_input_parameters(enum decimation dec,
-                                         enum equalizer ch_a_eq,
-                                         enum equalizer ch_b_eq,
-                                         int ch_a_shaping, int ch_b_shaping)
-{
-  *(uint32_t *)(scope + 0x00014) = dec; /* decimation */
-  *(uint32_t *)(scope + 0x00028) =
-      (dec != DE_OFF) ? 1 : 0; /* enable averaging */
-
-  scope_set_filters(
-      ch_a_eq, ch_a_shaping,
-      (uint32_t *)(scope + 0x00030)); /* filter coeff base channel a */
-  scope_set_filters(
-      ch_b_eq, ch_b_shaping,
-      (uint32_t *)(scope + 0x00040)); /* filter coeff base channel b */
-}
-
-static void scope_setup_trigger_parameters(int thresh_a, int thresh_b,
-                                           int hyst_a, int hyst_b,
-                                           int deadtime)
+/*
+ * hands length bytes starting at offs of the circular dma buffer src to the
+ * sender of q. with SEND_COPY they are copied to pos in the frame slot first,
+ * otherwise the descriptors point straight into the dma window and a block
+ * that wraps around the end of the ring is published as two pieces. the
+ * caller makes sure the ring has room for two descriptors. with RESULTS_ONLY
+ * the block is only copied for the peak finder.
+ */
+static void queue_publish(struct queue *q, uint8_t *frame, unsigned int pos,
+                          void *src, unsigned int offs, unsigned int size,
+                          unsigned int length, uint32_t flags)
 {
-  *(uint32_t *)(scope + 0x00008) = thresh_a; /* channel a trigger threshold */
-  *(uint32_t *)(scope + 0x0000c) = thresh_b; /* channel b trigger threshold */
-  /* the legacy recording logic controls when the trigger mode will be reset. we
-   * want
-   * that to happen as soon as possible (because that's the signal that a
-   * trigger event
-   * occured, and the pre-trigger samples are already waiting for transmission),
-   * so set
-   * some small value > 0 here */
-  *(uint32_t *)(scope + 0x00010) = 10; /* legacy post trigger samples */
-  *(uint32_t *)(scope + 0x00020) = hyst_a; /* channel a trigger hysteresis */
-  *(uint32_t *)(scope + 0x00024) = hyst_b; /* channel b trigger hysteresis */
-  *(uint32_t *)(scope + 0x00090) = deadtime; /* trigger deadtime */
-}
+  struct block_desc blk;
+  struct timespec copy_start, copy_stop;
 
-static void scope_setup_axi_recording(void)
-{
-  *(uint32_t *)(scope + 0x00050) = RAM_A_ADDRESS; /* buffer a start */
-  *(uint32_t *)(scope + 0x00054) =
-      RAM_A_ADDRESS + RAM_A_SIZE; /* buffer a stop */
-  *(uint32_t *)(scope + 0x00058) = ACQUISITION_LENGTH - PRE_TRIGGER_LENGTH +
-                                   64; /* channel a post trigger samples */
-  *(uint32_t *)(scope + 0x00070) = RAM_B_ADDRESS; /* buffer b start */
-  *(uint32_t *)(scope + 0x00074) =
-      RAM_B_ADDRESS + RAM_B_SIZE; /* buffer b stop */
-  *(uint32_t *)(scope + 0x00078) = ACQUISITION_LENGTH - PRE_TRIGGER_LENGTH +
-                                   64; /* channel b post trigger samples */
-
-  *(uint32_t *)(scope + 0x0005c) = 1; /* enable channel a axi */
-  *(uint32_t *)(scope + 0x0007c) = 1; /* enable channel b axi */
-}
+  if (SEND_MODE == SEND_COPY)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &copy_start);
+    CIRCULARSRC_MEMCPY(frame + pos, src, offs, size, length);
+    clock_gettime(CLOCK_MONOTONIC, &copy_stop);
+    q->sent.copy_ms += elapsed_ms(&copy_start, &copy_stop);
+    if (RESULTS_ONLY)
+      return;
+    blk.data = frame + pos;
+    blk.length = length;
+    blk.flags = flags;
+    spsc_ring_push(&q->ring, &blk);
+    return;
+  }
 
-static void scope_activate_trigger(enum trigger trigger)
-{
-  /* TODO maybe use the 'keep armed' flag without reset, to have better
-   * pre-trigger data when a trigger immediately follows the previous recording
-   */
-  *(uint32_t *)(scope + 0x00000) = 3; /* reset and arm scope */
-  *(uint32_t *)(scope + 0x00000) = 0; /* armed for trigger */
-  *(uint32_t *)(scope + 0x00004) = trigger; /* trigger source */
+  if (offs + length > size)
+  {
+    blk.data = (uint8_t *)src + offs;
+    blk.length = size - offs;
+    blk.flags = 0;
+    spsc_ring_push(&q->ring, &blk);
+    length -= size - offs;
+    offs = 0;
+  }
+  blk.data = (uint8_t *)src + offs;
+  blk.length = length;
+  blk.flags = flags;
+  spsc_ring_push(&q->ring, &blk);
 }
 
 /*
  * arms the scope and waits for trigger. once a trigger occurs, it reads samples
- * from dma ram and puts them on the channel queues. advances each queue's
- * queue->read_end for each block that was copied. rinse and repeat. access to
- * read_end is protected by queue->mutex.
+ * from dma ram and puts them on the channel queues. every block that was copied
+ * is published to the sender as a descriptor on queue->ring, the last one of an
+ * acquisition is flagged BLOCK_FRAME_END, and the environment read at trigger
+ * time is handed to the ack worker, preceded by the peak finder's result for
+ * the frame if it is enabled. rinse and repeat as soon as fewer than
+ * PIPELINE_DEPTH frames are still on their way out, each frame in flight has
+ * its own slot in queue->buf. no locks are taken on the way, except for the
+ * check for control commands once per frame.
  */
 static void ADC_read_worker(struct queue *a, struct queue *b)
 {
@@ -481,19 +785,34 @@ static void ADC_read_worker(struct queue *a, struct queue *b)
   unsigned int curr_pos_a, curr_pos_b;
   unsigned int read_pos_a, read_pos_b;
   size_t length_a, length_b;
-  int a_first, a_ready, b_first, b_ready;
+  int a_ready, b_ready;
   int did_something;
+  struct block_desc blk;
+  unsigned int frame = 0;
+  uint8_t *frame_a, *frame_b;
+  struct telemetry *tm;
+  struct peak_result *res = NULL;
+  struct timespec dsp_start, dsp_stop;
+  struct acq_settings next;
+  struct sensor_sample sensor_table[SENSOR_MAX];
+  struct sensor_ref fields[TELEMETRY_FIELDS], env;
+  unsigned int i;
 
   char Ackbuf[100];
-  char ackstr[3];
+  char ackstr[4];
 
   float settempcur;
-  float prev_settempcur;
-  float currentTemp;
   int psd;
-  float t, p, h;
 
-  MeParFloatFields Fields;
+  /* the pollers have registered their sensors by now */
+  for (i = 0; i < TELEMETRY_FIELDS; i++)
+    fields[i] = sensor_find(telemetry_fields[i].channel);
+  env = sensor_find(TELEMETRY_ENV_CHANNEL);
+
+  /* with the data server or persistent sessions the rings simply fill up
+   * until a client connects */
+  if (DATA_SERVER || PERSISTENT_SESSIONS)
+    goto ADC_read_worker_loop;
 
   /*wait for ack to start*/
   fprintf(stderr, "Waiting for Ack to Continue! (1st)\n");
@@ -502,62 +821,76 @@ static void ADC_read_worker(struct queue *a, struct queue *b)
   recv(psd, Ackbuf, sizeof(Ackbuf), 0);
   close(psd);
 
-  sscanf(Ackbuf, "%s %f", ackstr, &settempcur);
+  sscanf(Ackbuf, "%3s %f", ackstr, &settempcur);
   fprintf(stderr, "Received: %s and Temp set %f\n", ackstr, settempcur);
 
-  prev_settempcur = settempcur + 0.1; // force different for first test
-
   if (strcmp("END", ackstr) == 0)
     goto ADC_read_worker_exit;
 
+ADC_read_worker_loop:
   do
   {
+    /* wait until a frame slot is free, i.e. send of the oldest has finished */
+    if (queue_wait_released(a, PIPELINE_DEPTH - 1) != 0 ||
+        queue_wait_released(b, PIPELINE_DEPTH - 1) != 0 ||
+        queue_wait_released(&queue_ack, PIPELINE_DEPTH - 1) != 0)
+      goto ADC_read_worker_exit;
+    if (__atomic_load_n(&stop_requested, __ATOMIC_ACQUIRE))
+      goto ADC_read_worker_exit;
 
-    a_first = b_first = 1;
-    a_ready = b_ready = 0;
-
-    do
+    /* CMD_STOP: stay disarmed until CMD_START or PROTO_END */
+    while (control_paused())
     {
-      /* wait for send to finish */
-      /* get buffer positions */
-      if (pthread_mutex_lock(&a->mutex) != 0)
-        goto ADC_read_worker_exit;
-      read_pos_a = a->read_end;
-      if (pthread_mutex_unlock(&a->mutex) != 0)
+      if (__atomic_load_n(&stop_requested, __ATOMIC_ACQUIRE))
         goto ADC_read_worker_exit;
+      usleep(1000);
+    }
+    if (control_take_pending(&next) && apply_settings(a, b, &next) != 0)
+      goto ADC_read_worker_exit;
 
-      if (pthread_mutex_lock(&b->mutex) != 0)
-        goto ADC_read_worker_exit;
-      read_pos_b = b->read_end;
-      if (pthread_mutex_unlock(&b->mutex) != 0)
-        goto ADC_read_worker_exit;
-      usleep(5);
-    } while (read_pos_a != 0 || read_pos_b != 0);
+    frame_a = frame_b = NULL;
+    if (SEND_MODE == SEND_COPY)
+    {
+      frame_a = a->buf + (frame % PIPELINE_DEPTH) * ACQUISITION_LENGTH * 2;
+      frame_b = b->buf + (frame % PIPELINE_DEPTH) * ACQUISITION_LENGTH * 2;
+    }
+    tm = (struct telemetry *)queue_ack.buf + frame % PIPELINE_DEPTH;
+    if (PEAK_FINDER)
+      res = peak_results + frame % PIPELINE_DEPTH;
+    frame++;
+
+    read_pos_a = read_pos_b = 0;
+    a_ready = b_ready = 1;
 
-    scope_activate_trigger(TRIGGER_MODE);
+    scope_activate_trigger(acq.trigger);
     /* wait for trigger */
-    while (*(uint32_t *)(scope + 0x00004))
-      usleep(5);
+    if (trigger_wait(&trig_wait) != 0)
+      goto ADC_read_worker_exit;
 
-    //rp_DpinSetState(RP_LED4, RP_HIGH);
+    /* samples recorded since the trigger tell how late we woke up */
+    curr_pos_a = scope_read(SCOPE_CH_A_WRITE_PTR);
+    start_pos_a = scope_read(SCOPE_CH_A_TRIGGER_PTR);
+    trigger_wait_record(&trig_wait,
+                        CIRCULAR_DIST(start_pos_a, curr_pos_a, RAM_A_SIZE) /
+                            2.0 * acq.decimation / ADC_CLOCK_MHZ);
 
-    unsigned long long millisecondsSinceEpoch = getMillisecondsSinceEpoch();
-    fprintf(stderr, "Triggered at %lld.\n", millisecondsSinceEpoch);
+    //rp_DpinSetState(RP_LED4, RP_HIGH);
 
-    if (ENABLE_MECOM)
-      currentTemp = getTECTemp(0, 1);
-    else
-      currentTemp = 0;
+    tm->timestamp = getMillisecondsSinceEpoch();
     if (ENABLE_BME280)
-    {
-      connectAndGetBMEData(&t, &p, &h);
-      //fprintf(stderr, "Sent - Time: %f, Tec Temp: %f, Ext Temp: %f, Pressure: %f, Humidity: %f\n", millisecondsSinceEpoch / 1000.0, currentTemp, t, p, h);
-    }
+      bme_poller_trigger(); /* times the next conversion */
+    fprintf(stderr, "Triggered at %llu.\n",
+            (unsigned long long)tm->timestamp);
+
+    /* newest background samples, no serial or i2c round trip here */
+    sensors_snapshot(sensor_table);
+    fill_telemetry(tm, sensor_table, fields, env);
+    //fprintf(stderr, "Sent - Time: %f, Tec Temp: %f, Ext Temp: %f, Pressure: %f, Humidity: %f\n", tm->timestamp / 1000.0, tm->tec_temp, tm->t, tm->p, tm->h);
 
     start_pos_a =
-        *(uint32_t *)(scope + 0x00060); /* channel a trigger pointer */
+        scope_read(SCOPE_CH_A_TRIGGER_PTR); /* channel a trigger pointer */
     start_pos_b =
-        *(uint32_t *)(scope + 0x00080); /* channel b trigger pointer */
+        scope_read(SCOPE_CH_B_TRIGGER_PTR); /* channel b trigger pointer */
 
     start_pos_a = CIRCULAR_SUB(start_pos_a - RAM_A_ADDRESS,
                                PRE_TRIGGER_LENGTH * 2, RAM_A_SIZE);
@@ -572,38 +905,11 @@ static void ADC_read_worker(struct queue *a, struct queue *b)
         usleep(5);
       did_something = 0;
 
-      /* get buffer positions */
-      if (pthread_mutex_lock(&a->mutex) != 0)
-        goto ADC_read_worker_exit;
-      read_pos_a = a->read_end;
-      if (pthread_mutex_unlock(&a->mutex) != 0)
-        goto ADC_read_worker_exit;
-
-      if (pthread_mutex_lock(&b->mutex) != 0)
-        goto ADC_read_worker_exit;
-      read_pos_b = b->read_end;
-      if (pthread_mutex_unlock(&b->mutex) != 0)
-        goto ADC_read_worker_exit;
-
-      /* before starting, test if senders are ready */
-      if (a_first && read_pos_a == 0)
-      {
-        a_first = 0;
-        a_ready = 1;
-        // fprintf(stderr,"a_ready\n");
-      }
-      if (b_first && read_pos_b == 0)
-      {
-        b_first = 0;
-        b_ready = 1;
-        // fprintf(stderr,"b_ready\n");
-      }
-
       /* get current recording positions */
-      curr_pos_a =
-          *(uint32_t *)(scope + 0x00064); /* channel a current write pointer */
-      curr_pos_b =
-          *(uint32_t *)(scope + 0x00084); /* channel b current write pointer */
+      curr_pos_a = scope_read(
+          SCOPE_CH_A_WRITE_PTR); /* channel a current write pointer */
+      curr_pos_b = scope_read(
+          SCOPE_CH_B_WRITE_PTR); /* channel b current write pointer */
       curr_pos_a -= RAM_A_ADDRESS;
       curr_pos_b -= RAM_B_ADDRESS;
 
@@ -617,170 +923,718 @@ static void ADC_read_worker(struct queue *a, struct queue *b)
       else
         length_b = ACQUISITION_LENGTH * 2 - read_pos_b;
 
-      /* copy if sender is ready and a full block is available in the dma ram */
-      if (a_ready &&
+      /* publish if the ring has room (a block may be split at the wrap of
+       * the dma ring) and a full block is available in the dma ram */
+      if (a_ready && (RESULTS_ONLY || spsc_ring_space(&a->ring, 2) >= 2) &&
           CIRCULAR_DIST(start_pos_a, curr_pos_a, RAM_A_SIZE) >= length_a)
       {
-        CIRCULARSRC_MEMCPY(a->buf + read_pos_a, buf_a, start_pos_a, RAM_A_SIZE,
-                           length_a);
-        start_pos_a = CIRCULAR_ADD(start_pos_a, length_a, RAM_A_SIZE);
-
         if (read_pos_a + length_a >= ACQUISITION_LENGTH * 2)
+        {
+          if (!RESULTS_ONLY)
+            a->in_flight++;
           a_ready = 0; /* stop if all samples were copied */
-
-        if (pthread_mutex_lock(&a->mutex) != 0)
-          goto ADC_read_worker_exit;
-        if (a->read_end == read_pos_a)
-          a->read_end += length_a;
-        else
-          a_ready = 0; /* stop if sender resetted read_end */
-        if (pthread_mutex_unlock(&a->mutex) != 0)
-          goto ADC_read_worker_exit;
+        }
+        queue_publish(a, frame_a, read_pos_a, scope_buf_a, start_pos_a,
+                      RAM_A_SIZE, length_a, a_ready ? 0 : BLOCK_FRAME_END);
+        start_pos_a = CIRCULAR_ADD(start_pos_a, length_a, RAM_A_SIZE);
+        read_pos_a += length_a;
 
         did_something = 1;
       }
-      if (b_ready &&
+      if (b_ready && (RESULTS_ONLY || spsc_ring_space(&b->ring, 2) >= 2) &&
           CIRCULAR_DIST(start_pos_b, curr_pos_b, RAM_B_SIZE) > length_b)
       {
-        CIRCULARSRC_MEMCPY(b->buf + read_pos_b, buf_b, start_pos_b, RAM_B_SIZE,
-                           length_b);
-        start_pos_b = CIRCULAR_ADD(start_pos_b, length_b, RAM_B_SIZE);
-
         if (read_pos_b + length_b >= ACQUISITION_LENGTH * 2)
+        {
+          if (!RESULTS_ONLY)
+            b->in_flight++;
           b_ready = 0; /* stop if all samples were copied */
-
-        if (pthread_mutex_lock(&b->mutex) != 0)
-          goto ADC_read_worker_exit;
-        if (b->read_end == read_pos_b)
-          b->read_end += length_b;
-        else
-          b_ready = 0; /* stop if sender resetted read_end */
-        if (pthread_mutex_unlock(&b->mutex) != 0)
-          goto ADC_read_worker_exit;
+        }
+        queue_publish(b, frame_b, read_pos_b, scope_buf_b, start_pos_b,
+                      RAM_B_SIZE, length_b, b_ready ? 0 : BLOCK_FRAME_END);
+        start_pos_b = CIRCULAR_ADD(start_pos_b, length_b, RAM_B_SIZE);
+        read_pos_b += length_b;
 
         did_something = 1;
       }
-    } while (a_first || a_ready || b_first || b_ready);
+    } while (a_ready || b_ready);
+
+    if (PEAK_FINDER)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &dsp_start);
+      peak_find_dips((int16_t *)frame_a, ACQUISITION_LENGTH, res);
+      peak_find_fringes((int16_t *)frame_b, ACQUISITION_LENGTH, res);
+      clock_gettime(CLOCK_MONOTONIC, &dsp_stop);
+      if (VERBOSE)
+        fprintf(stderr, "Found %u dips, %u fringes in %.3f ms.\n", res->n_dips,
+                res->n_fringes,
+                (dsp_stop.tv_sec - dsp_start.tv_sec) * 1e3 +
+                    (dsp_stop.tv_nsec - dsp_start.tv_nsec) / 1e6);
+      blk.data = (uint8_t *)res;
+      blk.length = sizeof(*res);
+      blk.flags = BLOCK_RESULT;
+      spsc_ring_push(&queue_ack.ring, &blk);
+      if (LOCK_MODE)
+        lock_submit(res);
+    }
+
+    /* telemetry and set point exchange run behind the acquisition */
+    blk.data = (uint8_t *)tm;
+    blk.length = sizeof(*tm);
+    blk.flags = BLOCK_FRAME_END;
+    queue_ack.in_flight++;
+    spsc_ring_push(&queue_ack.ring, &blk);
+
+    usleep(DELAYFORLOOP);
+  } while (1);
+
+ADC_read_worker_exit:
+  fprintf(stderr, "ADC_read_worker_exit\n");
+  return;
+}
+
+/*
+ * sends the telemetry of each acquired frame on the ack port and waits for the
+ * client's "ACK <value>" answer, which sets the TEC target temperature (with
+ * the built-in PID) or the live current. "END" stops the acquisition. frames
+ * are released back to ADC_read_worker only after their ack was received, so
+ * with PIPELINE_DEPTH 1 the loop is strictly trigger, send, ack. with
+ * PERSISTENT_SESSIONS the exchange runs over one connection, see session_ack.
+ */
+static void *TCP_ack_worker(void *data)
+{
+  struct queue *q = (struct queue *)data;
+  struct block_desc blk;
+  struct telemetry *tm;
+  char Ackbuf[100];
+  char ackstr[4];
+  float settempcur;
+  int psd = -1;
+  uint32_t sequence = 0;
+
+  do
+  {
+    if (!spsc_ring_pop(&q->ring, &blk))
+    {
+      /* no frames while paused, keep answering the session's commands */
+      if (PERSISTENT_SESSIONS && psd >= 0 && control_paused())
+      {
+        if (session_idle(q->sock_fd, &psd, sequence) == PROTO_END)
+        {
+          request_stop();
+          goto TCP_ack_worker_exit;
+        }
+        continue;
+      }
+      if (spsc_ring_wait(&q->ring) != 0)
+        goto TCP_ack_worker_exit;
+      continue;
+    }
+    if (blk.flags & BLOCK_RESULT)
+    {
+      if (PERSISTENT_SESSIONS)
+        session_send(q->sock_fd, &psd, PROTO_RESULT, sequence, blk.data,
+                     blk.length);
+      continue;
+    }
+    tm = (struct telemetry *)blk.data;
+
+    if (PERSISTENT_SESSIONS)
+    {
+      switch (session_ack(q->sock_fd, &psd, sequence++, tm, &settempcur))
+      {
+      case PROTO_ACK:
+        tec_writer_set_point(settempcur);
+        break;
+      case PROTO_END:
+        request_stop();
+        spsc_ring_release(&q->ring);
+        goto TCP_ack_worker_exit;
+      default:
+        break; /* client gone, carry on with the next one at the next frame */
+      }
+      if (spsc_ring_release(&q->ring) != 0)
+        goto TCP_ack_worker_exit;
+      continue;
+    }
 
-    listen(AckSock_fd, 10);
-    psd = accept(AckSock_fd, 0, 0);
+    listen(q->sock_fd, 10);
+    psd = accept(q->sock_fd, 0, 0);
     fprintf(stderr, "Waiting to send temp and timestamp!\n");
-    send(psd, &millisecondsSinceEpoch, sizeof(unsigned long long), 0);
-    send(psd, &currentTemp, sizeof(float), 0);
-    send(psd, &t, sizeof(float), 0);
-    send(psd, &p, sizeof(float), 0);
-    send(psd, &h, sizeof(float), 0);
+    send(psd, &tm->timestamp, sizeof(tm->timestamp), 0);
+    send(psd, &tm->tec_temp, sizeof(float), 0);
+    send(psd, &tm->t, sizeof(float), 0);
+    send(psd, &tm->p, sizeof(float), 0);
+    send(psd, &tm->h, sizeof(float), 0);
     close(psd);
 
     //rp_DpinSetState(RP_LED4, RP_LOW);
 
     /*wait for ack to cont*/
 
-    listen(AckSock_fd, 10);
-    psd = accept(AckSock_fd, 0, 0);
+    listen(q->sock_fd, 10);
+    psd = accept(q->sock_fd, 0, 0);
     fprintf(stderr, "Waiting for Ack to Continue!\n");
-    recv(psd, Ackbuf, sizeof(Ackbuf), 0);
+    memset(Ackbuf, 0, sizeof(Ackbuf));
+    recv(psd, Ackbuf, sizeof(Ackbuf) - 1, 0);
     close(psd);
-    sscanf(Ackbuf, "%s %f", ackstr, &settempcur);
+    sscanf(Ackbuf, "%3s %f", ackstr, &settempcur);
 
     fprintf(stderr, "Received: %s and Temp/Vol set %f\n", ackstr, settempcur);
 
     if (strcmp("END", ackstr) == 0)
-      goto ADC_read_worker_exit;
+    {
+      request_stop();
+      spsc_ring_release(&q->ring);
+      goto TCP_ack_worker_exit;
+    }
+
+    tec_writer_set_point(settempcur);
+
+    if (spsc_ring_release(&q->ring) != 0)
+      goto TCP_ack_worker_exit;
+  } while (1);
+
+TCP_ack_worker_exit:
+  if (psd >= 0)
+    close(psd);
+  return NULL;
+}
+
+/* receives exactly length bytes, non-zero if the connection went away */
+static int recv_all(int psd, void *buf, size_t length)
+{
+  ssize_t n;
+
+  while (length > 0)
+  {
+    n = recv(psd, buf, length, MSG_WAITALL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf = (uint8_t *)buf + n;
+    length -= n;
+  }
+  return 0;
+}
+
+/*
+ * sends one message on the persistent session in *psd, accepting the
+ * connection on first use. returns -1 and closes *psd if the client went
+ * away.
+ */
+static int session_send(int sock_fd, int *psd, uint16_t type,
+                        uint32_t sequence, void *payload, uint32_t length)
+{
+  struct proto_header hdr;
+  struct iovec iov[2];
+  int zerocopy = 0;
+  uint32_t zc_sends = 0;
 
-    if (prev_settempcur != settempcur) // only set if value changes.
+  if (*psd < 0)
+  {
+    listen(sock_fd, 10);
+    *psd = accept(sock_fd, NULL, NULL);
+    if (*psd < 0)
+      return -1;
+    fprintf(stderr, "Ack client connected, next frame %u\n", sequence);
+  }
+
+  hdr.magic = PROTO_MAGIC;
+  hdr.type = type;
+  hdr.version = PROTO_VERSION;
+  hdr.sequence = sequence;
+  hdr.length = length;
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = payload;
+  iov[1].iov_len = length;
+  if (send_iov(*psd, iov, 2, &zerocopy, &zc_sends) != 0)
+  {
+    fprintf(stderr, "Ack client disconnected at frame %u\n", sequence);
+    close(*psd);
+    *psd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * reads one message of a persistent session on the ack port into *hdr and
+ * payload (PROTO_MAX_CLIENT_PAYLOAD bytes). PROTO_COMMAND is carried out and
+ * answered with a PROTO_REPLY right here. returns the message type, or -1
+ * after closing *psd if the client went away.
+ */
+static int session_receive(int sock_fd, int *psd, uint32_t sequence,
+                           struct proto_header *hdr, uint8_t *payload)
+{
+  struct proto_command cmd;
+  struct proto_reply reply;
+
+  if (recv_all(*psd, hdr, sizeof(*hdr)) != 0 || hdr->magic != PROTO_MAGIC ||
+      hdr->length > PROTO_MAX_CLIENT_PAYLOAD ||
+      recv_all(*psd, payload, hdr->length) != 0)
+  {
+    fprintf(stderr, "Ack client disconnected at frame %u\n", sequence);
+    close(*psd);
+    *psd = -1;
+    return -1;
+  }
+  if (hdr->type != PROTO_COMMAND || hdr->length < sizeof(cmd))
+    return hdr->version > PROTO_VERSION ? 0 : hdr->type;
+
+  memcpy(&cmd, payload, sizeof(cmd));
+  if (hdr->version > PROTO_VERSION)
+  {
+    memset(&reply, 0, sizeof(reply));
+    reply.request_id = cmd.request_id;
+    reply.command = cmd.command;
+    reply.status = PROTO_ERR_VERSION;
+  }
+  else
+    control_execute(&cmd, &reply);
+  if (session_send(sock_fd, psd, PROTO_REPLY, sequence, &reply,
+                   sizeof(reply)) != 0)
+    return -1;
+  return PROTO_COMMAND;
+}
+
+/*
+ * one telemetry/ack exchange of a persistent session on the ack port: sends
+ * the frame's telemetry as a PROTO_TELEMETRY message and waits for the
+ * client's PROTO_ACK (stored in *value) or PROTO_END, which is returned.
+ * commands that come in meanwhile are answered. the connection in *psd is
+ * accepted on first use and kept open. returns -1 and closes *psd if the
+ * client went away, the next client picks up with the next frame.
+ */
+static int session_ack(int sock_fd, int *psd, uint32_t sequence,
+                       struct telemetry *tm, float *value)
+{
+  struct proto_header hdr;
+  uint8_t payload[PROTO_MAX_CLIENT_PAYLOAD];
+  int type;
+
+  if (session_send(sock_fd, psd, PROTO_TELEMETRY, sequence, tm,
+                   sizeof(*tm)) != 0)
+    return -1;
+
+  do
+  {
+    type = session_receive(sock_fd, psd, sequence, &hdr, payload);
+    if (type < 0)
+      return -1;
+  } while (type != PROTO_END &&
+           !(type == PROTO_ACK && hdr.length >= sizeof(*value)));
+
+  if (type == PROTO_ACK)
+    memcpy(value, payload, sizeof(*value));
+  fprintf(stderr, "Received: %s and Temp/Vol set %f\n",
+          type == PROTO_ACK ? "ACK" : "END", *value);
+  return type;
+}
+
+/*
+ * waits up to 100 ms for a message of the persistent session while the
+ * acquisition is paused, answers commands. returns the message type, 0 if
+ * there was none, -1 if the client went away.
+ */
+static int session_idle(int sock_fd, int *psd, uint32_t sequence)
+{
+  struct pollfd pfd = {.fd = *psd, .events = POLLIN};
+  struct proto_header hdr;
+  uint8_t payload[PROTO_MAX_CLIENT_PAYLOAD];
+
+  if (poll(&pfd, 1, 100) <= 0)
+    return 0;
+  return session_receive(sock_fd, psd, sequence, &hdr, payload);
+}
+
+/*
+ * takes over new acquisition settings between two frames. the frames in
+ * flight are sent first, so neither the frame slots nor the dma window are
+ * referenced when they change.
+ */
+static int apply_settings(struct queue *a, struct queue *b,
+                          const struct acq_settings *next)
+{
+  uint8_t *buf;
+  int length = next->acquisition_length;
+
+  /* control_execute checked it already, the slots must never wrap size_t */
+  if (length < 1 || length > max_acquisition_length())
+    length = acq.acquisition_length;
+
+  if (queue_wait_released(a, 0) != 0 || queue_wait_released(b, 0) != 0 ||
+      queue_wait_released(&queue_ack, 0) != 0)
+    return -1;
+
+  if (length != acq.acquisition_length && SEND_MODE == SEND_COPY)
+  {
+    buf = realloc(a->buf, (size_t)length * 2 * PIPELINE_DEPTH);
+    if (buf)
     {
-      if (USE_BUILT_IN_PID && ENABLE_MECOM)
-      {
-        if (MeCom_TEC_Tem_TargetObjectTemp(0, 1, &Fields, MeGetLimits))
-        {
-          Fields.Value = settempcur;
-          if (MeCom_TEC_Tem_TargetObjectTemp(0, 1, &Fields, MeSet))
-            fprintf(stderr, "TEC Object Temperature: New Value: %f\n",
-                    Fields.Value);
-        }
-      }
-      else
+      a->buf = buf;
+      buf = realloc(b->buf, (size_t)length * 2 * PIPELINE_DEPTH);
+    }
+    if (buf)
+      b->buf = buf;
+    else
+    {
+      /* a larger a->buf does no harm */
+      fprintf(stderr, "realloc failed, keeping %d samples\n",
+              acq.acquisition_length);
+      length = acq.acquisition_length;
+    }
+  }
+  if (length != acq.acquisition_length)
+  {
+    __atomic_store_n(&ACQUISITION_LENGTH, length, __ATOMIC_RELEASE);
+    __atomic_store_n(&data_srv.frame_length, length * 2, __ATOMIC_RELEASE);
+    scope_setup_axi_recording(length);
+  }
+  if (next->decimation != acq.decimation)
+    scope_setup_input_parameters(next->decimation, EQ_LV, EQ_HV, 1, 1);
+  if (next->trigger_threshold != acq.trigger_threshold)
+    scope_setup_trigger_parameters(next->trigger_threshold,
+                                   next->trigger_threshold, 50, 50, 1250);
+
+  acq = *next;
+  acq.acquisition_length = length;
+  fprintf(stderr, "Acquisition: %d samples, decimation %d, trigger %d at %d\n",
+          acq.acquisition_length, acq.decimation, acq.trigger,
+          acq.trigger_threshold);
+  return 0;
+}
+
+/* "addr:inst,addr:inst,...", an address without :inst means instance 1 */
+static int parse_tec_devices(const char *arg)
+{
+  int n = 0, used;
+
+  while (*arg)
+  {
+    if (n == TEC_MAX_DEVICES)
+      return -1;
+    TEC_DEVICES[n].inst = 1;
+    if (sscanf(arg, "%d%n:%d%n", &TEC_DEVICES[n].address, &used,
+               &TEC_DEVICES[n].inst, &used) < 1 ||
+        TEC_DEVICES[n].address < 0 || TEC_DEVICES[n].address > 255)
+      return -1;
+    n++;
+    arg += used;
+    if (*arg == ',')
+      arg++;
+    else if (*arg)
+      return -1;
+  }
+  if (n == 0)
+    return -1;
+  TEC_DEVICE_COUNT = n;
+  return 0;
+}
+
+/*
+ * sets the TEC target temperature (with the built-in PID) or the live current
+ * to the value the client acked a frame with, only if it changed.
+ */
+static void apply_set_point(float value)
+{
+  static float prev_value;
+  static int first = 1;
+
+  if (!first && prev_value == value)
+    return;
+  if (USE_BUILT_IN_PID && ENABLE_MECOM)
+    setTECTargetTemp(TEC_DEVICES[0].address, TEC_DEVICES[0].inst, value);
+  else
+  {
+    setTECVandC(TEC_DEVICES[0].address, TEC_DEVICES[0].inst, 3, value);
+    fprintf(stderr, "TEC Current: New Value: %f\n", value);
+  }
+  prev_value = value;
+  first = 0;
+}
+
+/*
+ * longest acquisition in samples: the post trigger samples must fit the dma
+ * ring, the PIPELINE_DEPTH frame slots of a channel FRAME_BUFFER_MAX.
+ */
+static int max_acquisition_length(void)
+{
+  size_t slots = FRAME_BUFFER_MAX / 2 / PIPELINE_DEPTH;
+  size_t ring = RAM_A_SIZE / 2 - 128;
+
+  return (int)(slots < ring ? slots : ring);
+}
+
+/* copies the bound channels of a sensor table snapshot into tm */
+static void fill_telemetry(struct telemetry *tm,
+                           const struct sensor_sample *table,
+                           const struct sensor_ref *fields,
+                           struct sensor_ref env)
+{
+  unsigned int i;
+  float value;
+
+  for (i = 0; i < TELEMETRY_FIELDS; i++)
+  {
+    value = 0;
+    if (fields[i].sensor >= 0 && table[fields[i].sensor].timestamp != 0)
+      value = table[fields[i].sensor].values[fields[i].channel];
+    memcpy((uint8_t *)tm + telemetry_fields[i].offset, &value, sizeof(value));
+  }
+  tm->env_timestamp = env.sensor >= 0 ? table[env.sensor].timestamp : 0;
+}
+
+/* the client sent "END", ADC_read_worker stops before arming again */
+static void request_stop(void)
+{
+  __atomic_store_n(&stop_requested, 1, __ATOMIC_RELEASE);
+}
+
+/* totals of a sender, to compare the send modes (-z) at a given -a */
+static void send_stats_report(const char *name, const struct send_stats *st)
+{
+  static const char *const mode_name[] = {"copy", "direct", "zero-copy"};
+
+  if (st->frames == 0)
+    return;
+  fprintf(stderr,
+          "%s (%s): %lu frames, %.1f MB, per frame %.3f ms mean %.3f ms "
+          "max, %.3f ms in sendmsg, %.3f ms copying\n",
+          name, mode_name[SEND_MODE], st->frames, st->bytes / 1e6,
+          st->frame_ms / st->frames, st->frame_max_ms,
+          st->send_ms / st->frames, st->copy_ms / st->frames);
+}
+
+/*
+ * sends the iovecs in iov completely, advancing over partial writes. with
+ * *zerocopy set MSG_ZEROCOPY is tried first, if the kernel cannot pin the
+ * pages (the dma window is a raw /dev/mem mapping) *zerocopy is cleared and
+ * the data is sent the normal way. *zc_sends counts the zerocopy sendmsg
+ * calls whose completions must be reaped before the data may change.
+ */
+static int send_iov(int psd, struct iovec *iov, int niov, int *zerocopy,
+                    uint32_t *zc_sends)
+{
+  struct msghdr msg;
+  ssize_t sent;
+
+  memset(&msg, 0, sizeof(msg));
+  while (niov > 0)
+  {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = niov;
+#ifdef MSG_ZEROCOPY
+    if (*zerocopy)
+    {
+      sent = sendmsg(psd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+      if (sent < 0 && (errno == EFAULT || errno == ENOBUFS ||
+                       errno == EOPNOTSUPP || errno == EINVAL))
       {
-        setTECVandC(0, 1, 3, settempcur);
-        fprintf(stderr, "TEC Current: New Value: %f\n", settempcur);
+        fprintf(stderr, "MSG_ZEROCOPY failed (%s), using direct send\n",
+                strerror(errno));
+        *zerocopy = 0;
+        continue;
       }
+      if (sent >= 0)
+        (*zc_sends)++;
     }
+    else
+#endif
+      sent = sendmsg(psd, &msg, MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (niov > 0 && (size_t)sent >= iov->iov_len)
+    {
+      sent -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if (niov > 0)
+    {
+      iov->iov_base = (uint8_t *)iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+  return 0;
+}
 
-    usleep(DELAYFORLOOP);
-  } while (1);
-
-ADC_read_worker_exit:
-  fprintf(stderr, "ADC_read_worker_exit\n");
-  return;
+/*
+ * waits until the kernel reported completion of all zc_sends MSG_ZEROCOPY
+ * calls on psd, after that the sent memory may be overwritten. *completed
+ * counts the calls reaped so far on this connection.
+ */
+static int reap_zerocopy(int psd, uint32_t zc_sends, uint32_t *completed)
+{
+#ifdef MSG_ZEROCOPY
+  char control[128];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct sock_extended_err *serr;
+  struct pollfd pfd = {.fd = psd, .events = 0};
+
+  while (*completed < zc_sends)
+  {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      return -1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(psd, &msg, MSG_ERRQUEUE) < 0)
+    {
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+      return -1;
+    }
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+    {
+      serr = (struct sock_extended_err *)CMSG_DATA(cm);
+      if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+        *completed = serr->ee_data + 1; /* [ee_info, ee_data] completed */
+    }
+  }
+#endif
+  return 0;
 }
 
 /*
- * sends samples from a struct queue. synchronisation with the queue is done via
- * queue->read_end. TCP_ADC_data_send_worker will send data from 0 to read_end and will reset
- * read_end to 0 once ACQUISITION_LENGTH samples have been transmitted. then it
- * will wait until read_end advances from 0 and start all over. access to
- * read_end
- * is protected by queue->mutex.
+ * sends samples from a struct queue. blocks are taken off queue->ring in the
+ * order ADC_read_worker published them and gathered into one sendmsg, the
+ * sender sleeps on the ring's eventfd while there is nothing to send. once
+ * the BLOCK_FRAME_END block has been transmitted the frame is released back
+ * to the reader and the connection is closed, or with PERSISTENT_SESSIONS
+ * kept open for the next frame, each frame then preceded by a proto_header
+ * with its sequence number and length. a client that goes away mid frame
+ * loses the rest of it, the next one starts at a frame boundary. in
+ * SEND_DIRECT and SEND_ZEROCOPY mode the blocks point into the dma window, so
+ * no copy is made in user space.
  */
 static void *TCP_ADC_data_send_worker(void *data)
 {
   struct queue *q = (struct queue *)data;
-  int psd = 0;
-  unsigned int send_pos = 0;
-  ssize_t sent;
-  size_t length;
+  struct block_desc blk;
+  struct iovec iov[SEND_IOV_MAX + 1];
+  struct proto_header hdr;
+  int niov;
+  int frame_end;
+  int in_frame = 0; /* part of the current frame was sent */
+  int discard = 0; /* client left mid frame, drop the rest of it */
+  uint32_t sequence = 0;
+  int psd = -1;
+  int zerocopy = 0;
+  uint32_t zc_sends = 0, zc_done = 0;
+  int one = 1;
+  size_t frame_bytes = 0;
+  struct timespec frame_start, frame_stop, send_start;
+  int failed;
+  double ms;
+
+  hdr.magic = PROTO_MAGIC;
+  hdr.type = q == &queue_a ? PROTO_CH_A : PROTO_CH_B;
+  hdr.version = PROTO_VERSION;
 
   do
   {
-    if (pthread_mutex_lock(&q->mutex) != 0)
-      goto TCP_ADC_data_send_worker_exit;
-    if (q->read_end >= ACQUISITION_LENGTH * 2 &&
-        send_pos >= ACQUISITION_LENGTH * 2)
+    niov = 0;
+    frame_end = 0;
+    if (PERSISTENT_SESSIONS && !in_frame && !discard)
+    {
+      hdr.sequence = sequence;
+      iov[0].iov_base = &hdr;
+      iov[0].iov_len = sizeof(hdr);
+      niov = 1;
+    }
+    while (niov < SEND_IOV_MAX + 1 && !frame_end &&
+           spsc_ring_pop(&q->ring, &blk))
     {
-      send_pos = 0;
-      q->read_end = 0;
-      close(psd);
-      psd = 0;
+      iov[niov].iov_base = blk.data;
+      iov[niov].iov_len = blk.length;
+      frame_bytes += blk.length;
+      frame_end = blk.flags & BLOCK_FRAME_END;
+      niov++;
+    }
+    /* the reader changes the length only before it publishes a frame */
+    if (PERSISTENT_SESSIONS && !in_frame && !discard)
+      hdr.length = __atomic_load_n(&ACQUISITION_LENGTH, __ATOMIC_ACQUIRE) * 2;
+    if (niov == 0 || (niov == 1 && !in_frame && !discard &&
+                      PERSISTENT_SESSIONS))
+    {
+      if (spsc_ring_wait(&q->ring) != 0)
+        goto TCP_ADC_data_send_worker_exit;
+      continue;
     }
-    length = q->read_end - send_pos;
-    if (pthread_mutex_unlock(&q->mutex) != 0)
-      goto TCP_ADC_data_send_worker_exit;
 
-    if (length > 0)
+    if (!discard)
     {
-      if (!psd)
+      if (psd < 0)
       {
         //fprintf(stderr, "listening\n");
         listen(q->sock_fd, 10);
         psd = accept(q->sock_fd, NULL, NULL);
+        if (psd < 0)
+          goto TCP_ADC_data_send_worker_exit;
         //fprintf(stderr, "accepted\n");
+#ifdef SO_ZEROCOPY
+        zerocopy = SEND_MODE == SEND_ZEROCOPY &&
+                   setsockopt(psd, SOL_SOCKET, SO_ZEROCOPY, &one,
+                              sizeof(one)) == 0;
+#endif
+        zc_sends = zc_done = 0;
       }
-
-      do
+      if (!in_frame)
+        clock_gettime(CLOCK_MONOTONIC, &frame_start);
+      in_frame = 1;
+
+      clock_gettime(CLOCK_MONOTONIC, &send_start);
+      failed = send_iov(psd, iov, niov, &zerocopy, &zc_sends) != 0 ||
+               (frame_end && reap_zerocopy(psd, zc_sends, &zc_done) != 0);
+      clock_gettime(CLOCK_MONOTONIC, &frame_stop);
+      q->sent.send_ms += elapsed_ms(&send_start, &frame_stop);
+      if (failed)
       {
-        if (length > SEND_BLOCK_SIZE)
-          sent = send(psd, q->buf + send_pos, SEND_BLOCK_SIZE, 0);
-        else
-          sent = send(psd, q->buf + send_pos, length, 0);
-        if (sent > 0)
-        {
-          send_pos += sent;
-          length -= sent;
-        }
-      } while (sent >= 0 && length > 0);
-
-      // sent = send(q->sock_fd, "\n", 1, 0);
-      if (sent < 0)
-        goto TCP_ADC_data_send_worker_exit;
+        fprintf(stderr, "Data client disconnected at frame %u\n", sequence);
+        close(psd);
+        psd = -1;
+        discard = 1;
+      }
     }
-    else
+
+    if (frame_end)
     {
-      usleep(5);
+      if (!discard)
+      {
+        ms = elapsed_ms(&frame_start, &frame_stop);
+        q->sent.frames++;
+        q->sent.bytes += frame_bytes;
+        q->sent.frame_ms += ms;
+        if (ms > q->sent.frame_max_ms)
+          q->sent.frame_max_ms = ms;
+        if (VERBOSE)
+          fprintf(stderr, "Sent %zu bytes in %.3f ms.\n", frame_bytes, ms);
+      }
+      if (!PERSISTENT_SESSIONS && psd >= 0)
+      {
+        close(psd);
+        psd = -1;
+      }
+      frame_bytes = 0;
+      in_frame = 0;
+      discard = 0;
+      sequence++;
+      if (spsc_ring_release(&q->ring) != 0)
+        goto TCP_ADC_data_send_worker_exit;
     }
   } while (1);
 
 TCP_ADC_data_send_worker_exit:
+  if (psd >= 0)
+    close(psd);
   return NULL;
 }
 
@@ -794,18 +1648,3 @@ unsigned long long getMillisecondsSinceEpoch(void)
       (unsigned long long)(tv.tv_usec) / 1000;
   return millisecondsSinceEpoch;
 }
-
-float actual_error, error_previous, P, I, D;
-
-float PID_Controller(float set_point, float measured_value)
-{
-  error_previous = actual_error; // error_previous holds the previous error
-  actual_error = set_point - measured_value;
-  // PID
-  P = actual_error; // Current error
-  I += error_previous; // Sum of previous errors
-  D = actual_error - error_previous; // Difference with previous error
-
-  return Kp * P + Ki * I + Kd * D; // adjust Kp, Ki, Kd empirically or by using
-      // online method such as ZN
-}
\ No newline at end of file
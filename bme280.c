@@ -49,86 +49,215 @@ https://github.com/adafruit/Adafruit_BME280_Library/blob/master/Adafruit_BME280.
  ***************************************************************************
 ****************************************************************************/
 
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <linux/ioctl.h>
-#include <sys/ioctl.h>
-#include <linux/i2c-dev.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdint.h>
 #include <time.h>
 #include <math.h>
-#include <wiringPiI2C.h>
+#include "configuration.h"
+#include "i2c_bus.h"
 #include "bme280.h"
 
-int bmefd;
-bme280_calib_data bmecal;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BME280_NEON 1
+#endif
 
-int setupBME280()
+#define BME280_CAL1_LENGTH 26 /* 0x88 - 0xA1 */
+#define BME280_CAL2_LENGTH 7  /* 0xE1 - 0xE7 */
+#define BME280_DATA_LENGTH 8  /* 0xF7 - 0xFE */
+#define BME280_BATCH_CHUNK 64 /* samples of t_fine kept on the stack */
+
+/* the sensor of setupBME280 and connectAndGetBMEData, opened once */
+static bme280_dev bmedev;
+
+/*
+ * Reads length registers from reg on in one transaction: the register
+ * address is written, a repeated start reads them back to back.
+ */
+static int readBlock(bme280_dev *dev, uint8_t reg, uint8_t *buf, int length)
+{
+    return i2c_read_regs(&dev->bus, dev->address, reg, buf, length) ? -1 : 0;
+}
+
+static int writeReg(bme280_dev *dev, uint8_t reg, uint8_t value)
+{
+    return i2c_write_reg(&dev->bus, dev->address, reg, value) ? -1 : 0;
+}
+
+static void parseRawData(const uint8_t *buf, bme280_raw_data *raw)
 {
-    int status;
-    /*
-     * Open the device.
-     */
-    bmefd = open("/dev/i2c-0", O_RDWR);
+    raw->pmsb = buf[0];
+    raw->plsb = buf[1];
+    raw->pxsb = buf[2];
 
-    if (bmefd < 0)
+    raw->tmsb = buf[3];
+    raw->tlsb = buf[4];
+    raw->txsb = buf[5];
+
+    raw->hmsb = buf[6];
+    raw->hlsb = buf[7];
+
+    raw->temperature = 0;
+    raw->temperature = (raw->temperature | raw->tmsb) << 8;
+    raw->temperature = (raw->temperature | raw->tlsb) << 8;
+    raw->temperature = (raw->temperature | raw->txsb) >> 4;
+
+    raw->pressure = 0;
+    raw->pressure = (raw->pressure | raw->pmsb) << 8;
+    raw->pressure = (raw->pressure | raw->plsb) << 8;
+    raw->pressure = (raw->pressure | raw->pxsb) >> 4;
+
+    raw->humidity = 0;
+    raw->humidity = (raw->humidity | raw->hmsb) << 8;
+    raw->humidity = (raw->humidity | raw->hlsb);
+}
+
+/*
+ * Opens the sensor at address on the i2c bus device, through the i2c-dev
+ * driver or the register model, and reads its calibration. bme280Configure
+ * starts it. Returns 0, or -1 with the sensor closed.
+ */
+int bme280Open(bme280_dev *dev, const struct i2c_bus_ops *ops, const char *device,
+               int address)
+{
+    dev->address = address;
+    if (i2c_bus_open(&dev->bus, ops, device))
+        return -1;
+
+    if (readCalibrationData(dev, &dev->cal))
     {
-        printf("Cannot open the IIC device\n");
-        return 1;
+        fprintf(stderr, "No BME280 at 0x%02x on %s\n", address, device);
+        bme280Close(dev);
+        return -1;
     }
+    return 0;
+}
 
-    status = ioctl(bmefd, I2C_SLAVE_FORCE, BME280_ADDRESS);
-    if (status < 0)
+/* register code of an oversampling or filter setting, -1 if there is none */
+static int settingCode(int value, int filter)
+{
+    switch (value)
     {
-        printf("Unable to set the EEPROM address\n");
+    case 0:
+        return 0;
+    case 1:
+        return filter ? -1 : 1;
+    case 2:
+        return filter ? 1 : 2;
+    case 4:
+        return filter ? 2 : 3;
+    case 8:
+        return filter ? 3 : 4;
+    case 16:
+        return filter ? 4 : 5;
+    }
+    return -1;
+}
+
+/*
+ * Sets oversampling and filter and puts the sensor into mode. In normal
+ * mode it converts every 62.5 ms on its own, in forced mode each
+ * bme280StartForced runs one conversion.
+ */
+int bme280Configure(bme280_dev *dev, const bme280_settings *settings, int mode)
+{
+    int t = settingCode(settings->osrs_t, 0), p = settingCode(settings->osrs_p, 0);
+    int h = settingCode(settings->osrs_h, 0), f = settingCode(settings->filter, 1);
+
+    if (t < 0 || p < 0 || h < 0 || f < 0)
+    {
+        fprintf(stderr, "BME280 oversampling %d,%d,%d filter %d not supported\n",
+                settings->osrs_t, settings->osrs_p, settings->osrs_h, settings->filter);
         return -1;
     }
+    dev->ctrl_meas = (t << 5) | (p << 2);
 
-    readCalibrationData(bmefd, &bmecal);
+    // ctrl_hum only takes effect with the write of ctrl_meas
+    if (writeReg(dev, BME280_REGISTER_CONTROLHUMID, h) ||
+        writeReg(dev, BME280_REGISTER_CONFIG, (1 << 5) | (f << 2)) || // standby 62.5 ms
+        writeReg(dev, BME280_REGISTER_CONTROL, dev->ctrl_meas | mode))
+        return -1;
+    return 0;
+}
 
-    wiringPiI2CWriteReg8(bmefd, 0xf2, 0x01); // humidity oversampling x 1
-    wiringPiI2CWriteReg8(bmefd, 0xf4, 0x25); // pressure and temperature oversampling x 1, mode normal
+/* one conversion in forced mode, the data is there after bme280MeasureTimeUs */
+int bme280StartForced(bme280_dev *dev)
+{
+    return writeReg(dev, BME280_REGISTER_CONTROL, dev->ctrl_meas | BME280_MODE_FORCED);
+}
+
+/* maximum conversion time, datasheet appendix B */
+unsigned int bme280MeasureTimeUs(const bme280_settings *settings)
+{
+    unsigned int us = 1250 + 2300 * settings->osrs_t;
 
-    // float t;
-    // float p;
-    // float h;
+    if (settings->osrs_p)
+        us += 2300 * settings->osrs_p + 575;
+    if (settings->osrs_h)
+        us += 2300 * settings->osrs_h + 575;
+    return us;
+}
 
-    // getTempPressureHumidityReading(fd, &t, &p, &h);
+void bme280Close(bme280_dev *dev)
+{
+    i2c_bus_close(&dev->bus);
+}
 
-    // printf("{\"sensor\":\"bme280\", \"humidity\":%.2f, \"pressure\":%.2f,"
-    //        " \"temperature\":%.2f, \"timestamp\":%d}\n",
-    //        h, p, t, (int)time(NULL));
+/* the 8 data registers in one burst, they belong to the same conversion */
+int bme280ReadRaw(bme280_dev *dev, bme280_raw_data *raw)
+{
+    uint8_t buf[BME280_DATA_LENGTH];
 
+    if (readBlock(dev, BME280_REGISTER_PRESSUREDATA, buf, sizeof(buf)))
+        return -1;
+    parseRawData(buf, raw);
     return 0;
 }
 
-void getTempPressureHumidityReading(float *temp, float *pressure, float *humidity)
+int bme280Read(bme280_dev *dev, float *temp, float *pressure, float *humidity)
 {
     bme280_raw_data raw;
-    getRawData(bmefd, &raw);
+    int32_t t_fine;
 
-    int32_t t_fine = getTemperatureCalibration(&bmecal, raw.temperature);
-    *temp = compensateTemperature(t_fine);                               // C
-    *pressure = compensatePressure(raw.pressure, &bmecal, t_fine) / 100; // hPa
-    *humidity = compensateHumidity(raw.humidity, &bmecal, t_fine);       // %
+    if (bme280ReadRaw(dev, &raw))
+        return -1;
+    t_fine = getTemperatureCalibration(&dev->cal, raw.temperature);
+    *temp = compensateTemperature(t_fine);                                 // C
+    *pressure = compensatePressure(raw.pressure, &dev->cal, t_fine) / 100; // hPa
+    *humidity = compensateHumidity(raw.humidity, &dev->cal, t_fine);       // %
+    return 0;
+}
+
+int setupBME280()
+{
+    bme280_settings x1 = {.osrs_t = 1, .osrs_p = 1, .osrs_h = 1, .filter = 0};
+
+    if (bmedev.bus.ops)
+        return 0;
+    if (bme280Open(&bmedev, &i2c_dev_ops, BME280_I2C_DEVICE, BME280_ADDRESS))
+        return 1;
+    return bme280Configure(&bmedev, &x1, BME280_MODE_NORMAL) ? 1 : 0;
+}
+
+void getTempPressureHumidityReading(float *temp, float *pressure, float *humidity)
+{
+    if (bme280Read(&bmedev, temp, pressure, humidity))
+        *temp = *pressure = *humidity = 0;
 
     //fprintf(stderr, "Ext Temp: %f, Pressure: %f, Humidity: %f\n", *temp, *pressure, *humidity);
 }
 
+/* the sensor stays open, only the first call pays for the setup */
 void connectAndGetBMEData(float *temp, float *pressure, float *humidity)
 {
-    // int bmefd;
-    // bme280_calib_data bmecal;
-
-    if (setupBME280(&bmefd, &bmecal))
+    if (setupBME280())
         fprintf(stderr, "BME280 Failed.");
 
     getTempPressureHumidityReading(temp, pressure, humidity);
-    close(bmefd);
 }
 
 int32_t getTemperatureCalibration(bme280_calib_data *cal, int32_t adc_T)
@@ -146,28 +275,40 @@ int32_t getTemperatureCalibration(bme280_calib_data *cal, int32_t adc_T)
     return var1 + var2;
 }
 
-void readCalibrationData(int fd, bme280_calib_data *data)
+/* two bursts, 0x88 - 0xA1 and 0xE1 - 0xE7, all words little endian */
+int readCalibrationData(bme280_dev *dev, bme280_calib_data *data)
 {
-    data->dig_T1 = (uint16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_T1);
-    data->dig_T2 = (int16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_T2);
-    data->dig_T3 = (int16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_T3);
-
-    data->dig_P1 = (uint16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_P1);
-    data->dig_P2 = (int16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_P2);
-    data->dig_P3 = (int16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_P3);
-    data->dig_P4 = (int16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_P4);
-    data->dig_P5 = (int16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_P5);
-    data->dig_P6 = (int16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_P6);
-    data->dig_P7 = (int16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_P7);
-    data->dig_P8 = (int16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_P8);
-    data->dig_P9 = (int16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_P9);
-
-    data->dig_H1 = (uint8_t)wiringPiI2CReadReg8(fd, BME280_REGISTER_DIG_H1);
-    data->dig_H2 = (int16_t)wiringPiI2CReadReg16(fd, BME280_REGISTER_DIG_H2);
-    data->dig_H3 = (uint8_t)wiringPiI2CReadReg8(fd, BME280_REGISTER_DIG_H3);
-    data->dig_H4 = (wiringPiI2CReadReg8(fd, BME280_REGISTER_DIG_H4) << 4) | (wiringPiI2CReadReg8(fd, BME280_REGISTER_DIG_H4 + 1) & 0xF);
-    data->dig_H5 = (wiringPiI2CReadReg8(fd, BME280_REGISTER_DIG_H5 + 1) << 4) | (wiringPiI2CReadReg8(fd, BME280_REGISTER_DIG_H5) >> 4);
-    data->dig_H6 = (int8_t)wiringPiI2CReadReg8(fd, BME280_REGISTER_DIG_H6);
+    uint8_t c[BME280_CAL1_LENGTH], e[BME280_CAL2_LENGTH];
+
+    if (readBlock(dev, BME280_REGISTER_DIG_T1, c, sizeof(c)) ||
+        readBlock(dev, BME280_REGISTER_DIG_H2, e, sizeof(e)))
+    {
+        fprintf(stderr, "Reading the BME280 calibration failed\n");
+        memset(data, 0, sizeof(*data));
+        return -1;
+    }
+
+    data->dig_T1 = (uint16_t)(c[0] | c[1] << 8);
+    data->dig_T2 = (int16_t)(c[2] | c[3] << 8);
+    data->dig_T3 = (int16_t)(c[4] | c[5] << 8);
+
+    data->dig_P1 = (uint16_t)(c[6] | c[7] << 8);
+    data->dig_P2 = (int16_t)(c[8] | c[9] << 8);
+    data->dig_P3 = (int16_t)(c[10] | c[11] << 8);
+    data->dig_P4 = (int16_t)(c[12] | c[13] << 8);
+    data->dig_P5 = (int16_t)(c[14] | c[15] << 8);
+    data->dig_P6 = (int16_t)(c[16] | c[17] << 8);
+    data->dig_P7 = (int16_t)(c[18] | c[19] << 8);
+    data->dig_P8 = (int16_t)(c[20] | c[21] << 8);
+    data->dig_P9 = (int16_t)(c[22] | c[23] << 8);
+
+    data->dig_H1 = c[25];
+    data->dig_H2 = (int16_t)(e[0] | e[1] << 8);
+    data->dig_H3 = e[2];
+    data->dig_H4 = (e[3] << 4) | (e[4] & 0xF);
+    data->dig_H5 = (e[5] << 4) | (e[4] >> 4);
+    data->dig_H6 = (int8_t)e[6];
+    return 0;
 }
 
 float compensateTemperature(int32_t t_fine)
@@ -229,34 +370,216 @@ float compensateHumidity(int32_t adc_H, bme280_calib_data *cal, int32_t t_fine)
     return h / 1024.0;
 }
 
-void getRawData(int fd, bme280_raw_data *raw)
+void getRawData(bme280_dev *dev, bme280_raw_data *raw)
 {
-    wiringPiI2CWrite(fd, 0xf7);
+    uint8_t buf[BME280_DATA_LENGTH];
 
-    raw->pmsb = wiringPiI2CRead(fd);
-    raw->plsb = wiringPiI2CRead(fd);
-    raw->pxsb = wiringPiI2CRead(fd);
+    if (readBlock(dev, BME280_REGISTER_PRESSUREDATA, buf, sizeof(buf)))
+        memset(buf, 0, sizeof(buf));
+    parseRawData(buf, raw);
+}
 
-    raw->tmsb = wiringPiI2CRead(fd);
-    raw->tlsb = wiringPiI2CRead(fd);
-    raw->txsb = wiringPiI2CRead(fd);
+/*
+ * Batch compensation, bit for bit the results of the functions above.
+ *
+ * Temperature and humidity are int32 throughout, the products wrap as in
+ * the single sample functions. With NEON four samples go through them at
+ * once, the vector multiply wraps the same way.
+ *
+ * Pressure needs int64. The terms that only depend on t_fine are kept from
+ * the sample before, oversampled data barely changes temperature. The
+ * 64 bit division, a library call on the Cortex-A9, becomes a multiply
+ * with the reciprocal of the divisor in double, corrected to the exact
+ * quotient with one 64 bit multiply.
+ */
+typedef struct
+{
+    int32_t t_fine;
+    int64_t var1; /* divisor, 0 if the pressure is 0 */
+    int64_t var2;
+    double inverse; /* 1 / var1, 0 to divide the slow way */
+} pressure_terms;
 
-    raw->hmsb = wiringPiI2CRead(fd);
-    raw->hlsb = wiringPiI2CRead(fd);
+const char *compensateBatchImpl(void)
+{
+#ifdef BME280_NEON
+    return "neon";
+#else
+    return "portable";
+#endif
+}
 
-    raw->temperature = 0;
-    raw->temperature = (raw->temperature | raw->tmsb) << 8;
-    raw->temperature = (raw->temperature | raw->tlsb) << 8;
-    raw->temperature = (raw->temperature | raw->txsb) >> 4;
+static void batchTFine(const bme280_calib_data *cal, const int32_t *adc_T, int32_t *t_fine, int n)
+{
+    int i = 0;
 
-    raw->pressure = 0;
-    raw->pressure = (raw->pressure | raw->pmsb) << 8;
-    raw->pressure = (raw->pressure | raw->plsb) << 8;
-    raw->pressure = (raw->pressure | raw->pxsb) >> 4;
+#ifdef BME280_NEON
+    int32x4_t t1 = vdupq_n_s32(cal->dig_T1), t1x2 = vdupq_n_s32((int32_t)cal->dig_T1 << 1);
+    int32x4_t t2 = vdupq_n_s32(cal->dig_T2), t3 = vdupq_n_s32(cal->dig_T3);
 
-    raw->humidity = 0;
-    raw->humidity = (raw->humidity | raw->hmsb) << 8;
-    raw->humidity = (raw->humidity | raw->hlsb);
+    for (; i + 4 <= n; i += 4)
+    {
+        int32x4_t a = vld1q_s32(adc_T + i);
+        int32x4_t d = vsubq_s32(vshrq_n_s32(a, 4), t1);
+        int32x4_t var1 = vshrq_n_s32(vmulq_s32(vsubq_s32(vshrq_n_s32(a, 3), t1x2), t2), 11);
+        int32x4_t var2 = vshrq_n_s32(vmulq_s32(vshrq_n_s32(vmulq_s32(d, d), 12), t3), 14);
+        vst1q_s32(t_fine + i, vaddq_s32(var1, var2));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        int32_t d = (adc_T[i] >> 4) - (int32_t)cal->dig_T1;
+        int32_t var1 = (int32_t)((uint32_t)((adc_T[i] >> 3) - ((int32_t)cal->dig_T1 << 1)) *
+                                 (uint32_t)cal->dig_T2) >> 11;
+        int32_t var2 = (int32_t)((uint32_t)((int32_t)((uint32_t)d * (uint32_t)d) >> 12) *
+                                 (uint32_t)cal->dig_T3) >> 14;
+        t_fine[i] = var1 + var2;
+    }
+}
+
+static void pressureTerms(const bme280_calib_data *cal, int32_t t_fine, pressure_terms *pt)
+{
+    int64_t var1, var2;
+
+    var1 = ((int64_t)t_fine) - 128000;
+    var2 = var1 * var1 * (int64_t)cal->dig_P6;
+    var2 = var2 + ((var1 * (int64_t)cal->dig_P5) << 17);
+    var2 = var2 + (((int64_t)cal->dig_P4) << 35);
+    var1 = ((var1 * var1 * (int64_t)cal->dig_P3) >> 8) +
+           ((var1 * (int64_t)cal->dig_P2) << 12);
+    var1 = (((((int64_t)1) << 47) + var1)) * ((int64_t)cal->dig_P1) >> 33;
+
+    pt->t_fine = t_fine;
+    pt->var1 = var1;
+    pt->var2 = var2;
+    /* large enough that the estimate is off by one at most */
+    pt->inverse = var1 >= (1 << 20) ? 1.0 / var1 : 0;
+}
+
+/* n / d rounded towards zero as the / operator does */
+static int64_t divide(int64_t n, const pressure_terms *pt)
+{
+    uint64_t a = n < 0 ? -(uint64_t)n : (uint64_t)n;
+    int64_t d = pt->var1, q, r;
+
+    if (pt->inverse == 0 || a >= ((uint64_t)1 << 62))
+        return n / d;
+    q = (int64_t)((double)a * pt->inverse);
+    r = (int64_t)a - q * d;
+    while (r < 0)
+    {
+        q--;
+        r += d;
+    }
+    while (r >= d)
+    {
+        q++;
+        r -= d;
+    }
+    return n < 0 ? -q : q;
+}
+
+static float batchPressure(const bme280_calib_data *cal, int32_t adc_P, const pressure_terms *pt)
+{
+    int64_t var1, var2, p;
+
+    if (pt->var1 == 0)
+        return 0;
+    p = 1048576 - adc_P;
+    p = divide((int64_t)((((uint64_t)p << 31) - (uint64_t)pt->var2) * 3125), pt);
+    var1 = (((int64_t)cal->dig_P9) * (p >> 13) * (p >> 13)) >> 25;
+    var2 = (((int64_t)cal->dig_P8) * p) >> 19;
+
+    p = ((p + var1 + var2) >> 8) + (((int64_t)cal->dig_P7) << 4);
+    return (float)p / 256;
+}
+
+static void batchHumidity(const bme280_calib_data *cal, const int32_t *adc_H, const int32_t *t_fine,
+                          int n, float *humidity)
+{
+    int32_t v, x, y, last = 0, factor = 0;
+    int i = 0;
+
+#ifdef BME280_NEON
+    int32x4_t h1 = vdupq_n_s32(cal->dig_H1), h2 = vdupq_n_s32(cal->dig_H2);
+    int32x4_t h3 = vdupq_n_s32(cal->dig_H3), h4 = vdupq_n_s32((int32_t)cal->dig_H4 << 20);
+    int32x4_t h5 = vdupq_n_s32(cal->dig_H5), h6 = vdupq_n_s32(cal->dig_H6);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        int32x4_t vv = vsubq_s32(vld1q_s32(t_fine + i), vdupq_n_s32(76800));
+        int32x4_t a = vshlq_n_s32(vld1q_s32(adc_H + i), 14);
+        int32x4_t b, c;
+
+        a = vsubq_s32(vsubq_s32(a, h4), vmulq_s32(h5, vv));
+        a = vshrq_n_s32(vaddq_s32(a, vdupq_n_s32(16384)), 15);
+        b = vshrq_n_s32(vmulq_s32(vv, h6), 10);
+        c = vaddq_s32(vshrq_n_s32(vmulq_s32(vv, h3), 11), vdupq_n_s32(32768));
+        b = vaddq_s32(vshrq_n_s32(vmulq_s32(b, c), 10), vdupq_n_s32(2097152));
+        b = vshrq_n_s32(vaddq_s32(vmulq_s32(b, h2), vdupq_n_s32(8192)), 14);
+        a = vmulq_s32(a, b);
+        c = vshrq_n_s32(a, 15);
+        c = vshrq_n_s32(vmulq_s32(vshrq_n_s32(vmulq_s32(c, c), 7), h1), 4);
+        a = vsubq_s32(a, c);
+        a = vminq_s32(vmaxq_s32(a, vdupq_n_s32(0)), vdupq_n_s32(419430400));
+        vst1q_f32(humidity + i, vmulq_n_f32(vcvtq_f32_s32(vshrq_n_s32(a, 12)), 1.0f / 1024));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        v = t_fine[i] - 76800;
+        /* the second factor only depends on the temperature */
+        if (i == 0 || t_fine[i] != last)
+        {
+            x = (int32_t)((uint32_t)v * (uint32_t)cal->dig_H6) >> 10;
+            y = ((int32_t)((uint32_t)v * (uint32_t)cal->dig_H3) >> 11) + 32768;
+            x = ((int32_t)((uint32_t)x * (uint32_t)y) >> 10) + 2097152;
+            factor = (int32_t)((uint32_t)x * (uint32_t)cal->dig_H2 + 8192) >> 14;
+            last = t_fine[i];
+        }
+        x = (int32_t)(((uint32_t)adc_H[i] << 14) - ((uint32_t)cal->dig_H4 << 20) -
+                      (uint32_t)cal->dig_H5 * (uint32_t)v + 16384) >> 15;
+        x = (int32_t)((uint32_t)x * (uint32_t)factor);
+        y = x >> 15;
+        x = x - ((int32_t)((uint32_t)((int32_t)((uint32_t)y * (uint32_t)y) >> 7) * cal->dig_H1) >> 4);
+        x = x < 0 ? 0 : x;
+        x = x > 419430400 ? 419430400 : x;
+        humidity[i] = (x >> 12) / 1024.0f;
+    }
+}
+
+/*
+ * Compensates n raw samples at once, temp in C, pressure in Pa and humidity
+ * in %, the same as compensateTemperature, compensatePressure and
+ * compensateHumidity. adc_P with pressure, adc_H with humidity may be NULL.
+ */
+void compensateBatch(const bme280_calib_data *cal, const int32_t *adc_T, const int32_t *adc_P,
+                     const int32_t *adc_H, int n, float *temp, float *pressure, float *humidity)
+{
+    int32_t t_fine[BME280_BATCH_CHUNK];
+    pressure_terms pt;
+    int i, k, m;
+
+    pressureTerms(cal, 0, &pt);
+    for (k = 0; k < n; k += m)
+    {
+        m = n - k < BME280_BATCH_CHUNK ? n - k : BME280_BATCH_CHUNK;
+        batchTFine(cal, adc_T + k, t_fine, m);
+
+        for (i = 0; i < m; i++)
+            temp[k + i] = (float)((int32_t)((uint32_t)t_fine[i] * 5 + 128) >> 8) / 100;
+
+        if (adc_P && pressure)
+            for (i = 0; i < m; i++)
+            {
+                if (t_fine[i] != pt.t_fine)
+                    pressureTerms(cal, t_fine[i], &pt);
+                pressure[k + i] = batchPressure(cal, adc_P[k + i], &pt);
+            }
+
+        if (adc_H && humidity)
+            batchHumidity(cal, adc_H + k, t_fine, m, humidity + k);
+    }
 }
 
 float getAltitude(float pressure)
@@ -37,10 +37,7 @@ https://projects.drogon.net/raspberry-pi/wiringpi/i2c-library/
 #ifndef __BME280_H__
 #define __BME280_H__
 
-#define I2C_SLAVE_FORCE 0x0706
-#define I2C_SLAVE 0x0703 /* Change slave address            */
-#define I2C_FUNCS 0x0705 /* Get the adapter functionality */
-#define I2C_RDWR 0x0707  /* Combined R/W transfer (one stop only)*/
+#include "i2c_bus.h"
 
 #define BME280_ADDRESS 0x77
 
@@ -76,6 +73,10 @@ https://projects.drogon.net/raspberry-pi/wiringpi/i2c-library/
 
 #define MEAN_SEA_LEVEL_PRESSURE 1013
 
+#define BME280_MODE_SLEEP 0
+#define BME280_MODE_FORCED 1 /* one conversion, then back to sleep */
+#define BME280_MODE_NORMAL 3 /* converts on its own, standby in between */
+
 /*
 * Immutable calibration data read from bme280
 */
@@ -125,12 +126,48 @@ typedef struct
 
 } bme280_raw_data;
 
-void readCalibrationData(int fd, bme280_calib_data *cal);
+/*
+* Conversion settings, oversampling 0 (skipped), 1, 2, 4, 8 or 16 and
+* IIR filter coefficient 0 (off), 2, 4, 8 or 16
+*/
+typedef struct
+{
+    uint8_t osrs_t;
+    uint8_t osrs_p;
+    uint8_t osrs_h;
+    uint8_t filter;
+} bme280_settings;
+
+/*
+* An open sensor, the calibration is read once when it is opened.
+* bus.ops is NULL while it is closed
+*/
+typedef struct
+{
+    struct i2c_bus bus;
+    int address;
+    uint8_t ctrl_meas; /* oversampling bits of 0xF4, without the mode */
+    bme280_calib_data cal;
+} bme280_dev;
+
+int bme280Open(bme280_dev *dev, const struct i2c_bus_ops *ops, const char *device,
+               int address);
+void bme280Close(bme280_dev *dev);
+int bme280Configure(bme280_dev *dev, const bme280_settings *settings, int mode);
+int bme280StartForced(bme280_dev *dev);
+unsigned int bme280MeasureTimeUs(const bme280_settings *settings);
+int bme280ReadRaw(bme280_dev *dev, bme280_raw_data *raw);
+int bme280Read(bme280_dev *dev, float *temp, float *pressure, float *humidity);
+
+int readCalibrationData(bme280_dev *dev, bme280_calib_data *cal);
 int32_t getTemperatureCalibration(bme280_calib_data *cal, int32_t adc_T);
 float compensateTemperature(int32_t t_fine);
 float compensatePressure(int32_t adc_P, bme280_calib_data *cal, int32_t t_fine);
 float compensateHumidity(int32_t adc_H, bme280_calib_data *cal, int32_t t_fine);
-void getRawData(int fd, bme280_raw_data *raw);
+void compensateBatch(const bme280_calib_data *cal, const int32_t *adc_T, const int32_t *adc_P,
+                     const int32_t *adc_H, int n, float *temp, float *pressure, float *humidity);
+const char *compensateBatchImpl(void);
+void getRawData(bme280_dev *dev, bme280_raw_data *raw);
 float getAltitude(float pressure);
 void getTempPressureHumidityReading(float *temp, float *pressure, float *humidity);
 int setupBME280();
@@ -0,0 +1,201 @@
+/*
+ * Background BME280 sampling.
+ *
+ * The sensor is opened once: the calibration is read at start, every
+ * sample is a single burst of the eight data registers (see
+ * bme280ReadRaw). The bus statistics are printed at stop, tools/i2c_bench
+ * times the burst against the register by register reads of wiringPi.
+ *
+ * The sensor runs in forced mode and converts when it is told to. The
+ * acquisition reports every trigger (bme_poller_trigger), which gives the
+ * trigger period. Each conversion is started so that it completes, and has
+ * been read, BME_SCHED_MARGIN_US before the next expected trigger. The
+ * environment is then measured right at the optical frame, and the bus is
+ * idle while the frame is read out of the dma ring. Without triggers, at
+ * start or while paused, the sensor converts every period_ms.
+ *
+ * The sensor is registered as bme280 (sensors.c) without a sample
+ * function, this thread publishes each reading to the sensor table itself:
+ * ADC_read_worker copies it right after a trigger and environmental data
+ * adds no i2c latency there.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "configuration.h"
+#include "bme280.h"
+#include "bme_poller.h"
+#include "sensors.h"
+
+#define BME_POLLER_REPORT_EVERY 100 /* print failures every n polls */
+#define BME_SCHED_MARGIN_US 2000 /* read done this long before the trigger */
+#define BME_TRIGGER_LOST 4 /* trigger periods without one, fall back */
+
+enum bme_channel
+{
+  BME_TEMP,
+  BME_PRESSURE,
+  BME_HUMIDITY,
+  BME_CHANNELS
+};
+
+static bme280_dev sensor;
+static pthread_t poller_thread;
+static int poller_running;
+static uint64_t poller_period_ns;
+static uint64_t measure_ns;
+static int sensor_id = -1; /* index in the sensor table */
+/* written by the acquisition only, ns of CLOCK_MONOTONIC */
+static uint64_t last_trigger;
+static uint64_t trigger_period;
+
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+  struct timespec ts = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000};
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/*
+ * called by the acquisition right after each trigger. the period is a
+ * running average, a gap of a pause does not count.
+ */
+void bme_poller_trigger(void)
+{
+  uint64_t now = now_ns();
+  uint64_t last = __atomic_load_n(&last_trigger, __ATOMIC_RELAXED);
+  uint64_t period = __atomic_load_n(&trigger_period, __ATOMIC_RELAXED);
+  uint64_t gap = now - last;
+
+  if (last != 0 && (period == 0 || gap < BME_TRIGGER_LOST * period))
+    period = period == 0 ? gap : (period * 7 + gap) / 8;
+  __atomic_store_n(&trigger_period, period, __ATOMIC_RELAXED);
+  __atomic_store_n(&last_trigger, now, __ATOMIC_RELEASE);
+}
+
+/* when to start the next conversion, now at the earliest */
+static uint64_t next_start(uint64_t now, uint64_t fallback)
+{
+  uint64_t last = __atomic_load_n(&last_trigger, __ATOMIC_ACQUIRE);
+  uint64_t period = __atomic_load_n(&trigger_period, __ATOMIC_RELAXED);
+  uint64_t lead = measure_ns + BME_SCHED_MARGIN_US * 1000ULL;
+  uint64_t trigger;
+
+  if (period == 0 || now - last > BME_TRIGGER_LOST * period)
+    return fallback > now ? fallback : now;
+  if (period <= lead)
+    return now; /* conversions back to back still miss some triggers */
+
+  /* the first expected trigger that leaves time for a whole conversion */
+  trigger = last + period;
+  if (trigger < now + lead)
+    trigger += ((now + lead - trigger) / period + 1) * period;
+  return trigger - lead;
+}
+
+static void *bme_poller_worker(void *data)
+{
+  float values[BME_CHANNELS];
+  uint64_t start, fallback;
+  unsigned long polls = 0, failures = 0;
+
+  (void)data;
+  fallback = now_ns();
+  while (__atomic_load_n(&poller_running, __ATOMIC_ACQUIRE))
+  {
+    start = next_start(now_ns(), fallback);
+    sleep_until(start);
+    if (!__atomic_load_n(&poller_running, __ATOMIC_ACQUIRE))
+      break;
+    fallback = start + poller_period_ns;
+
+    polls++;
+    if (bme280StartForced(&sensor) == 0)
+    {
+      sleep_until(start + measure_ns);
+      if (bme280Read(&sensor, &values[BME_TEMP], &values[BME_PRESSURE],
+                     &values[BME_HUMIDITY]) == 0)
+      {
+        sensor_publish(sensor_id, now_ms(), values);
+        continue;
+      }
+    }
+    if (failures++ % BME_POLLER_REPORT_EVERY == 0)
+      fprintf(stderr, "BME280 poll failed (%lu of %lu)\n", failures, polls);
+  }
+  return NULL;
+}
+
+int bme_poller_start(unsigned int period_ms, const bme280_settings *settings,
+                     const struct i2c_bus_ops *bus)
+{
+  struct sensor bme = {
+      .name = "bme280",
+      .channels = BME_CHANNELS,
+      .channel = {{"temp", "degC"}, {"pressure", "hPa"}, {"humidity", "%"}},
+  };
+  int rc;
+
+  if (bme280Open(&sensor, bus, BME280_I2C_DEVICE, BME280_ADDRESS) != 0)
+    return -1;
+  if (bme280Configure(&sensor, settings, BME280_MODE_SLEEP) != 0)
+  {
+    bme280Close(&sensor);
+    return -1;
+  }
+  poller_period_ns = (period_ms > 0 ? period_ms : 1) * 1000000ULL;
+  measure_ns = bme280MeasureTimeUs(settings) * 1000ULL;
+  sensor_id = sensor_register(&bme);
+  if (sensor_id < 0)
+  {
+    bme280Close(&sensor);
+    return -1;
+  }
+  last_trigger = trigger_period = 0;
+  __atomic_store_n(&poller_running, 1, __ATOMIC_RELEASE);
+  rc = pthread_create(&poller_thread, NULL, bme_poller_worker, NULL);
+  if (rc != 0)
+  {
+    fprintf(stderr, "start BME280 poller failed, %s\n", strerror(rc));
+    __atomic_store_n(&poller_running, 0, __ATOMIC_RELEASE);
+    bme280Close(&sensor);
+    return -1;
+  }
+  fprintf(stderr,
+          "BME280 poller: forced conversions of %u us before each trigger, "
+          "every %u ms without, oversampling %d,%d,%d filter %d\n",
+          (unsigned int)(measure_ns / 1000), period_ms, settings->osrs_t,
+          settings->osrs_p, settings->osrs_h, settings->filter);
+  return 0;
+}
+
+/* returns after the conversion in progress, if any, has finished */
+void bme_poller_stop(void)
+{
+  if (!__atomic_exchange_n(&poller_running, 0, __ATOMIC_ACQ_REL))
+    return;
+  pthread_join(poller_thread, NULL);
+  i2c_bus_report(&sensor.bus);
+  bme280Close(&sensor);
+}
@@ -0,0 +1,21 @@
+/*
+ * Background BME280 sampling. A thread keeps the sensor open and runs a
+ * forced conversion that completes just before each expected trigger. The
+ * readings go to the sensor table as bme280.temp, .pressure and .humidity,
+ * the acquisition picks them up without touching the i2c bus.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __BME_POLLER_H__
+#define __BME_POLLER_H__
+
+#include <stdint.h>
+
+#include "bme280.h"
+
+int bme_poller_start(unsigned int period_ms, const bme280_settings *settings,
+                     const struct i2c_bus_ops *bus);
+void bme_poller_trigger(void);
+void bme_poller_stop(void);
+
+#endif
@@ -17,27 +17,52 @@
 #define CLIENT_IP_PORT_A 12345
 #define CLIENT_IP_PORT_B 12346
 #define CLIENT_IP_PORT_ACK 12347
+#define DATA_SERVER_PORT 12348 /* multiplexed data server (-s), see protocol.h */
 //#define ACQUISITION_LENGTH 150000    /* samples */
 #define PRE_TRIGGER_LENGTH 0        /* samples */
 #define DECIMATION DE_64            /* one of enum decimation */
 #define TRIGGER_MODE TR_EXT_FALLING /* one of enum trigger */
 #define TRIGGER_THRESHOLD 350       // 2048   750         /* ADC counts, 2048 ≃ +0.25V */
 #define DELAYFORLOOP 5              // 66000
+#define SIM_TRIGGER_PERIOD_US 10000 /* external trigger period of the fpga model (-S) */
+#define SIM_I2C_ERROR_PERMILLE 5 /* failed transfers of the BME280 model (-S) */
+#define TRIGGER_UIO_DEVICE "/dev/uio0" /* fpga interrupt for the uio trigger wait */
 
 /* internal constants */
 #define READ_BLOCK_SIZE 20000
-#define SEND_BLOCK_SIZE 20000
+#define SEND_IOV_MAX 16 /* ring blocks gathered per sendmsg */
+#define FRAME_BUFFER_MAX (128UL << 20) /* bytes of frame slots per channel, caps -a times -d */
 #define RAM_A_ADDRESS 0x1e000000UL
 #define RAM_A_SIZE 0x01000000UL
 #define RAM_B_ADDRESS 0x1f000000UL
 #define RAM_B_SIZE 0x01000000UL
+#define ADC_CLOCK_MHZ 125 /* undecimated sample rate */
 
+#ifndef ENABLE_MECOM
 #define ENABLE_MECOM 1
+#endif
+#ifndef ENABLE_BME280
 #define ENABLE_BME280 1
+#endif
+#define TEC_POLL_PERIOD_MS 100 /* default TEC telemetry rate (-t) */
+#define BME_POLL_PERIOD_MS 100 /* BME280 sampling rate while there are no triggers */
+#define BME_OVERSAMPLING 1 /* BME280 default for all three channels (-B) */
+#define BME_FILTER 0 /* BME280 IIR filter coefficient (-B) */
+#define BME280_I2C_DEVICE "/dev/i2c-0"
+#define TEC_MAX_DEVICES 4 /* TEC controllers on the line (-e), <= MEPORT_MAX_DEVICES */
+#define MECOM_DEFAULT_BAUD 57600 /* controller factory rate, the link opens at it */
+#define TEC_BAUD_RATE 57600 /* TEC link rate after connecting (-b), up to 1000000 */
 
+/* on-board lock (-l), gains can be changed at runtime (-k, PROTO_SET_GAINS) */
 #define Kp 0.01
 #define Ki 0
 #define Kd 0
+#define LOCK_DIP 1 /* reference rb dip, counted from the start of the scan */
+#define LOCK_OFFSET 0.0 /* fringe to dip distance to hold, fraction of the fsr */
+#define LOCK_TEMP_MIN 15.0 /* TEC target temperature limits, degC */
+#define LOCK_TEMP_MAX 45.0
+#define LOCK_CURRENT_MIN -1.5 /* TEC current limits, A */
+#define LOCK_CURRENT_MAX 1.5
 
 #define SW1TRIGPIN RP_DIO0_N
 #define SW1STATUSPIN RP_DIO1_N
@@ -0,0 +1,252 @@
+/*
+ * Binary control protocol commands.
+ *
+ * control_execute runs in the thread that received the command (the ack
+ * worker), or in the TEC writer for the TEC commands of the data server,
+ * which control_submit queues there. The TEC commands pick the controller by
+ * arg, an index into the devices given to control_init, and go through
+ * temp_moniter.c to the MeCom bus, which queues the requests of all threads
+ * and matches the answers by sequence number (MeInt.c), so they may run
+ * while the pollers and the lock talk to the controllers. Acquisition
+ * settings only change the pending copy, ADC_read_worker picks that up with
+ * control_take_pending before it arms the scope, lets the frames in flight
+ * drain and applies it.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include "configuration.h"
+#include "control.h"
+#include "scope.h"
+#include "temp_moniter.h"
+#include "tec_poller.h"
+#include "tec_writer.h"
+#include "sensors.h"
+#include "MeComAPI/ComPort/ComTrace.h"
+
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct acq_settings pending;
+static int pending_changed;
+static int paused;
+static int length_max; /* samples, the dma ring and the frame slots */
+static int tec_owned_by_lock; /* the on-board lock drives tec[0] */
+static struct tec_device tec[TEC_MAX_DEVICES];
+static int tec_count;
+
+void control_init(const struct acq_settings *initial, int max_length,
+                  int tec_locked, const struct tec_device *devices, int count)
+{
+  pthread_mutex_lock(&control_lock);
+  pending = *initial;
+  length_max = max_length;
+  pending_changed = 0;
+  paused = 0;
+  tec_owned_by_lock = tec_locked;
+  tec_count = count < TEC_MAX_DEVICES ? count : TEC_MAX_DEVICES;
+  memcpy(tec, devices, tec_count * sizeof(*tec));
+  pthread_mutex_unlock(&control_lock);
+}
+
+static int valid_decimation(int dec)
+{
+  switch (dec)
+  {
+  case DE_1:
+  case DE_8:
+  case DE_64:
+  case DE_1024:
+  case DE_8192:
+  case DE_65536:
+    return 1;
+  }
+  return 0;
+}
+
+/* whether cmd may set a TEC value, PROTO_OK or the status to reply with */
+static int check_tec(const struct proto_command *cmd)
+{
+  float min, max;
+
+  if (!ENABLE_MECOM || cmd->arg < 0 || cmd->arg >= tec_count)
+    return PROTO_ERR_UNAVAILABLE;
+  if (cmd->arg == 0 && tec_owned_by_lock)
+    return PROTO_ERR_UNAVAILABLE;
+  min = cmd->command == CMD_SET_TEMPERATURE ? LOCK_TEMP_MIN : LOCK_CURRENT_MIN;
+  max = cmd->command == CMD_SET_TEMPERATURE ? LOCK_TEMP_MAX : LOCK_CURRENT_MAX;
+  if (!(cmd->value >= min && cmd->value <= max))
+    return PROTO_ERR_INVALID;
+  return PROTO_OK;
+}
+
+/* set a TEC value, the reply carries what was requested */
+static int set_tec(const struct proto_command *cmd)
+{
+  const struct tec_device *dev;
+  int rc;
+
+  rc = check_tec(cmd);
+  if (rc != PROTO_OK)
+    return rc;
+  dev = &tec[cmd->arg];
+  if (cmd->command == CMD_SET_TEMPERATURE)
+    rc = setTECTargetTemp(dev->address, dev->inst, cmd->value);
+  else
+    rc = setTECVandC(dev->address, dev->inst, 3, cmd->value);
+  return rc == 0 ? PROTO_OK : PROTO_ERR_FAILED;
+}
+
+static void reply_init(const struct proto_command *cmd,
+                       struct proto_reply *reply)
+{
+  reply->request_id = cmd->request_id;
+  reply->command = cmd->command;
+  reply->status = PROTO_OK;
+  reply->arg = cmd->arg;
+  reply->value = cmd->value;
+}
+
+/* checks and carries out cmd, fills in reply */
+void control_execute(const struct proto_command *cmd, struct proto_reply *reply)
+{
+  struct tec_reading reading;
+
+  reply_init(cmd, reply);
+  switch (cmd->command)
+  {
+  case CMD_SET_TEMPERATURE:
+  case CMD_SET_CURRENT:
+    reply->status = set_tec(cmd);
+    return;
+  case CMD_GET_TEMPERATURE:
+    if (!ENABLE_MECOM || tec_poller_latest(cmd->arg, &reading) != 0)
+      reply->status = PROTO_ERR_UNAVAILABLE;
+    else
+      reply->value = reading.object_temp;
+    return;
+  case CMD_GET_SENSOR:
+    switch (sensor_channel_value(cmd->arg, &reply->value))
+    {
+    case 0:
+      break;
+    case -1:
+      reply->status = PROTO_ERR_UNAVAILABLE;
+      break;
+    default:
+      reply->status = PROTO_ERR_INVALID;
+    }
+    return;
+  case CMD_SET_TRACE:
+    if (cmd->arg != 0 && cmd->arg != 1)
+    {
+      reply->status = PROTO_ERR_INVALID;
+      return;
+    }
+    reply->arg = ComTrace_Enable(cmd->arg);
+    if (reply->arg != cmd->arg)
+      reply->status = PROTO_ERR_FAILED; /* the writer did not start */
+    fprintf(stderr, "MeCom trace %s\n", reply->arg ? "on" : "off");
+    return;
+  case CMD_START:
+  case CMD_STOP:
+  case CMD_SET_ACQUISITION_LENGTH:
+  case CMD_SET_DECIMATION:
+  case CMD_SET_TRIGGER:
+    break;
+  default:
+    reply->status = PROTO_ERR_UNKNOWN;
+    return;
+  }
+
+  pthread_mutex_lock(&control_lock);
+  switch (cmd->command)
+  {
+  case CMD_START:
+  case CMD_STOP:
+    paused = cmd->command == CMD_STOP;
+    reply->arg = !paused;
+    break;
+  case CMD_SET_ACQUISITION_LENGTH:
+    /* the post trigger samples must fit the dma ring and the frame slots */
+    if (cmd->arg < 1 || cmd->arg > length_max)
+      reply->status = PROTO_ERR_INVALID;
+    else if (cmd->arg != pending.acquisition_length)
+    {
+      pending.acquisition_length = cmd->arg;
+      pending_changed = 1;
+    }
+    break;
+  case CMD_SET_DECIMATION:
+    if (!valid_decimation(cmd->arg))
+      reply->status = PROTO_ERR_INVALID;
+    else if (cmd->arg != pending.decimation)
+    {
+      pending.decimation = cmd->arg;
+      pending_changed = 1;
+    }
+    break;
+  case CMD_SET_TRIGGER:
+    if (cmd->arg < TR_OFF || cmd->arg > TR_ASG_FALLING ||
+        !(cmd->value >= -8192 && cmd->value <= 8191))
+      reply->status = PROTO_ERR_INVALID;
+    else
+    {
+      pending.trigger = cmd->arg;
+      pending.trigger_threshold = (int)cmd->value;
+      pending_changed = 1;
+    }
+    break;
+  }
+  pthread_mutex_unlock(&control_lock);
+
+  fprintf(stderr, "Command %u (request %u): %d\n", cmd->command,
+          cmd->request_id, reply->status);
+}
+
+/*
+ * the data server: as control_execute, but the TEC settings are handed to
+ * the TEC writer once they passed the checks. returns 1 if the reply comes
+ * later from tec_writer_take_reply, 0 if it is filled in.
+ */
+int control_submit(const struct proto_command *cmd, struct proto_reply *reply)
+{
+  if (cmd->command != CMD_SET_TEMPERATURE && cmd->command != CMD_SET_CURRENT)
+  {
+    control_execute(cmd, reply);
+    return 0;
+  }
+  reply_init(cmd, reply);
+  reply->status = check_tec(cmd);
+  if (reply->status != PROTO_OK)
+    return 0;
+  if (tec_writer_submit(cmd) == 0)
+    return 1;
+  reply->status = PROTO_ERR_UNAVAILABLE; /* too many settings in progress */
+  return 0;
+}
+
+/*
+ * ADC_read_worker: copies the acquisition settings to *settings if they were
+ * changed since the last call, returns non-zero in that case.
+ */
+int control_take_pending(struct acq_settings *settings)
+{
+  int changed;
+
+  pthread_mutex_lock(&control_lock);
+  changed = pending_changed;
+  if (changed)
+    *settings = pending;
+  pending_changed = 0;
+  pthread_mutex_unlock(&control_lock);
+  return changed;
+}
+
+int control_paused(void)
+{
+  int p;
+
+  pthread_mutex_lock(&control_lock);
+  p = paused;
+  pthread_mutex_unlock(&control_lock);
+  return p;
+}
@@ -0,0 +1,31 @@
+/*
+ * Commands of the binary control protocol (PROTO_COMMAND, see protocol.h).
+ * TEC settings are carried out right away, or by the TEC writer when the
+ * data server submits them, acquisition settings are handed to
+ * ADC_read_worker, which applies them between frames.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+#include "protocol.h"
+#include "temp_moniter.h"
+
+struct acq_settings
+{
+  int acquisition_length; /* samples */
+  int decimation; /* one of enum decimation */
+  int trigger; /* one of enum trigger */
+  int trigger_threshold; /* adc counts */
+};
+
+void control_init(const struct acq_settings *initial, int max_length,
+                  int tec_locked, const struct tec_device *devices, int count);
+void control_execute(const struct proto_command *cmd,
+                     struct proto_reply *reply);
+int control_submit(const struct proto_command *cmd, struct proto_reply *reply);
+int control_take_pending(struct acq_settings *settings);
+int control_paused(void);
+
+#endif
@@ -0,0 +1,707 @@
+/*
+ * Multiplexed data server.
+ *
+ * data_server_worker runs one epoll loop over the listening socket, the
+ * client connection and the data_fd eventfds of the three reader rings. For
+ * every frame the blocks of channel a, channel b and the telemetry are taken
+ * off their rings in that order and written to the client as three messages
+ * of protocol.h, gathered into non-blocking sendmsg calls. Acks from the
+ * client arrive on the same connection and release the frame's telemetry
+ * slot, which is what lets ADC_read_worker arm for the next frame. Every
+ * block on the telemetry ring is a message of its own, the peak finder's
+ * result ahead of the telemetry. Replies to control commands are queued and
+ * go out between two messages. Commands that wait for a device (the TEC
+ * settings) are answered when they are done, through reply_fd, possibly
+ * after later commands; the request id tells the client which is which.
+ *
+ * Only one client is served at a time, a new connection replaces the old
+ * one. The rings are not drained while nobody is connected, so the reader
+ * stalls as it would waiting for accept on the per-port sockets. Only when
+ * the server runs autonomously (the on-board lock) frames are dropped while
+ * nobody watches and released as soon as they are sent. A client
+ * that goes away in the middle of a frame loses the rest of that frame, and
+ * the next client starts at a frame boundary.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#define _GNU_SOURCE /* accept4 */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "configuration.h"
+#include "data_server.h"
+
+#define DS_MAX_EVENTS 8
+#define DS_CHANNELS 3 /* messages per frame */
+#define DS_MAX_REPLIES 16 /* command replies waiting for a message boundary */
+
+/* epoll tags, the rings use their channel index */
+enum
+{
+  DS_EV_LISTEN = DS_CHANNELS,
+  DS_EV_CLIENT,
+  DS_EV_REPLY
+};
+
+static const uint16_t ds_type[DS_CHANNELS] = {PROTO_CH_A, PROTO_CH_B,
+                                              PROTO_TELEMETRY};
+
+/* header and body back to back, both are multiples of four bytes */
+struct ds_reply
+{
+  struct proto_header hdr;
+  struct proto_reply body;
+};
+
+struct session
+{
+  int epfd;
+  int fd; /* client connection, -1 while nobody is connected */
+  int want_out; /* the socket buffer was full, wait for EPOLLOUT */
+  uint32_t events; /* armed on fd */
+
+  /* output, chan is the message of the current frame being sent */
+  int chan;
+  int started; /* header of the current message is queued */
+  int msg_end; /* last block of the current message is in out[] */
+  int discard; /* client left mid frame, drop the rest of it */
+  uint32_t sequence;
+  struct proto_header hdr;
+  struct iovec out[SEND_IOV_MAX + 1];
+  int nout;
+  unsigned int unacked; /* telemetry sent, ack outstanding */
+  struct ds_reply replies[DS_MAX_REPLIES];
+  int nreplies; /* queued replies */
+  int sending_replies; /* how many of them are in out[] */
+  int pending; /* commands whose reply comes from take_reply */
+  int stale; /* replies still to come for a client that left, discarded */
+  size_t frame_bytes;
+  struct timespec frame_start;
+
+  /* input, always large enough for one complete client message */
+  uint8_t in[sizeof(struct proto_header) + PROTO_MAX_CLIENT_PAYLOAD];
+  size_t nin;
+};
+
+static int ds_parse(struct data_server *srv, struct session *s);
+
+/* the reply queue has room for every reply owed */
+static int ds_room(const struct session *s)
+{
+  return s->nreplies + s->pending + s->stale < DS_MAX_REPLIES;
+}
+
+static struct queue *ds_queue(struct data_server *srv, int chan)
+{
+  return chan == 0 ? srv->a : chan == 1 ? srv->b : srv->tm;
+}
+
+/* the first message of every frame */
+static int ds_first_chan(struct data_server *srv)
+{
+  return srv->results_only ? 2 : 0;
+}
+
+int data_server_open(struct data_server *srv, int port)
+{
+  struct sockaddr_in srv_addr;
+  int reuse = 1;
+
+  srv->sock_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (srv->sock_fd < 0)
+  {
+    fprintf(stderr, "create data server socket failed, %s\n", strerror(errno));
+    return -1;
+  }
+  if (setsockopt(srv->sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                 sizeof(reuse)) < 0)
+    fprintf(stderr, "setsockopt(SO_REUSEADDR) failed");
+
+  memset(&srv_addr, 0, sizeof(srv_addr));
+  srv_addr.sin_family = AF_INET;
+  srv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  srv_addr.sin_port = htons(port);
+  if (bind(srv->sock_fd, (struct sockaddr *)&srv_addr, sizeof(srv_addr)) < 0 ||
+      listen(srv->sock_fd, 10) < 0)
+  {
+    fprintf(stderr, "bind data server failed, %s\n", strerror(errno));
+    data_server_close(srv);
+    return -1;
+  }
+  fprintf(stderr, "Data server listening on port %d\n", port);
+  return 0;
+}
+
+void data_server_close(struct data_server *srv)
+{
+  if (srv->sock_fd >= 0)
+    close(srv->sock_fd);
+  srv->sock_fd = -1;
+}
+
+static void ds_message_done(struct data_server *srv, struct session *s);
+
+/* hands all telemetry slots still waiting for an ack back to the reader */
+static void ds_release_unacked(struct data_server *srv, struct session *s)
+{
+  for (; s->unacked > 0; s->unacked--)
+    spsc_ring_release(&srv->tm->ring);
+}
+
+/*
+ * arms EPOLLOUT while waiting for room in the socket buffer and EPOLLIN
+ * unless the reply queue is full, the client is not read until its replies
+ * are out.
+ */
+static void ds_watch(struct session *s)
+{
+  struct epoll_event ev;
+
+  ev.events = (ds_room(s) ? EPOLLIN : 0) |
+              (s->want_out ? EPOLLOUT : 0);
+  ev.data.u32 = DS_EV_CLIENT;
+  if (s->fd < 0 || ev.events == s->events)
+    return;
+  epoll_ctl(s->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+  s->events = ev.events;
+}
+
+static void ds_drop(struct data_server *srv, struct session *s)
+{
+  fprintf(stderr, "Data client disconnected at frame %u\n", s->sequence);
+  close(s->fd); /* also removes it from the epoll set */
+  s->fd = -1;
+  s->want_out = 0;
+  s->nin = 0;
+  s->nout = 0;
+  s->nreplies = 0;
+  s->sending_replies = 0;
+  s->stale += s->pending;
+  s->pending = 0;
+  s->discard = s->chan != ds_first_chan(srv) || s->started;
+  ds_release_unacked(srv, s);
+  if (s->msg_end)
+    ds_message_done(srv, s);
+}
+
+static void ds_accept(struct data_server *srv, struct session *s, int epfd)
+{
+  struct epoll_event ev;
+  int one = 1;
+  int fd;
+
+  fd = accept4(srv->sock_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (s->fd >= 0)
+    ds_drop(srv, s);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  ev.events = EPOLLIN;
+  ev.data.u32 = DS_EV_CLIENT;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+  {
+    fprintf(stderr, "epoll add client failed, %s\n", strerror(errno));
+    close(fd);
+    return;
+  }
+  s->fd = fd;
+  s->events = ev.events;
+  if (s->discard && s->chan == ds_first_chan(srv) && !s->started)
+    s->discard = 0; /* nothing of the current frame is gone yet */
+  fprintf(stderr, "Data client connected, next frame %u\n",
+          s->discard ? s->sequence + 1 : s->sequence);
+}
+
+/* queues as many of the waiting replies as fit in s->out */
+static void ds_fill_replies(struct session *s)
+{
+  for (s->nout = 0; s->nout < s->nreplies && s->nout < SEND_IOV_MAX + 1;
+       s->nout++)
+  {
+    s->out[s->nout].iov_base = &s->replies[s->nout];
+    s->out[s->nout].iov_len = sizeof(s->replies[s->nout]);
+  }
+  s->sending_replies = s->nout;
+}
+
+static void ds_frame_start(struct session *s)
+{
+  s->frame_bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &s->frame_start);
+}
+
+/* queues the next block of the telemetry ring as a message of its own */
+static int ds_fill_record(struct data_server *srv, struct session *s)
+{
+  struct block_desc blk;
+
+  if (!spsc_ring_pop(&srv->tm->ring, &blk))
+    return 0;
+  if (!s->discard)
+  {
+    if (srv->results_only && !s->started)
+      ds_frame_start(s);
+    s->hdr.magic = PROTO_MAGIC;
+    s->hdr.type = blk.flags & BLOCK_RESULT ? PROTO_RESULT : PROTO_TELEMETRY;
+    s->hdr.version = PROTO_VERSION;
+    s->hdr.sequence = s->sequence;
+    s->hdr.length = blk.length;
+    s->out[s->nout].iov_base = &s->hdr;
+    s->out[s->nout].iov_len = sizeof(s->hdr);
+    s->nout++;
+  }
+  s->out[s->nout].iov_base = blk.data;
+  s->out[s->nout].iov_len = blk.length;
+  s->nout++;
+  s->started = 1;
+  s->frame_bytes += blk.length;
+  s->msg_end = blk.flags & BLOCK_FRAME_END;
+  return s->nout;
+}
+
+/*
+ * queues the next part of the current message in s->out: its header if not
+ * sent yet and as many blocks as its ring has ready. returns the number of
+ * iovecs queued, 0 if the ring is empty.
+ */
+static int ds_fill(struct data_server *srv, struct session *s)
+{
+  struct queue *q = ds_queue(srv, s->chan);
+  struct block_desc blk;
+
+  s->nout = 0;
+  if (s->chan == 2)
+    return ds_fill_record(srv, s);
+  while (s->nout < SEND_IOV_MAX + 1 && !s->msg_end &&
+         spsc_ring_pop(&q->ring, &blk))
+  {
+    /* the header goes out with the first block, the reader only changes
+     * frame_length before it publishes a frame */
+    if (!s->started && !s->discard)
+    {
+      s->hdr.magic = PROTO_MAGIC;
+      s->hdr.type = ds_type[s->chan];
+      s->hdr.version = PROTO_VERSION;
+      s->hdr.sequence = s->sequence;
+      s->hdr.length = __atomic_load_n(&srv->frame_length, __ATOMIC_ACQUIRE);
+      s->out[0].iov_base = &s->hdr;
+      s->out[0].iov_len = sizeof(s->hdr);
+      s->nout = 1;
+      if (s->chan == 0)
+        ds_frame_start(s);
+    }
+    s->out[s->nout].iov_base = blk.data;
+    s->out[s->nout].iov_len = blk.length;
+    s->started = 1;
+    s->frame_bytes += blk.length;
+    s->msg_end = blk.flags & BLOCK_FRAME_END;
+    s->nout++;
+  }
+  return s->nout;
+}
+
+/* returns 0 once s->out is sent, 1 if the socket is full, -1 on error */
+static int ds_flush(struct session *s)
+{
+  struct iovec *iov = s->out;
+  struct msghdr msg;
+  ssize_t sent;
+
+  memset(&msg, 0, sizeof(msg));
+  while (s->nout > 0)
+  {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = s->nout;
+    sent = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        memmove(s->out, iov, s->nout * sizeof(*iov));
+        return 1;
+      }
+      return -1;
+    }
+    while (s->nout > 0 && (size_t)sent >= iov->iov_len)
+    {
+      sent -= iov->iov_len;
+      iov++;
+      s->nout--;
+    }
+    if (s->nout > 0)
+    {
+      iov->iov_base = (uint8_t *)iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+  return 0;
+}
+
+/* the current message is out (or dropped), move on to the next one */
+static void ds_message_done(struct data_server *srv, struct session *s)
+{
+  struct timespec now;
+  double ms;
+
+  if (s->chan == 2 && !s->discard && !srv->autonomous)
+    s->unacked++; /* released by the client's ack */
+  else
+    spsc_ring_release(&ds_queue(srv, s->chan)->ring);
+  s->msg_end = 0;
+  s->started = 0;
+  if (++s->chan < DS_CHANNELS)
+    return;
+
+  if (!s->discard)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = elapsed_ms(&s->frame_start, &now);
+    srv->sent.frames++;
+    srv->sent.bytes += s->frame_bytes;
+    srv->sent.frame_ms += ms;
+    if (ms > srv->sent.frame_max_ms)
+      srv->sent.frame_max_ms = ms;
+    if (srv->verbose)
+      fprintf(stderr, "Sent frame %u, %zu bytes in %.3f ms.\n", s->sequence,
+              s->frame_bytes, ms);
+  }
+  s->chan = ds_first_chan(srv);
+  s->discard = 0;
+  s->sequence++;
+}
+
+/*
+ * moves blocks from the rings to the client until the ring of the current
+ * message runs empty or the socket is full. returns the ring the worker has
+ * to wait on, or NULL if it waits for the socket or a client.
+ */
+static struct spsc_ring *ds_pump(struct data_server *srv, struct session *s)
+{
+  struct timespec send_start, send_stop;
+  int rc;
+
+  while (s->fd >= 0 || s->discard || srv->autonomous)
+  {
+    if (s->fd < 0)
+      s->discard = 1; /* autonomous, nobody to send to */
+    if (s->nout == 0 && s->nreplies > 0 && !s->started && !s->discard)
+      ds_fill_replies(s);
+    else if (s->nout == 0 && ds_fill(srv, s) == 0)
+      return &ds_queue(srv, s->chan)->ring;
+    if (s->discard)
+      s->nout = 0;
+    else
+    {
+      clock_gettime(CLOCK_MONOTONIC, &send_start);
+      rc = ds_flush(s);
+      clock_gettime(CLOCK_MONOTONIC, &send_stop);
+      srv->sent.send_ms += elapsed_ms(&send_start, &send_stop);
+      if (rc < 0)
+      {
+        ds_drop(srv, s);
+        continue;
+      }
+      if (rc > 0)
+      {
+        s->want_out = 1;
+        ds_watch(s);
+        return NULL;
+      }
+    }
+    if (s->sending_replies)
+    {
+      s->nreplies -= s->sending_replies;
+      memmove(s->replies, s->replies + s->sending_replies,
+              s->nreplies * sizeof(s->replies[0]));
+      s->sending_replies = 0;
+      /* take up the commands held back while the queue was full */
+      if (ds_parse(srv, s) != 0)
+      {
+        ds_drop(srv, s);
+        continue;
+      }
+      ds_watch(s);
+    }
+    else if (s->msg_end)
+      ds_message_done(srv, s);
+  }
+  return NULL;
+}
+
+/* queues s->replies[s->nreplies], its body is filled in */
+static void ds_queue_reply(struct session *s)
+{
+  struct ds_reply *r = &s->replies[s->nreplies++];
+
+  r->hdr.magic = PROTO_MAGIC;
+  r->hdr.type = PROTO_REPLY;
+  r->hdr.version = PROTO_VERSION;
+  r->hdr.sequence = s->sequence;
+  r->hdr.length = sizeof(r->body);
+}
+
+static void ds_handle(struct data_server *srv, struct session *s,
+                      const struct proto_header *hdr, const uint8_t *payload)
+{
+  float value, gains[3];
+  struct proto_command cmd;
+  struct ds_reply *r;
+
+  if (hdr->version > PROTO_VERSION && hdr->type != PROTO_COMMAND)
+  {
+    fprintf(stderr, "Message version %u from data client, ignored\n",
+            hdr->version);
+    return;
+  }
+
+  switch (hdr->type)
+  {
+  case PROTO_ACK:
+    if (hdr->length < sizeof(value) || srv->autonomous)
+      break; /* autonomous frames were released when they were sent */
+    memcpy(&value, payload, sizeof(value));
+    if (s->unacked == 0)
+    {
+      fprintf(stderr, "Ack for frame %u without telemetry, ignored\n",
+              hdr->sequence);
+      break;
+    }
+    s->unacked--;
+    if (srv->ack)
+      srv->ack(value);
+    spsc_ring_release(&srv->tm->ring);
+    break;
+  case PROTO_SET_GAINS:
+    if (hdr->length < sizeof(gains) || !srv->gains)
+      break;
+    memcpy(gains, payload, sizeof(gains));
+    srv->gains(gains[0], gains[1], gains[2]);
+    break;
+  case PROTO_COMMAND:
+    if (hdr->length < sizeof(cmd))
+      break;
+    memcpy(&cmd, payload, sizeof(cmd));
+    r = &s->replies[s->nreplies];
+    if (hdr->version > PROTO_VERSION || !srv->command)
+    {
+      memset(&r->body, 0, sizeof(r->body));
+      r->body.request_id = cmd.request_id;
+      r->body.command = cmd.command;
+      r->body.status = hdr->version > PROTO_VERSION ? PROTO_ERR_VERSION
+                                                    : PROTO_ERR_UNKNOWN;
+    }
+    else if (srv->command(&cmd, &r->body))
+    {
+      s->pending++; /* ds_take_replies queues it */
+      break;
+    }
+    ds_queue_reply(s);
+    break;
+  case PROTO_END:
+    srv->end();
+    ds_release_unacked(srv, s);
+    break;
+  default:
+    fprintf(stderr, "Unknown message type %u from data client\n", hdr->type);
+    break;
+  }
+}
+
+/*
+ * handles the complete messages in s->in, stops early while the reply queue
+ * is full. -1 on a malformed message.
+ */
+static int ds_parse(struct data_server *srv, struct session *s)
+{
+  struct proto_header hdr;
+  size_t msg_len;
+
+  while (s->nin >= sizeof(hdr) && ds_room(s))
+  {
+    memcpy(&hdr, s->in, sizeof(hdr));
+    if (hdr.magic != PROTO_MAGIC || hdr.length > PROTO_MAX_CLIENT_PAYLOAD)
+    {
+      fprintf(stderr, "Bad message from data client\n");
+      return -1;
+    }
+    msg_len = sizeof(hdr) + hdr.length;
+    if (s->nin < msg_len)
+      break;
+    ds_handle(srv, s, &hdr, s->in + sizeof(hdr));
+    memmove(s->in, s->in + msg_len, s->nin - msg_len);
+    s->nin -= msg_len;
+  }
+  return 0;
+}
+
+/* reads and handles client messages, -1 if the connection is gone */
+static int ds_receive(struct data_server *srv, struct session *s)
+{
+  ssize_t n;
+
+  while (ds_room(s))
+  {
+    n = recv(s->fd, s->in + s->nin, sizeof(s->in) - s->nin, 0);
+    if (n == 0)
+      return -1;
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    s->nin += n;
+    if (ds_parse(srv, s) != 0)
+      return -1;
+  }
+  ds_watch(s);
+  return 0;
+}
+
+/*
+ * queues the replies of finished commands. they come in the order of the
+ * commands, so the first s->stale belong to a client that left.
+ */
+static void ds_take_replies(struct data_server *srv, struct session *s)
+{
+  struct proto_reply reply;
+  uint64_t count;
+
+  if (read(srv->reply_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    fprintf(stderr, "read reply eventfd failed, %s\n", strerror(errno));
+  while (srv->take_reply(&reply))
+  {
+    if (s->stale > 0)
+    {
+      s->stale--;
+      continue;
+    }
+    if (s->pending == 0)
+      continue;
+    s->pending--;
+    s->replies[s->nreplies].body = reply;
+    ds_queue_reply(s);
+  }
+  /* take up the commands held back while the queue was full */
+  if (s->fd < 0)
+    return;
+  if (ds_parse(srv, s) != 0)
+  {
+    ds_drop(srv, s);
+    return;
+  }
+  ds_watch(s);
+}
+
+static void ds_cleanup(void *data)
+{
+  struct session *s = (struct session *)data;
+
+  if (s->fd >= 0)
+    close(s->fd);
+  close(s->epfd);
+}
+
+/*
+ * serves one client at a time until cancelled. data is a struct data_server
+ * opened with data_server_open.
+ */
+void *data_server_worker(void *data)
+{
+  struct data_server *srv = (struct data_server *)data;
+  struct session s;
+  struct epoll_event ev, events[DS_MAX_EVENTS];
+  struct spsc_ring *wait_ring;
+  int epfd;
+  int n, i, chan;
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0)
+  {
+    fprintf(stderr, "epoll_create failed, %s\n", strerror(errno));
+    return NULL;
+  }
+  ev.events = EPOLLIN;
+  ev.data.u32 = DS_EV_LISTEN;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, srv->sock_fd, &ev);
+  for (chan = 0; chan < DS_CHANNELS; chan++)
+  {
+    ev.data.u32 = chan;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, ds_queue(srv, chan)->ring.data_fd, &ev);
+  }
+  if (srv->reply_fd >= 0 && srv->take_reply)
+  {
+    ev.data.u32 = DS_EV_REPLY;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, srv->reply_fd, &ev);
+  }
+
+  memset(&s, 0, sizeof(s));
+  s.epfd = epfd;
+  s.fd = -1;
+  s.chan = ds_first_chan(srv);
+  pthread_cleanup_push(ds_cleanup, &s);
+
+  do
+  {
+    /* sleep on the ring of the current message only if it is still empty
+     * once the reader knows we are waiting */
+    wait_ring = ds_pump(srv, &s);
+    if (wait_ring && spsc_ring_prepare_wait(wait_ring) != 0)
+      continue;
+
+    n = epoll_wait(epfd, events, DS_MAX_EVENTS, -1);
+    if (wait_ring)
+      spsc_ring_finish_wait(wait_ring);
+    if (n < 0 && errno != EINTR)
+    {
+      fprintf(stderr, "epoll_wait failed, %s\n", strerror(errno));
+      break;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+      switch (events[i].data.u32)
+      {
+      case DS_EV_LISTEN:
+        ds_accept(srv, &s, epfd);
+        break;
+      case DS_EV_CLIENT:
+        if (s.fd < 0)
+          break;
+        if ((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+            ((events[i].events & EPOLLIN) && ds_receive(srv, &s) != 0))
+        {
+          ds_drop(srv, &s);
+          break;
+        }
+        if ((events[i].events & EPOLLOUT) && s.want_out)
+        {
+          s.want_out = 0;
+          ds_watch(&s);
+        }
+        break;
+      case DS_EV_REPLY:
+        ds_take_replies(srv, &s);
+        break;
+      default:
+        /* a wakeup that raced with the end of an earlier wait */
+        spsc_ring_finish_wait(&ds_queue(srv, events[i].data.u32)->ring);
+        break;
+      }
+    }
+  } while (1);
+
+  pthread_cleanup_pop(1);
+  return NULL;
+}
@@ -0,0 +1,38 @@
+/*
+ * Multiplexed data server. One epoll loop on a single port carries channel a,
+ * channel b, the telemetry and the client's acks over one persistent
+ * connection (see protocol.h), instead of a connection per channel per frame.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __DATA_SERVER_H__
+#define __DATA_SERVER_H__
+
+#include <stdint.h>
+
+#include "queue.h"
+
+struct data_server
+{
+  int sock_fd; /* listening socket */
+  struct queue *a, *b, *tm; /* sent in this order for every frame */
+  uint32_t frame_length; /* bytes per channel and frame */
+  int results_only; /* a and b carry nothing, only the telemetry is sent */
+  int autonomous; /* frames do not wait for a client or its acks */
+  int verbose; /* a line per frame on stderr */
+  struct send_stats sent; /* whole frames, read after the worker stopped */
+  void (*ack)(float value); /* the client acked a frame with a set point,
+                              runs on the server thread, must not block */
+  void (*gains)(float kp, float ki, float kd); /* new lock gains */
+  /* fills in reply and returns 0, or 1 if the reply follows from take_reply */
+  int (*command)(const struct proto_command *cmd, struct proto_reply *reply);
+  int reply_fd; /* readable while take_reply has replies, -1 without */
+  int (*take_reply)(struct proto_reply *reply); /* 0 if none */
+  void (*end)(void); /* the client asked to stop */
+};
+
+int data_server_open(struct data_server *srv, int port);
+void data_server_close(struct data_server *srv);
+void *data_server_worker(void *data);
+
+#endif
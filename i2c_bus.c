@@ -0,0 +1,153 @@
+/*
+ * I2C transfers.
+ *
+ * The i2c-dev backend hands a whole transaction to the kernel with one
+ * I2C_RDWR ioctl: a register read is the register address written and the
+ * data read back after a repeated start, however many bytes there are.
+ * wiringPi took one ioctl per byte and could not keep a burst together.
+ *
+ * A transfer that fails with a bus error (no ack, arbitration lost, time
+ * out) is tried again up to bus->retries times. Retries and failures are
+ * counted per bus, the first failure of a transfer and every
+ * I2C_BUS_REPORT_EVERY'th are printed with their errno.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+
+#include "i2c_bus.h"
+
+#define I2C_BUS_REPORT_EVERY 100 /* print every n'th failed transfer */
+
+static int dev_open(struct i2c_bus *bus, const char *device)
+{
+  unsigned long funcs;
+
+  bus->fd = open(device, O_RDWR | O_CLOEXEC);
+  if (bus->fd < 0)
+  {
+    fprintf(stderr, "Cannot open the IIC device %s, %s\n", device,
+            strerror(errno));
+    return -1;
+  }
+  if (ioctl(bus->fd, I2C_FUNCS, &funcs) < 0 || !(funcs & I2C_FUNC_I2C))
+  {
+    fprintf(stderr, "%s does not support combined transfers\n", device);
+    close(bus->fd);
+    bus->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void dev_close(struct i2c_bus *bus)
+{
+  if (bus->fd >= 0)
+    close(bus->fd);
+  bus->fd = -1;
+}
+
+static int dev_transfer(struct i2c_bus *bus, struct i2c_msg *msgs, int n)
+{
+  struct i2c_rdwr_ioctl_data xfer = {.msgs = msgs, .nmsgs = n};
+
+  if (ioctl(bus->fd, I2C_RDWR, &xfer) != n)
+    return -errno;
+  return 0;
+}
+
+const struct i2c_bus_ops i2c_dev_ops = {
+    .name = "i2c-dev",
+    .open = dev_open,
+    .close = dev_close,
+    .transfer = dev_transfer,
+};
+
+int i2c_bus_open(struct i2c_bus *bus, const struct i2c_bus_ops *ops,
+                 const char *device)
+{
+  memset(bus, 0, sizeof(*bus));
+  bus->ops = ops;
+  bus->fd = -1;
+  bus->retries = I2C_BUS_RETRIES;
+  if (ops->open(bus, device) != 0)
+  {
+    bus->ops = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void i2c_bus_close(struct i2c_bus *bus)
+{
+  if (bus->ops == NULL)
+    return;
+  bus->ops->close(bus);
+  bus->ops = NULL;
+}
+
+/* errors a second attempt may get past, anything else is given up at once */
+static int transient(int err)
+{
+  return err == EREMOTEIO || err == EIO || err == ENXIO || err == EAGAIN ||
+         err == ETIMEDOUT;
+}
+
+/* returns 0, or -errno of the last attempt */
+int i2c_bus_transfer(struct i2c_bus *bus, struct i2c_msg *msgs, int n)
+{
+  unsigned int attempt;
+  int rc;
+
+  bus->transfers++;
+  for (attempt = 0;; attempt++)
+  {
+    rc = bus->ops->transfer(bus, msgs, n);
+    if (rc == 0)
+      return 0;
+    bus->last_error = -rc;
+    if (attempt == bus->retries || !transient(-rc))
+      break;
+    bus->retried++;
+  }
+  if (bus->failed++ % I2C_BUS_REPORT_EVERY == 0)
+    fprintf(stderr, "i2c transfer to 0x%02x failed after %u attempts, %s\n",
+            msgs[0].addr, attempt + 1, strerror(-rc));
+  return rc;
+}
+
+/* length registers from reg on, one transaction */
+int i2c_read_regs(struct i2c_bus *bus, uint16_t address, uint8_t reg,
+                  uint8_t *buf, uint16_t length)
+{
+  struct i2c_msg msgs[2] = {
+      {.addr = address, .flags = 0, .len = 1, .buf = &reg},
+      {.addr = address, .flags = I2C_M_RD, .len = length, .buf = buf},
+  };
+
+  return i2c_bus_transfer(bus, msgs, 2);
+}
+
+int i2c_write_reg(struct i2c_bus *bus, uint16_t address, uint8_t reg,
+                  uint8_t value)
+{
+  uint8_t buf[2] = {reg, value};
+  struct i2c_msg msg = {.addr = address, .flags = 0, .len = 2, .buf = buf};
+
+  return i2c_bus_transfer(bus, &msg, 1);
+}
+
+void i2c_bus_report(const struct i2c_bus *bus)
+{
+  fprintf(stderr, "i2c %s: %lu transfers, %lu retried, %lu failed%s%s\n",
+          bus->ops ? bus->ops->name : "closed", bus->transfers, bus->retried,
+          bus->failed, bus->last_error ? ", last error " : "",
+          bus->last_error ? strerror(bus->last_error) : "");
+}
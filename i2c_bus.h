@@ -0,0 +1,57 @@
+/*
+ * I2C transfers behind a backend interface: the kernel's i2c-dev driver
+ * (I2C_RDWR combined transactions) or a register model of the BME280 for
+ * running without the sensor (i2c_sim.c).
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __I2C_BUS_H__
+#define __I2C_BUS_H__
+
+#include <stdint.h>
+#include <linux/i2c.h>
+
+#define I2C_BUS_RETRIES 3 /* extra attempts of a failed transfer */
+
+struct i2c_bus;
+
+/*
+ * an i2c backend. transfer runs the messages as one transaction, repeated
+ * start in between and one stop at the end, and returns 0 or -errno.
+ */
+struct i2c_bus_ops
+{
+  const char *name;
+  int (*open)(struct i2c_bus *bus, const char *device);
+  void (*close)(struct i2c_bus *bus);
+  int (*transfer)(struct i2c_bus *bus, struct i2c_msg *msgs, int n);
+};
+
+struct i2c_bus
+{
+  const struct i2c_bus_ops *ops;
+  int fd; /* i2c-dev */
+  void *state; /* model */
+  unsigned int retries;
+  /* statistics */
+  unsigned long transfers, retried, failed;
+  int last_error; /* errno of the last failed attempt */
+};
+
+extern const struct i2c_bus_ops i2c_dev_ops;
+extern const struct i2c_bus_ops i2c_sim_ops;
+
+int i2c_bus_open(struct i2c_bus *bus, const struct i2c_bus_ops *ops,
+                 const char *device);
+void i2c_bus_close(struct i2c_bus *bus);
+int i2c_bus_transfer(struct i2c_bus *bus, struct i2c_msg *msgs, int n);
+int i2c_read_regs(struct i2c_bus *bus, uint16_t address, uint8_t reg,
+                  uint8_t *buf, uint16_t length);
+int i2c_write_reg(struct i2c_bus *bus, uint16_t address, uint8_t reg,
+                  uint8_t value);
+void i2c_bus_report(const struct i2c_bus *bus);
+
+/* i2c_sim.c, failed transfers per 1000 */
+void i2c_sim_configure(unsigned int error_permille);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Register model of a BME280 on an i2c bus, used with the fpga model (-S).
+ *
+ * Messages are played against 256 registers the way the sensor does: a
+ * write is register address and data pairs, the last address written is
+ * the pointer reads continue from. The calibration is the
+ * datasheet's example sensor (humidity from a typical part). Writing forced
+ * mode to 0xF4 runs a conversion at once and goes back to sleep, in normal
+ * mode every data read sees a new one. The raw values drift slowly around
+ * 25 C, 1006 hPa and 55 % with a little noise.
+ *
+ * Other addresses do not acknowledge. error_permille of the transfers fail
+ * with EREMOTEIO as an unacknowledged byte would.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bme280.h"
+#include "i2c_bus.h"
+
+struct i2c_sim
+{
+  uint8_t regs[256];
+  uint8_t pointer;
+  uint32_t conversions;
+  uint32_t seed;
+};
+
+static unsigned int sim_error_permille;
+
+static const uint8_t sim_calibration[26] = {
+    0x70, 0x6b, 0x43, 0x67, 0x18, 0xfc, /* T1 27504, T2 26435, T3 -1000 */
+    0x7d, 0x8e, 0x43, 0xd6, 0xd0, 0x0b, /* P1 36477, P2 -10685, P3 3024 */
+    0x27, 0x0b, 0x8c, 0x00, 0xf9, 0xff, /* P4 2855, P5 140, P6 -7 */
+    0x8c, 0x3c, 0xf8, 0xc6, 0x70, 0x17, /* P7 15500, P8 -14600, P9 6000 */
+    0x00, 0x4b, /* H1 75 */
+};
+static const uint8_t sim_calibration_h[7] = {
+    0x6a, 0x01, 0x00, 0x13, 0x29, 0x03, 0x1e, /* H2 362, H3 0, H4 313, H5 50, H6 30 */
+};
+
+void i2c_sim_configure(unsigned int error_permille)
+{
+  sim_error_permille = error_permille;
+}
+
+static uint32_t sim_rand(struct i2c_sim *s, uint32_t range)
+{
+  s->seed = s->seed * 1664525 + 1013904223;
+  return (uint32_t)(((uint64_t)(s->seed >> 8) * range) >> 24);
+}
+
+/* latches a new conversion into 0xF7 - 0xFE */
+static void sim_convert(struct i2c_sim *s)
+{
+  uint32_t drift = (s->conversions++ / 16) % 64;
+  uint32_t t = 519888 + drift + sim_rand(s, 8);
+  uint32_t p = 415148 - drift + sim_rand(s, 16);
+  uint32_t h = 30000 + drift + sim_rand(s, 8);
+
+  s->regs[0xf7] = p >> 12;
+  s->regs[0xf8] = p >> 4;
+  s->regs[0xf9] = (p & 0xf) << 4;
+  s->regs[0xfa] = t >> 12;
+  s->regs[0xfb] = t >> 4;
+  s->regs[0xfc] = (t & 0xf) << 4;
+  s->regs[0xfd] = h >> 8;
+  s->regs[0xfe] = h;
+}
+
+static void sim_write(struct i2c_sim *s, uint8_t reg, uint8_t value)
+{
+  if (reg == BME280_REGISTER_SOFTRESET && value == BME280_RESET)
+  {
+    s->regs[BME280_REGISTER_CONTROLHUMID] = 0;
+    s->regs[BME280_REGISTER_CONTROL] = 0;
+    s->regs[BME280_REGISTER_CONFIG] = 0;
+    return;
+  }
+  if (reg != BME280_REGISTER_CONTROLHUMID && reg != BME280_REGISTER_CONTROL &&
+      reg != BME280_REGISTER_CONFIG)
+    return; /* read only */
+  s->regs[reg] = value;
+  if (reg == BME280_REGISTER_CONTROL &&
+      (value & 3) != BME280_MODE_SLEEP && (value & 3) != BME280_MODE_NORMAL)
+  {
+    sim_convert(s);
+    s->regs[reg] &= ~3; /* back to sleep */
+  }
+}
+
+static int sim_open(struct i2c_bus *bus, const char *device)
+{
+  struct i2c_sim *s = calloc(1, sizeof(*s));
+
+  (void)device;
+  if (s == NULL)
+    return -1;
+  memcpy(&s->regs[BME280_REGISTER_DIG_T1], sim_calibration,
+         sizeof(sim_calibration));
+  memcpy(&s->regs[BME280_REGISTER_DIG_H2], sim_calibration_h,
+         sizeof(sim_calibration_h));
+  s->regs[BME280_REGISTER_CHIPID] = 0x60;
+  s->seed = 2017;
+  sim_convert(s);
+  bus->state = s;
+  return 0;
+}
+
+static void sim_close(struct i2c_bus *bus)
+{
+  free(bus->state);
+  bus->state = NULL;
+}
+
+static int sim_transfer(struct i2c_bus *bus, struct i2c_msg *msgs, int n)
+{
+  struct i2c_sim *s = bus->state;
+  int i, k;
+
+  for (i = 0; i < n; i++)
+    if (msgs[i].addr != BME280_ADDRESS)
+      return -ENXIO;
+  if (sim_error_permille && sim_rand(s, 1000) < sim_error_permille)
+    return -EREMOTEIO;
+
+  for (i = 0; i < n; i++)
+  {
+    if (msgs[i].flags & I2C_M_RD)
+    {
+      if (msgs[i].len && s->pointer == BME280_REGISTER_PRESSUREDATA &&
+          (s->regs[BME280_REGISTER_CONTROL] & 3) == BME280_MODE_NORMAL)
+        sim_convert(s);
+      for (k = 0; k < msgs[i].len; k++)
+        msgs[i].buf[k] = s->regs[s->pointer++];
+    }
+    else if (msgs[i].len)
+    {
+      /* register address, then data and register address in turn */
+      s->pointer = msgs[i].buf[0];
+      for (k = 1; k < msgs[i].len; k++)
+        if (k & 1)
+          sim_write(s, s->pointer, msgs[i].buf[k]);
+        else
+          s->pointer = msgs[i].buf[k];
+    }
+  }
+  return 0;
+}
+
+const struct i2c_bus_ops i2c_sim_ops = {
+    .name = "bme280 model",
+    .open = sim_open,
+    .close = sim_close,
+    .transfer = sim_transfer,
+};
@@ -0,0 +1,180 @@
+/*
+ * On-board lock.
+ *
+ * The error signal is the position of the etalon fringe nearest to Rb dip
+ * LOCK_DIP, relative to that dip and in units of the fringe spacing, so it
+ * does not depend on the scan speed. PID_Controller turns it into a TEC
+ * target temperature or current around the operating point given with -l.
+ *
+ * ADC_read_worker hands each frame's peak_result over with lock_submit and
+ * carries on, the lock thread applies the output. Talking to the TEC takes
+ * several ms on the serial line, so a newer result simply replaces one the
+ * lock thread has not picked up yet.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <math.h>
+#include <time.h>
+
+#include "configuration.h"
+#include "lock.h"
+#include "pid.h"
+
+#define LOCK_REPORT_EVERY 100 /* print the lock state every n updates */
+
+static pthread_t lock_thread;
+static int lock_running;
+static pthread_mutex_t lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lock_cond = PTHREAD_COND_INITIALIZER;
+
+/* shared with the reader and the data server, under lock_mutex */
+static struct peak_result mailbox;
+static int mailbox_full;
+static float gains[3] = {Kp, Ki, Kd};
+static int gains_changed;
+
+/* lock thread only */
+static struct pid_state pid;
+static void (*lock_apply)(float value);
+
+/*
+ * error signal of res, in fractions of the fringe spacing. returns non-zero
+ * if the frame does not show the reference dip or at least two fringes.
+ */
+static int lock_error(const struct peak_result *res, float *error)
+{
+  unsigned int n_fringes = res->n_fringes;
+  unsigned int i, nearest = 0;
+  float dip, spacing;
+
+  if (n_fringes > PEAK_MAX_FRINGES)
+    n_fringes = PEAK_MAX_FRINGES;
+  if (res->n_dips <= LOCK_DIP || LOCK_DIP >= PEAK_MAX_DIPS || n_fringes < 2)
+    return -1;
+
+  dip = res->dip_centre[LOCK_DIP];
+  for (i = 1; i < n_fringes; i++)
+    if (fabsf(res->fringe_centre[i] - dip) <
+        fabsf(res->fringe_centre[nearest] - dip))
+      nearest = i;
+  spacing = (res->fringe_centre[n_fringes - 1] - res->fringe_centre[0]) /
+            (n_fringes - 1);
+  if (spacing <= 0)
+    return -1;
+  *error = (res->fringe_centre[nearest] - dip) / spacing;
+  return 0;
+}
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *lock_worker(void *data)
+{
+  struct peak_result res;
+  unsigned long updates = 0, misses = 0;
+  double now, last = 0;
+  float error, out;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&lock_mutex);
+    while (!mailbox_full && lock_running)
+      pthread_cond_wait(&lock_cond, &lock_mutex);
+    if (!lock_running)
+    {
+      pthread_mutex_unlock(&lock_mutex);
+      break;
+    }
+    res = mailbox;
+    mailbox_full = 0;
+    if (gains_changed)
+    {
+      pid_set_gains(&pid, gains[0], gains[1], gains[2]);
+      fprintf(stderr, "Lock gains: Kp %g Ki %g Kd %g\n", gains[0], gains[1],
+              gains[2]);
+      gains_changed = 0;
+    }
+    pthread_mutex_unlock(&lock_mutex);
+
+    if (lock_error(&res, &error) != 0)
+    {
+      if (misses++ % LOCK_REPORT_EVERY == 0)
+        fprintf(stderr, "Lock: no reference in frame (%u dips, %u fringes)\n",
+                res.n_dips, res.n_fringes);
+      continue;
+    }
+
+    now = now_s();
+    out = PID_Controller(&pid, LOCK_OFFSET, error, last > 0 ? now - last : 0);
+    last = now;
+    lock_apply(out);
+
+    if (updates++ % LOCK_REPORT_EVERY == 0)
+      fprintf(stderr, "Lock: error %.4f fsr, output %.4f\n", error, out);
+  }
+  return NULL;
+}
+
+int lock_start(float offset, float out_min, float out_max,
+               void (*apply)(float value))
+{
+  int rc;
+
+  pthread_mutex_lock(&lock_mutex);
+  pid_init(&pid, gains[0], gains[1], gains[2], offset, out_min, out_max);
+  gains_changed = 0;
+  lock_apply = apply;
+  lock_running = 1;
+  pthread_mutex_unlock(&lock_mutex);
+
+  rc = pthread_create(&lock_thread, NULL, lock_worker, NULL);
+  if (rc != 0)
+  {
+    fprintf(stderr, "start lock failed, %s\n", strerror(rc));
+    lock_running = 0;
+    return -1;
+  }
+  fprintf(stderr, "Lock on dip %d at %g fsr, output %g in [%g, %g]\n",
+          LOCK_DIP, LOCK_OFFSET, offset, out_min, out_max);
+  return 0;
+}
+
+void lock_stop(void)
+{
+  pthread_mutex_lock(&lock_mutex);
+  if (!lock_running)
+  {
+    pthread_mutex_unlock(&lock_mutex);
+    return;
+  }
+  lock_running = 0;
+  pthread_cond_signal(&lock_cond);
+  pthread_mutex_unlock(&lock_mutex);
+  pthread_join(lock_thread, NULL);
+}
+
+/* hands the newest frame's result to the lock thread, never blocks for long */
+void lock_submit(const struct peak_result *res)
+{
+  pthread_mutex_lock(&lock_mutex);
+  mailbox = *res;
+  mailbox_full = 1;
+  pthread_cond_signal(&lock_cond);
+  pthread_mutex_unlock(&lock_mutex);
+}
+
+/* takes effect with the next update, callable from any thread */
+void lock_set_gains(float kp, float ki, float kd)
+{
+  pthread_mutex_lock(&lock_mutex);
+  gains[0] = kp;
+  gains[1] = ki;
+  gains[2] = kd;
+  gains_changed = 1;
+  pthread_mutex_unlock(&lock_mutex);
+}
@@ -0,0 +1,19 @@
+/*
+ * On-board lock of the etalon to the Rb reference (-l). The peak finder
+ * results of every frame give the error signal, a PID drives the TEC
+ * without a round trip to the monitor client.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __LOCK_H__
+#define __LOCK_H__
+
+#include "protocol.h"
+
+int lock_start(float offset, float out_min, float out_max,
+               void (*apply)(float value));
+void lock_stop(void);
+void lock_submit(const struct peak_result *res);
+void lock_set_gains(float kp, float ki, float kd);
+
+#endif
@@ -0,0 +1,561 @@
+/*
+ * Emulated Meerstetter TEC controllers behind a pseudo terminal (-M).
+ *
+ * A thread holds the master side of a pty and plays the controllers on the
+ * RS485 line: it takes '#' frames apart, checks their CRC and address and
+ * answers with '!' frames, an ACK echoing the request CRC for VS and RS, or
+ * a '+' error code. Frames with a bad CRC or for an unknown address get no
+ * answer, as on the real line.
+ *
+ * The controllers work through their requests one after the other. An
+ * answer leaves latency_us (plus up to jitter_us) after the request has
+ * arrived and the controller is free, and takes the byte time of the rate
+ * in parameter 2050 on the wire. error_permille of the requests are
+ * dropped, answered with a broken CRC or refused with +02 (busy), a third
+ * each.
+ *
+ * Each controller models the parameters temp_moniter.c uses: object
+ * temperature, output current and voltage, input selection, target
+ * temperature, live current and voltage and the RS485 rate. The object
+ * follows the output current with a first order lag, in temperature
+ * controller mode the current is regulated towards the target.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "configuration.h"
+#include "mecom_sim.h"
+#include "MeComAPI/private/MeCRC16.h"
+#include "MeComAPI/private/MeVarConv.h"
+
+#define SIM_CHANNELS 2 /* instances per controller */
+#define SIM_PENDING 32 /* answers queued, more requests are lost */
+#define SIM_FRAME_MAX 128 /* longest frame taken or sent */
+#define SIM_RX_BUF 1024
+
+#define SIM_AMBIENT 22.0 /* degC */
+#define SIM_TAU 5.0 /* s, object time constant */
+#define SIM_K_PER_A 5.0 /* K of heating per A of output current */
+#define SIM_OHM 1.2 /* load resistance */
+#define SIM_I_MAX 3.0 /* A */
+#define SIM_GAIN 2.0 /* A/K of the temperature controller */
+#define SIM_STEP 0.01 /* s, integration step */
+
+/* MeCom error codes */
+#define SIM_ERR_CMD 1 /* command not available */
+#define SIM_ERR_BUSY 2
+#define SIM_ERR_FORMAT 4
+#define SIM_ERR_PAR 5 /* parameter not available */
+#define SIM_ERR_RO 6 /* parameter not writable */
+#define SIM_ERR_RANGE 7
+#define SIM_ERR_INST 8
+
+enum sim_par_type
+{
+  SIM_FLOAT = 0,
+  SIM_INT = 1
+};
+
+struct sim_par
+{
+  uint16_t id;
+  enum sim_par_type type;
+  int writable;
+  double min, max;
+};
+
+static const struct sim_par sim_pars[] = {
+    {1000, SIM_FLOAT, 0, -100, 200}, /* object temperature */
+    {1020, SIM_FLOAT, 0, -SIM_I_MAX, SIM_I_MAX}, /* actual output current */
+    {1021, SIM_FLOAT, 0, -SIM_I_MAX * SIM_OHM, SIM_I_MAX * SIM_OHM},
+    {2000, SIM_INT, 1, 0, 2}, /* output stage input selection */
+    {2050, SIM_INT, 1, 9600, 1000000}, /* RS485 rate */
+    {3000, SIM_FLOAT, 1, -20, 80}, /* target object temperature */
+    {50001, SIM_FLOAT, 1, -SIM_I_MAX, SIM_I_MAX}, /* live set current */
+    {50002, SIM_FLOAT, 1, 0, 10}, /* live set voltage */
+};
+
+struct sim_channel
+{
+  int input_selection; /* 0 static, 1 live current/voltage, 2 temperature */
+  double target;
+  double live_current;
+  double live_voltage;
+  double temp;
+  double current;
+  double updated; /* s, model time of temp */
+};
+
+struct sim_device
+{
+  int address;
+  int baud;
+  struct sim_channel ch[SIM_CHANNELS];
+};
+
+struct sim_answer
+{
+  double due; /* s */
+  int len;
+  char buf[SIM_FRAME_MAX];
+};
+
+static struct mecom_sim_config sim_cfg;
+static struct sim_device sim_devices[TEC_MAX_DEVICES];
+static struct sim_answer sim_queue[SIM_PENDING];
+static unsigned int sim_head, sim_tail;
+static double sim_busy_until; /* s, when the last queued answer is out */
+static uint32_t sim_seed = 4711;
+
+static int sim_master = -1, sim_slave = -1, sim_stop_fd = -1;
+static pthread_t sim_thread;
+static int sim_started;
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* 0..range-1 */
+static uint32_t sim_rand(uint32_t range)
+{
+  sim_seed = sim_seed * 1664525 + 1013904223;
+  return range ? (uint32_t)(((uint64_t)(sim_seed >> 8) * range) >> 24) : 0;
+}
+
+static const struct sim_par *find_par(uint16_t id)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(sim_pars) / sizeof(sim_pars[0]); i++)
+    if (sim_pars[i].id == id)
+      return &sim_pars[i];
+  return NULL;
+}
+
+static struct sim_device *find_device(int address)
+{
+  int i;
+
+  for (i = 0; i < sim_cfg.count; i++)
+    if (sim_devices[i].address == address)
+      return &sim_devices[i];
+  return NULL;
+}
+
+static double clamp(double v, double lo, double hi)
+{
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+static double output_current(const struct sim_channel *c)
+{
+  double i;
+
+  switch (c->input_selection)
+  {
+  case 1:
+    /* the voltage limit caps the current */
+    i = clamp(c->live_current, -c->live_voltage / SIM_OHM,
+              c->live_voltage / SIM_OHM);
+    break;
+  case 2:
+    /* steady state current of the target plus a proportional term */
+    i = (c->target - SIM_AMBIENT) / SIM_K_PER_A +
+        SIM_GAIN * (c->target - c->temp);
+    break;
+  default:
+    i = 0;
+  }
+  return clamp(i, -SIM_I_MAX, SIM_I_MAX);
+}
+
+/* advances the object temperature to now */
+static void sim_update(struct sim_channel *c, double now)
+{
+  double dt = now - c->updated;
+  int steps = (int)(dt / SIM_STEP);
+
+  if (steps > 100 * SIM_TAU / SIM_STEP)
+    steps = 100 * SIM_TAU / SIM_STEP;
+  for (; steps > 0; steps--)
+  {
+    c->current = output_current(c);
+    c->temp += (SIM_AMBIENT + SIM_K_PER_A * c->current - c->temp) * SIM_STEP /
+               SIM_TAU;
+    c->updated += SIM_STEP;
+  }
+  if (now - c->updated > SIM_STEP)
+    c->updated = now;
+  c->current = output_current(c);
+}
+
+static double par_get(struct sim_device *d, struct sim_channel *c,
+                      uint16_t id)
+{
+  switch (id)
+  {
+  case 1000:
+    return c->temp;
+  case 1020:
+    return c->current;
+  case 1021:
+    return c->current * SIM_OHM;
+  case 2000:
+    return c->input_selection;
+  case 2050:
+    return d->baud;
+  case 3000:
+    return c->target;
+  case 50001:
+    return c->live_current;
+  default:
+    return c->live_voltage;
+  }
+}
+
+static void par_set(struct sim_device *d, struct sim_channel *c, uint16_t id,
+                    double v)
+{
+  switch (id)
+  {
+  case 2000:
+    c->input_selection = (int)v;
+    break;
+  case 2050:
+    d->baud = (int)v;
+    break;
+  case 3000:
+    c->target = v;
+    break;
+  case 50001:
+    c->live_current = v;
+    break;
+  case 50002:
+    c->live_voltage = v;
+    break;
+  }
+}
+
+static void put_value(int8_t *arr, const struct sim_par *par, double v)
+{
+  if (par->type == SIM_FLOAT)
+    MeVarConv_AddFloatHex(arr, (float)v);
+  else
+    MeVarConv_AddSlHex(arr, (int32_t)v);
+}
+
+/*
+ * carries out one request, fills in the answer payload. Returns its length,
+ * -1 for an ACK, or writes "+XX" for an error.
+ */
+static int sim_execute(struct sim_device *d, int8_t *req, int len,
+                       int8_t *ans, double now)
+{
+  const struct sim_par *par;
+  struct sim_channel *c;
+  uint16_t id;
+  int32_t l;
+  float f;
+  double v;
+  int inst, err;
+
+  if (len == 3 && memcmp(req, "?IF", 3) == 0)
+  {
+    memcpy(ans, "TEC-1091 emulator   ", 20);
+    return 20;
+  }
+  if (len == 2 && memcmp(req, "RS", 2) == 0)
+    return -1;
+  if (!((len == 9 && (memcmp(req, "?VR", 3) == 0 || memcmp(req, "?VL", 3) == 0)) ||
+        (len == 16 && memcmp(req, "VS", 2) == 0)))
+  {
+    err = req[0] == '?' || req[0] == 'V' ? SIM_ERR_FORMAT : SIM_ERR_CMD;
+    goto error;
+  }
+
+  req += req[0] == '?' ? 3 : 2;
+  id = MeVarConv_HexToUs(req);
+  inst = MeVarConv_HexToUc(req + 4);
+  if ((par = find_par(id)) == NULL)
+  {
+    err = SIM_ERR_PAR;
+    goto error;
+  }
+  if (inst < 1 || inst > SIM_CHANNELS)
+  {
+    err = SIM_ERR_INST;
+    goto error;
+  }
+  c = &d->ch[inst - 1];
+  sim_update(c, now);
+
+  if (len == 16)
+  {
+    if (!par->writable)
+    {
+      err = SIM_ERR_RO;
+      goto error;
+    }
+    if (!MeVarConv_HexToSlChecked(req + 6, &l))
+    {
+      err = SIM_ERR_FORMAT;
+      goto error;
+    }
+    memcpy(&f, &l, sizeof(f));
+    v = par->type == SIM_FLOAT ? f : l;
+    if (!(v >= par->min && v <= par->max))
+    {
+      err = SIM_ERR_RANGE;
+      goto error;
+    }
+    par_set(d, c, id, v);
+    return -1;
+  }
+  if (req[-1] == 'L')
+  {
+    MeVarConv_AddUcHex(ans, par->type);
+    put_value(ans + 2, par, par->min);
+    put_value(ans + 10, par, par->max);
+    return 18;
+  }
+  put_value(ans, par, par_get(d, c, id));
+  return 8;
+
+error:
+  ans[0] = '+';
+  MeVarConv_AddUcHex(ans + 1, err);
+  return 3;
+}
+
+/* frames the answer to the request in frame and queues it */
+static void sim_request(int8_t *frame, int len, double now)
+{
+  struct sim_device *d;
+  struct sim_answer *a;
+  int8_t *p;
+  uint16_t crc, seq;
+  double wire;
+  int n;
+  uint32_t fault = 0;
+
+  if (!MeVarConv_HexToUsChecked(&frame[len - 4], &crc) ||
+      crc != MeCRC16_Block(0, frame, len - 4) ||
+      !MeVarConv_HexToUsChecked(&frame[3], &seq) ||
+      (d = find_device(MeVarConv_HexToUc(&frame[1]))) == NULL)
+    return;
+  if (sim_head - sim_tail == SIM_PENDING)
+    return; /* overrun, the request is lost */
+
+  if (sim_rand(1000) < sim_cfg.error_permille)
+  {
+    fault = 1 + sim_rand(3);
+    if (fault == 1)
+      return; /* dropped */
+  }
+
+  a = &sim_queue[sim_head % SIM_PENDING];
+  p = (int8_t *)a->buf;
+  p[0] = '!';
+  memcpy(p + 1, frame + 1, 6); /* address and sequence number */
+  if (fault == 3)
+  {
+    p[7] = '+';
+    MeVarConv_AddUcHex(p + 8, SIM_ERR_BUSY);
+    n = 3;
+  }
+  else
+    n = sim_execute(d, frame + 7, len - 11, p + 7, now);
+  if (n < 0)
+    memcpy(p + 7, frame + len - 4, 4); /* ACK, echoes the request CRC */
+  else
+    MeVarConv_AddUsHex(p + 7 + n, MeCRC16_Block(0, p, 7 + n));
+  n = n < 0 ? 11 : 11 + n;
+  if (fault == 2)
+    p[n - 1] ^= 1; /* broken CRC */
+  p[n] = 0x0D;
+  a->len = n + 1;
+
+  /* the request has to come in, then the controller works on it */
+  wire = 10.0 / d->baud;
+  if (sim_busy_until < now + (len + 1) * wire)
+    sim_busy_until = now + (len + 1) * wire;
+  sim_busy_until += (sim_cfg.latency_us + sim_rand(sim_cfg.jitter_us + 1)) * 1e-6 +
+                    a->len * wire;
+  a->due = sim_busy_until;
+  sim_head++;
+}
+
+/* takes every complete '#' frame off the buffer, keeps an unfinished one */
+static size_t sim_frames(char *buf, size_t fill, double now)
+{
+  char *pos = buf, *end = buf + fill;
+  char *start, *stop;
+
+  while ((start = memchr(pos, '#', end - pos)) != NULL)
+  {
+    stop = memchr(start, 0x0D, end - start);
+    if (stop == NULL)
+      break;
+    start = memrchr(start, '#', stop - start);
+    if (stop - start >= 11 && stop - start < SIM_FRAME_MAX - 20)
+      sim_request((int8_t *)start, stop - start, now);
+    pos = stop + 1;
+  }
+  if (start == NULL)
+    return 0;
+  memmove(buf, start, end - start);
+  return end - start;
+}
+
+static void *sim_worker(void *arg)
+{
+  static char buf[SIM_RX_BUF];
+  struct pollfd fds[2] = {{sim_master, POLLIN, 0}, {sim_stop_fd, POLLIN, 0}};
+  struct timespec timeout;
+  struct sim_answer *a;
+  size_t fill = 0;
+  ssize_t n;
+  double now, wait;
+
+  (void)arg;
+  while (1)
+  {
+    /* sleep until the next answer is due or a request comes in */
+    wait = -1;
+    if (sim_head != sim_tail)
+    {
+      wait = sim_queue[sim_tail % SIM_PENDING].due - now_s();
+      if (wait < 0)
+        wait = 0;
+      timeout.tv_sec = (time_t)wait;
+      timeout.tv_nsec = (long)((wait - timeout.tv_sec) * 1e9);
+    }
+    if (ppoll(fds, 2, wait < 0 ? NULL : &timeout, NULL) < 0 && errno != EINTR)
+    {
+      fprintf(stderr, "MeCom emulator poll failed, %s\n", strerror(errno));
+      break;
+    }
+    if (fds[1].revents)
+      break;
+
+    now = now_s();
+    while (sim_head != sim_tail &&
+           (a = &sim_queue[sim_tail % SIM_PENDING])->due <= now)
+    {
+      if (write(sim_master, a->buf, a->len) != a->len)
+        fprintf(stderr, "MeCom emulator write failed, %s\n", strerror(errno));
+      sim_tail++;
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      if (fill == sizeof(buf))
+        fill = 0;
+      n = read(sim_master, buf + fill, sizeof(buf) - fill);
+      if (n > 0)
+        fill = sim_frames(buf, fill + n, now);
+      else if (n < 0 && errno != EINTR && errno != EAGAIN)
+      {
+        fprintf(stderr, "MeCom emulator read failed, %s\n", strerror(errno));
+        break;
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+ * opens the pty and starts the controllers, the slave path for
+ * ComPort_OpenDevice is returned in port.
+ */
+int mecom_sim_start(const struct mecom_sim_config *cfg, char *port,
+                    size_t port_len)
+{
+  double now = now_s();
+  int i, j, rc;
+
+  if (cfg->count < 1 || cfg->count > TEC_MAX_DEVICES)
+    return -1;
+  sim_cfg = *cfg;
+  for (i = 0; i < cfg->count; i++)
+  {
+    sim_devices[i].address = cfg->devices[i].address;
+    sim_devices[i].baud = MECOM_DEFAULT_BAUD;
+    for (j = 0; j < SIM_CHANNELS; j++)
+    {
+      memset(&sim_devices[i].ch[j], 0, sizeof(struct sim_channel));
+      sim_devices[i].ch[j].input_selection = 2;
+      sim_devices[i].ch[j].target = 25;
+      sim_devices[i].ch[j].temp = SIM_AMBIENT;
+      sim_devices[i].ch[j].updated = now;
+    }
+  }
+  sim_head = sim_tail = 0;
+  sim_busy_until = 0;
+
+  sim_master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (sim_master < 0 || grantpt(sim_master) != 0 ||
+      unlockpt(sim_master) != 0 || ptsname_r(sim_master, port, port_len) != 0)
+  {
+    fprintf(stderr, "MeCom emulator pty failed, %s\n", strerror(errno));
+    mecom_sim_stop();
+    return -1;
+  }
+  /* a master without an open slave reads as hung up, keep one open */
+  sim_slave = open(port, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  sim_stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (sim_slave < 0 || sim_stop_fd < 0)
+  {
+    fprintf(stderr, "MeCom emulator setup failed, %s\n", strerror(errno));
+    mecom_sim_stop();
+    return -1;
+  }
+  rc = pthread_create(&sim_thread, NULL, sim_worker, NULL);
+  if (rc != 0)
+  {
+    fprintf(stderr, "start MeCom emulator failed, %s\n", strerror(rc));
+    mecom_sim_stop();
+    return -1;
+  }
+  sim_started = 1;
+  fprintf(stderr, "Emulating %d TEC controller(s) on %s, %u+%u us, %u/1000 errors\n",
+          cfg->count, port, cfg->latency_us, cfg->jitter_us,
+          cfg->error_permille);
+  return 0;
+}
+
+void mecom_sim_stop(void)
+{
+  uint64_t one = 1;
+
+  if (sim_started)
+  {
+    if (write(sim_stop_fd, &one, sizeof(one)) == sizeof(one))
+      pthread_join(sim_thread, NULL);
+    sim_started = 0;
+  }
+  if (sim_stop_fd >= 0)
+    close(sim_stop_fd);
+  if (sim_slave >= 0)
+    close(sim_slave);
+  if (sim_master >= 0)
+    close(sim_master);
+  sim_stop_fd = sim_slave = sim_master = -1;
+}
@@ -0,0 +1,29 @@
+/*
+ * Emulated Meerstetter TEC controllers behind a pseudo terminal, selected
+ * with -M. The MeCom stack opens the pty like /dev/ttyUSB0 and can not tell
+ * the difference, so initMeCom, the poller and the lock run without
+ * hardware.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __MECOM_SIM_H__
+#define __MECOM_SIM_H__
+
+#include <stddef.h>
+
+#include "temp_moniter.h"
+
+struct mecom_sim_config
+{
+  unsigned int latency_us; /* controller turnaround per request */
+  unsigned int jitter_us; /* uniform extra turnaround, 0..jitter_us */
+  unsigned int error_permille; /* requests dropped, corrupted or refused */
+  const struct tec_device *devices; /* addresses that answer */
+  int count;
+};
+
+int mecom_sim_start(const struct mecom_sim_config *cfg, char *port,
+                    size_t port_len);
+void mecom_sim_stop(void);
+
+#endif
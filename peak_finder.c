@@ -0,0 +1,295 @@
+/*
+ * On-board peak finder.
+ *
+ * Both channels are first summed over PEAK_DECIMATION samples, which cuts the
+ * noise and the work of the search by the same factor. Channel a is detrended
+ * with a straight line fit (the scan rides on a ramp) and every excursion of
+ * the residual below PEAK_DIP_THRESHOLD of its range is one absorption dip.
+ * On channel b every excursion above PEAK_FRINGE_THRESHOLD of the range is
+ * one transmission fringe. Leaving a feature takes another PEAK_HYSTERESIS of
+ * the range, so noise on the edges does not split it. The centre of a feature
+ * is the vertex of the parabola through its extreme point and the two
+ * neighbours.
+ *
+ * The decimation and range kernels use NEON where the compiler targets it
+ * (-mfpu=neon on the Red Pitaya) and plain C otherwise.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <stdlib.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PEAK_NEON 1
+#endif
+
+#include "peak_finder.h"
+
+#if PEAK_DECIMATION != 8
+#error "the decimation kernels sum exactly 8 samples per point"
+#endif
+
+static int32_t *points; /* decimated samples, used by the reader thread only */
+static unsigned int points_size;
+
+/*
+ * allocates the points for frames of up to max_samples once, so the search
+ * never runs out of memory in the middle of the acquisition. -1 on failure.
+ */
+int peak_finder_init(unsigned int max_samples)
+{
+  unsigned int m = max_samples / PEAK_DECIMATION;
+
+  free(points);
+  points = malloc((m > 0 ? m : 1) * sizeof(*points));
+  points_size = points ? m : 0;
+  return points ? 0 : -1;
+}
+
+void peak_finder_free(void)
+{
+  free(points);
+  points = NULL;
+  points_size = 0;
+}
+
+const char *peak_finder_impl(void)
+{
+#ifdef PEAK_NEON
+  return "neon";
+#else
+  return "portable";
+#endif
+}
+
+/*
+ * sums groups of PEAK_DECIMATION samples into points, returns their number.
+ * the acquisition length never exceeds the max_samples of peak_finder_init.
+ */
+static unsigned int decimate(const int16_t *x, unsigned int n)
+{
+  unsigned int m = n / PEAK_DECIMATION;
+  unsigned int i = 0, j;
+  int32_t sum;
+
+  if (m > points_size)
+    m = points_size;
+
+#ifdef PEAK_NEON
+  /* four points from 32 samples: widen pairwise to 4 x int32 per 8 samples,
+   * fold the halves and add the pairs of two groups at once */
+  for (; i + 4 <= m; i += 4, x += 4 * PEAK_DECIMATION)
+  {
+    int32x4_t s0 = vpaddlq_s16(vld1q_s16(x));
+    int32x4_t s1 = vpaddlq_s16(vld1q_s16(x + 8));
+    int32x4_t s2 = vpaddlq_s16(vld1q_s16(x + 16));
+    int32x4_t s3 = vpaddlq_s16(vld1q_s16(x + 24));
+    int32x2_t p0 = vadd_s32(vget_low_s32(s0), vget_high_s32(s0));
+    int32x2_t p1 = vadd_s32(vget_low_s32(s1), vget_high_s32(s1));
+    int32x2_t p2 = vadd_s32(vget_low_s32(s2), vget_high_s32(s2));
+    int32x2_t p3 = vadd_s32(vget_low_s32(s3), vget_high_s32(s3));
+
+    vst1q_s32(points + i, vcombine_s32(vpadd_s32(p0, p1), vpadd_s32(p2, p3)));
+  }
+#endif
+  for (; i < m; i++, x += PEAK_DECIMATION)
+  {
+    sum = 0;
+    for (j = 0; j < PEAK_DECIMATION; j++)
+      sum += x[j];
+    points[i] = sum;
+  }
+  return m;
+}
+
+static void range(const int32_t *y, unsigned int m, int32_t *min,
+                  int32_t *max)
+{
+  unsigned int i = 1;
+  int32_t lo = y[0], hi = y[0];
+
+#ifdef PEAK_NEON
+  if (m >= 8)
+  {
+    int32x4_t vlo = vld1q_s32(y), vhi = vlo;
+    int32x2_t l, h;
+
+    for (i = 4; i + 4 <= m; i += 4)
+    {
+      int32x4_t v = vld1q_s32(y + i);
+      vlo = vminq_s32(vlo, v);
+      vhi = vmaxq_s32(vhi, v);
+    }
+    l = vpmin_s32(vget_low_s32(vlo), vget_high_s32(vlo));
+    h = vpmax_s32(vget_low_s32(vhi), vget_high_s32(vhi));
+    lo = vget_lane_s32(vpmin_s32(l, l), 0);
+    hi = vget_lane_s32(vpmax_s32(h, h), 0);
+  }
+#endif
+  for (; i < m; i++)
+  {
+    if (y[i] < lo)
+      lo = y[i];
+    if (y[i] > hi)
+      hi = y[i];
+  }
+  *min = lo;
+  *max = hi;
+}
+
+/* vertex of the parabola through ym, y0, yp, as an offset from y0 */
+static double vertex(double ym, double y0, double yp)
+{
+  double d = ym - 2 * y0 + yp;
+
+  return d != 0 ? 0.5 * (ym - yp) / d : 0;
+}
+
+/* position of the centre of point c in samples */
+static float to_sample(double c)
+{
+  return (float)(c * PEAK_DECIMATION + (PEAK_DECIMATION - 1) / 2.0);
+}
+
+static double residual(unsigned int i, double a, double b)
+{
+  return points[i] - (a + b * i);
+}
+
+static void add_dip(struct peak_result *res, unsigned int at, unsigned int m,
+                    double a, double b)
+{
+  double c = at;
+  double bg;
+
+  if (res->n_dips < PEAK_MAX_DIPS)
+  {
+    if (at > 0 && at + 1 < m)
+      c += vertex(residual(at - 1, a, b), residual(at, a, b),
+                  residual(at + 1, a, b));
+    bg = a + b * c;
+    res->dip_centre[res->n_dips] = to_sample(c);
+    res->dip_depth[res->n_dips] =
+        bg != 0 ? (float)(-residual(at, a, b) / bg) : 0;
+  }
+  res->n_dips++;
+}
+
+static void add_fringe(struct peak_result *res, unsigned int at,
+                       unsigned int m)
+{
+  double c = at;
+
+  if (res->n_fringes < PEAK_MAX_FRINGES)
+  {
+    if (at > 0 && at + 1 < m)
+      c += vertex(points[at - 1], points[at], points[at + 1]);
+    res->fringe_centre[res->n_fringes] = to_sample(c);
+    res->fringe_height[res->n_fringes] =
+        (float)points[at] / PEAK_DECIMATION;
+  }
+  res->n_fringes++;
+}
+
+/* rb absorption dips in n samples of channel a */
+void peak_find_dips(const int16_t *samples, unsigned int n,
+                    struct peak_result *res)
+{
+  unsigned int m = decimate(samples, n);
+  unsigned int i, at = 0;
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  double a, b, r, rmin, rmax, level, leave, best = 0;
+  int in_dip = 0;
+
+  res->n_dips = 0;
+  if (m < 3)
+    return;
+
+  /* least squares line through the ramp */
+  for (i = 0; i < m; i++)
+  {
+    sx += i;
+    sy += points[i];
+    sxx += (double)i * i;
+    sxy += (double)i * points[i];
+  }
+  b = (m * sxy - sx * sy) / (m * sxx - sx * sx);
+  a = (sy - b * sx) / m;
+
+  rmin = rmax = residual(0, a, b);
+  for (i = 1; i < m; i++)
+  {
+    r = residual(i, a, b);
+    if (r < rmin)
+      rmin = r;
+    if (r > rmax)
+      rmax = r;
+  }
+  if (rmax == rmin)
+    return;
+  level = rmax - PEAK_DIP_THRESHOLD * (rmax - rmin);
+  leave = level + PEAK_HYSTERESIS * (rmax - rmin);
+
+  for (i = 0; i < m; i++)
+  {
+    r = residual(i, a, b);
+    if (!in_dip && r < level)
+    {
+      in_dip = 1;
+      best = r;
+      at = i;
+    }
+    else if (in_dip && r < best)
+    {
+      best = r;
+      at = i;
+    }
+    else if (in_dip && r > leave)
+    {
+      add_dip(res, at, m, a, b);
+      in_dip = 0;
+    }
+  }
+  if (in_dip)
+    add_dip(res, at, m, a, b);
+}
+
+/* etalon transmission fringes in n samples of channel b */
+void peak_find_fringes(const int16_t *samples, unsigned int n,
+                       struct peak_result *res)
+{
+  unsigned int m = decimate(samples, n);
+  unsigned int i, at = 0;
+  int32_t lo, hi;
+  double level, leave;
+  int in_fringe = 0;
+
+  res->n_fringes = 0;
+  if (m < 3)
+    return;
+
+  range(points, m, &lo, &hi);
+  if (hi == lo)
+    return;
+  level = lo + PEAK_FRINGE_THRESHOLD * (hi - lo);
+  leave = level - PEAK_HYSTERESIS * (hi - lo);
+
+  for (i = 0; i < m; i++)
+  {
+    if (!in_fringe && points[i] > level)
+    {
+      in_fringe = 1;
+      at = i;
+    }
+    else if (in_fringe && points[i] > points[at])
+      at = i;
+    else if (in_fringe && points[i] < leave)
+    {
+      add_fringe(res, at, m);
+      in_fringe = 0;
+    }
+  }
+  if (in_fringe)
+    add_fringe(res, at, m);
+}
@@ -0,0 +1,29 @@
+/*
+ * On-board analysis of the scope channels. Locates the Rb hyperfine
+ * absorption dips on channel a and the etalon transmission fringes on
+ * channel b and fits their centres, so a client can follow the lock from a
+ * struct peak_result instead of the raw samples.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __PEAK_FINDER_H__
+#define __PEAK_FINDER_H__
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+#define PEAK_DECIMATION 8 /* samples summed into one point before the search */
+#define PEAK_DIP_THRESHOLD 0.15 /* dip level, fraction of the residual range */
+#define PEAK_FRINGE_THRESHOLD 0.5 /* fringe level, fraction of the range */
+#define PEAK_HYSTERESIS 0.05 /* fraction of the range to leave a feature */
+
+int peak_finder_init(unsigned int max_samples);
+void peak_finder_free(void);
+void peak_find_dips(const int16_t *samples, unsigned int n,
+                    struct peak_result *res);
+void peak_find_fringes(const int16_t *samples, unsigned int n,
+                       struct peak_result *res);
+const char *peak_finder_impl(void);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * PID controller.
+ *
+ * The output is offset + Kp * e + Ki * integral(e) + Kd * de/dt, clamped to
+ * [out_min, out_max]. While the output sits at a limit the error is not
+ * integrated further in the direction that drives it there, so the
+ * integrator does not wind up and the loop recovers as soon as the error
+ * changes sign. dt is the time since the previous call in seconds.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include "pid.h"
+
+void pid_init(struct pid_state *pid, float kp, float ki, float kd,
+              float offset, float out_min, float out_max)
+{
+  pid->offset = offset;
+  pid->out_min = out_min;
+  pid->out_max = out_max;
+  pid->integral = 0;
+  pid->error_previous = 0;
+  pid->first = 1;
+  pid_set_gains(pid, kp, ki, kd);
+}
+
+/*
+ * changes the gains without a bump in the output: the integral is rescaled
+ * so that Ki * integral stays the same.
+ */
+void pid_set_gains(struct pid_state *pid, float kp, float ki, float kd)
+{
+  if (!pid->first && pid->ki != 0 && ki != 0)
+    pid->integral *= pid->ki / ki;
+  else if (ki == 0)
+    pid->integral = 0;
+  pid->kp = kp;
+  pid->ki = ki;
+  pid->kd = kd;
+}
+
+float PID_Controller(struct pid_state *pid, float set_point,
+                     float measured_value, float dt)
+{
+  float actual_error = set_point - measured_value;
+  float P, I, D, out;
+  float integral = pid->integral;
+
+  P = actual_error; // Current error
+  if (dt > 0)
+    integral += actual_error * dt; // Sum of previous errors
+  I = integral;
+  D = (pid->first || dt <= 0) ? 0 : (actual_error - pid->error_previous) / dt;
+
+  out = pid->offset + pid->kp * P + pid->ki * I + pid->kd * D;
+  if (out > pid->out_max)
+  {
+    out = pid->out_max;
+    /* anti-windup: keep the integral unless it pulls away from the limit */
+    if (pid->ki * actual_error < 0)
+      pid->integral = integral;
+  }
+  else if (out < pid->out_min)
+  {
+    out = pid->out_min;
+    if (pid->ki * actual_error > 0)
+      pid->integral = integral;
+  }
+  else
+    pid->integral = integral;
+
+  pid->error_previous = actual_error;
+  pid->first = 0;
+  return out;
+}
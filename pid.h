@@ -0,0 +1,26 @@
+/*
+ * PID controller with runtime gains and anti-windup, used by the on-board
+ * lock (lock.c).
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __PID_H__
+#define __PID_H__
+
+struct pid_state
+{
+  float kp, ki, kd;
+  float offset; /* output at zero error, the operating point */
+  float out_min, out_max; /* output limits */
+  float integral; /* integrated error, seconds */
+  float error_previous;
+  int first;
+};
+
+void pid_init(struct pid_state *pid, float kp, float ki, float kd,
+              float offset, float out_min, float out_max);
+void pid_set_gains(struct pid_state *pid, float kp, float ki, float kd);
+float PID_Controller(struct pid_state *pid, float set_point,
+                     float measured_value, float dt);
+
+#endif
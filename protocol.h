@@ -0,0 +1,137 @@
+/*
+ * Wire format of the multiplexed data port (DATA_SERVER_PORT, -s).
+ *
+ * Everything travels over one persistent TCP connection as messages made of a
+ * struct proto_header and length bytes of payload, all fields little endian.
+ * For every acquisition the server sends PROTO_CH_A and PROTO_CH_B
+ * (ACQUISITION_LENGTH int16 samples each) followed by PROTO_TELEMETRY (a
+ * struct telemetry), all three tagged with the frame's sequence number. The
+ * client answers each telemetry message with PROTO_ACK (a float set point for
+ * the TEC) or PROTO_END to stop the acquisition.
+ *
+ * With the on-board peak finder (-f) a PROTO_RESULT message (a struct
+ * peak_result) precedes the telemetry of every frame. In results-only mode
+ * (-r) the PROTO_CH_A/PROTO_CH_B messages are left out. With the on-board
+ * lock (-l) acks are optional and their set points are ignored, the client
+ * may tune the lock with PROTO_SET_GAINS instead.
+ *
+ * At any time the client may send a PROTO_COMMAND (struct proto_command).
+ * Every command is answered with a PROTO_REPLY (struct proto_reply) carrying
+ * the same request_id, in between the frame messages. The TEC settings are
+ * answered once the controller took them, so their replies may come after
+ * those of later commands. Messages with a newer version than the server's
+ * are answered with PROTO_ERR_VERSION.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <stdint.h>
+
+#define PROTO_MAGIC 0x4c425245 /* "ERBL" */
+#define PROTO_VERSION 1
+#define PROTO_MAX_CLIENT_PAYLOAD 64 /* largest message a client may send */
+
+enum proto_type
+{
+  PROTO_CH_A = 1, /* server: channel a samples */
+  PROTO_CH_B, /* server: channel b samples */
+  PROTO_TELEMETRY, /* server: struct telemetry */
+  PROTO_ACK, /* client: float set point, releases the frame */
+  PROTO_END, /* client: stop the acquisition */
+  PROTO_RESULT, /* server: struct peak_result */
+  PROTO_SET_GAINS, /* client: three floats, Kp Ki Kd of the on-board lock */
+  PROTO_COMMAND, /* client: struct proto_command */
+  PROTO_REPLY /* server: struct proto_reply */
+};
+
+struct proto_header
+{
+  uint32_t magic;
+  uint16_t type; /* one of enum proto_type */
+  uint16_t version;
+  uint32_t sequence; /* frame number, counts from 0 */
+  uint32_t length; /* payload bytes following the header */
+} __attribute__((packed));
+
+/*
+ * environment recorded at trigger time, 32 bytes without padding, filled
+ * from the sensor table (sensors.c). t, p and h come from the BME280
+ * conversion that ended at env_timestamp, 0 if there was none. Other
+ * sensor channels are read with CMD_GET_SENSOR.
+ */
+struct telemetry
+{
+  uint64_t timestamp; /* ms since the epoch */
+  float tec_temp;
+  float t, p, h;
+  uint64_t env_timestamp; /* ms since the epoch */
+};
+
+enum proto_command_code
+{
+  CMD_START = 1, /* resume arming the scope */
+  CMD_STOP, /* pause after the current frame, PROTO_END shuts down */
+  CMD_SET_TEMPERATURE, /* arg: TEC (-e order), value: target temperature, degC */
+  CMD_SET_CURRENT, /* arg: TEC (-e order), value: current, A */
+  CMD_SET_ACQUISITION_LENGTH, /* arg: samples per channel and frame */
+  CMD_SET_DECIMATION, /* arg: one of enum decimation */
+  CMD_SET_TRIGGER, /* arg: one of enum trigger, value: threshold, adc counts */
+  CMD_GET_TEMPERATURE, /* arg: TEC (-e order), reply value: object temperature */
+  CMD_GET_SENSOR, /* arg: sensor channel (printed at start), reply value: newest sample */
+  CMD_SET_TRACE /* arg: 1 traces the MeCom line to ComLog.txt, 0 stops (-T at start) */
+};
+
+enum proto_status
+{
+  PROTO_OK = 0,
+  PROTO_ERR_UNKNOWN = -1, /* no such command */
+  PROTO_ERR_INVALID = -2, /* argument out of range */
+  PROTO_ERR_UNAVAILABLE = -3, /* no TEC, or the on-board lock owns it */
+  PROTO_ERR_FAILED = -4, /* the device did not take the setting */
+  PROTO_ERR_VERSION = -5 /* message version not supported */
+};
+
+struct proto_command
+{
+  uint32_t request_id; /* chosen by the client, echoed in the reply */
+  uint16_t command; /* one of enum proto_command_code */
+  uint16_t reserved;
+  int32_t arg;
+  float value;
+};
+
+/*
+ * arg and value hold the setting in effect once the command is carried out.
+ * acquisition settings are applied by the reader before it arms the next
+ * time, the frame headers show when a new acquisition length took effect.
+ */
+struct proto_reply
+{
+  uint32_t request_id;
+  uint16_t command;
+  int16_t status; /* one of enum proto_status */
+  int32_t arg;
+  float value;
+};
+
+#define PEAK_MAX_DIPS 8
+#define PEAK_MAX_FRINGES 32
+
+/*
+ * features found by the peak finder, positions in samples from the start of
+ * the frame. n_dips and n_fringes count what was found, at most
+ * PEAK_MAX_DIPS and PEAK_MAX_FRINGES of them are filled in.
+ */
+struct peak_result
+{
+  uint16_t n_dips; /* rb absorption dips on channel a */
+  uint16_t n_fringes; /* etalon transmission fringes on channel b */
+  float dip_centre[PEAK_MAX_DIPS];
+  float dip_depth[PEAK_MAX_DIPS]; /* fraction of the fitted background */
+  float fringe_centre[PEAK_MAX_FRINGES];
+  float fringe_height[PEAK_MAX_FRINGES]; /* adc counts */
+};
+
+#endif
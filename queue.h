@@ -0,0 +1,50 @@
+/*
+ * Per channel hand-over from ADC_read_worker to the thread that sends the
+ * channel out, shared by the per-port senders in axi_adc.c and the
+ * multiplexed data server.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "spsc_ring.h"
+
+/*
+ * what a sender got out, printed when the server stops. the sender owns all
+ * fields but copy_ms, which the reader adds up; both are read once the
+ * threads have stopped.
+ */
+struct send_stats
+{
+  unsigned long frames;
+  uint64_t bytes;
+  double frame_ms, frame_max_ms; /* first block sent to the end of the frame */
+  double send_ms; /* in sendmsg and the zero-copy reaping */
+  double copy_ms; /* reader copying out of the dma ram (SEND_COPY) */
+};
+
+static inline double elapsed_ms(const struct timespec *from,
+                                const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1e3 +
+         (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+struct queue
+{
+  struct spsc_ring ring;
+  pthread_t sender;
+  int started;
+  unsigned int in_flight; /* frames handed to the sender, reader side only */
+  uint8_t *buf;
+  int sock_fd;
+  struct send_stats sent;
+};
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * Scope setup for the axi_adc fpga image and the /dev/mem backend.
+ * Based on axi_adc.c redpitaya example code by Nils Roos (License attached).
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <sys/mman.h>
+
+#include "configuration.h"
+#include "scope.h"
+
+const struct scope_ops *scope_backend = &scope_fpga_ops;
+void *scope_buf_a;
+void *scope_buf_b;
+
+/* fpga backend */
+static int mem_fd = -1;
+static volatile void *scope = MAP_FAILED; /* access to fpga registers must
+                                             not be optimized */
+static void *fpga_buf_a = MAP_FAILED;
+static void *fpga_buf_b = MAP_FAILED;
+
+static void fpga_close(void)
+{
+  if (scope != MAP_FAILED)
+    munmap((void *)scope, SCOPE_REGS_SIZE);
+  if (fpga_buf_a != MAP_FAILED)
+    munmap(fpga_buf_a, RAM_A_SIZE);
+  if (fpga_buf_b != MAP_FAILED)
+    munmap(fpga_buf_b, RAM_B_SIZE);
+  if (mem_fd >= 0)
+    close(mem_fd);
+  scope = fpga_buf_a = fpga_buf_b = MAP_FAILED;
+  mem_fd = -1;
+}
+
+/* acquire pointers to mapped bus regions of fpga and dma ram */
+static int fpga_open(void)
+{
+  mem_fd = open("/dev/mem", O_RDWR);
+  if (mem_fd < 0)
+  {
+    fprintf(stderr, "open /dev/mem failed, %s\n", strerror(errno));
+    return -1;
+  }
+
+  scope = mmap(NULL, SCOPE_REGS_SIZE, PROT_WRITE | PROT_READ, MAP_SHARED,
+               mem_fd, 0x40100000UL);
+  fpga_buf_a =
+      mmap(NULL, RAM_A_SIZE, PROT_READ, MAP_SHARED, mem_fd, RAM_A_ADDRESS);
+  fpga_buf_b =
+      mmap(NULL, RAM_B_SIZE, PROT_READ, MAP_SHARED, mem_fd, RAM_B_ADDRESS);
+  if (scope == MAP_FAILED || fpga_buf_a == MAP_FAILED ||
+      fpga_buf_b == MAP_FAILED)
+  {
+    fprintf(stderr, "mmap failed, %s - scope %p buf_a %p buf_b %p\n",
+            strerror(errno), scope, fpga_buf_a, fpga_buf_b);
+    fpga_close();
+    return -2;
+  }
+  scope_buf_a = fpga_buf_a;
+  scope_buf_b = fpga_buf_b;
+  return 0;
+}
+
+static uint32_t fpga_read(unsigned int offset)
+{
+  return *(volatile uint32_t *)(scope + offset);
+}
+
+static void fpga_write(unsigned int offset, uint32_t value)
+{
+  *(volatile uint32_t *)(scope + offset) = value;
+}
+
+const struct scope_ops scope_fpga_ops = {
+    .name = "fpga",
+    .open = fpga_open,
+    .close = fpga_close,
+    .read = fpga_read,
+    .write = fpga_write,
+};
+
+int scope_open(const struct scope_ops *ops)
+{
+  int rc;
+
+  scope_backend = ops;
+  rc = ops->open();
+  if (rc == 0)
+    fprintf(stderr, "Scope backend: %s\n", ops->name);
+  return rc;
+}
+
+void scope_close(void)
+{
+  scope_backend->close();
+  scope_buf_a = scope_buf_b = NULL;
+}
+
+void scope_reset(void)
+{
+  scope_write(SCOPE_CONTROL, 2); /* reset scope */
+}
+
+static void scope_set_filters(enum equalizer eq, int shaping,
+                              unsigned int base)
+{
+  /* equalization filter */
+  switch (eq)
+  {
+  case EQ_HV:
+    scope_write(base + 0x0, 0x4c5f); /* filter coeff aa */
+    scope_write(base + 0x4, 0x2f38b); /* filter coeff bb */
+    break;
+  case EQ_LV:
+    scope_write(base + 0x0, 0x7d93); /* filter coeff aa */
+    scope_write(base + 0x4, 0x437c7); /* filter coeff bb */
+    break;
+  case EQ_OFF:
+    scope_write(base + 0x0, 0x0); /* filter coeff aa */
+    scope_write(base + 0x4, 0x0); /* filter coeff bb */
+    break;
+  }
+
+  /* shaping filter */
+  if (shaping)
+  {
+    scope_write(base + 0x8, 0xd9999a); /* filter coeff kk */
+    scope_write(base + 0xc, 0x2666); /* filter coeff pp */
+  }
+  else
+  {
+    scope_write(base + 0x8, 0xffffff); /* filter coeff kk */
+    scope_write(base + 0xc, 0x0); /* filter coeff pp */
+  }
+}
+
+void scope_setup_input_parameters(enum decimation dec, enum equalizer ch_a_eq,
+                                  enum equalizer ch_b_eq, int ch_a_shaping,
+                                  int ch_b_shaping)
+{
+  scope_write(SCOPE_DECIMATION, dec); /* decimation */
+  scope_write(SCOPE_AVERAGING, (dec != DE_OFF) ? 1 : 0); /* enable averaging */
+
+  scope_set_filters(ch_a_eq, ch_a_shaping,
+                    SCOPE_CH_A_FILTER); /* filter coeff base channel a */
+  scope_set_filters(ch_b_eq, ch_b_shaping,
+                    SCOPE_CH_B_FILTER); /* filter coeff base channel b */
+}
+
+void scope_setup_trigger_parameters(int thresh_a, int thresh_b, int hyst_a,
+                                    int hyst_b, int deadtime)
+{
+  scope_write(SCOPE_CH_A_THRESHOLD, thresh_a); /* channel a trigger threshold */
+  scope_write(SCOPE_CH_B_THRESHOLD, thresh_b); /* channel b trigger threshold */
+  /* the legacy recording logic controls when the trigger mode will be reset. we
+   * want
+   * that to happen as soon as possible (because that's the signal that a
+   * trigger event
+   * occured, and the pre-trigger samples are already waiting for transmission),
+   * so set
+   * some small value > 0 here */
+  scope_write(SCOPE_LEGACY_POST_TRIGGER, 10); /* legacy post trigger samples */
+  scope_write(SCOPE_CH_A_HYSTERESIS, hyst_a); /* channel a trigger hysteresis */
+  scope_write(SCOPE_CH_B_HYSTERESIS, hyst_b); /* channel b trigger hysteresis */
+  scope_write(SCOPE_DEADTIME, deadtime); /* trigger deadtime */
+}
+
+void scope_setup_axi_recording(int acquisition_length)
+{
+  scope_write(SCOPE_CH_A_BUF_START, RAM_A_ADDRESS); /* buffer a start */
+  scope_write(SCOPE_CH_A_BUF_STOP,
+              RAM_A_ADDRESS + RAM_A_SIZE); /* buffer a stop */
+  scope_write(SCOPE_CH_A_POST_TRIGGER,
+              acquisition_length - PRE_TRIGGER_LENGTH +
+                  64); /* channel a post trigger samples */
+  scope_write(SCOPE_CH_B_BUF_START, RAM_B_ADDRESS); /* buffer b start */
+  scope_write(SCOPE_CH_B_BUF_STOP,
+              RAM_B_ADDRESS + RAM_B_SIZE); /* buffer b stop */
+  scope_write(SCOPE_CH_B_POST_TRIGGER,
+              acquisition_length - PRE_TRIGGER_LENGTH +
+                  64); /* channel b post trigger samples */
+
+  scope_write(SCOPE_CH_A_AXI_ENABLE, 1); /* enable channel a axi */
+  scope_write(SCOPE_CH_B_AXI_ENABLE, 1); /* enable channel b axi */
+}
+
+void scope_activate_trigger(enum trigger trigger)
+{
+  /* TODO maybe use the 'keep armed' flag without reset, to have better
+   * pre-trigger data when a trigger immediately follows the previous recording
+   */
+  scope_write(SCOPE_CONTROL, 3); /* reset and arm scope */
+  scope_write(SCOPE_CONTROL, 0); /* armed for trigger */
+  scope_write(SCOPE_TRIGGER_SOURCE, trigger); /* trigger source */
+}
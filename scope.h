@@ -0,0 +1,114 @@
+/*
+ * Scope register access for the axi_adc fpga image, behind a backend interface
+ * so the acquisition and transport pipeline can also run against a software
+ * model of the fpga (scope_sim.c).
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __SCOPE_H__
+#define __SCOPE_H__
+
+#include <stdint.h>
+
+/* register offsets */
+#define SCOPE_CONTROL 0x00000 /* 2 reset, 3 reset and arm, 0 armed */
+#define SCOPE_TRIGGER_SOURCE 0x00004 /* cleared by the fpga on trigger */
+#define SCOPE_CH_A_THRESHOLD 0x00008
+#define SCOPE_CH_B_THRESHOLD 0x0000c
+#define SCOPE_LEGACY_POST_TRIGGER 0x00010
+#define SCOPE_DECIMATION 0x00014
+#define SCOPE_CH_A_HYSTERESIS 0x00020
+#define SCOPE_CH_B_HYSTERESIS 0x00024
+#define SCOPE_AVERAGING 0x00028
+#define SCOPE_CH_A_FILTER 0x00030 /* aa, bb, kk, pp */
+#define SCOPE_CH_B_FILTER 0x00040
+#define SCOPE_CH_A_BUF_START 0x00050
+#define SCOPE_CH_A_BUF_STOP 0x00054
+#define SCOPE_CH_A_POST_TRIGGER 0x00058
+#define SCOPE_CH_A_AXI_ENABLE 0x0005c
+#define SCOPE_CH_A_TRIGGER_PTR 0x00060
+#define SCOPE_CH_A_WRITE_PTR 0x00064
+#define SCOPE_CH_B_BUF_START 0x00070
+#define SCOPE_CH_B_BUF_STOP 0x00074
+#define SCOPE_CH_B_POST_TRIGGER 0x00078
+#define SCOPE_CH_B_AXI_ENABLE 0x0007c
+#define SCOPE_CH_B_TRIGGER_PTR 0x00080
+#define SCOPE_CH_B_WRITE_PTR 0x00084
+#define SCOPE_DEADTIME 0x00090
+#define SCOPE_REGS_SIZE 0x00100000UL
+
+enum equalizer
+{
+  EQ_OFF,
+  EQ_LV,
+  EQ_HV
+};
+enum trigger
+{
+  TR_OFF = 0,
+  TR_MANUAL,
+  TR_CH_A_RISING,
+  TR_CH_A_FALLING,
+  TR_CH_B_RISING,
+  TR_CH_B_FALLING,
+  TR_EXT_RISING,
+  TR_EXT_FALLING,
+  TR_ASG_RISING,
+  TR_ASG_FALLING
+};
+enum decimation
+{
+  DE_OFF = 0,
+  DE_1 = 0x00001,
+  DE_8 = 0x00008,
+  DE_64 = 0x00040,
+  DE_1024 = 0x00400,
+  DE_8192 = 0x02000,
+  DE_65536 = 0x10000
+};
+
+/*
+ * a scope backend. open maps the registers and sets scope_buf_a/scope_buf_b
+ * to the dma ram of the two channels, read and write access one register.
+ */
+struct scope_ops
+{
+  const char *name;
+  int (*open)(void);
+  void (*close)(void);
+  uint32_t (*read)(unsigned int offset);
+  void (*write)(unsigned int offset, uint32_t value);
+};
+
+extern const struct scope_ops scope_fpga_ops;
+extern const struct scope_ops scope_sim_ops;
+
+extern const struct scope_ops *scope_backend;
+extern void *scope_buf_a;
+extern void *scope_buf_b;
+
+static inline uint32_t scope_read(unsigned int offset)
+{
+  return scope_backend->read(offset);
+}
+
+static inline void scope_write(unsigned int offset, uint32_t value)
+{
+  scope_backend->write(offset, value);
+}
+
+int scope_open(const struct scope_ops *ops);
+void scope_close(void);
+void scope_reset(void);
+void scope_setup_input_parameters(enum decimation dec, enum equalizer ch_a_eq,
+                                  enum equalizer ch_b_eq, int ch_a_shaping,
+                                  int ch_b_shaping);
+void scope_setup_trigger_parameters(int thresh_a, int thresh_b, int hyst_a,
+                                    int hyst_b, int deadtime);
+void scope_setup_axi_recording(int acquisition_length);
+void scope_activate_trigger(enum trigger trigger);
+
+/* scope_sim.c tuning, samples per second and external trigger period */
+void scope_sim_configure(double sample_rate, double trigger_period_us);
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * Software model of the axi_adc fpga image, selected with -S.
+ *
+ * A background thread plays the fpga: while the scope is armed it fills the
+ * two circular dma buffers at the configured sample rate and advances the
+ * write pointers (0x64/0x84). An external trigger fires periodically, the
+ * first one after arming clears the trigger source register (0x04), latches
+ * the trigger pointers (0x60/0x80) and lets the recording run for the post
+ * trigger samples before it stops, as the real recording logic does.
+ *
+ * Channel a carries a scan over four gaussian absorption dips on a rising
+ * ramp (a stand-in for the Rb hyperfine spectrum), channel b the airy
+ * transmission of an etalon. Both include a little noise.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <math.h>
+#include <time.h>
+
+#include "configuration.h"
+#include "scope.h"
+
+#define SIM_TICK_US 100 /* how often the model thread runs */
+#define SIM_FULL_SCALE 8191 /* 14 bit adc */
+
+enum sim_state
+{
+  SIM_IDLE,
+  SIM_ARMED,
+  SIM_POST_TRIGGER
+};
+
+static uint32_t regs[0x100 / 4];
+static int16_t *ram_a, *ram_b;
+static pthread_t sim_thread;
+static int sim_running;
+
+static double sim_sample_rate = 125e6 / DE_64;
+static double sim_trigger_period_us = 10000;
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum sim_state state = SIM_IDLE;
+static uint32_t post_trigger_left;
+static uint32_t noise_seed = 12345;
+
+void scope_sim_configure(double sample_rate, double trigger_period_us)
+{
+  if (sample_rate > 0)
+    sim_sample_rate = sample_rate;
+  if (trigger_period_us > 0)
+    sim_trigger_period_us = trigger_period_us;
+}
+
+static double now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double noise(void)
+{
+  noise_seed = noise_seed * 1664525 + 1013904223;
+  return ((noise_seed >> 8) / (double)(1 << 24) - 0.5) * 0.01;
+}
+
+/* x is the position within the scan, 0 at the trigger, 1 at the next one */
+static int16_t sim_rb_sample(double x)
+{
+  static const double centre[4] = {0.22, 0.36, 0.61, 0.79};
+  static const double depth[4] = {0.15, 0.40, 0.30, 0.10};
+  double v = 0.5 + 0.3 * x;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    v -= v * depth[i] *
+         exp(-(x - centre[i]) * (x - centre[i]) / (2 * 0.012 * 0.012));
+  return (int16_t)((v + noise()) * SIM_FULL_SCALE);
+}
+
+static int16_t sim_etalon_sample(double x)
+{
+  double s = sin(M_PI * 12.3 * x);
+  double v = 0.8 / (1 + 20 * s * s);
+  return (int16_t)((v + noise()) * SIM_FULL_SCALE);
+}
+
+static uint32_t reg_get(unsigned int offset)
+{
+  return __atomic_load_n(&regs[offset / 4], __ATOMIC_ACQUIRE);
+}
+
+static void reg_set(unsigned int offset, uint32_t value)
+{
+  __atomic_store_n(&regs[offset / 4], value, __ATOMIC_RELEASE);
+}
+
+/* append one sample per channel at the write pointers */
+static void sim_record(double x)
+{
+  uint32_t start_a = reg_get(SCOPE_CH_A_BUF_START);
+  uint32_t stop_a = reg_get(SCOPE_CH_A_BUF_STOP);
+  uint32_t start_b = reg_get(SCOPE_CH_B_BUF_START);
+  uint32_t stop_b = reg_get(SCOPE_CH_B_BUF_STOP);
+  uint32_t wp_a = reg_get(SCOPE_CH_A_WRITE_PTR);
+  uint32_t wp_b = reg_get(SCOPE_CH_B_WRITE_PTR);
+
+  ram_a[(wp_a - start_a) / 2] = sim_rb_sample(x);
+  ram_b[(wp_b - start_b) / 2] = sim_etalon_sample(x);
+  wp_a += 2;
+  wp_b += 2;
+  if (wp_a >= stop_a)
+    wp_a = start_a;
+  if (wp_b >= stop_b)
+    wp_b = start_b;
+  /* release: the samples are visible before the pointer moves */
+  reg_set(SCOPE_CH_A_WRITE_PTR, wp_a);
+  reg_set(SCOPE_CH_B_WRITE_PTR, wp_b);
+}
+
+static void *sim_worker(void *arg)
+{
+  double t0 = now_us();
+  double last = t0;
+  double carry = 0;
+  double now;
+  long n;
+
+  while (__atomic_load_n(&sim_running, __ATOMIC_ACQUIRE))
+  {
+    usleep(SIM_TICK_US);
+    now = now_us();
+    carry += (now - last) * sim_sample_rate / 1e6;
+    last = now;
+    n = (long)carry;
+    carry -= n;
+
+    pthread_mutex_lock(&sim_lock);
+    for (; n > 0; n--)
+    {
+      /* time of this sample, and where it falls in the periodic scan */
+      double t = now - n * 1e6 / sim_sample_rate;
+      double x = fmod(t - t0, sim_trigger_period_us) / sim_trigger_period_us;
+      double x_prev = fmod(t - t0 - 1e6 / sim_sample_rate,
+                           sim_trigger_period_us) /
+                      sim_trigger_period_us;
+
+      if (state == SIM_IDLE)
+        continue;
+      if (state == SIM_ARMED && x < x_prev &&
+          reg_get(SCOPE_TRIGGER_SOURCE) != TR_OFF)
+      {
+        /* external trigger edge */
+        reg_set(SCOPE_CH_A_TRIGGER_PTR, reg_get(SCOPE_CH_A_WRITE_PTR));
+        reg_set(SCOPE_CH_B_TRIGGER_PTR, reg_get(SCOPE_CH_B_WRITE_PTR));
+        post_trigger_left = reg_get(SCOPE_CH_A_POST_TRIGGER);
+        state = SIM_POST_TRIGGER;
+        reg_set(SCOPE_TRIGGER_SOURCE, TR_OFF);
+      }
+      sim_record(x);
+      if (state == SIM_POST_TRIGGER && --post_trigger_left == 0)
+        state = SIM_IDLE;
+    }
+    pthread_mutex_unlock(&sim_lock);
+  }
+  return NULL;
+}
+
+static uint32_t sim_read(unsigned int offset)
+{
+  return reg_get(offset);
+}
+
+static void sim_write(unsigned int offset, uint32_t value)
+{
+  pthread_mutex_lock(&sim_lock);
+  reg_set(offset, value);
+  if (offset == SCOPE_CONTROL)
+  {
+    switch (value)
+    {
+    case 2: /* reset */
+      state = SIM_IDLE;
+      break;
+    case 3: /* reset and arm, the write pointers carry on around the ring */
+      state = SIM_IDLE;
+      break;
+    case 0: /* armed */
+      state = SIM_ARMED;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&sim_lock);
+}
+
+static void sim_close(void)
+{
+  if (__atomic_load_n(&sim_running, __ATOMIC_ACQUIRE))
+  {
+    __atomic_store_n(&sim_running, 0, __ATOMIC_RELEASE);
+    pthread_join(sim_thread, NULL);
+  }
+  free(ram_a);
+  free(ram_b);
+  ram_a = ram_b = NULL;
+}
+
+static int sim_open(void)
+{
+  int rc;
+
+  ram_a = calloc(1, RAM_A_SIZE);
+  ram_b = calloc(1, RAM_B_SIZE);
+  if (ram_a == NULL || ram_b == NULL)
+  {
+    fprintf(stderr, "simulator ram allocation failed, %s\n", strerror(errno));
+    sim_close();
+    return -2;
+  }
+  scope_buf_a = ram_a;
+  scope_buf_b = ram_b;
+
+  /* start out as the fpga would after setup, pointers at the buffer start */
+  reg_set(SCOPE_CH_A_BUF_START, RAM_A_ADDRESS);
+  reg_set(SCOPE_CH_A_BUF_STOP, RAM_A_ADDRESS + RAM_A_SIZE);
+  reg_set(SCOPE_CH_A_WRITE_PTR, RAM_A_ADDRESS);
+  reg_set(SCOPE_CH_B_BUF_START, RAM_B_ADDRESS);
+  reg_set(SCOPE_CH_B_BUF_STOP, RAM_B_ADDRESS + RAM_B_SIZE);
+  reg_set(SCOPE_CH_B_WRITE_PTR, RAM_B_ADDRESS);
+
+  __atomic_store_n(&sim_running, 1, __ATOMIC_RELEASE);
+  rc = pthread_create(&sim_thread, NULL, sim_worker, NULL);
+  if (rc != 0)
+  {
+    fprintf(stderr, "start simulator failed, %s\n", strerror(rc));
+    __atomic_store_n(&sim_running, 0, __ATOMIC_RELEASE);
+    sim_close();
+    return -2;
+  }
+  fprintf(stderr, "Simulating %.0f samples/s, trigger every %.0f us\n",
+          sim_sample_rate, sim_trigger_period_us);
+  return 0;
+}
+
+const struct scope_ops scope_sim_ops = {
+    .name = "simulator",
+    .open = sim_open,
+    .close = sim_close,
+    .read = sim_read,
+    .write = sim_write,
+};
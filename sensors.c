@@ -0,0 +1,268 @@
+/*
+ * Environmental sensors.
+ *
+ * Sensors are registered at start from the main thread, the TEC
+ * controllers by tec_poller_start, the BME280 by bme_poller_start. A sensor
+ * with a sample function gets a thread that calls it every period_ms at a
+ * fixed rate, a slow or failing sensor only delays itself. The BME280 keeps
+ * its own thread, which times the conversions to the triggers, and
+ * publishes from there.
+ *
+ * Every sensor has a slot in the snapshot table: the newest sample under a
+ * seqlock, written by one thread only. The sequence number is odd while it
+ * is written, a reader retries if it was odd or changed meanwhile. The
+ * acquisition copies the whole table once per frame with sensors_snapshot,
+ * so the values of a frame are consistent per sensor and the trigger path
+ * never waits for a bus. A new sensor adds a slot, the acquisition loop
+ * stays as it is; its channels can be read with CMD_GET_SENSOR by the
+ * index printed when it is registered.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sensors.h"
+
+#define SENSOR_REPORT_EVERY 100 /* print failures every n samples */
+
+struct sensor_slot
+{
+  struct sensor sensor;
+  pthread_t thread;
+  int running; /* sampling thread */
+  /* seqlock, written by one thread only */
+  uint32_t latest_seq;
+  struct sensor_sample latest;
+};
+
+static struct sensor_slot slots[SENSOR_MAX];
+static int slot_count;
+
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* the newest sample of a sensor, from the thread that samples it */
+void sensor_publish(int sensor, uint64_t timestamp, const float *values)
+{
+  struct sensor_slot *s = &slots[sensor];
+  uint32_t seq = s->latest_seq;
+
+  __atomic_store_n(&s->latest_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  s->latest.timestamp = timestamp;
+  memcpy(s->latest.values, values, s->sensor.channels * sizeof(*values));
+  __atomic_store_n(&s->latest_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void read_slot(struct sensor_slot *s, struct sensor_sample *sample)
+{
+  uint32_t seq0, seq1;
+
+  do
+  {
+    seq0 = __atomic_load_n(&s->latest_seq, __ATOMIC_ACQUIRE);
+    *sample = s->latest;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    seq1 = __atomic_load_n(&s->latest_seq, __ATOMIC_RELAXED);
+  } while ((seq0 & 1) || seq0 != seq1);
+}
+
+/*
+ * copies the newest sample of a sensor to *sample, returns -1 if there is
+ * none yet. callable from any thread.
+ */
+int sensor_latest(int sensor, struct sensor_sample *sample)
+{
+  if (sensor < 0 || sensor >= __atomic_load_n(&slot_count, __ATOMIC_ACQUIRE))
+    return -1;
+  read_slot(&slots[sensor], sample);
+  return sample->timestamp == 0 ? -1 : 0;
+}
+
+/*
+ * copies the newest sample of every sensor to table[0] to table[n - 1],
+ * timestamp 0 where there is none yet. returns n.
+ */
+int sensors_snapshot(struct sensor_sample *table)
+{
+  int i, n = __atomic_load_n(&slot_count, __ATOMIC_ACQUIRE);
+
+  for (i = 0; i < n; i++)
+    read_slot(&slots[i], &table[i]);
+  return n;
+}
+
+/* looks up "sensor.channel", e.g. "bme280.temp" */
+struct sensor_ref sensor_find(const char *name)
+{
+  struct sensor_ref ref = {.sensor = -1, .channel = -1};
+  const char *dot = strchr(name, '.');
+  int i, k, n = __atomic_load_n(&slot_count, __ATOMIC_ACQUIRE);
+
+  if (dot == NULL)
+    return ref;
+  for (i = 0; i < n; i++)
+  {
+    if (strncmp(slots[i].sensor.name, name, dot - name) != 0 ||
+        slots[i].sensor.name[dot - name] != '\0')
+      continue;
+    for (k = 0; k < slots[i].sensor.channels; k++)
+      if (strcmp(slots[i].sensor.channel[k].name, dot + 1) == 0)
+      {
+        ref.sensor = i;
+        ref.channel = k;
+      }
+  }
+  return ref;
+}
+
+/*
+ * the newest value of channel index, counting the channels of all sensors in
+ * the order they were registered. returns 0, -1 if there is no sample yet,
+ * -2 if there is no such channel.
+ */
+int sensor_channel_value(int index, float *value)
+{
+  struct sensor_sample sample;
+  int i, n = __atomic_load_n(&slot_count, __ATOMIC_ACQUIRE);
+
+  for (i = 0; i < n && index >= slots[i].sensor.channels; i++)
+    index -= slots[i].sensor.channels;
+  if (index < 0 || i == n)
+    return -2;
+  if (sensor_latest(i, &sample) != 0)
+    return -1;
+  *value = sample.values[index];
+  return 0;
+}
+
+static void *sensor_worker(void *data)
+{
+  struct sensor_slot *s = data;
+  int sensor = s - slots;
+  unsigned int period_ms = s->sensor.period_ms;
+  float values[SENSOR_MAX_CHANNELS];
+  struct timespec next, now;
+  unsigned long samples = 0, failures = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (__atomic_load_n(&s->running, __ATOMIC_ACQUIRE))
+  {
+    samples++;
+    if (s->sensor.sample(s->sensor.arg, values) == 0)
+      sensor_publish(sensor, now_ms(), values);
+    else if (failures++ % SENSOR_REPORT_EVERY == 0)
+      fprintf(stderr, "%s sample failed (%lu of %lu)\n", s->sensor.name,
+              failures, samples);
+
+    /* fixed rate, after an overrun start again from now instead of
+     * sampling back to back to catch up */
+    next.tv_nsec += (long)(period_ms % 1000) * 1000000;
+    next.tv_sec += period_ms / 1000 + next.tv_nsec / 1000000000;
+    next.tv_nsec %= 1000000000;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > next.tv_sec ||
+        (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+      next = now;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) ==
+           EINTR)
+      ;
+  }
+  return NULL;
+}
+
+/*
+ * adds a sensor to the table, or takes over the slot of a stopped one of
+ * the same name, and starts sampling it. returns its index, -1 on failure.
+ * main thread only.
+ */
+int sensor_register(const struct sensor *sensor)
+{
+  struct sensor_slot *s;
+  int i, k, rc, index = 0;
+
+  if (sensor->channels < 1 || sensor->channels > SENSOR_MAX_CHANNELS)
+    return -1;
+  for (i = 0; i < slot_count; i++)
+    if (strcmp(slots[i].sensor.name, sensor->name) == 0)
+      break;
+  if (i < slot_count && slots[i].running)
+  {
+    fprintf(stderr, "sensor %s is registered already\n", sensor->name);
+    return -1;
+  }
+  if (i == SENSOR_MAX)
+  {
+    fprintf(stderr, "no room for sensor %s\n", sensor->name);
+    return -1;
+  }
+
+  s = &slots[i];
+  if (i == slot_count)
+  {
+    s->sensor = *sensor;
+    s->sensor.name[SENSOR_NAME_LENGTH - 1] = '\0';
+    __atomic_store_n(&slot_count, i + 1, __ATOMIC_RELEASE);
+  }
+  else if (s->sensor.channels != sensor->channels)
+    return -1; /* readers may be copying the old layout */
+  else
+  {
+    s->sensor.period_ms = sensor->period_ms;
+    s->sensor.sample = sensor->sample;
+    s->sensor.arg = sensor->arg;
+  }
+
+  if (s->sensor.sample)
+  {
+    if (s->sensor.period_ms == 0)
+      s->sensor.period_ms = 1;
+    __atomic_store_n(&s->running, 1, __ATOMIC_RELEASE);
+    rc = pthread_create(&s->thread, NULL, sensor_worker, s);
+    if (rc != 0)
+    {
+      fprintf(stderr, "start %s sampling failed, %s\n", s->sensor.name,
+              strerror(rc));
+      s->running = 0;
+      return -1;
+    }
+  }
+
+  for (k = 0; k < i; k++)
+    index += slots[k].sensor.channels;
+  fprintf(stderr, "Sensor %s:", s->sensor.name);
+  for (k = 0; k < s->sensor.channels; k++)
+    fprintf(stderr, " %d %s [%s]%s", index + k, s->sensor.channel[k].name,
+            s->sensor.channel[k].unit, k + 1 < s->sensor.channels ? "," : "");
+  if (s->sensor.sample)
+    fprintf(stderr, " every %u ms\n", s->sensor.period_ms);
+  else
+    fprintf(stderr, "\n");
+  return i;
+}
+
+/* returns after the sample in progress, if any, has been taken */
+void sensor_stop(int sensor)
+{
+  if (sensor < 0 || sensor >= slot_count)
+    return;
+  if (__atomic_exchange_n(&slots[sensor].running, 0, __ATOMIC_ACQ_REL))
+    pthread_join(slots[sensor].thread, NULL);
+}
+
+void sensors_stop(void)
+{
+  int i;
+
+  for (i = 0; i < slot_count; i++)
+    sensor_stop(i);
+}
@@ -0,0 +1,62 @@
+/*
+ * Registry of the environmental sensors. Each sensor names its channels and
+ * their units and is either sampled by a thread of its own at a fixed rate
+ * or publishes by itself. The newest sample of every sensor sits in a table
+ * the acquisition copies without locks and without touching a bus.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __SENSORS_H__
+#define __SENSORS_H__
+
+#include <stdint.h>
+
+#define SENSOR_MAX 12 /* registered sensors */
+#define SENSOR_MAX_CHANNELS 4 /* values per sample */
+#define SENSOR_NAME_LENGTH 16
+
+struct sensor_channel
+{
+  const char *name;
+  const char *unit;
+};
+
+/*
+ * with sample the registry calls it every period_ms from a thread of the
+ * sensor's own, sample fills in values[0] to values[channels - 1] and
+ * returns 0, or -1 if there was no sample. without sample the sensor calls
+ * sensor_publish itself. channel names and units are not copied.
+ */
+struct sensor
+{
+  char name[SENSOR_NAME_LENGTH];
+  int channels;
+  struct sensor_channel channel[SENSOR_MAX_CHANNELS];
+  unsigned int period_ms;
+  int (*sample)(void *arg, float *values);
+  void *arg;
+};
+
+struct sensor_sample
+{
+  uint64_t timestamp; /* ms since epoch, 0 if there is none yet */
+  float values[SENSOR_MAX_CHANNELS];
+};
+
+/* a channel looked up by name, sensor is -1 if there is no such channel */
+struct sensor_ref
+{
+  int sensor;
+  int channel;
+};
+
+int sensor_register(const struct sensor *s);
+void sensor_stop(int sensor);
+void sensors_stop(void);
+void sensor_publish(int sensor, uint64_t timestamp, const float *values);
+int sensor_latest(int sensor, struct sensor_sample *sample);
+int sensors_snapshot(struct sensor_sample *table);
+struct sensor_ref sensor_find(const char *name);
+int sensor_channel_value(int index, float *value);
+
+#endif
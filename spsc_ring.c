@@ -0,0 +1,112 @@
+/*
+ * Single-producer/single-consumer block ring, sleeping and wakeup side.
+ * The lock-free push/pop fast path lives in spsc_ring.h.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "spsc_ring.h"
+
+int spsc_ring_init(struct spsc_ring *r)
+{
+  memset(r, 0, sizeof(*r));
+  r->data_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  r->done_fd = eventfd(0, EFD_CLOEXEC);
+  if (r->data_fd < 0 || r->done_fd < 0)
+  {
+    spsc_ring_destroy(r);
+    return -1;
+  }
+  return 0;
+}
+
+void spsc_ring_destroy(struct spsc_ring *r)
+{
+  if (r->data_fd >= 0)
+    close(r->data_fd);
+  if (r->done_fd >= 0)
+    close(r->done_fd);
+  r->data_fd = r->done_fd = -1;
+}
+
+void spsc_ring_wake(struct spsc_ring *r)
+{
+  uint64_t one = 1;
+  ssize_t n;
+
+  /* cannot fail short of the counter overflowing after 2^64 wakeups */
+  n = write(r->data_fd, &one, sizeof(one));
+  (void)n;
+}
+
+/*
+ * consumer: announce that it is about to sleep on data_fd. returns 0 if the
+ * ring is empty, then the next push will make data_fd readable. returns -1
+ * if blocks are waiting, the consumer must not sleep.
+ */
+int spsc_ring_prepare_wait(struct spsc_ring *r)
+{
+  __atomic_store_n(&r->consumer_waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail)
+  {
+    __atomic_store_n(&r->consumer_waiting, 0, __ATOMIC_RELAXED);
+    return -1;
+  }
+  return 0;
+}
+
+/* consumer: done sleeping, consume a pending wakeup without blocking */
+void spsc_ring_finish_wait(struct spsc_ring *r)
+{
+  uint64_t count;
+  ssize_t n;
+
+  __atomic_store_n(&r->consumer_waiting, 0, __ATOMIC_RELAXED);
+  n = read(r->data_fd, &count, sizeof(count));
+  (void)n;
+}
+
+/*
+ * blocks the consumer until the producer has published at least one block.
+ * returns immediately if the ring is not empty. consumers that multiplex
+ * several rings put data_fd into their own poll set and use
+ * spsc_ring_prepare_wait/spsc_ring_finish_wait directly.
+ */
+int spsc_ring_wait(struct spsc_ring *r)
+{
+  struct pollfd pfd = {.fd = r->data_fd, .events = POLLIN};
+  int rc = 0;
+
+  if (spsc_ring_prepare_wait(r) != 0)
+    return 0;
+  if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+    rc = -1;
+  spsc_ring_finish_wait(r);
+  return rc;
+}
+
+/* consumer: hand a completely transmitted frame back to the producer */
+int spsc_ring_release(struct spsc_ring *r)
+{
+  uint64_t one = 1;
+
+  return write(r->done_fd, &one, sizeof(one)) < 0 ? -1 : 0;
+}
+
+/* producer: block until at least one frame was released, *count is how many */
+int spsc_ring_wait_released(struct spsc_ring *r, uint64_t *count)
+{
+  ssize_t n;
+
+  do
+    n = read(r->done_fd, count, sizeof(*count));
+  while (n < 0 && errno == EINTR);
+  return n < 0 ? -1 : 0;
+}
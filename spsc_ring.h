@@ -0,0 +1,107 @@
+/*
+ * Single-producer/single-consumer ring of block descriptors.
+ *
+ * ADC_read_worker (producer) publishes blocks of samples that are ready for
+ * transmission, one TCP sender (consumer) drains them. head and tail live on
+ * separate cache lines and are only ever written by their owning side, so the
+ * hot path is a pair of acquire/release accesses and never takes a lock.
+ *
+ * A sleeping consumer is woken through data_fd (a non-blocking eventfd, so it
+ * can also sit in an epoll set next to sockets). The consumer hands finished
+ * frames back to the producer through done_fd.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __SPSC_RING_H__
+#define __SPSC_RING_H__
+
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+#define SPSC_RING_SLOTS 512 /* must be a power of two */
+
+#define BLOCK_FRAME_END 0x1 /* last block of an acquisition */
+#define BLOCK_RESULT 0x2 /* a struct peak_result ahead of the telemetry */
+
+struct block_desc
+{
+  uint8_t *data;
+  uint32_t length;
+  uint32_t flags;
+};
+
+struct spsc_ring
+{
+  struct block_desc slot[SPSC_RING_SLOTS];
+  int data_fd; /* producer -> consumer: blocks were published */
+  int done_fd; /* consumer -> producer: frames were released */
+
+  /* producer side, written by ADC_read_worker only */
+  uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint32_t cached_tail;
+
+  /* consumer side, written by the sender only */
+  uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint32_t cached_head;
+  uint32_t consumer_waiting;
+};
+
+int spsc_ring_init(struct spsc_ring *r);
+void spsc_ring_destroy(struct spsc_ring *r);
+void spsc_ring_wake(struct spsc_ring *r);
+int spsc_ring_prepare_wait(struct spsc_ring *r);
+void spsc_ring_finish_wait(struct spsc_ring *r);
+int spsc_ring_wait(struct spsc_ring *r);
+int spsc_ring_release(struct spsc_ring *r);
+int spsc_ring_wait_released(struct spsc_ring *r, uint64_t *count);
+
+/* producer: number of free slots, at least n if that many are free */
+static inline unsigned int spsc_ring_space(struct spsc_ring *r, unsigned int n)
+{
+  if (SPSC_RING_SLOTS - (r->head - r->cached_tail) < n)
+    r->cached_tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  return SPSC_RING_SLOTS - (r->head - r->cached_tail);
+}
+
+/* producer: non-zero if there is no free slot for another block */
+static inline int spsc_ring_full(struct spsc_ring *r)
+{
+  return spsc_ring_space(r, 1) == 0;
+}
+
+/* producer: publish a block, returns 0 if the ring is full */
+static inline int spsc_ring_push(struct spsc_ring *r,
+                                 const struct block_desc *d)
+{
+  uint32_t head = r->head;
+
+  if (spsc_ring_full(r))
+    return 0;
+  r->slot[head & (SPSC_RING_SLOTS - 1)] = *d;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+  /* pairs with the fence in spsc_ring_prepare_wait, only pay for the eventfd write
+   * when the consumer is actually asleep */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->consumer_waiting, __ATOMIC_RELAXED))
+    spsc_ring_wake(r);
+  return 1;
+}
+
+/* consumer: take the oldest block, returns 0 if the ring is empty */
+static inline int spsc_ring_pop(struct spsc_ring *r, struct block_desc *d)
+{
+  uint32_t tail = r->tail;
+
+  if (tail == r->cached_head)
+  {
+    r->cached_head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (tail == r->cached_head)
+      return 0;
+  }
+  *d = r->slot[tail & (SPSC_RING_SLOTS - 1)];
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+#endif
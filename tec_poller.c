@@ -0,0 +1,111 @@
+/*
+ * Background TEC telemetry.
+ *
+ * Every TEC controller is a sensor of its own (sensors.c), named tec0,
+ * tec1, ... in the order of the devices. The registry samples it every
+ * period_ms from a thread of its own, object temperature, output voltage
+ * and output current share one round trip (see getTECReadings). The
+ * controllers share the serial line, the MeCom bus hands it to them in
+ * turn, so a controller that stops answering delays the others by one
+ * timeout per round at most.
+ *
+ * The newest reading of each controller sits in the sensor table: readers
+ * never block and never write shared memory, ADC_read_worker picks up the
+ * values right after a trigger at the cost of a copy.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "temp_moniter.h"
+#include "sensors.h"
+#include "tec_poller.h"
+
+enum tec_channel
+{
+  TEC_OBJECT_TEMP,
+  TEC_VOLTAGE,
+  TEC_CURRENT,
+  TEC_CHANNELS
+};
+
+struct tec_poller
+{
+  struct tec_device device;
+  int sensor; /* index in the sensor table */
+};
+
+static struct tec_poller pollers[TEC_MAX_DEVICES];
+static int poller_count;
+
+/*
+ * copies the newest reading of the device'th controller (the order given to
+ * tec_poller_start) to *reading, returns -1 if there is none yet.
+ * callable from any thread.
+ */
+int tec_poller_latest(int device, struct tec_reading *reading)
+{
+  struct sensor_sample sample;
+
+  if (device < 0 || device >= __atomic_load_n(&poller_count, __ATOMIC_ACQUIRE))
+    return -1;
+  if (sensor_latest(pollers[device].sensor, &sample) != 0)
+    return -1;
+  reading->timestamp = sample.timestamp;
+  reading->object_temp = sample.values[TEC_OBJECT_TEMP];
+  reading->voltage = sample.values[TEC_VOLTAGE];
+  reading->current = sample.values[TEC_CURRENT];
+  return 0;
+}
+
+static int tec_sample(void *arg, float *values)
+{
+  struct tec_poller *p = arg;
+
+  return getTECReadings(p->device.address, p->device.inst,
+                        &values[TEC_OBJECT_TEMP], &values[TEC_VOLTAGE],
+                        &values[TEC_CURRENT]) == 0 ? 0 : -1;
+}
+
+int tec_poller_start(const struct tec_device *devices, int count,
+                     unsigned int period_ms)
+{
+  struct sensor tec = {
+      .channels = TEC_CHANNELS,
+      .channel = {{"object_temp", "degC"}, {"voltage", "V"}, {"current", "A"}},
+      .period_ms = period_ms > 0 ? period_ms : 1,
+      .sample = tec_sample,
+  };
+  int i;
+
+  if (count > TEC_MAX_DEVICES)
+    count = TEC_MAX_DEVICES;
+
+  for (i = 0; i < count; i++)
+  {
+    pollers[i].device = devices[i];
+    snprintf(tec.name, sizeof(tec.name), "tec%d", i);
+    tec.arg = &pollers[i];
+    pollers[i].sensor = sensor_register(&tec);
+    if (pollers[i].sensor < 0)
+    {
+      tec_poller_stop();
+      return -1;
+    }
+    __atomic_store_n(&poller_count, i + 1, __ATOMIC_RELEASE);
+  }
+  fprintf(stderr, "TEC poller: %d controllers every %u ms\n", count,
+          tec.period_ms);
+  return 0;
+}
+
+/* returns after the polls in progress, if any, have finished */
+void tec_poller_stop(void)
+{
+  int i;
+
+  for (i = 0; i < poller_count; i++)
+    sensor_stop(pollers[i].sensor);
+}
@@ -0,0 +1,29 @@
+/*
+ * Background TEC telemetry. A thread per TEC controller polls it at a fixed
+ * rate, the acquisition reads the latest values without touching the
+ * serial line.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __TEC_POLLER_H__
+#define __TEC_POLLER_H__
+
+#include <stdint.h>
+
+#include "configuration.h"
+#include "temp_moniter.h"
+
+struct tec_reading
+{
+  uint64_t timestamp; /* ms since epoch, when the answers were in */
+  float object_temp; /* degC */
+  float voltage; /* V */
+  float current; /* A */
+};
+
+int tec_poller_start(const struct tec_device *devices, int count,
+                     unsigned int period_ms);
+void tec_poller_stop(void);
+int tec_poller_latest(int device, struct tec_reading *reading);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * TEC writer.
+ *
+ * A set point is carried out by the apply function given to
+ * tec_writer_start (apply_set_point in axi_adc.c), which takes a GetLimits
+ * query and a Set, each up to MEINT_TRIALS times MEPORT_SET_AND_QUERY_TIMEOUT
+ * on a controller that does not answer, and waits behind the pollers'
+ * requests on the shared bus. The network threads only leave the value in a
+ * mailbox and carry on; as with the lock (lock.c), a newer set point simply
+ * replaces one the writer has not picked up yet, only the latest matters.
+ *
+ * Commands (CMD_SET_TEMPERATURE and CMD_SET_CURRENT, see control.c) are
+ * queued instead, every one is answered. The writer carries them out in
+ * order with the execute function, queues the reply and counts it on an
+ * eventfd, which the data server watches in its epoll set. The set point
+ * goes first, it is the one the lock and the client's frames wait on.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <sys/eventfd.h>
+
+#include "configuration.h"
+#include "tec_writer.h"
+
+#define TEC_WRITER_QUEUE 32 /* commands queued, in progress or answered */
+
+static pthread_t writer_thread;
+static int writer_running;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+/* shared with the network threads, under writer_mutex */
+static float mailbox;
+static int mailbox_full;
+static struct proto_command commands[TEC_WRITER_QUEUE];
+static struct proto_reply replies[TEC_WRITER_QUEUE];
+static unsigned int cmd_head, cmd_tail, reply_head, reply_tail; /* fifos */
+static int reply_fd = -1;
+
+/* writer thread only */
+static void (*writer_apply)(float value);
+static void (*writer_execute)(const struct proto_command *cmd,
+                              struct proto_reply *reply);
+
+static void *tec_writer_worker(void *data)
+{
+  struct proto_command cmd;
+  struct proto_reply reply;
+  uint64_t one = 1;
+  float value;
+
+  (void)data;
+  for (;;)
+  {
+    pthread_mutex_lock(&writer_mutex);
+    while (!mailbox_full && cmd_head == cmd_tail && writer_running)
+      pthread_cond_wait(&writer_cond, &writer_mutex);
+    if (mailbox_full)
+    {
+      value = mailbox;
+      mailbox_full = 0;
+      pthread_mutex_unlock(&writer_mutex);
+      writer_apply(value);
+      continue;
+    }
+    if (!writer_running)
+    {
+      /* nobody waits for the replies any more */
+      pthread_mutex_unlock(&writer_mutex);
+      break;
+    }
+    cmd = commands[cmd_tail % TEC_WRITER_QUEUE];
+    pthread_mutex_unlock(&writer_mutex);
+
+    writer_execute(&cmd, &reply);
+
+    pthread_mutex_lock(&writer_mutex);
+    cmd_tail++;
+    replies[reply_head++ % TEC_WRITER_QUEUE] = reply;
+    pthread_mutex_unlock(&writer_mutex);
+    if (write(reply_fd, &one, sizeof(one)) < 0)
+      fprintf(stderr, "TEC writer: reply not signalled, %s\n", strerror(errno));
+  }
+  return NULL;
+}
+
+int tec_writer_start(void (*apply)(float value),
+                     void (*execute)(const struct proto_command *cmd,
+                                     struct proto_reply *reply))
+{
+  int rc;
+
+  reply_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (reply_fd < 0)
+  {
+    fprintf(stderr, "create TEC writer eventfd failed, %s\n", strerror(errno));
+    return -1;
+  }
+  pthread_mutex_lock(&writer_mutex);
+  writer_apply = apply;
+  writer_execute = execute;
+  mailbox_full = 0;
+  cmd_head = cmd_tail = reply_head = reply_tail = 0;
+  writer_running = 1;
+  pthread_mutex_unlock(&writer_mutex);
+
+  rc = pthread_create(&writer_thread, NULL, tec_writer_worker, NULL);
+  if (rc != 0)
+  {
+    fprintf(stderr, "start TEC writer failed, %s\n", strerror(rc));
+    writer_running = 0;
+    close(reply_fd);
+    reply_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * applies a set point still in the mailbox, then ends the writer. queued
+ * commands are dropped.
+ */
+void tec_writer_stop(void)
+{
+  pthread_mutex_lock(&writer_mutex);
+  if (!writer_running)
+  {
+    pthread_mutex_unlock(&writer_mutex);
+    return;
+  }
+  writer_running = 0;
+  pthread_cond_signal(&writer_cond);
+  pthread_mutex_unlock(&writer_mutex);
+  pthread_join(writer_thread, NULL);
+  close(reply_fd);
+  reply_fd = -1;
+}
+
+/* hands the client's newest set point to the writer, never blocks for long */
+void tec_writer_set_point(float value)
+{
+  pthread_mutex_lock(&writer_mutex);
+  if (writer_running)
+  {
+    mailbox = value;
+    mailbox_full = 1;
+    pthread_cond_signal(&writer_cond);
+  }
+  pthread_mutex_unlock(&writer_mutex);
+}
+
+/*
+ * queues cmd for the writer, its reply comes from tec_writer_take_reply.
+ * -1 if the writer is not running or TEC_WRITER_QUEUE replies are owed.
+ */
+int tec_writer_submit(const struct proto_command *cmd)
+{
+  int rc = -1;
+
+  pthread_mutex_lock(&writer_mutex);
+  if (writer_running && cmd_head - reply_tail < TEC_WRITER_QUEUE)
+  {
+    commands[cmd_head++ % TEC_WRITER_QUEUE] = *cmd;
+    pthread_cond_signal(&writer_cond);
+    rc = 0;
+  }
+  pthread_mutex_unlock(&writer_mutex);
+  return rc;
+}
+
+/* the oldest reply not taken yet, in the order of the commands. 0 if none */
+int tec_writer_take_reply(struct proto_reply *reply)
+{
+  int taken = 0;
+
+  pthread_mutex_lock(&writer_mutex);
+  if (reply_tail != reply_head)
+  {
+    *reply = replies[reply_tail++ % TEC_WRITER_QUEUE];
+    taken = 1;
+  }
+  pthread_mutex_unlock(&writer_mutex);
+  return taken;
+}
+
+/* readable while replies wait, read it before taking them. -1 if stopped */
+int tec_writer_reply_fd(void)
+{
+  return reply_fd;
+}
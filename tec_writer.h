@@ -0,0 +1,24 @@
+/*
+ * TEC settings off the network threads. The set points the client sends
+ * with its acks and the TEC commands of the data server go to a thread of
+ * their own, which waits for the MeCom answers, so the data server and the
+ * ack worker never block on the serial line. The replies to the commands
+ * are collected with tec_writer_take_reply once reply fd is readable.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __TEC_WRITER_H__
+#define __TEC_WRITER_H__
+
+#include "protocol.h"
+
+int tec_writer_start(void (*apply)(float value),
+                     void (*execute)(const struct proto_command *cmd,
+                                     struct proto_reply *reply));
+void tec_writer_stop(void);
+void tec_writer_set_point(float value);
+int tec_writer_submit(const struct proto_command *cmd);
+int tec_writer_take_reply(struct proto_reply *reply);
+int tec_writer_reply_fd(void);
+
+#endif
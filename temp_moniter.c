@@ -5,13 +5,91 @@
 #include "MeComAPI/ComPort/ComPort.h"
 #include "MeComAPI/MeCom.h"
 #include "configuration.h"
+#include <time.h>
 
-int initMeCom(int MECOM_ADDRESS, int MECOM_INST, int USE_BUILT_IN_PID)
+/* parameter ids for batched requests, see MeComAPI/MeCom.h */
+#define TEC_PAR_OBJECT_TEMPERATURE 1000
+#define TEC_PAR_ACTUAL_OUTPUT_CURRENT 1020
+#define TEC_PAR_ACTUAL_OUTPUT_VOLTAGE 1021
+
+#define TEC_RATE_PROBES 50 /* ?VR exchanges timed to report the link rate */
+
+/* the MeCom stack matches answers to requests by sequence number, so the
+ * acquisition, ack and control threads may all talk to the TEC at once */
+
+/* the identification string is the cheapest round trip there is */
+static int pingMeCom(int MECOM_ADDRESS)
+{
+  int8_t ident[21];
+  return MeCom_GetIdentString(MECOM_ADDRESS, ident) ? 0 : -1;
+}
+
+/* every controller on the line has to answer */
+static int pingAllMeCom(const struct tec_device *devices, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    if (pingMeCom(devices[i].address) != 0)
+    {
+      fprintf(stderr, "TEC %d does not answer\n", devices[i].address);
+      return -1;
+    }
+  return 0;
+}
+
+/*
+ * the controllers acknowledge at the old rate and then switch, the port
+ * follows and pings them. If one does not answer at the new rate the port
+ * goes back. returns the rate in use, -1 if the controllers are lost at both.
+ */
+static int switchMeComBaud(const struct tec_device *devices, int count, int from, int to)
 {
   MeParLongFields lFields;
+  int i, speed;
 
-  /*MeCom port open*/
-  ComPort_Open(0, 57600);
+  /* all or none, a controller left behind would be lost */
+  for (i = 0; i < count; i++)
+    if (!MeCom_TEC_Ope_RS485CH1BaudRate(devices[i].address, devices[i].inst, &lFields, MeGetLimits) ||
+        to < lFields.Min || to > lFields.Max)
+    {
+      fprintf(stderr, "TEC %d can not run at %d baud\n", devices[i].address, to);
+      return from;
+    }
+  for (i = 0; i < count; i++)
+  {
+    lFields.Value = to;
+    MeCom_TEC_Ope_RS485CH1BaudRate(devices[i].address, devices[i].inst, &lFields, MeSet);
+  }
+  speed = ComPort_SetSpeed(to);
+  if (speed > 0 && pingAllMeCom(devices, count) == 0)
+    return speed;
+
+  fprintf(stderr, "TEC link not working at %d baud, staying at %d\n", to, from);
+  ComPort_SetSpeed(from);
+  return pingAllMeCom(devices, count) == 0 ? from : -1;
+}
+
+/* times single ?VR exchanges, the unit the temperature loop is built of */
+static void reportMeComRate(int MECOM_ADDRESS, int MECOM_INST, int baud)
+{
+  MeParFloatFields fFields;
+  struct timespec t0, t1;
+  double seconds;
+  int i, ok = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < TEC_RATE_PROBES; i++)
+    ok += MeCom_TEC_Mon_ObjectTemperature(MECOM_ADDRESS, MECOM_INST, &fFields, MeGet) != 0;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+  fprintf(stderr, "TEC link: %d baud, %.0f transactions/s (%d of %d answered)\n",
+          baud, ok / seconds, ok, TEC_RATE_PROBES);
+}
+
+static int setupTEC(int MECOM_ADDRESS, int MECOM_INST, int USE_BUILT_IN_PID)
+{
+  MeParLongFields lFields;
 
   // if (MeCom_ResetDevice(MECOM_ADDRESS))
   // {
@@ -23,14 +101,14 @@ int initMeCom(int MECOM_ADDRESS, int MECOM_INST, int USE_BUILT_IN_PID)
   {
     if (USE_BUILT_IN_PID)
     {
-      fprintf(stderr, "Using Built-in Temperature Controller\n\n");
+      fprintf(stderr, "TEC %d: Using Built-in Temperature Controller\n\n", MECOM_ADDRESS);
       lFields.Value = 2; // Temperature Controller
       MeCom_TEC_Ope_OutputStageInputSelection(MECOM_ADDRESS, MECOM_INST, &lFields,
                                               MeSet);
     }
     else
     {
-      fprintf(stderr, "Using Live Current/Voltage\n\n");
+      fprintf(stderr, "TEC %d: Using Live Current/Voltage\n\n", MECOM_ADDRESS);
       lFields.Value = 1; // Live Current/Voltage
       MeCom_TEC_Ope_OutputStageInputSelection(MECOM_ADDRESS, MECOM_INST, &lFields,
                                               MeSet);
@@ -41,6 +119,39 @@ int initMeCom(int MECOM_ADDRESS, int MECOM_INST, int USE_BUILT_IN_PID)
   return 1;
 }
 
+/*
+ * opens the TEC link at MECOM_DEFAULT_BAUD and moves it to baud. Controllers
+ * which still run at baud from an earlier start are found there. All count
+ * devices share the line, devices[0] is used to time it. port is the tty,
+ * NULL for /dev/ttyUSB0.
+ */
+int initMeCom(const char *port, const struct tec_device *devices, int count,
+              int USE_BUILT_IN_PID, int baud)
+{
+  int i, speed = MECOM_DEFAULT_BAUD;
+
+  /*MeCom port open*/
+  if (port)
+    ComPort_OpenDevice(port, MECOM_DEFAULT_BAUD);
+  else
+    ComPort_Open(0, MECOM_DEFAULT_BAUD);
+  if (pingAllMeCom(devices, count) != 0)
+  {
+    if (baud == MECOM_DEFAULT_BAUD || (speed = ComPort_SetSpeed(baud)) < 0 ||
+        pingAllMeCom(devices, count) != 0)
+      return 1;
+  }
+  else if (baud != MECOM_DEFAULT_BAUD &&
+           (speed = switchMeComBaud(devices, count, MECOM_DEFAULT_BAUD, baud)) < 0)
+    return 1;
+  reportMeComRate(devices[0].address, devices[0].inst, speed);
+
+  for (i = 0; i < count; i++)
+    if (setupTEC(devices[i].address, devices[i].inst, USE_BUILT_IN_PID))
+      return 1;
+  return 0;
+}
+
 int setTECVandC(int MECOM_ADDRESS, int MECOM_INST, float Voltage, float Current)
 {
   MeParFloatFields fFields;
@@ -51,7 +162,7 @@ int setTECVandC(int MECOM_ADDRESS, int MECOM_INST, float Voltage, float Current)
   if (err == 0)
   {
     fprintf(stderr, "LiveSetCurrent failed: Error %d", err);
-    return err;
+    return -1;
   }
 
   fFields.Value = Voltage;
@@ -60,33 +171,41 @@ int setTECVandC(int MECOM_ADDRESS, int MECOM_INST, float Voltage, float Current)
   if (err == 0)
   {
     fprintf(stderr, "LiveSetCurrent failed: Error %d", err);
-    return err;
+    return -1;
   }
   return 0;
 }
 
-int getTECVandC(int MECOM_ADDRESS, int MECOM_INST, float *Voltage, float *Current)
+int setTECTargetTemp(int MECOM_ADDRESS, int MECOM_INST, float Temp)
 {
   MeParFloatFields fFields;
-  int err;
-
-  err = MeCom_TEC_Mon_ActualOutputVoltage(MECOM_ADDRESS, MECOM_INST, &fFields,
-                                          MeGet);
-  if (err == 0)
+  int err = 0; /* MeCom calls return non-zero on success */
+  if (MeCom_TEC_Tem_TargetObjectTemp(MECOM_ADDRESS, MECOM_INST, &fFields, MeGetLimits))
   {
-    fprintf(stderr, "LiveSetCurrent failed: Error %d", err);
-    return err;
+    fFields.Value = Temp;
+    err = MeCom_TEC_Tem_TargetObjectTemp(MECOM_ADDRESS, MECOM_INST, &fFields, MeSet);
+    if (err)
+      fprintf(stderr, "TEC Object Temperature: New Value: %f\n",
+              fFields.Value);
   }
-  *Voltage = fFields.Value;
+  return err ? 0 : -1;
+}
 
-  err = MeCom_TEC_Mon_ActualOutputCurrent(MECOM_ADDRESS, MECOM_INST, &fFields,
-                                          MeGet);
-  if (err == 0)
+/* both values are queried at once, the answers arrive back to back */
+int getTECVandC(int MECOM_ADDRESS, int MECOM_INST, float *Voltage, float *Current)
+{
+  MeParBatchItem items[] = {
+      {.ParId = TEC_PAR_ACTUAL_OUTPUT_VOLTAGE, .Inst = MECOM_INST, .Cmd = MeGet},
+      {.ParId = TEC_PAR_ACTUAL_OUTPUT_CURRENT, .Inst = MECOM_INST, .Cmd = MeGet},
+  };
+
+  if (MeCom_ParBatch(MECOM_ADDRESS, items, 2) != 2)
   {
-    fprintf(stderr, "LiveSetCurrent failed: Error %d", err);
-    return err;
+    fprintf(stderr, "Reading TEC voltage and current failed\n");
+    return -1;
   }
-  *Current = fFields.Value;
+  *Voltage = items[0].Fields.f.Value;
+  *Current = items[1].Fields.f.Value;
   return 0;
 }
 
@@ -95,4 +214,22 @@ float getTECTemp(int MECOM_ADDRESS, int MECOM_INST)
   MeParFloatFields fFields;
   MeCom_TEC_Mon_ObjectTemperature(MECOM_ADDRESS, MECOM_INST, &fFields, MeGet);
   return fFields.Value;
-}
\ No newline at end of file
+}
+
+/* object temperature, output voltage and current in one round trip */
+int getTECReadings(int MECOM_ADDRESS, int MECOM_INST, float *Temp,
+                   float *Voltage, float *Current)
+{
+  MeParBatchItem items[] = {
+      {.ParId = TEC_PAR_OBJECT_TEMPERATURE, .Inst = MECOM_INST, .Cmd = MeGet},
+      {.ParId = TEC_PAR_ACTUAL_OUTPUT_VOLTAGE, .Inst = MECOM_INST, .Cmd = MeGet},
+      {.ParId = TEC_PAR_ACTUAL_OUTPUT_CURRENT, .Inst = MECOM_INST, .Cmd = MeGet},
+  };
+
+  if (MeCom_ParBatch(MECOM_ADDRESS, items, 3) != 3)
+    return -1;
+  *Temp = items[0].Fields.f.Value;
+  *Voltage = items[1].Fields.f.Value;
+  *Current = items[2].Fields.f.Value;
+  return 0;
+}
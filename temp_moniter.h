@@ -1,4 +1,20 @@
-int initMeCom(int MECOM_ADDRESS, int MECOM_INST, int USE_BUILT_IN_PID);
+#ifndef __TEMP_MONITER_H__
+#define __TEMP_MONITER_H__
+
+/* a TEC controller on the MeCom line */
+struct tec_device
+{
+  int address;
+  int inst;
+};
+
+int initMeCom(const char *port, const struct tec_device *devices, int count,
+              int USE_BUILT_IN_PID, int baud);
 int setTECVandC(int MECOM_ADDRESS, int MECOM_INST, float Voltage, float Current);
+int setTECTargetTemp(int MECOM_ADDRESS, int MECOM_INST, float Temp);
 int getTECVandC(int MECOM_ADDRESS, int MECOM_INST, float *Voltage, float *Current);
-float getTECTemp(int MECOM_ADDRESS, int MECOM_INST);
\ No newline at end of file
+float getTECTemp(int MECOM_ADDRESS, int MECOM_INST);
+int getTECReadings(int MECOM_ADDRESS, int MECOM_INST, float *Temp,
+                   float *Voltage, float *Current);
+
+#endif
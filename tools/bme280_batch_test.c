@@ -0,0 +1,233 @@
+/*
+ * Bit exact test of the BME280 batch compensation (compensateBatch) against
+ * the single sample functions, and its speed.
+ *
+ * For a few calibrations (the datasheet example, extremes and random ones)
+ * every raw temperature goes through both, every raw pressure with each of
+ * 64 temperatures across the range and every raw humidity with the same
+ * temperatures, then every raw temperature once more with random pressure
+ * and humidity. The temperature changes every third sample, so the batch
+ * both keeps and recomputes its per temperature terms. Results are compared
+ * bit for bit.
+ *
+ * Build with -fwrapv: the single sample functions overflow int32 for some
+ * calibrations and the batch relies on the same wrap. On the Red Pitaya the
+ * Makefile adds -mfpu=neon, which tests the NEON kernels.
+ *
+ * usage: bme280_batch_test
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bme280.h"
+
+#define RAW_20BIT (1 << 20) /* temperature and pressure */
+#define RAW_16BIT (1 << 16) /* humidity */
+#define TEMPERATURES 64
+#define RANDOM_CALIBRATIONS 4
+
+static unsigned long failures, compared;
+static uint32_t seed = 2463534242U;
+
+static uint32_t rnd(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void compare(const char *what, const bme280_calib_data *cal, int32_t adc_T,
+                    int32_t adc, float got, float want)
+{
+  compared++;
+  if (memcmp(&got, &want, sizeof(got)) == 0)
+    return;
+  if (failures++ < 10)
+    printf("FAIL %s: T1 %u adc_T %d raw %d: batch %.9g, expected %.9g\n", what,
+           cal->dig_T1, adc_T, adc, got, want);
+}
+
+/* n samples through compensateBatch and the single sample functions */
+static void check(bme280_calib_data *cal, const int32_t *adc_T, const int32_t *adc_P,
+                  const int32_t *adc_H, int n, float *temp, float *pressure,
+                  float *humidity)
+{
+  int32_t t_fine;
+  int i;
+
+  compensateBatch(cal, adc_T, adc_P, adc_H, n, temp, pressure, humidity);
+  for (i = 0; i < n; i++)
+  {
+    t_fine = getTemperatureCalibration(cal, adc_T[i]);
+    compare("temperature", cal, adc_T[i], adc_T[i], temp[i],
+            compensateTemperature(t_fine));
+    if (adc_P)
+      compare("pressure", cal, adc_T[i], adc_P[i], pressure[i],
+              compensatePressure(adc_P[i], cal, t_fine));
+    if (adc_H)
+      compare("humidity", cal, adc_T[i], adc_H[i], humidity[i],
+              compensateHumidity(adc_H[i], cal, t_fine));
+  }
+}
+
+static void calibration(int k, bme280_calib_data *cal)
+{
+  /* datasheet example, the humidity of a typical part */
+  static const bme280_calib_data example = {
+      27504, 26435, -1000, 36477, -10685, 3024, 2855, 140, -7, 15500, -14600,
+      6000, 75, 362, 0, 313, 50, 30};
+
+  *cal = example;
+  if (k == 1) /* extremes */
+  {
+    cal->dig_T1 = 65535;
+    cal->dig_T2 = 32767;
+    cal->dig_T3 = -32768;
+    cal->dig_P1 = 65535;
+    cal->dig_P2 = -32768;
+    cal->dig_P3 = 32767;
+    cal->dig_P4 = -32768;
+    cal->dig_P5 = 32767;
+    cal->dig_P6 = -32768;
+    cal->dig_P7 = 32767;
+    cal->dig_P8 = -32768;
+    cal->dig_P9 = 32767;
+    cal->dig_H1 = 255;
+    cal->dig_H2 = 32767;
+    cal->dig_H3 = 255;
+    cal->dig_H4 = 2047;
+    cal->dig_H5 = -2048;
+    cal->dig_H6 = -128;
+  }
+  else if (k > 1) /* random, H4 and H5 are 12 bits */
+  {
+    cal->dig_T1 = rnd();
+    cal->dig_T2 = rnd();
+    cal->dig_T3 = rnd();
+    cal->dig_P1 = rnd();
+    cal->dig_P2 = rnd();
+    cal->dig_P3 = rnd();
+    cal->dig_P4 = rnd();
+    cal->dig_P5 = rnd();
+    cal->dig_P6 = rnd();
+    cal->dig_P7 = rnd();
+    cal->dig_P8 = rnd();
+    cal->dig_P9 = rnd();
+    cal->dig_H1 = rnd();
+    cal->dig_H2 = rnd();
+    cal->dig_H3 = rnd();
+    cal->dig_H4 = (int16_t)(rnd() << 4) >> 4;
+    cal->dig_H5 = (int16_t)(rnd() << 4) >> 4;
+    cal->dig_H6 = rnd();
+  }
+}
+
+static void benchmark(bme280_calib_data *cal, int32_t *adc_T, int32_t *adc_P,
+                      int32_t *adc_H, float *temp, float *pressure, float *humidity)
+{
+  const int n = RAW_16BIT;
+  volatile float sink = 0;
+  int32_t t_fine;
+  double t, t_ref;
+  int i;
+
+  /* oversampled readings: the temperature barely changes */
+  for (i = 0; i < n; i++)
+  {
+    adc_T[i] = 519888 + (i / 16) % 8;
+    adc_P[i] = 415148 + rnd() % 64;
+    adc_H[i] = 30000 + rnd() % 64;
+  }
+  t = now_s();
+  for (i = 0; i < n; i++)
+  {
+    t_fine = getTemperatureCalibration(cal, adc_T[i]);
+    temp[i] = compensateTemperature(t_fine);
+    pressure[i] = compensatePressure(adc_P[i], cal, t_fine);
+    humidity[i] = compensateHumidity(adc_H[i], cal, t_fine);
+  }
+  t_ref = now_s() - t;
+  sink += temp[n - 1] + pressure[n - 1] + humidity[n - 1];
+  t = now_s();
+  compensateBatch(cal, adc_T, adc_P, adc_H, n, temp, pressure, humidity);
+  t = now_s() - t;
+  sink += temp[n - 1] + pressure[n - 1] + humidity[n - 1];
+  printf("per sample: single functions %.1f ns, batch (%s) %.1f ns (%.1fx)\n",
+         t_ref * 1e9 / n, compensateBatchImpl(), t * 1e9 / n, t_ref / t);
+  (void)sink;
+}
+
+int main(void)
+{
+  int32_t *adc_T = malloc(RAW_20BIT * sizeof(int32_t));
+  int32_t *adc_P = malloc(RAW_20BIT * sizeof(int32_t));
+  int32_t *adc_H = malloc(RAW_20BIT * sizeof(int32_t));
+  float *temp = malloc(RAW_20BIT * sizeof(float));
+  float *pressure = malloc(RAW_20BIT * sizeof(float));
+  float *humidity = malloc(RAW_20BIT * sizeof(float));
+  int32_t temps[TEMPERATURES];
+  bme280_calib_data cal;
+  double start = now_s();
+  int k, pass, i;
+
+  if (!adc_T || !adc_P || !adc_H || !temp || !pressure || !humidity)
+  {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (i = 0; i < TEMPERATURES; i++)
+    temps[i] = (int32_t)((int64_t)i * (RAW_20BIT - 1) / (TEMPERATURES - 1));
+  temps[TEMPERATURES / 2] = 519888; /* datasheet example */
+
+  for (k = 0; k < 2 + RANDOM_CALIBRATIONS; k++)
+  {
+    calibration(k, &cal);
+
+    /* every temperature with random pressure and humidity */
+    for (i = 0; i < RAW_20BIT; i++)
+    {
+      adc_T[i] = i;
+      adc_P[i] = rnd() % RAW_20BIT;
+      adc_H[i] = rnd() % RAW_16BIT;
+    }
+    check(&cal, adc_T, adc_P, adc_H, RAW_20BIT, temp, pressure, humidity);
+
+    /* every pressure and every humidity with each of the temperatures */
+    for (pass = 0; pass < TEMPERATURES; pass++)
+    {
+      for (i = 0; i < RAW_20BIT; i++)
+      {
+        adc_T[i] = temps[(pass + i / 3) % TEMPERATURES];
+        adc_P[i] = i;
+        adc_H[i] = i % RAW_16BIT;
+      }
+      check(&cal, adc_T, adc_P, adc_H, RAW_20BIT, temp, pressure, humidity);
+    }
+  }
+  printf("%lu results of %d calibrations compared in %.1f s\n", compared,
+         2 + RANDOM_CALIBRATIONS, now_s() - start);
+
+  calibration(0, &cal);
+  benchmark(&cal, adc_T, adc_P, adc_H, temp, pressure, humidity);
+  if (failures)
+  {
+    printf("%lu differences\n", failures);
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}
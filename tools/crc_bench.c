@@ -0,0 +1,170 @@
+/*
+ * Test and benchmark of the MeCom CRC of a whole buffer (MeCRC16_Block)
+ * against the byte by byte table function (MeCRC16).
+ *
+ * The test compares both for every length up to 512 bytes at every
+ * alignment of the buffer and every start value the frame code can pass
+ * on, with random data. The benchmark runs the frames the TEC poller and
+ * the lock exchange with a controller: the header and the payload of a
+ * request as MeFrame_Send does it, and the reply without its CRC as
+ * MeFrame_ReceiveFrame does it.
+ *
+ * usage: crc_bench [-r rounds]
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "MeComAPI/private/MeCRC16.h"
+
+#define MAX_LENGTH 512
+#define ALIGNMENTS 8
+#define HEADER 7 /* control, address and sequence number */
+
+/*
+ * payloads of the frames, the CRC covers header and payload. a request is
+ * sent in two parts, a reply is checked in one.
+ */
+struct frame_kind
+{
+  const char *name;
+  const char *payload;
+  int reply;
+};
+
+static const struct frame_kind frames[] = {
+    {"?VR request", "?VR03E801", 0},
+    {"?VR reply", "41C80000", 1},
+    {"VS request", "VS0BB80141C80000", 0},
+    {"?IF request", "?IF", 0},
+    {"?IF reply", "TEC-1091_SW_ID_Version_x.yy", 1},
+};
+
+static uint32_t seed = 2463534242U;
+
+static uint32_t rnd(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint16_t crc_bytes(uint16_t n, const int8_t *data, uint32_t length)
+{
+  while (length--)
+    n = MeCRC16(n, *data++);
+  return n;
+}
+
+static unsigned long test(void)
+{
+  static int8_t buf[MAX_LENGTH + ALIGNMENTS];
+  unsigned long failures = 0;
+  uint16_t start, got, want;
+  uint32_t length;
+  int align, pass;
+
+  for (pass = 0; pass < 64; pass++)
+  {
+    for (length = 0; length < sizeof(buf); length++)
+      buf[length] = rnd();
+    start = pass == 0 ? 0 : rnd();
+    for (align = 0; align < ALIGNMENTS; align++)
+      for (length = 0; length <= MAX_LENGTH; length++)
+      {
+        got = MeCRC16_Block(start, buf + align, length);
+        want = crc_bytes(start, buf + align, length);
+        if (got != want && failures++ < 10)
+          printf("FAIL start %04x alignment %d length %u: %04x, expected "
+                 "%04x\n", start, align, length, got, want);
+      }
+  }
+  return failures;
+}
+
+static void benchmark(const struct frame_kind *kind, long rounds)
+{
+  int8_t frame[HEADER + MAX_LENGTH] = {'#', '0', '1', '0', '0', '0', '0'};
+  const int8_t *payload = frame + HEADER;
+  uint32_t length = strlen(kind->payload);
+  volatile uint16_t sink = 0;
+  double t, t_ref;
+  long i;
+
+  if (kind->reply)
+    frame[0] = '!';
+  memcpy(frame + HEADER, kind->payload, length);
+  t = now_s();
+  for (i = 0; i < rounds; i++)
+  {
+    frame[6] = i; /* the sequence number changes with every frame */
+    if (kind->reply)
+      sink += crc_bytes(0, frame, HEADER + length);
+    else
+      sink += crc_bytes(crc_bytes(0, frame, HEADER), payload, length);
+  }
+  t_ref = now_s() - t;
+  t = now_s();
+  for (i = 0; i < rounds; i++)
+  {
+    frame[6] = i;
+    if (kind->reply)
+      sink += MeCRC16_Block(0, frame, HEADER + length);
+    else
+      sink += MeCRC16_Block(MeCRC16_Block(0, frame, HEADER), payload, length);
+  }
+  t = now_s() - t;
+  printf("%-12s %6u %10.1f %10.1f %8.1fx\n", kind->name, HEADER + length,
+         t_ref * 1e9 / rounds, t * 1e9 / rounds, t_ref / t);
+  (void)sink;
+}
+
+int main(int argc, char **argv)
+{
+  long rounds = 10000000;
+  unsigned long failures;
+  size_t k;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r:")) != -1)
+    switch (opt)
+    {
+    case 'r':
+      rounds = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-r rounds]\n", argv[0]);
+      return 2;
+    }
+
+  failures = test();
+  printf("lengths 0 to %d at %d alignments: %s\n", MAX_LENGTH, ALIGNMENTS,
+         failures ? "FAIL" : "same as byte by byte");
+
+  printf("%-12s %6s %10s %10s %9s\n", "frame", "bytes", "per byte",
+         "block", "speedup");
+  printf("%-12s %6s %10s %10s %9s\n", "", "", "ns", "ns", "");
+  for (k = 0; k < sizeof(frames) / sizeof(frames[0]); k++)
+    benchmark(&frames[k], rounds);
+  if (failures)
+  {
+    printf("%lu differences\n", failures);
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}
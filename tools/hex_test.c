@@ -0,0 +1,333 @@
+/*
+ * Test and benchmark of the MeCom hex conversions (MeVarConv.c) against the
+ * per-nibble code they replaced, which is kept here as the reference.
+ *
+ * - every 32 bit value is encoded and decoded again (-q: every 65537th and
+ *   all 16 bit values), output and results must match the reference
+ * - every byte at every digit position, every pair of bytes at every pair
+ *   of positions and random strings near the hex digits: the checked
+ *   conversions must reject exactly what is not 0-9, A-F or a-f, the
+ *   unchecked ones must return what the reference returns
+ * - ns per 8 digit conversion, old and new
+ *
+ * usage: hex_test [-q]
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "MeComAPI/private/MeVarConv.h"
+
+#define BENCH_VALUES 4096
+#define BENCH_ROUNDS 5000
+#define RANDOM_STRINGS 20000000
+
+static const int8_t cHex[16] = {'0', '1', '2', '3', '4', '5', '6', '7',
+                                '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
+static unsigned long failures;
+static uint32_t seed = 2463534242U;
+
+static uint32_t rnd(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the reference, HEXtoNR and the Add functions as they were */
+static uint8_t ref_nibble(int8_t uc)
+{
+  switch (uc)
+  {
+  case '0': return 0;
+  case '1': return 1;
+  case '2': return 2;
+  case '3': return 3;
+  case '4': return 4;
+  case '5': return 5;
+  case '6': return 6;
+  case '7': return 7;
+  case '8': return 8;
+  case '9': return 9;
+  case 'A': return 10;
+  case 'B': return 11;
+  case 'C': return 12;
+  case 'D': return 13;
+  case 'E': return 14;
+  case 'F': return 15;
+  case 'a': return 10;
+  case 'b': return 11;
+  case 'c': return 12;
+  case 'd': return 13;
+  case 'e': return 14;
+  case 'f': return 15;
+  }
+  return 0;
+}
+
+static int ref_is_hex(int8_t uc)
+{
+  return (uc >= '0' && uc <= '9') || (uc >= 'A' && uc <= 'F') ||
+         (uc >= 'a' && uc <= 'f');
+}
+
+/* out of line like the library functions they are compared with */
+__attribute__((noinline)) static uint32_t ref_hex_to_ul(const int8_t *arr)
+{
+  return ((uint32_t)ref_nibble(arr[0]) << 28) +
+         ((uint32_t)ref_nibble(arr[1]) << 24) +
+         ((uint32_t)ref_nibble(arr[2]) << 20) +
+         ((uint32_t)ref_nibble(arr[3]) << 16) +
+         ((uint32_t)ref_nibble(arr[4]) << 12) +
+         ((uint32_t)ref_nibble(arr[5]) << 8) +
+         ((uint32_t)ref_nibble(arr[6]) << 4) + (uint32_t)ref_nibble(arr[7]);
+}
+
+static uint16_t ref_hex_to_us(const int8_t *arr)
+{
+  return ((uint16_t)ref_nibble(arr[0]) << 12) +
+         ((uint16_t)ref_nibble(arr[1]) << 8) +
+         ((uint16_t)ref_nibble(arr[2]) << 4) + (uint16_t)ref_nibble(arr[3]);
+}
+
+__attribute__((noinline)) static void ref_add_ul_hex(int8_t *arr,
+                                                  uint32_t value)
+{
+  *arr++ = cHex[value >> 28];
+  *arr++ = cHex[(value >> 24) & 0x00F];
+  *arr++ = cHex[(value >> 20) & 0x00F];
+  *arr++ = cHex[(value >> 16) & 0x00F];
+  *arr++ = cHex[(value >> 12) & 0x00F];
+  *arr++ = cHex[(value >> 8) & 0x00F];
+  *arr++ = cHex[(value >> 4) & 0x00F];
+  *arr++ = cHex[value & 0x00F];
+}
+
+static void ref_add_us_hex(int8_t *arr, uint16_t value)
+{
+  *arr++ = cHex[value / 4096];
+  *arr++ = cHex[(value / 256) % 16];
+  *arr++ = cHex[(value % 256) / 16];
+  *arr++ = cHex[(value % 256) % 16];
+}
+
+static void report(const char *what, const int8_t *arr, int digits,
+                   uint32_t got, uint32_t want)
+{
+  int i;
+
+  if (failures++ >= 10)
+    return;
+  printf("FAIL %s \"", what);
+  for (i = 0; i < digits; i++)
+    printf(arr[i] >= 0x20 && arr[i] < 0x7f ? "%c" : "\\x%02x",
+           (uint8_t)arr[i]);
+  printf("\": %08x, expected %08x\n", got, want);
+}
+
+/* both conversions of an 8 digit string against the reference */
+static void check8(const int8_t *arr)
+{
+  uint32_t want = ref_hex_to_ul(arr), got = 0xdeadbeef;
+  int valid = 1, i, ok;
+
+  for (i = 0; i < 8; i++)
+    valid &= ref_is_hex(arr[i]);
+  if (MeVarConv_HexToUl((int8_t *)arr) != want)
+    report("HexToUl", arr, 8, MeVarConv_HexToUl((int8_t *)arr), want);
+  if ((uint32_t)MeVarConv_HexToSl((int8_t *)arr) != want)
+    report("HexToSl", arr, 8, MeVarConv_HexToSl((int8_t *)arr), want);
+  ok = MeVarConv_HexToUlChecked((int8_t *)arr, &got);
+  if (ok != valid || (valid && got != want) || (!valid && got != 0xdeadbeef))
+    report("HexToUlChecked", arr, 8, ok ? got : 0xdeadbeef,
+           valid ? want : 0xdeadbeef);
+}
+
+static void check4(const int8_t *arr)
+{
+  uint16_t want = ref_hex_to_us(arr), got = 0xbeef;
+  int valid = 1, i, ok;
+
+  for (i = 0; i < 4; i++)
+    valid &= ref_is_hex(arr[i]);
+  if (MeVarConv_HexToUs((int8_t *)arr) != want)
+    report("HexToUs", arr, 4, MeVarConv_HexToUs((int8_t *)arr), want);
+  if ((uint16_t)MeVarConv_HexToSs((int8_t *)arr) != want)
+    report("HexToSs", arr, 4, (uint16_t)MeVarConv_HexToSs((int8_t *)arr),
+           want);
+  ok = MeVarConv_HexToUsChecked((int8_t *)arr, &got);
+  if (ok != valid || (valid && got != want) || (!valid && got != 0xbeef))
+    report("HexToUsChecked", arr, 4, ok ? got : 0xbeef,
+           valid ? want : 0xbeef);
+}
+
+static void round_trip(int quick)
+{
+  int8_t got[9] = {0}, want[9] = {0};
+  uint64_t v;
+  uint32_t back;
+
+  for (v = 0; v <= 0xFFFFFFFFULL; v += quick ? 65537 : 1)
+  {
+    MeVarConv_AddUlHex(got, (uint32_t)v);
+    ref_add_ul_hex(want, (uint32_t)v);
+    if (memcmp(got, want, 8) != 0)
+      report("AddUlHex", got, 8, (uint32_t)v, (uint32_t)v);
+    if (!MeVarConv_HexToUlChecked(got, &back) || back != v ||
+        MeVarConv_HexToUl(got) != v)
+      report("round trip", got, 8, back, (uint32_t)v);
+    MeVarConv_AddSlHex(got, (int32_t)v);
+    if (memcmp(got, want, 8) != 0)
+      report("AddSlHex", got, 8, (uint32_t)v, (uint32_t)v);
+  }
+  for (v = 0; v <= 0xFFFF; v++)
+  {
+    MeVarConv_AddUsHex(got, (uint16_t)v);
+    ref_add_us_hex(want, (uint16_t)v);
+    if (memcmp(got, want, 4) != 0)
+      report("AddUsHex", got, 4, (uint32_t)v, (uint32_t)v);
+    MeVarConv_AddSsHex(got, (int16_t)v);
+    if (memcmp(got, want, 4) != 0)
+      report("AddSsHex", got, 4, (uint32_t)v, (uint32_t)v);
+    check4(got);
+  }
+}
+
+static void invalid_digits(void)
+{
+  static const int8_t base[8] = {'7', 'a', 'F', '0', '9', 'c', 'B', 'e'};
+  /* around the edges of the ranges, and with the top bit set */
+  static const uint8_t near[] = {'/', '0', '9', ':', '@', 'A', 'F', 'G', '`',
+                                 'a', 'f', 'g', 0x00, 0x7f, 0x80, 0xb0, 0xc1,
+                                 0xe1, 0xe6, 0xff, 0x10, 0x50};
+  int8_t s[8];
+  int i, j, a, b;
+  long n;
+
+  for (i = 0; i < 8; i++)
+    for (a = 0; a < 256; a++)
+    {
+      memcpy(s, base, 8);
+      s[i] = (int8_t)a;
+      check8(s);
+      if (i < 4)
+        check4(s);
+    }
+  for (i = 0; i < 8; i++)
+    for (j = i + 1; j < 8; j++)
+      for (a = 0; a < 256; a++)
+        for (b = 0; b < 256; b++)
+        {
+          memcpy(s, base, 8);
+          s[i] = (int8_t)a;
+          s[j] = (int8_t)b;
+          check8(s);
+          if (j < 4)
+            check4(s);
+        }
+  for (n = 0; n < RANDOM_STRINGS; n++)
+  {
+    for (i = 0; i < 8; i++)
+      s[i] = rnd() % 4 ? cHex[rnd() % 16] | (rnd() % 2 ? 0x20 : 0)
+                       : (int8_t)near[rnd() % sizeof(near)];
+    check8(s);
+    check4(s);
+  }
+}
+
+static void benchmark(void)
+{
+  static int8_t text[BENCH_VALUES][8];
+  static uint32_t values[BENCH_VALUES];
+  volatile uint32_t sink;
+  uint32_t sum;
+  double t, t_ref;
+  int i, r;
+
+  for (i = 0; i < BENCH_VALUES; i++)
+  {
+    values[i] = rnd();
+    ref_add_ul_hex(text[i], values[i]);
+  }
+
+  t = now_s();
+  for (r = 0, sum = 0; r < BENCH_ROUNDS; r++)
+    for (i = 0; i < BENCH_VALUES; i++)
+      sum += ref_hex_to_ul(text[i]);
+  t_ref = now_s() - t;
+  sink = sum;
+  t = now_s();
+  for (r = 0, sum = 0; r < BENCH_ROUNDS; r++)
+    for (i = 0; i < BENCH_VALUES; i++)
+      sum += MeVarConv_HexToUl(text[i]);
+  t = now_s() - t;
+  sink += sum;
+  printf("decode 8 digits: per nibble %.2f ns, word %.2f ns (%.1fx)\n",
+         t_ref * 1e9 / BENCH_ROUNDS / BENCH_VALUES,
+         t * 1e9 / BENCH_ROUNDS / BENCH_VALUES, t_ref / t);
+
+  t = now_s();
+  for (r = 0; r < BENCH_ROUNDS; r++)
+    for (i = 0; i < BENCH_VALUES; i++)
+      ref_add_ul_hex(text[i], values[i] + r);
+  t_ref = now_s() - t;
+  sink += text[r % BENCH_VALUES][0];
+  t = now_s();
+  for (r = 0; r < BENCH_ROUNDS; r++)
+    for (i = 0; i < BENCH_VALUES; i++)
+      MeVarConv_AddUlHex(text[i], values[i] + r);
+  t = now_s() - t;
+  sink += text[r % BENCH_VALUES][0];
+  printf("encode 8 digits: per nibble %.2f ns, word %.2f ns (%.1fx)\n",
+         t_ref * 1e9 / BENCH_ROUNDS / BENCH_VALUES,
+         t * 1e9 / BENCH_ROUNDS / BENCH_VALUES, t_ref / t);
+  (void)sink;
+}
+
+int main(int argc, char **argv)
+{
+  int quick = 0, opt;
+  double t;
+
+  while ((opt = getopt(argc, argv, "q")) != -1)
+    switch (opt)
+    {
+    case 'q':
+      quick = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-q]\n", argv[0]);
+      return 2;
+    }
+
+  t = now_s();
+  round_trip(quick);
+  printf("round trip of %s 32 bit values: %.1f s\n",
+         quick ? "every 65537th" : "all", now_s() - t);
+  t = now_s();
+  invalid_digits();
+  printf("digit bytes, byte pairs and %d random strings: %.1f s\n",
+         RANDOM_STRINGS, now_s() - t);
+  benchmark();
+  if (failures)
+  {
+    printf("%lu failures\n", failures);
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}
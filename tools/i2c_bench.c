@@ -0,0 +1,162 @@
+/*
+ * Benchmark of the BME280 data register reads.
+ *
+ * Times the eight data registers (0xF7 - 0xFE) read the way the poller
+ * reads them, one I2C_RDWR transaction with a repeated start
+ * (i2c_read_regs), against the way wiringPi read them with
+ * wiringPiI2CReadReg8: I2C_SLAVE once, then an I2C_SMBUS_READ_BYTE_DATA
+ * ioctl per register. Register by register I2C_RDWR reads are timed as
+ * well. The chip id is read both ways first, so a wrong bus or address is
+ * reported before anything is timed.
+ *
+ * Stop the server first, its poller would share the bus. With -m the
+ * register model of -S (i2c_sim.c) stands in for the sensor; it has no
+ * SMBus emulation, so only the I2C_RDWR reads are timed.
+ *
+ * usage: i2c_bench [-d device] [-a address] [-n reads] [-m]
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "configuration.h"
+#include "bme280.h"
+#include "i2c_bus.h"
+
+#define DATA_LENGTH 8 /* 0xF7 - 0xFE */
+#define BME280_CHIP_ID 0x60
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* one register the way wiringPiI2CReadReg8 reads it, -1 on failure */
+static int smbus_read_byte(int fd, uint8_t reg)
+{
+  union i2c_smbus_data data;
+  struct i2c_smbus_ioctl_data args = {.read_write = I2C_SMBUS_READ,
+                                      .command = reg,
+                                      .size = I2C_SMBUS_BYTE_DATA,
+                                      .data = &data};
+
+  if (ioctl(fd, I2C_SMBUS, &args) < 0)
+    return -1;
+  return data.byte;
+}
+
+static void report(const char *name, int transactions, int reads, int failed,
+                   double t)
+{
+  printf("%-28s %8d %10.0f %10.2f %8d\n", name, transactions, reads / t,
+         t * 1e6 / reads, failed);
+}
+
+int main(int argc, char **argv)
+{
+  const char *device = BME280_I2C_DEVICE;
+  const struct i2c_bus_ops *ops = &i2c_dev_ops;
+  int address = BME280_ADDRESS, reads = 1000, fd = -1, failed, opt, i, k, v;
+  struct i2c_bus bus;
+  uint8_t buf[DATA_LENGTH];
+  double t;
+
+  while ((opt = getopt(argc, argv, "d:a:n:m")) != -1)
+    switch (opt)
+    {
+    case 'd':
+      device = optarg;
+      break;
+    case 'a':
+      address = strtol(optarg, NULL, 0);
+      break;
+    case 'n':
+      reads = atoi(optarg);
+      break;
+    case 'm':
+      ops = &i2c_sim_ops;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-d device] [-a address] [-n reads] [-m]\n",
+              argv[0]);
+      return 2;
+    }
+  if (reads < 1)
+    reads = 1;
+
+  memset(&bus, 0, sizeof(bus));
+  if (i2c_bus_open(&bus, ops, device) != 0)
+    return 1;
+  bus.retries = 0; /* a failed read counts, it is not hidden by a retry */
+  if (i2c_read_regs(&bus, address, BME280_REGISTER_CHIPID, buf, 1) != 0 ||
+      buf[0] != BME280_CHIP_ID)
+  {
+    fprintf(stderr, "no BME280 at 0x%02x on %s\n", address, device);
+    return 1;
+  }
+  if (ops == &i2c_dev_ops)
+  {
+    fd = open(device, O_RDWR | O_CLOEXEC);
+    if (fd < 0 || ioctl(fd, I2C_SLAVE, address) < 0 ||
+        smbus_read_byte(fd, BME280_REGISTER_CHIPID) != BME280_CHIP_ID)
+    {
+      fprintf(stderr, "SMBus reads of 0x%02x on %s failed, %s\n", address,
+              device, strerror(errno));
+      return 1;
+    }
+  }
+
+  printf("%d reads of the data registers on %s (%s), 0x%02x\n", reads, device,
+         ops->name, address);
+  printf("%-28s %8s %10s %10s %8s\n", "", "ioctls", "reads/s", "us/read",
+         "failed");
+
+  failed = 0;
+  t = now_s();
+  for (i = 0; i < reads; i++)
+    failed += i2c_read_regs(&bus, address, BME280_REGISTER_PRESSUREDATA, buf,
+                            DATA_LENGTH) != 0;
+  report("I2C_RDWR burst", 1, reads, failed, now_s() - t);
+
+  failed = 0;
+  t = now_s();
+  for (i = 0; i < reads; i++)
+    for (k = 0; k < DATA_LENGTH; k++)
+      failed += i2c_read_regs(&bus, address, BME280_REGISTER_PRESSUREDATA + k,
+                              &buf[k], 1) != 0;
+  report("I2C_RDWR per register", DATA_LENGTH, reads, failed, now_s() - t);
+
+  if (fd >= 0)
+  {
+    failed = 0;
+    t = now_s();
+    for (i = 0; i < reads; i++)
+      for (k = 0; k < DATA_LENGTH; k++)
+      {
+        v = smbus_read_byte(fd, BME280_REGISTER_PRESSUREDATA + k);
+        failed += v < 0;
+        buf[k] = v;
+      }
+    report("SMBus byte data (wiringPi)", DATA_LENGTH, reads, failed,
+           now_s() - t);
+    close(fd);
+  }
+  else
+    printf("SMBus byte data: not modelled\n");
+
+  i2c_bus_close(&bus);
+  return 0;
+}
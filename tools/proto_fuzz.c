@@ -0,0 +1,746 @@
+/*
+ * Fuzz and throughput test of the data server protocol (protocol.h).
+ *
+ * Starts the server on the fpga model (-S) with the data server (-s) and
+ * emulated TEC controllers (-M), connects to DATA_SERVER_PORT and acks
+ * every frame while it sends commands. First a run of valid commands
+ * measures the command rate next to the frame stream. Then come random
+ * commands with arguments at the edges of their ranges, in particular
+ * acquisition lengths whose frame slots would not fit in memory, newer
+ * versions, short and long payloads, unknown types and messages split over
+ * several writes. Now and then a bad magic or an oversized length, which
+ * must cost the connection and nothing else; the test reconnects.
+ *
+ * Every reply must carry the request id of one of the commands outstanding
+ * (the TEC settings are answered when the controller is done, maybe after
+ * later commands) and the status the command deserves where that does not
+ * depend on the devices. Frames must keep their sequence and channel a and
+ * b their length. The emulated controllers answer after
+ * FUZZ_TEC_LATENCY_US; a stream of CMD_SET_TEMPERATURE must not hold up the
+ * frames for that long. At the end the settings are restored, a frame of
+ * the restored length must arrive and PROTO_END must shut the server down
+ * without a crash.
+ *
+ * usage: proto_fuzz [-n commands] [-r seed] [-d depth] [-S rate] server
+ * The server output goes to proto_fuzz.log. Exits 1 on the first failure.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "configuration.h"
+#include "protocol.h"
+#include "scope.h"
+
+#define FUZZ_WINDOW 8 /* commands in flight, half the server's reply queue */
+#define FUZZ_LENGTH 2000 /* samples per frame while fuzzing */
+#define FUZZ_RANDOM_LENGTH 50000 /* longest random valid length */
+#define FUZZ_TIMEOUT_MS 10000 /* for a reply, a frame or the shutdown */
+#define STATUS_ANY 1 /* any status of enum proto_status */
+#define FUZZ_TEC_LATENCY_US 30000 /* turnaround of the emulated controllers */
+#define FUZZ_GAP_SECONDS 2 /* frame gaps measured with and without settings */
+
+struct expect
+{
+  uint32_t request_id;
+  uint16_t command;
+  int status; /* STATUS_ANY or one of enum proto_status */
+};
+
+struct client
+{
+  int fd;
+  uint8_t in[65536];
+  size_t nin;
+  size_t skip; /* payload bytes of the current frame message still to come */
+  struct proto_header hdr; /* of the message being skipped */
+  struct expect expect[FUZZ_WINDOW]; /* commands not answered yet */
+  unsigned int nexpect;
+  uint32_t next_id;
+
+  /* frames */
+  int have_frame;
+  uint32_t frame_seq;
+  uint32_t ch_a_length;
+  unsigned long frames, bytes, replies;
+  uint32_t last_length; /* payload bytes of the newest channel b */
+  double last_frame; /* arrival of the newest telemetry, 0 for none yet */
+  double max_gap; /* longest time between two telemetry messages */
+};
+
+static pid_t server = -1;
+static int length_max;
+static uint64_t seed = 88172645463325252ULL;
+
+static uint64_t rnd(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed;
+}
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *msg, ...) __attribute__((format(printf, 1, 2)));
+
+static void fail(const char *msg, ...)
+{
+  va_list ap;
+
+  va_start(ap, msg);
+  fprintf(stderr, "FAIL: ");
+  vfprintf(stderr, msg, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  if (server > 0)
+    kill(server, SIGKILL);
+  exit(1);
+}
+
+/* fails if the server is gone */
+static void check_server(void)
+{
+  int status;
+
+  if (waitpid(server, &status, WNOHANG) != server)
+    return;
+  server = -1;
+  if (WIFSIGNALED(status))
+    fail("server killed by signal %d", WTERMSIG(status));
+  fail("server exited with %d", WEXITSTATUS(status));
+}
+
+static void start_server(char *path, int depth, const char *rate)
+{
+  char length[16], pipeline[16], latency[16];
+  char *argv[] = {path, "-S", (char *)rate, "-s", "-M", latency, "-d",
+                  pipeline, "-a", length, NULL};
+  int log;
+
+  snprintf(latency, sizeof(latency), "%d", FUZZ_TEC_LATENCY_US);
+  snprintf(length, sizeof(length), "%d", FUZZ_LENGTH);
+  snprintf(pipeline, sizeof(pipeline), "%d", depth);
+  server = fork();
+  if (server < 0)
+    fail("fork: %s", strerror(errno));
+  if (server == 0)
+  {
+    log = open("proto_fuzz.log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log >= 0)
+    {
+      dup2(log, STDOUT_FILENO);
+      dup2(log, STDERR_FILENO);
+    }
+    execv(path, argv);
+    perror(path);
+    _exit(127);
+  }
+}
+
+static void client_connect(struct client *c)
+{
+  struct sockaddr_in addr;
+  double start = now_s();
+  int one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(DATA_SERVER_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (;;)
+  {
+    check_server();
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      break;
+    close(c->fd);
+    if (now_s() - start > FUZZ_TIMEOUT_MS / 1000.0)
+      fail("no data server on port %d", DATA_SERVER_PORT);
+    usleep(50000);
+  }
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  c->nin = 0;
+  c->skip = 0;
+  c->have_frame = 0;
+  c->last_frame = 0;
+  c->nexpect = 0;
+}
+
+static void send_all(struct client *c, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  ssize_t n;
+
+  while (len > 0)
+  {
+    n = send(c->fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      fail("send: %s", strerror(errno));
+    p += n;
+    len -= n;
+  }
+}
+
+static void send_message(struct client *c, uint16_t type, uint16_t version,
+                         const void *payload, uint32_t length)
+{
+  struct proto_header hdr = {PROTO_MAGIC, type, version, 0, length};
+  uint8_t buf[sizeof(hdr) + PROTO_MAX_CLIENT_PAYLOAD];
+
+  memcpy(buf, &hdr, sizeof(hdr));
+  memcpy(buf + sizeof(hdr), payload, length);
+  send_all(c, buf, sizeof(hdr) + length);
+}
+
+static void frame_message(struct client *c, const struct proto_header *hdr)
+{
+  float set_point = 0;
+  double now;
+
+  if (c->have_frame && hdr->type == PROTO_CH_A &&
+      hdr->sequence <= c->frame_seq)
+    fail("frame %u after frame %u", hdr->sequence, c->frame_seq);
+  if (c->have_frame && hdr->type != PROTO_CH_A &&
+      hdr->sequence != c->frame_seq)
+    fail("message type %u of frame %u within frame %u", hdr->type,
+         hdr->sequence, c->frame_seq);
+  if (hdr->type == PROTO_CH_A || hdr->type == PROTO_CH_B)
+  {
+    if (hdr->length == 0 || hdr->length > 2 * (uint32_t)length_max ||
+        hdr->length % 2)
+      fail("channel payload of %u bytes", hdr->length);
+    c->bytes += hdr->length;
+  }
+
+  switch (hdr->type)
+  {
+  case PROTO_CH_A:
+    c->have_frame = 1;
+    c->frame_seq = hdr->sequence;
+    c->ch_a_length = hdr->length;
+    break;
+  case PROTO_CH_B:
+    if (hdr->length != c->ch_a_length)
+      fail("frame %u: channel a %u bytes, channel b %u", hdr->sequence,
+           c->ch_a_length, hdr->length);
+    c->last_length = hdr->length;
+    break;
+  case PROTO_TELEMETRY:
+    if (hdr->length != sizeof(struct telemetry))
+      fail("telemetry of %u bytes", hdr->length);
+    c->frames++;
+    now = now_s();
+    if (c->last_frame > 0 && now - c->last_frame > c->max_gap)
+      c->max_gap = now - c->last_frame;
+    c->last_frame = now;
+    send_message(c, PROTO_ACK, PROTO_VERSION, &set_point, sizeof(set_point));
+    break;
+  default:
+    fail("message type %u from the server", hdr->type);
+  }
+}
+
+static void reply_message(struct client *c, const struct proto_reply *r)
+{
+  struct expect *e;
+  unsigned int i;
+
+  for (i = 0; i < c->nexpect && c->expect[i].request_id != r->request_id; i++)
+    ;
+  if (i == c->nexpect)
+    fail("reply to request %u, not outstanding", r->request_id);
+  e = &c->expect[i];
+  if (r->command != e->command)
+    fail("request %u: reply for command %u, sent %u", r->request_id,
+         r->command, e->command);
+  if (e->status == STATUS_ANY
+          ? r->status > PROTO_OK || r->status < PROTO_ERR_VERSION
+          : r->status != e->status)
+    fail("request %u command %u: status %d, expected %d", r->request_id,
+         r->command, r->status, e->status);
+  *e = c->expect[--c->nexpect];
+  c->replies++;
+}
+
+/*
+ * handles what arrived within timeout_ms. returns -1 at the end of the
+ * connection, 0 otherwise.
+ */
+static int client_poll(struct client *c, int timeout_ms)
+{
+  struct pollfd pfd = {c->fd, POLLIN, 0};
+  struct proto_header hdr;
+  struct proto_reply reply;
+  size_t used = 0, n;
+  ssize_t got;
+
+  if (poll(&pfd, 1, timeout_ms) <= 0)
+    return 0;
+  got = recv(c->fd, c->in + c->nin, sizeof(c->in) - c->nin, 0);
+  if (got < 0 && errno == EINTR)
+    return 0;
+  if (got <= 0)
+    return -1;
+  c->nin += got;
+
+  for (;;)
+  {
+    if (c->skip > 0)
+    {
+      n = c->nin - used < c->skip ? c->nin - used : c->skip;
+      used += n;
+      c->skip -= n;
+      if (c->skip > 0)
+        break;
+      frame_message(c, &c->hdr);
+      continue;
+    }
+    if (c->nin - used < sizeof(hdr))
+      break;
+    memcpy(&hdr, c->in + used, sizeof(hdr));
+    if (hdr.magic != PROTO_MAGIC || hdr.version != PROTO_VERSION)
+      fail("bad header, magic %08x version %u", hdr.magic, hdr.version);
+    if (hdr.type != PROTO_REPLY)
+    {
+      used += sizeof(hdr);
+      c->hdr = hdr;
+      c->skip = hdr.length;
+      if (c->skip == 0)
+        frame_message(c, &hdr);
+      continue;
+    }
+    if (hdr.length != sizeof(reply))
+      fail("reply of %u bytes", hdr.length);
+    if (c->nin - used < sizeof(hdr) + sizeof(reply))
+      break;
+    memcpy(&reply, c->in + used + sizeof(hdr), sizeof(reply));
+    used += sizeof(hdr) + sizeof(reply);
+    reply_message(c, &reply);
+  }
+  memmove(c->in, c->in + used, c->nin - used);
+  c->nin -= used;
+  return 0;
+}
+
+/* waits until fewer than max commands are outstanding */
+static void wait_window(struct client *c, unsigned int max)
+{
+  double start = now_s();
+
+  while (c->nexpect >= max)
+  {
+    if (client_poll(c, 100) != 0)
+      fail("connection closed with %u replies outstanding", c->nexpect);
+    if (now_s() - start > FUZZ_TIMEOUT_MS / 1000.0)
+      fail("no reply to request %u", c->expect[0].request_id);
+    check_server();
+  }
+}
+
+static int valid_decimation(int32_t dec)
+{
+  return dec == DE_1 || dec == DE_8 || dec == DE_64 || dec == DE_1024 ||
+         dec == DE_8192 || dec == DE_65536;
+}
+
+/* what the server must answer, where that does not depend on the devices */
+static int expected_status(uint16_t version, const struct proto_command *cmd)
+{
+  if (version > PROTO_VERSION)
+    return PROTO_ERR_VERSION;
+  switch (cmd->command)
+  {
+  case CMD_START:
+  case CMD_STOP:
+    return PROTO_OK;
+  case CMD_SET_ACQUISITION_LENGTH:
+    return cmd->arg >= 1 && cmd->arg <= length_max ? PROTO_OK
+                                                   : PROTO_ERR_INVALID;
+  case CMD_SET_DECIMATION:
+    return valid_decimation(cmd->arg) ? PROTO_OK : PROTO_ERR_INVALID;
+  case CMD_SET_TRIGGER:
+    return cmd->arg >= TR_OFF && cmd->arg <= TR_ASG_FALLING &&
+                   cmd->value >= -8192 && cmd->value <= 8191
+               ? PROTO_OK
+               : PROTO_ERR_INVALID;
+  case CMD_SET_TEMPERATURE:
+  case CMD_SET_CURRENT:
+  case CMD_GET_TEMPERATURE:
+    return cmd->arg < 0 || cmd->arg >= TEC_MAX_DEVICES ? PROTO_ERR_UNAVAILABLE
+                                                       : STATUS_ANY;
+  case CMD_GET_SENSOR:
+    return cmd->arg < 0 ? PROTO_ERR_INVALID : STATUS_ANY;
+  case CMD_SET_TRACE:
+    return cmd->arg == 0 ? PROTO_OK
+           : cmd->arg == 1 ? STATUS_ANY
+                           : PROTO_ERR_INVALID;
+  }
+  return PROTO_ERR_UNKNOWN;
+}
+
+/*
+ * sends a command with payload bytes beyond the struct, split into up to
+ * three writes. the reply is expected unless the payload is too short.
+ */
+static void send_command(struct client *c, uint16_t version,
+                         struct proto_command *cmd, uint32_t length,
+                         int split)
+{
+  struct proto_header hdr = {PROTO_MAGIC, PROTO_COMMAND, version, 0, length};
+  uint8_t buf[sizeof(hdr) + PROTO_MAX_CLIENT_PAYLOAD];
+  size_t total = sizeof(hdr) + length, cut1, cut2;
+  struct expect *e;
+  uint32_t i;
+
+  cmd->request_id = c->next_id++;
+  memcpy(buf, &hdr, sizeof(hdr));
+  for (i = 0; i < length; i++)
+    buf[sizeof(hdr) + i] = rnd();
+  memcpy(buf + sizeof(hdr), cmd,
+         length < sizeof(*cmd) ? length : sizeof(*cmd));
+  if (length >= sizeof(*cmd))
+  {
+    e = &c->expect[c->nexpect++];
+    e->request_id = cmd->request_id;
+    e->command = cmd->command;
+    e->status = expected_status(version, cmd);
+  }
+  if (!split)
+  {
+    send_all(c, buf, total);
+    return;
+  }
+  cut1 = rnd() % total;
+  cut2 = cut1 + rnd() % (total - cut1);
+  send_all(c, buf, cut1);
+  usleep(200);
+  send_all(c, buf + cut1, cut2 - cut1);
+  usleep(200);
+  send_all(c, buf + cut2, total - cut2);
+}
+
+static void valid_command(struct client *c, uint16_t command, int32_t arg,
+                          float value)
+{
+  struct proto_command cmd = {0, command, 0, arg, value};
+
+  wait_window(c, FUZZ_WINDOW);
+  send_command(c, PROTO_VERSION, &cmd, sizeof(cmd), 0);
+}
+
+static int32_t random_arg(uint16_t command)
+{
+  static const int32_t edge[] = {0, 1, -1, 2, 3, 4, 9, 10, INT32_MAX,
+                                 INT32_MIN, 0x10000, 0x7fff, 0xffff,
+                                 0x40000000, 0x55555556, 0x2aaaaaab};
+
+  switch (rnd() % 4)
+  {
+  case 0:
+    return edge[rnd() % (sizeof(edge) / sizeof(edge[0]))];
+  case 1:
+    return (int32_t)rnd();
+  }
+  if (command == CMD_SET_ACQUISITION_LENGTH)
+    switch (rnd() % 4)
+    {
+    case 0:
+      return length_max + (int32_t)(rnd() % 3) - 1; /* the edge */
+    case 1: /* would overflow length times the frame slots in 32 bits */
+      return (int32_t)(0x80000000UL / (2 * (1 + rnd() % 512))) + 1;
+    }
+  if (command == CMD_SET_ACQUISITION_LENGTH)
+    return 1 + rnd() % FUZZ_RANDOM_LENGTH;
+  if (command == CMD_SET_DECIMATION)
+    return 1 << (rnd() % 18);
+  return rnd() % 12;
+}
+
+static float random_value(void)
+{
+  static const float edge[] = {0, -0.0f, 1.5f, -1.5f, 1.5001f, 15, 45, 14.99f,
+                               45.01f, 8191, -8192, 8192, -8193, 1e30f,
+                               -1e30f, 20, 0.5f};
+
+  switch (rnd() % 4)
+  {
+  case 0:
+    return NAN;
+  case 1:
+    return rnd() % 2 ? INFINITY : -INFINITY;
+  }
+  return edge[rnd() % (sizeof(edge) / sizeof(edge[0]))];
+}
+
+/* a command or other message, valid or not, never one that drops the link */
+static void fuzz_message(struct client *c)
+{
+  struct proto_command cmd;
+  uint8_t junk[PROTO_MAX_CLIENT_PAYLOAD];
+  uint16_t version = PROTO_VERSION, type;
+  uint32_t length = sizeof(cmd), i;
+  unsigned int pick = rnd() % 100;
+
+  wait_window(c, FUZZ_WINDOW);
+  if (pick < 10) /* other message types, none of them answered */
+  {
+    static const uint16_t types[] = {0, PROTO_CH_A, PROTO_CH_B,
+                                     PROTO_TELEMETRY, PROTO_RESULT,
+                                     PROTO_SET_GAINS, PROTO_REPLY,
+                                     PROTO_REPLY + 1, 0xffff};
+    type = types[rnd() % (sizeof(types) / sizeof(types[0]))];
+    length = rnd() % (PROTO_MAX_CLIENT_PAYLOAD + 1);
+    for (i = 0; i < length; i++)
+      junk[i] = rnd();
+    send_message(c, type, rnd() % 3, junk, length);
+    return;
+  }
+
+  cmd.command = rnd() % 8 ? 1 + rnd() % CMD_SET_TRACE : rnd() % 0x10000;
+  cmd.reserved = rnd() % 4 ? 0 : rnd();
+  cmd.arg = random_arg(cmd.command);
+  cmd.value = random_value();
+  if (cmd.command == CMD_SET_TRIGGER && rnd() % 2)
+    cmd.value = (float)(rnd() % 16384) - 8192;
+  if (cmd.command == CMD_STOP && rnd() % 2)
+    cmd.command = CMD_START; /* keep the frames coming most of the time */
+  if (pick < 20)
+    version = rnd() % 4 ? PROTO_VERSION + 1 : rnd();
+  else if (pick < 25)
+    version = 0;
+  if (pick >= 25 && pick < 35)
+    length = rnd() % (PROTO_MAX_CLIENT_PAYLOAD + 1); /* short or long */
+  send_command(c, version, &cmd, length, pick >= 90);
+}
+
+/* a bad magic or length, the server has to drop the connection */
+static void fuzz_drop(struct client *c)
+{
+  struct proto_header hdr = {PROTO_MAGIC, PROTO_COMMAND, PROTO_VERSION, 0, 0};
+  double start = now_s();
+
+  wait_window(c, 1); /* so that all replies are accounted for */
+  if (rnd() % 2)
+    hdr.magic = (uint32_t)rnd();
+  else
+    hdr.length = PROTO_MAX_CLIENT_PAYLOAD + 1 + rnd() % 0x7fffffff;
+  if (hdr.magic == PROTO_MAGIC)
+    hdr.magic++;
+  send_all(c, &hdr, sizeof(hdr));
+  while (client_poll(c, 100) == 0)
+    if (now_s() - start > FUZZ_TIMEOUT_MS / 1000.0)
+      fail("connection kept after a bad header");
+  close(c->fd);
+  client_connect(c);
+}
+
+/*
+ * the longest time between two frames in FUZZ_GAP_SECONDS, with a
+ * CMD_SET_TEMPERATURE in flight all the time if set_temperature
+ */
+static double frame_gap(struct client *c, int set_temperature)
+{
+  double start = now_s();
+  unsigned long frames = c->frames;
+  int i = 0;
+
+  c->max_gap = 0;
+  c->last_frame = 0;
+  while (now_s() - start < FUZZ_GAP_SECONDS)
+  {
+    if (set_temperature)
+      valid_command(c, CMD_SET_TEMPERATURE, 0, 20 + i++ % 2);
+    else if (client_poll(c, 10) != 0)
+      fail("connection closed measuring frame gaps");
+    check_server();
+  }
+  wait_window(c, 1);
+  if (c->frames < frames + 2)
+    fail("%lu frames in %d s", c->frames - frames, FUZZ_GAP_SECONDS);
+  return c->max_gap;
+}
+
+/* frames of length samples arrive */
+static void wait_length(struct client *c, int length)
+{
+  double start = now_s();
+  unsigned long frames = c->frames;
+
+  c->last_length = 0;
+  while (c->last_length != 2 * (uint32_t)length || c->frames < frames + 2)
+  {
+    if (client_poll(c, 100) != 0)
+      fail("connection closed waiting for frames");
+    if (now_s() - start > FUZZ_TIMEOUT_MS / 1000.0)
+      fail("no frame of %d samples, last %u bytes", length, c->last_length);
+    check_server();
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct client c;
+  const char *rate = "10000000";
+  int commands = 20000, depth = 4, rounds, opt, status;
+  unsigned long frames, bytes;
+  double start, t, gap;
+  int i;
+
+  while ((opt = getopt(argc, argv, "n:r:d:S:")) != -1)
+    switch (opt)
+    {
+    case 'n':
+      commands = atoi(optarg);
+      break;
+    case 'r':
+      seed = strtoull(optarg, NULL, 0);
+      if (seed == 0)
+        seed = 1; /* xorshift stays at 0 */
+      break;
+    case 'd':
+      depth = atoi(optarg);
+      break;
+    case 'S':
+      rate = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-n commands] [-r seed] [-d depth] [-S rate] server\n",
+              argv[0]);
+      return 2;
+    }
+  if (optind + 1 != argc || depth < 1)
+  {
+    fprintf(stderr,
+            "usage: %s [-n commands] [-r seed] [-d depth] [-S rate] server\n",
+            argv[0]);
+    return 2;
+  }
+
+  /* as max_acquisition_length in axi_adc.c */
+  length_max = FRAME_BUFFER_MAX / 2 / depth;
+  if (length_max > RAM_A_SIZE / 2 - 128)
+    length_max = RAM_A_SIZE / 2 - 128;
+
+  memset(&c, 0, sizeof(c));
+  start_server(argv[optind], depth, rate);
+  client_connect(&c);
+  printf("server %s, -d %d: lengths 1 to %d accepted\n", argv[optind], depth,
+         length_max);
+
+  /* throughput of valid commands next to the frames */
+  valid_command(&c, CMD_SET_ACQUISITION_LENGTH, FUZZ_LENGTH, 0);
+  wait_length(&c, FUZZ_LENGTH);
+  frames = c.frames;
+  bytes = c.bytes;
+  start = now_s();
+  for (i = 0; i < commands; i++)
+  {
+    switch (i % 3)
+    {
+    case 0:
+      valid_command(&c, CMD_GET_SENSOR, 0, 0);
+      break;
+    case 1:
+      valid_command(&c, CMD_GET_TEMPERATURE, 0, 0);
+      break;
+    default:
+      valid_command(&c, CMD_START, 0, 0);
+    }
+  }
+  wait_window(&c, 1);
+  t = now_s() - start;
+  printf("%d valid commands in %.3f s: %.0f commands/s, %lu frames "
+         "(%.1f MB/s) meanwhile\n",
+         commands, t, commands / t, c.frames - frames,
+         (c.bytes - bytes) / t / 1e6);
+
+  /* TEC settings are carried out next to the frames, not between them */
+  t = frame_gap(&c, 0);
+  gap = frame_gap(&c, 1);
+  printf("longest frame gap %.1f ms, %.1f ms with CMD_SET_TEMPERATURE in "
+         "flight\n", t * 1e3, gap * 1e3);
+  if (gap > t + FUZZ_TEC_LATENCY_US / 1e6)
+    fail("CMD_SET_TEMPERATURE holds up the frames, gap of %.1f ms",
+         gap * 1e3);
+
+  /* the edges of the acquisition length */
+  valid_command(&c, CMD_SET_ACQUISITION_LENGTH, 0, 0);
+  valid_command(&c, CMD_SET_ACQUISITION_LENGTH, -1, 0);
+  valid_command(&c, CMD_SET_ACQUISITION_LENGTH, length_max + 1, 0);
+  valid_command(&c, CMD_SET_ACQUISITION_LENGTH, INT32_MAX, 0);
+  valid_command(&c, CMD_SET_ACQUISITION_LENGTH,
+                (int32_t)(0x100000000ULL / (2 * depth)) + 1, 0);
+  valid_command(&c, CMD_SET_ACQUISITION_LENGTH, FUZZ_LENGTH, 0);
+  wait_window(&c, 1);
+
+  /* random messages, now and then one that costs the connection */
+  start = now_s();
+  rounds = 0;
+  for (i = 0; i < commands; i++)
+  {
+    if (rnd() % 500 == 0)
+    {
+      fuzz_drop(&c);
+      rounds++;
+    }
+    else
+      fuzz_message(&c);
+    check_server();
+  }
+  wait_window(&c, 1);
+  printf("%d random messages in %.3f s, %lu replies checked, %d "
+         "reconnects, %lu frames\n",
+         commands, now_s() - start, c.replies, rounds, c.frames);
+
+  /* the server must still take settings and deliver frames */
+  valid_command(&c, CMD_SET_DECIMATION, DECIMATION, 0);
+  valid_command(&c, CMD_SET_TRIGGER, TRIGGER_MODE, TRIGGER_THRESHOLD);
+  valid_command(&c, CMD_SET_ACQUISITION_LENGTH, FUZZ_LENGTH / 2, 0);
+  valid_command(&c, CMD_START, 0, 0);
+  wait_window(&c, 1);
+  wait_length(&c, FUZZ_LENGTH / 2);
+
+  send_message(&c, PROTO_END, PROTO_VERSION, NULL, 0);
+  start = now_s();
+  while (client_poll(&c, 100) == 0 && now_s() - start < 1)
+    ;
+  close(c.fd);
+  while (waitpid(server, &status, WNOHANG) != server)
+  {
+    if (now_s() - start > FUZZ_TIMEOUT_MS / 1000.0)
+      fail("server still running after PROTO_END");
+    usleep(50000);
+  }
+  server = -1;
+  if (WIFSIGNALED(status))
+    fail("server killed by signal %d", WTERMSIG(status));
+  printf("server exited with %d after %lu frames, %lu replies: PASS\n",
+         WEXITSTATUS(status), c.frames, c.replies);
+  return 0;
+}
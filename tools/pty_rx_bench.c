@@ -0,0 +1,276 @@
+/*
+ * Receive throughput of the MeCom serial port over a pseudo terminal.
+ *
+ * Receiver: the ComPort receiver (ComPort_Linux.c, whole frames to
+ * MePort_ReceiveFrame) and, for comparison, the receiver it replaced,
+ * which read up to 99 bytes at a time and fed them to MePort_ReceiveByte.
+ * A round queries the object temperature, writes a number of answers with
+ * other sequence numbers (parsed and CRC checked, then dropped as late
+ * answers) and the real answer last, the query returns once all frames went
+ * through the parser. Rounds stay well inside the MeCom timeout.
+ *
+ * Controllers: the whole stack against the emulated controllers of -M
+ * (mecom_sim.c) without turnaround, one query at a time and with
+ * MEPORT_MAX_IN_FLIGHT queries per controller in flight. The emulator takes
+ * the wire time at the link rate into account, so this is bound by the rate.
+ *
+ * usage: pty_rx_bench [-n frames] [-r rounds] [-t seconds] [-b baud]
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "configuration.h"
+#include "mecom_sim.h"
+#include "temp_moniter.h"
+#include "MeComAPI/MeCom.h"
+#include "MeComAPI/MePort.h"
+#include "MeComAPI/ComPort/ComPort.h"
+#include "MeComAPI/private/MeCRC16.h"
+#include "MeComAPI/private/MeVarConv.h"
+
+#define ADDRESS 1
+#define INST 1
+#define PAR_TEMP 1000 /* object temperature */
+#define ANSWER_LEN 20 /* '!', address, sequence, float, CRC and 0x0D */
+#define FLOOD_CHUNK 400 /* answers per write */
+
+struct pty
+{
+  int master, slave;
+  char name[64];
+};
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *msg)
+{
+  fprintf(stderr, "pty_rx_bench: %s\n", msg);
+  exit(1);
+}
+
+static void open_pty(struct pty *p)
+{
+  struct termios raw;
+
+  p->master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (p->master < 0 || grantpt(p->master) != 0 || unlockpt(p->master) != 0 ||
+      ptsname_r(p->master, p->name, sizeof(p->name)) != 0)
+    fail("no pty");
+  /* a master without an open slave reads as hung up, keep one open */
+  p->slave = open(p->name, O_RDWR | O_NOCTTY);
+  if (p->slave < 0 || tcgetattr(p->slave, &raw) != 0)
+    fail("no pty slave");
+  cfmakeraw(&raw);
+  tcsetattr(p->slave, TCSANOW, &raw);
+}
+
+/* the answer to a query of the object temperature */
+static void put_answer(char *buf, uint8_t address, uint16_t seq, float value)
+{
+  int8_t *p = (int8_t *)buf;
+
+  p[0] = '!';
+  MeVarConv_AddUcHex(p + 1, address);
+  MeVarConv_AddUsHex(p + 3, seq);
+  MeVarConv_AddFloatHex(p + 7, value);
+  MeVarConv_AddUsHex(p + 15, MeCRC16_Block(0, p, 15));
+  p[19] = 0x0D;
+}
+
+/* the sequence number of the next request on the wire */
+static uint16_t read_request(int master)
+{
+  char buf[256];
+  size_t fill = 0;
+  ssize_t n;
+  char *start;
+
+  for (;;)
+  {
+    n = read(master, buf + fill, sizeof(buf) - 1 - fill);
+    if (n <= 0)
+      fail("no request on the pty");
+    fill += n;
+    if ((start = memchr(buf, '#', fill)) != NULL &&
+        memchr(start, 0x0D, buf + fill - start) != NULL &&
+        buf + fill - start >= 7)
+      return MeVarConv_HexToUs((int8_t *)start + 3);
+    if (fill == sizeof(buf) - 1)
+      fill = 0;
+  }
+}
+
+/* the receiver before the ComPort one, reads up to 99 bytes at a time */
+static void *byte_receiver(void *arg)
+{
+  int fd = *(int *)arg;
+  char Buffer[100];
+  ssize_t bytes_read;
+
+  while ((bytes_read = read(fd, Buffer, sizeof(Buffer) - 1)) > 0)
+  {
+    Buffer[bytes_read] = 0;
+    MePort_ReceiveByte((int8_t *)Buffer);
+  }
+  return NULL;
+}
+
+/*
+ * rounds of frames answers written to flood, which the receiver under test
+ * reads; the requests come in on wire. returns the frames per second.
+ */
+static double flood(int wire, int flood_fd, int frames, int rounds)
+{
+  static char buf[FLOOD_CHUNK * ANSWER_LEN];
+  MeParFloatFields fields;
+  double start = now_s();
+  int32_t handle;
+  uint16_t seq;
+  int r, i, n;
+
+  for (r = 0; r < rounds; r++)
+  {
+    handle = MeCom_ParValuefSubmit(ADDRESS, PAR_TEMP, INST, &fields, MeGet);
+    if (handle < 0)
+      fail("query not submitted");
+    seq = read_request(wire);
+    for (i = 0; i < FLOOD_CHUNK; i++)
+      put_answer(buf + i * ANSWER_LEN, ADDRESS, seq ^ 0x8000, 20.0f + i);
+    for (i = 0; i < frames; i += n)
+    {
+      n = frames - i < FLOOD_CHUNK ? frames - i : FLOOD_CHUNK;
+      if (write(flood_fd, buf, n * ANSWER_LEN) != n * ANSWER_LEN)
+        fail("pty write failed");
+    }
+    put_answer(buf, ADDRESS, seq, 25.0f);
+    if (write(flood_fd, buf, ANSWER_LEN) != ANSWER_LEN)
+      fail("pty write failed");
+    if (!MeCom_ParValuefWait(handle, &fields, MeGet) || fields.Value != 25.0f)
+      fail("answer after the flood lost, fewer frames (-n) per round");
+  }
+  return (double)frames * rounds / (now_s() - start);
+}
+
+static void report(const char *name, double frames_s)
+{
+  printf("%-32s %12.0f %10.2f\n", name, frames_s,
+         frames_s * ANSWER_LEN / 1e6);
+}
+
+/* queries for seconds, in_flight of them per controller at a time */
+static void controllers(const struct tec_device *devices, int count,
+                        int in_flight, double seconds)
+{
+  int32_t handles[TEC_MAX_DEVICES][MEPORT_MAX_IN_FLIGHT];
+  MeParFloatFields fields;
+  unsigned long answers = 0, failed = 0;
+  double start = now_s(), t;
+  char name[64];
+  int d, i;
+
+  for (d = 0; d < count; d++)
+    for (i = 0; i < in_flight; i++)
+      handles[d][i] = MeCom_ParValuefSubmit(devices[d].address, PAR_TEMP,
+                                            devices[d].inst, &fields, MeGet);
+  do
+  {
+    for (i = 0; i < in_flight; i++)
+      for (d = 0; d < count; d++)
+      {
+        if (handles[d][i] >= 0 && MeCom_ParValuefWait(handles[d][i], &fields, MeGet))
+          answers++;
+        else
+          failed++;
+        handles[d][i] = MeCom_ParValuefSubmit(devices[d].address, PAR_TEMP,
+                                              devices[d].inst, &fields, MeGet);
+      }
+  } while ((t = now_s() - start) < seconds);
+  for (d = 0; d < count; d++)
+    for (i = 0; i < in_flight; i++)
+      if (handles[d][i] >= 0)
+        MeCom_ParValuefWait(handles[d][i], &fields, MeGet);
+
+  snprintf(name, sizeof(name), "%d controllers, %d in flight", count, in_flight);
+  report(name, answers / t);
+  if (failed)
+    printf("  %lu queries failed\n", failed);
+}
+
+int main(int argc, char **argv)
+{
+  static const struct tec_device devices[] = {{ADDRESS, INST}, {2, INST}};
+  struct mecom_sim_config cfg = {0, 0, 0, devices, 2};
+  int frames = 20000, rounds = 50, baud = 1000000, opt;
+  double seconds = 2;
+  struct pty wire, old;
+  pthread_t reader;
+  char port[64];
+
+  while ((opt = getopt(argc, argv, "n:r:t:b:")) != -1)
+    switch (opt)
+    {
+    case 'n':
+      frames = atoi(optarg);
+      break;
+    case 'r':
+      rounds = atoi(optarg);
+      break;
+    case 't':
+      seconds = atof(optarg);
+      break;
+    case 'b':
+      baud = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n frames] [-r rounds] [-t seconds] [-b baud]\n",
+              argv[0]);
+      return 2;
+    }
+  /* in order with the messages of the MeCom stack and the emulator */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  open_pty(&wire);
+  ComPort_OpenDevice(wire.name, MECOM_DEFAULT_BAUD);
+  printf("\n%-32s %12s %10s\n", "", "frames/s", "MB/s");
+  report("ComPort receiver", flood(wire.master, wire.master, frames, rounds));
+
+  /* the old receiver on a second pty, the requests still go out on wire */
+  open_pty(&old);
+  if (pthread_create(&reader, NULL, byte_receiver, &old.slave) != 0)
+    fail("no receiver thread");
+  report("byte by byte receiver", flood(wire.master, old.master, frames, rounds));
+  close(old.master);
+  pthread_join(reader, NULL);
+  close(old.slave);
+  ComPort_Close();
+  close(wire.slave);
+  close(wire.master);
+
+  if (mecom_sim_start(&cfg, port, sizeof(port)) != 0 ||
+      initMeCom(port, devices, 2, 1, baud) != 0)
+    fail("emulated controllers not found");
+  printf("\nemulated controllers at %d baud, no turnaround\n", baud);
+  controllers(devices, 1, 1, seconds);
+  controllers(devices, 1, MEPORT_MAX_IN_FLIGHT, seconds);
+  controllers(devices, 2, MEPORT_MAX_IN_FLIGHT, seconds);
+  ComPort_Close();
+  mecom_sim_stop();
+  return 0;
+}
@@ -0,0 +1,355 @@
+/*
+ * Benchmark of the send modes (-z) of the per-port senders.
+ *
+ * For every send mode (copy, direct, zero-copy) and acquisition length
+ * (20000, 150000 and 1000000 samples by default) the server is started on
+ * the fpga model (-S) with persistent sessions (-p). The benchmark takes
+ * the frames on CLIENT_IP_PORT_A and _B, acks the telemetry on
+ * CLIENT_IP_PORT_ACK and ends the run with PROTO_END after a number of
+ * frames. The server prints the totals of its senders when it stops
+ * (send_stats_report in axi_adc.c); they are collected into one table
+ * with the throughput seen by the client.
+ *
+ * Per frame: the time of a channel from the first block sent to the end
+ * of the frame, which includes waiting for the recording; for both
+ * channels together the time in sendmsg, the cost of getting the samples
+ * into the kernel, and the time the reader spends copying them out of the
+ * dma ram, only in copy mode. On the model the dma ram is ordinary memory,
+ * on the Red Pitaya -S 0 runs against the fpga and the uncached window.
+ *
+ * usage: send_bench [-n frames] [-S rate] [-a length,...] server
+ * The output of the last run is left in send_bench.log.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "configuration.h"
+#include "protocol.h"
+
+#define BENCH_MODES 3
+#define BENCH_MAX_LENGTHS 8
+#define BENCH_TIMEOUT_S 60 /* per run */
+#define BENCH_LOG "send_bench.log"
+
+/* the totals of one sender, as printed by send_stats_report */
+struct sender_totals
+{
+  unsigned long frames;
+  double mb, frame_ms, frame_max_ms, send_ms, copy_ms;
+};
+
+/* a channel connection, frames are a proto_header and the samples */
+struct channel
+{
+  int fd;
+  uint8_t buf[65536];
+  size_t nin;
+  size_t skip; /* sample bytes of the current frame still to come */
+  unsigned long frames;
+  uint64_t bytes;
+};
+
+static const char *const mode_name[BENCH_MODES] = {"copy", "direct",
+                                                   "zero-copy"};
+static pid_t server = -1;
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *msg)
+{
+  fprintf(stderr, "send_bench: %s, see %s\n", msg, BENCH_LOG);
+  if (server > 0)
+    kill(server, SIGKILL);
+  exit(1);
+}
+
+static void start_server(char *path, const char *rate, int mode, int length)
+{
+  char z[8], a[16];
+  char *argv[] = {path, "-S", (char *)rate, "-p", "-z", z, "-a", a,
+                  "-M", "100", NULL};
+  int log;
+
+  snprintf(z, sizeof(z), "%d", mode);
+  snprintf(a, sizeof(a), "%d", length);
+  server = fork();
+  if (server < 0)
+    fail("fork failed");
+  if (server == 0)
+  {
+    log = open(BENCH_LOG, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log >= 0)
+    {
+      dup2(log, STDOUT_FILENO);
+      dup2(log, STDERR_FILENO);
+    }
+    execv(path, argv);
+    perror(path);
+    _exit(127);
+  }
+}
+
+/* the senders listen once their first frame is ready, retry until then */
+static int connect_port(int port, double deadline)
+{
+  struct sockaddr_in addr;
+  int fd, status;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (;;)
+  {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      return fd;
+    close(fd);
+    if (waitpid(server, &status, WNOHANG) == server)
+    {
+      server = -1;
+      fail("server stopped at start");
+    }
+    if (now_s() > deadline)
+      fail("no server on the data ports");
+    usleep(10000);
+  }
+}
+
+/* reads what arrived on a channel, -1 once it is closed */
+static int channel_read(struct channel *ch)
+{
+  struct proto_header hdr;
+  size_t used = 0, n;
+  ssize_t got;
+
+  got = recv(ch->fd, ch->buf + ch->nin, sizeof(ch->buf) - ch->nin, 0);
+  if (got < 0 && errno == EINTR)
+    return 0;
+  if (got <= 0)
+    return -1;
+  ch->nin += got;
+  for (;;)
+  {
+    if (ch->skip > 0)
+    {
+      n = ch->nin - used < ch->skip ? ch->nin - used : ch->skip;
+      used += n;
+      ch->skip -= n;
+      ch->bytes += n;
+      if (ch->skip > 0)
+        break;
+      ch->frames++;
+      continue;
+    }
+    if (ch->nin - used < sizeof(hdr))
+      break;
+    memcpy(&hdr, ch->buf + used, sizeof(hdr));
+    if (hdr.magic != PROTO_MAGIC)
+      fail("bad frame header");
+    used += sizeof(hdr);
+    ch->skip = hdr.length;
+  }
+  memmove(ch->buf, ch->buf + used, ch->nin - used);
+  ch->nin -= used;
+  return 0;
+}
+
+static void send_message(int fd, uint16_t type, uint32_t sequence,
+                         const void *payload, uint32_t length)
+{
+  struct proto_header hdr = {PROTO_MAGIC, type, PROTO_VERSION, sequence,
+                             length};
+  uint8_t buf[sizeof(hdr) + sizeof(float)];
+
+  memcpy(buf, &hdr, sizeof(hdr));
+  memcpy(buf + sizeof(hdr), payload, length);
+  if (send(fd, buf, sizeof(hdr) + length, MSG_NOSIGNAL) < 0)
+    fail("ack connection lost");
+}
+
+/*
+ * takes frames until the telemetry of frames frames came in, then ends the
+ * run. returns the client side throughput in MB/s from the first to the
+ * last frame.
+ */
+static double run_client(int frames)
+{
+  struct channel ch[3]; /* a, b, ack */
+  struct pollfd pfd[3];
+  struct proto_header hdr;
+  double deadline = now_s() + BENCH_TIMEOUT_S, start = 0, stop;
+  uint64_t start_bytes = 0;
+  float set_point = 0;
+  size_t used;
+  ssize_t got;
+  int acks = 0, i;
+
+  memset(ch, 0, sizeof(ch));
+  ch[0].fd = connect_port(CLIENT_IP_PORT_A, deadline);
+  ch[1].fd = connect_port(CLIENT_IP_PORT_B, deadline);
+  ch[2].fd = connect_port(CLIENT_IP_PORT_ACK, deadline);
+
+  while (acks < frames)
+  {
+    for (i = 0; i < 3; i++)
+    {
+      pfd[i].fd = ch[i].fd;
+      pfd[i].events = POLLIN;
+    }
+    if (poll(pfd, 3, 100) < 0 && errno != EINTR)
+      fail("poll failed");
+    if (now_s() > deadline)
+      fail("run timed out");
+    for (i = 0; i < 2; i++)
+      if ((pfd[i].revents & (POLLIN | POLLHUP)) && channel_read(&ch[i]) != 0)
+        fail("data connection lost");
+    if (!(pfd[2].revents & (POLLIN | POLLHUP)))
+      continue;
+
+    /* the ack port: every telemetry is answered, the last one with the end */
+    got = recv(ch[2].fd, ch[2].buf + ch[2].nin, sizeof(ch[2].buf) - ch[2].nin,
+               0);
+    if (got <= 0)
+      fail("ack connection lost");
+    ch[2].nin += got;
+    used = 0;
+    while (acks < frames && ch[2].nin - used >= sizeof(hdr))
+    {
+      memcpy(&hdr, ch[2].buf + used, sizeof(hdr));
+      if (hdr.magic != PROTO_MAGIC)
+        fail("bad message header on the ack port");
+      if (ch[2].nin - used < sizeof(hdr) + hdr.length)
+        break;
+      used += sizeof(hdr) + hdr.length;
+      if (hdr.type != PROTO_TELEMETRY)
+        continue;
+      if (acks == 0)
+      {
+        start = now_s();
+        start_bytes = ch[0].bytes + ch[1].bytes;
+      }
+      if (++acks < frames)
+        send_message(ch[2].fd, PROTO_ACK, hdr.sequence, &set_point,
+                     sizeof(set_point));
+    }
+    memmove(ch[2].buf, ch[2].buf + used, ch[2].nin - used);
+    ch[2].nin -= used;
+  }
+  stop = now_s();
+  send_message(ch[2].fd, PROTO_END, hdr.sequence, NULL, 0);
+  for (i = 0; i < 3; i++)
+    close(ch[i].fd);
+  return (ch[0].bytes + ch[1].bytes - start_bytes) / (stop - start) / 1e6;
+}
+
+/* the "Sender a" or "Sender b" line of the server's report */
+static int parse_totals(const char *name, struct sender_totals *t)
+{
+  char line[512], *p;
+  FILE *log = fopen(BENCH_LOG, "r");
+  int found = 0;
+
+  if (log == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), log))
+  {
+    if (strncmp(line, name, strlen(name)) != 0 ||
+        (p = strstr(line, "): ")) == NULL)
+      continue;
+    found = sscanf(p, "): %lu frames, %lf MB, per frame %lf ms mean %lf ms "
+                      "max, %lf ms in sendmsg, %lf ms copying",
+                   &t->frames, &t->mb, &t->frame_ms, &t->frame_max_ms,
+                   &t->send_ms, &t->copy_ms) == 6;
+  }
+  fclose(log);
+  return found ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+  int lengths[BENCH_MAX_LENGTHS] = {20000, 150000, 1000000};
+  int nlengths = 3, frames = 20, mode, l, opt, status;
+  const char *rate = "20000000";
+  struct sender_totals a, b;
+  double mbs, deadline;
+  char *arg;
+
+  while ((opt = getopt(argc, argv, "n:S:a:")) != -1)
+    switch (opt)
+    {
+    case 'n':
+      frames = atoi(optarg);
+      break;
+    case 'S':
+      rate = optarg;
+      break;
+    case 'a':
+      nlengths = 0;
+      for (arg = strtok(optarg, ","); arg && nlengths < BENCH_MAX_LENGTHS;
+           arg = strtok(NULL, ","))
+        lengths[nlengths++] = atoi(arg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n frames] [-S rate] [-a length,...] server\n",
+              argv[0]);
+      return 2;
+    }
+  if (optind + 1 != argc || frames < 2 || nlengths == 0)
+  {
+    fprintf(stderr, "usage: %s [-n frames] [-S rate] [-a length,...] server\n",
+            argv[0]);
+    return 2;
+  }
+
+  printf("%d frames per run, -S %s. per frame: wall time of a channel, time "
+         "in sendmsg and copying of both\n",
+         frames, rate);
+  printf("%-10s %8s %10s %10s %10s %10s %10s\n", "mode", "samples",
+         "client", "frame", "max", "sendmsg", "copying");
+  printf("%-10s %8s %10s %10s %10s %10s %10s\n", "", "", "MB/s", "ms", "ms",
+         "ms", "ms");
+  for (l = 0; l < nlengths; l++)
+    for (mode = 0; mode < BENCH_MODES; mode++)
+    {
+      start_server(argv[optind], rate, mode, lengths[l]);
+      mbs = run_client(frames);
+      deadline = now_s() + BENCH_TIMEOUT_S;
+      while (waitpid(server, &status, WNOHANG) != server)
+      {
+        if (now_s() > deadline)
+          fail("server still running after PROTO_END");
+        usleep(20000);
+      }
+      server = -1;
+      if (parse_totals("Sender a", &a) != 0 || parse_totals("Sender b", &b) != 0)
+        fail("no sender totals from the server");
+      printf("%-10s %8d %10.1f %10.3f %10.3f %10.3f %10.3f\n",
+             mode_name[mode], lengths[l], mbs, (a.frame_ms + b.frame_ms) / 2,
+             a.frame_max_ms > b.frame_max_ms ? a.frame_max_ms : b.frame_max_ms,
+             a.send_ms + b.send_ms, a.copy_ms + b.copy_ms);
+      fflush(stdout);
+    }
+  return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * Waiting for the scope to trigger, with selectable backends.
+ *
+ * The scope clears its trigger source register (0x00004) once a trigger event
+ * happened. TW_BUSY_POLL checks it every 5 us, which pins a core. TW_SPIN_SLEEP
+ * learns the arm to trigger interval and sleeps through most of it, spinning
+ * only for a short window around the expected trigger. TW_UIO blocks in poll()
+ * on a uio device bound to the fpga interrupt, falling back to the register
+ * when the interrupt does not arrive.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scope.h"
+#include "trigger_wait.h"
+
+#define TW_POLL_US 5 /* TW_BUSY_POLL interval */
+#define TW_MIN_MARGIN_US 20.0 /* TW_SPIN_SLEEP spin window bounds */
+#define TW_MAX_MARGIN_US 5000.0
+#define TW_MAX_BACKOFF_US 1000 /* longest sleep once the spin window passed */
+#define TW_UIO_TIMEOUT_MS 1000 /* re-check the register this often */
+#define TW_REPORT_EVERY 100 /* print statistics every n triggers */
+
+#if defined(__arm__) || defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#elif defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static inline int triggered(struct trigger_wait *tw)
+{
+  return scope_read(SCOPE_TRIGGER_SOURCE) == 0;
+}
+
+static double now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void sleep_us(double us)
+{
+  struct timespec ts;
+  ts.tv_sec = (time_t)(us / 1e6);
+  ts.tv_nsec = (long)((us - ts.tv_sec * 1e6) * 1e3);
+  nanosleep(&ts, NULL);
+}
+
+const char *trigger_wait_name(enum trigger_wait_mode mode)
+{
+  switch (mode)
+  {
+  case TW_BUSY_POLL:
+    return "busy-poll";
+  case TW_SPIN_SLEEP:
+    return "spin-sleep";
+  case TW_UIO:
+    return "uio";
+  }
+  return "unknown";
+}
+
+int trigger_wait_init(struct trigger_wait *tw, enum trigger_wait_mode mode,
+                      const char *uio_device)
+{
+  memset(tw, 0, sizeof(*tw));
+  tw->mode = mode;
+  tw->uio_fd = -1;
+  tw->margin_us = TW_MIN_MARGIN_US;
+
+  if (mode == TW_UIO)
+  {
+    tw->uio_fd = open(uio_device, O_RDWR);
+    if (tw->uio_fd < 0)
+    {
+      fprintf(stderr, "open %s failed, %s - using %s trigger wait\n",
+              uio_device, strerror(errno), trigger_wait_name(TW_SPIN_SLEEP));
+      tw->mode = TW_SPIN_SLEEP;
+    }
+  }
+  fprintf(stderr, "Trigger wait: %s\n", trigger_wait_name(tw->mode));
+  return 0;
+}
+
+void trigger_wait_close(struct trigger_wait *tw)
+{
+  if (tw->uio_fd >= 0)
+    close(tw->uio_fd);
+  tw->uio_fd = -1;
+}
+
+static int wait_busy_poll(struct trigger_wait *tw)
+{
+  while (!triggered(tw))
+    usleep(TW_POLL_US);
+  return 0;
+}
+
+static int wait_spin_sleep(struct trigger_wait *tw)
+{
+  double start = now_us();
+  double spin_start, waited;
+  double backoff = TW_POLL_US;
+  int overslept = 0;
+
+  /* sleep through the bulk of the expected interval */
+  if (tw->predicted_us > tw->margin_us && !triggered(tw))
+  {
+    sleep_us(tw->predicted_us - tw->margin_us);
+    overslept = triggered(tw);
+  }
+
+  /* spin for up to twice the margin around the expected trigger */
+  spin_start = now_us();
+  while (!triggered(tw))
+  {
+    if (now_us() - spin_start > 2 * tw->margin_us)
+    {
+      /* trigger is late, back off exponentially */
+      sleep_us(backoff);
+      if (backoff < TW_MAX_BACKOFF_US)
+        backoff *= 2;
+    }
+    else
+      cpu_relax();
+  }
+
+  /* adapt: widen the window after oversleeping, narrow it slowly otherwise */
+  waited = now_us() - start;
+  tw->predicted_us += (waited - tw->predicted_us) / 8;
+  if (overslept)
+    tw->margin_us *= 2;
+  else
+    tw->margin_us = tw->margin_us * 7 / 8;
+  if (tw->margin_us < TW_MIN_MARGIN_US)
+    tw->margin_us = TW_MIN_MARGIN_US;
+  if (tw->margin_us > TW_MAX_MARGIN_US)
+    tw->margin_us = TW_MAX_MARGIN_US;
+  return 0;
+}
+
+static int wait_uio(struct trigger_wait *tw)
+{
+  struct pollfd pfd = {.fd = tw->uio_fd, .events = POLLIN};
+  uint32_t count = 1;
+
+  /* (re-)enable the interrupt, uio masks it after each event */
+  if (write(tw->uio_fd, &count, sizeof(count)) != sizeof(count))
+    return -1;
+  while (!triggered(tw))
+  {
+    if (poll(&pfd, 1, TW_UIO_TIMEOUT_MS) < 0 && errno != EINTR)
+      return -1;
+    if (pfd.revents & POLLIN)
+    {
+      if (read(tw->uio_fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+      count = 1;
+      if (write(tw->uio_fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* returns once the armed scope has triggered, non-zero on error */
+int trigger_wait(struct trigger_wait *tw)
+{
+  switch (tw->mode)
+  {
+  case TW_SPIN_SLEEP:
+    return wait_spin_sleep(tw);
+  case TW_UIO:
+    return wait_uio(tw);
+  case TW_BUSY_POLL:
+  default:
+    return wait_busy_poll(tw);
+  }
+}
+
+/*
+ * accounts the time between the trigger event and the worker waking up, as
+ * measured by the caller from the dma write pointers.
+ */
+void trigger_wait_record(struct trigger_wait *tw, double latency_us)
+{
+  tw->last_us = latency_us;
+  if (tw->count == 0 || latency_us < tw->min_us)
+    tw->min_us = latency_us;
+  if (tw->count == 0 || latency_us > tw->max_us)
+    tw->max_us = latency_us;
+  tw->sum_us += latency_us;
+  tw->count++;
+  if (tw->count % TW_REPORT_EVERY == 0)
+    trigger_wait_report(tw);
+}
+
+void trigger_wait_report(struct trigger_wait *tw)
+{
+  if (tw->count == 0)
+    return;
+  fprintf(stderr,
+          "Trigger wake latency (%s, %lu triggers): last %.1f us, min %.1f us, "
+          "mean %.1f us, max %.1f us\n",
+          trigger_wait_name(tw->mode), tw->count, tw->last_us, tw->min_us,
+          tw->sum_us / tw->count, tw->max_us);
+}
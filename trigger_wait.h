@@ -0,0 +1,40 @@
+/*
+ * Waiting for the scope to trigger, with selectable backends.
+ *
+ * Copyright Chris Betters USYD 2017
+ */
+#ifndef __TRIGGER_WAIT_H__
+#define __TRIGGER_WAIT_H__
+
+#include <stdint.h>
+
+enum trigger_wait_mode
+{
+  TW_BUSY_POLL = 0, /* poll the trigger register every 5 us */
+  TW_SPIN_SLEEP, /* sleep until shortly before the expected trigger, then spin */
+  TW_UIO /* block on the fpga interrupt through a uio device */
+};
+
+struct trigger_wait
+{
+  enum trigger_wait_mode mode;
+  int uio_fd;
+
+  /* TW_SPIN_SLEEP state, microseconds */
+  double predicted_us; /* running estimate of arm to trigger time */
+  double margin_us; /* how long before the prediction spinning starts */
+
+  /* trigger to wakeup latency statistics, microseconds */
+  unsigned long count;
+  double last_us, min_us, max_us, sum_us;
+};
+
+int trigger_wait_init(struct trigger_wait *tw, enum trigger_wait_mode mode,
+                      const char *uio_device);
+void trigger_wait_close(struct trigger_wait *tw);
+int trigger_wait(struct trigger_wait *tw);
+void trigger_wait_record(struct trigger_wait *tw, double latency_us);
+void trigger_wait_report(struct trigger_wait *tw);
+const char *trigger_wait_name(enum trigger_wait_mode mode);
+
+#endif